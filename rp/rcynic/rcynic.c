@@ -30,6 +30,10 @@
  * here. @endlink
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define	_GNU_SOURCE		/* For pipe2() */
+#endif
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -43,15 +47,35 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <limits.h>
 #include <fcntl.h>
 #include <signal.h>
-#include <utime.h>
+#include <spawn.h>
 #include <glob.h>
 #include <sys/param.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#define	RCYNIC_USE_EPOLL	1
+#define	RCYNIC_USE_SENDFILE	1
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+extern char **environ;
 
 #define SYSLOG_NAMES		/* defines CODE prioritynames[], facilitynames[] */
 #include <syslog.h>
@@ -66,11 +90,14 @@
 #include <openssl/rand.h>
 #include <openssl/asn1t.h>
 #include <openssl/cms.h>
+#include <openssl/sha.h>
+#include <openssl/ssl.h>
 
 #include <rpki/roa.h>
 #include <rpki/manifest.h>
 
 #include "bio_f_linebreak.h"
+#include "rrdp.h"
 
 #include "defstack.h"
 
@@ -83,9 +110,6 @@
 #define	SCHEME_RSYNC	("rsync://")
 #define	SIZEOF_RSYNC	(sizeof(SCHEME_RSYNC) - 1)
 
-#define SCHEME_HTTP	("http://")
-#define	SIZEOF_HTTP	(sizeof(SCHEME_HTTP) - 1)
-
 /**
  * Maximum length of a hostname.
  */
@@ -109,6 +133,11 @@
  */
 #define	XML_SUMMARY_VERSION	1
 
+/**
+ * Size of the output buffer for the summary writers.
+ */
+#define	SUMMARY_BUFFER_SIZE	(1024 * 1024)
+
 /**
  * How much buffer space do we need for a raw address?
  */
@@ -291,6 +320,7 @@ static const struct {
   QW(nonconformant_issuer_name,		"Nonconformant X.509 issuer name")  \
   QW(nonconformant_subject_name,	"Nonconformant X.509 subject name") \
   QW(policy_qualifier_cps,		"Policy Qualifier CPS")		\
+  QW(rrdp_transfer_failed,		"RRDP transfer failed")		    \
   QW(rsync_partial_transfer,		"rsync partial transfer")	    \
   QW(rsync_transfer_skipped,		"rsync transfer skipped")	    \
   QW(sia_extension_missing_from_ee,	"SIA extension missing from EE")    \
@@ -308,6 +338,8 @@ static const struct {
   QG(non_rsync_uri_in_extension,	"Non-rsync URI in extension")	    \
   QG(object_accepted,			"Object accepted")		    \
   QG(rechecking_object,			"Rechecking object")		    \
+  QG(rrdp_deltas_applied,		"RRDP deltas applied")		    \
+  QG(rrdp_snapshot_loaded,		"RRDP snapshot loaded")		    \
   QG(rsync_transfer_succeeded,		"rsync transfer succeeded")	    \
   QG(validation_ok,			"OK")
 
@@ -392,17 +424,17 @@ typedef struct { unsigned char h[EVP_MAX_MD_SIZE]; } hashbuf_t;
 typedef struct { char s[sizeof("2001-01-01T00:00:00Z") + 1]; } timestamp_t;
 
 /**
- * Per-URI validation status object.
- * uri must be first element.
+ * Per-URI validation status object.  The URI is stored as an
+ * interned publication point prefix (everything up to and including
+ * the last slash) plus the remaining filename, both allocated from
+ * the validation status arena along with the record itself.
  */
 typedef struct validation_status {
-  uri_t uri;
+  const char *prefix, *name;
   object_generation_t generation;
+  int installed;
   time_t timestamp;
   unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8];
-  short balance;
-  struct validation_status *left_child;
-  struct validation_status *right_child;
 } validation_status_t;
 
 DECLARE_STACK_OF(validation_status_t)
@@ -430,6 +462,20 @@ typedef enum {
   walk_state_done		/**< Done walking this cert's outputs */
 } walk_state_t;
 
+/**
+ * Open-addressing hash table of pointers, indexed by caller-supplied
+ * hash values.  The table doesn't know anything about keys: callers
+ * walk the entries with a given hash via hash_table_next() and do
+ * their own comparison.
+ */
+typedef struct hash_table {
+  size_t size, count;
+  struct hash_table_entry {
+    uint64_t hash;
+    void *value;
+  } *entries;
+} hash_table_t;
+
 /**
  * Context for certificate tree walks.  This includes all the stuff
  * that we would keep as automatic variables on the call stack if we
@@ -437,16 +483,30 @@ typedef enum {
  */
 typedef struct walk_ctx {
   unsigned refcount;
+  pthread_mutex_t mutex;
   certinfo_t certinfo;
   X509 *cert;
+  EVP_PKEY *pkey;
   Manifest *manifest;
+  hash_table_t manifest_index;
   object_generation_t manifest_generation;
-  STACK_OF(OPENSSL_STRING) *filenames;
+  struct dir_listing *filenames;
   int manifest_iteration, filename_iteration, stale_manifest;
   walk_state_t state;
   uri_t crldp;
   STACK_OF(X509) *certs;
   STACK_OF(X509_CRL) *crls;
+  unsigned char chain_hash[SHA256_DIGEST_LENGTH];
+  unsigned char crl_hash[SHA256_DIGEST_LENGTH];
+  const struct crl_index *crl_index;
+  int64_t expires;
+  const struct pubpoint_record *carry;
+  const struct pubpoint_object *carry_next;
+  uint32_t carry_remaining;
+  int carry_checked, recorded;
+  int pubpoint_fd[2];
+  char *children;
+  size_t children_length, children_max;
 } walk_ctx_t;
 
 DECLARE_STACK_OF(walk_ctx_t)
@@ -470,6 +530,7 @@ typedef enum {
 #define RSYNC_STATES	\
   QQ(initial)		\
   QQ(running)		\
+  QQ(batched)		\
   QQ(conflict_wait)	\
   QQ(retry_wait)	\
   QQ(closed)		\
@@ -479,6 +540,20 @@ typedef enum {
 typedef enum { RSYNC_STATES RSYNC_STATE_T_MAX } rsync_state_t;
 #undef	QQ
 
+/**
+ * Per-module rsync state: how many processes we have fetching from
+ * it, how many it has shown us it will put up with, and a token
+ * bucket pacing new connections.  The bucket refills continuously at
+ * fetch-rate-per-host tokens per second and holds at most one
+ * second's worth.
+ */
+typedef struct rsync_host {
+  uri_t module;
+  int running, limit;
+  double tokens;
+  struct timespec refilled;
+} rsync_host_t;
+
 /**
  * Context for asyncronous rsync.
  */
@@ -494,8 +569,12 @@ typedef struct rsync_ctx {
   } problem;
   unsigned tries;
   pid_t pid;
-  int fd;
+  int fd, pidfd, timerfd, queue_index, unbatched;
   time_t started, deadline;
+  rsync_host_t *host;
+  struct rsync_ctx *batch;
+  struct rsync_ctx *runq_prev, *runq_next;
+  struct rsync_ctx *blocker, *waiters, *next_waiter;
   char buffer[URI_MAX * 4];
   size_t buflen;
 } rsync_ctx_t;
@@ -524,6 +603,18 @@ typedef struct task {
 
 DECLARE_STACK_OF(task_t)
 
+/**
+ * Shared state for threads pruning the unauthenticated tree.  Each
+ * thread takes the next top-level entry (normally a hostname) and
+ * prunes that whole subtree.
+ */
+typedef struct prune_ctx {
+  const rcynic_ctx_t *rc;
+  STACK_OF(OPENSSL_STRING) *names;
+  pthread_mutex_t lock;
+  int dfd, next, ok;
+} prune_ctx_t;
+
 /**
  * Trust anchor locator (TAL) fetch context.
  */
@@ -547,29 +638,172 @@ typedef struct rcynic_x509_store_ctx {
   const certinfo_t *subject;
 } rcynic_x509_store_ctx_t;
 
+/**
+ * Non-directory names in a publication point directory, stored back
+ * to back as NUL-terminated strings in a single buffer.
+ */
+typedef struct dir_listing {
+  char *buf;
+  size_t len, max;
+  size_t *offsets;
+  int count, max_count;
+} dir_listing_t;
+
+/**
+ * Bump allocator for large numbers of small objects which all live
+ * until the end of the run.  Nothing is ever freed individually.
+ */
+typedef struct arena {
+  struct arena_block {
+    struct arena_block *next;
+  } *blocks;
+  char *next;
+  size_t left;
+} arena_t;
+
+/**
+ * Width of a serial number in a CRL index.  RFC 5280 limits serial
+ * numbers to 20 octets.
+ */
+#define	CRL_SERIAL_LEN	20
+
+/**
+ * Object cache record, as stored on disk.  The fixed part is followed
+ * by the object's certinfo URIs packed as NUL-terminated strings, and
+ * the whole record is padded to a multiple of eight bytes so that
+ * records can be used in place from an mmap()ed cache file.
+ */
+typedef struct object_cache_record {
+  uint32_t length, ca;
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+  unsigned char serial[CRL_SERIAL_LEN];
+  int64_t not_before, not_after;
+  uint64_t file_dev, file_ino, file_size;
+  int64_t file_mtime;
+  unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8];
+} object_cache_record_t;
+
+#define	OBJECT_CACHE_MAGIC	"rcynicO2"
+
+/**
+ * Publication point cache record, as stored on disk.  The fixed part
+ * is followed by the manifest and CRL URIs as NUL-terminated strings,
+ * padded to a multiple of eight bytes, then n_objects object records.
+ */
+typedef struct pubpoint_record {
+  uint32_t length, n_objects;
+  unsigned char chain_hash[SHA256_DIGEST_LENGTH];
+  unsigned char manifest_hash[SHA256_DIGEST_LENGTH];
+  unsigned char crl_hash[SHA256_DIGEST_LENGTH];
+  unsigned char current_listing[SHA256_DIGEST_LENGTH];
+  unsigned char authenticated_listing[SHA256_DIGEST_LENGTH];
+  int64_t expires;
+} pubpoint_record_t;
+
+/**
+ * One object within a publication point cache record.  The fixed part
+ * is followed by the object's URI or, for CA certificates, by the
+ * packed certinfo URIs we need to walk it again, padded to a multiple
+ * of eight bytes.
+ */
+typedef struct pubpoint_object {
+  uint32_t length, generation, ca, pad;
+  unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8];
+} pubpoint_object_t;
+
+#define	PUBPOINT_CACHE_MAGIC	"rcynicPP"
+
+/**
+ * Cache file header.
+ */
+typedef struct record_cache_header {
+  char magic[8];
+  uint64_t config, count, length;
+} record_cache_header_t;
+
+/**
+ * In-memory handle on a cache record, either from the file we loaded
+ * at startup or added during this run.  Records we don't use during a
+ * run are dropped when we write the cache back out.
+ */
+typedef struct record_cache_entry {
+  const void *record;
+  int used;
+  struct record_cache_entry *next;
+} record_cache_entry_t;
+
+/**
+ * Persistent record cache state.
+ */
+typedef struct record_cache {
+  path_t filename;
+  const char *magic;
+  uint64_t config;
+  void *map;
+  size_t map_length;
+  record_cache_entry_t *loaded, *added;
+  size_t n_loaded;
+  hash_table_t index;
+} record_cache_t;
+
+/**
+ * Stale authenticated trees waiting to be deleted.  finalize_directories()
+ * renames each stale tree aside and queues its top-level entries here;
+ * background threads remove those while we finish up (pruning, writing
+ * the summary), and trash_finish() waits for them and removes whatever
+ * is left before we exit.  serial keeps the renamed trees' names unique.
+ */
+typedef struct trash {
+  STACK_OF(OPENSSL_STRING) *roots, *entries;
+  pthread_t *threads;
+  int nthreads, next;
+  unsigned serial;
+  pthread_mutex_t lock;
+} trash_t;
+
 /**
  * Program context that would otherwise be a mess of global variables.
  */
 struct rcynic_ctx {
   path_t authenticated, old_authenticated, new_authenticated, unauthenticated;
+  path_t rrdp_directory;
   char *jane, *rsync_program;
   STACK_OF(validation_status_t) *validation_status;
   STACK_OF(rsync_history_t) *rsync_history;
+  hash_table_t rsync_history_index, rrdp_history, crl_cache;
+  hash_table_t validation_status_index, uri_prefixes, *mkdir_cache;
+  arena_t validation_status_arena;
+  record_cache_t object_cache, pubpoint_cache;
+  trash_t trash;
   STACK_OF(rsync_ctx_t) *rsync_queue;
-  STACK_OF(task_t) *task_queue;
+  STACK_OF(rsync_ctx_t) *rsync_active;
+  rsync_ctx_t *rsync_runq_head, *rsync_runq_tail;
+  hash_table_t rsync_hosts;
+  int rsync_state_count[RSYNC_STATE_T_MAX];
+  STACK_OF(task_t) *task_queue, *ready_queue;
   int use_syslog, allow_stale_crl, allow_stale_manifest, use_links;
   int require_crl_in_manifest, rsync_timeout, priority[LOG_LEVEL_T_MAX];
   int allow_non_self_signed_trust_anchor, allow_object_not_in_manifest;
   int max_parallel_fetches, max_retries, retry_wait_min, run_rsync;
+  int max_fetches_per_host, fetch_rate_per_host, rsync_batch_size, rsync_throttled;
   int allow_digest_mismatch, allow_crl_digest_mismatch;
   int allow_nonconformant_name, allow_ee_without_signedObject;
   int allow_1024_bit_ee_key, allow_wrong_cms_si_attributes;
-  int rsync_early;
+  int rsync_early, validation_threads, tasks_running, tasks_shutdown;
+  int pipeline_depth, threaded;
+  int use_rrdp, rrdp_timeout, rrdp_max_time, rrdp_max_size;
+  int rrdp_threads, rrdp_jobs, rrdp_shutdown;
+  struct rrdp_history *rrdp_queue_head, *rrdp_queue_tail;
   unsigned max_select_time;
-  validation_status_t *validation_status_in_waiting;
-  validation_status_t *validation_status_root;
+  pthread_t *task_workers, *rrdp_workers;
+  pthread_mutex_t lock;
+  pthread_cond_t task_cond, rrdp_cond;
+  int wakeup_fds[2], epoll_fd, use_pidfd;
+  int unauthenticated_fd, old_authenticated_fd, new_authenticated_fd;
   log_level_t log_level;
   X509_STORE *x509_store;
+  SSL_CTX *ssl_ctx;
 };
 
 
@@ -724,38 +958,166 @@ static void OPENSSL_STRING_free(OPENSSL_STRING s)
     free(s);
 }
 
+
+
 /**
- * Wrapper around an idiom we use with OPENSSL_STRING stacks.  There's
- * a bug in the current sk_OPENSSL_STRING_delete() macro that casts
- * the return value to the wrong type, so we cast it to something
- * innocuous here and avoid using that macro elsewhere.
+ * FNV-1a hash, in a form that can be run incrementally: pass
+ * HASH_INIT to start a new hash, or a previous result to continue.
  */
-static void sk_OPENSSL_STRING_remove(STACK_OF(OPENSSL_STRING) *sk, const char *str)
+#define	HASH_INIT	((uint64_t) 14695981039346656037ULL)
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
 {
-  OPENSSL_STRING_free((void *) sk_OPENSSL_STRING_delete(sk, sk_OPENSSL_STRING_find(sk, str)));
+  const unsigned char *p = data;
+  while (len-- > 0) {
+    hash ^= *p++;
+    hash *= (uint64_t) 1099511628211ULL;
+  }
+  return hash;
 }
 
 /**
- * Allocate a new validation_status_t object.
+ * Hash a NUL-terminated string.
  */
-static validation_status_t *validation_status_t_new(void)
+static uint64_t hash_string(const char *s)
 {
-  validation_status_t *v = malloc(sizeof(*v));
-  if (v)
-    memset(v, 0, sizeof(*v));
-  return v;
+  return hash_bytes(HASH_INIT, s, strlen(s));
 }
 
 /**
- * Type-safe wrapper around free() to keep safestack macros happy.
+ * Insert a value into a hash table, growing the table as needed.
+ * Duplicate hashes (and values) are allowed; it's up to the caller
+ * to check first if that matters.
+ */
+static int hash_table_insert(hash_table_t *ht, const uint64_t hash, void *value)
+{
+  struct hash_table_entry *e;
+  size_t i;
+
+  assert(ht && value);
+
+  if ((ht->count + 1) * 2 > ht->size) {
+    struct hash_table_entry *old = ht->entries;
+    size_t old_size = ht->size;
+    size_t new_size = old_size ? old_size * 2 : 64;
+
+    if ((e = calloc(new_size, sizeof(*e))) == NULL)
+      return 0;
+
+    ht->entries = e;
+    ht->size = new_size;
+
+    for (i = 0; i < old_size; i++) {
+      size_t j;
+      if (old[i].value == NULL)
+	continue;
+      for (j = old[i].hash & (new_size - 1); e[j].value != NULL; j = (j + 1) & (new_size - 1))
+	;
+      e[j] = old[i];
+    }
+
+    free(old);
+  }
+
+  for (i = hash & (ht->size - 1); ht->entries[i].value != NULL; i = (i + 1) & (ht->size - 1))
+    ;
+
+  ht->entries[i].hash = hash;
+  ht->entries[i].value = value;
+  ht->count++;
+  return 1;
+}
+
+/**
+ * Iterate over values in a hash table with a particular hash.  Set
+ * *cursor to zero to start; returns NULL when there are no more.
+ */
+static void *hash_table_next(const hash_table_t *ht, const uint64_t hash, size_t *cursor)
+{
+  const struct hash_table_entry *e;
+
+  assert(ht && cursor);
+
+  if (ht->size == 0)
+    return NULL;
+
+  while (*cursor < ht->size) {
+    e = &ht->entries[(hash + *cursor) & (ht->size - 1)];
+    ++*cursor;
+    if (e->value == NULL)
+      return NULL;
+    if (e->hash == hash)
+      return e->value;
+  }
+
+  return NULL;
+}
+
+/**
+ * Release a hash table's storage.  Doesn't touch the values.
  */
-static void validation_status_t_free(validation_status_t *v)
+static void hash_table_clear(hash_table_t *ht)
 {
-  if (v)
-    free(v);
+  assert(ht);
+  free(ht->entries);
+  memset(ht, 0, sizeof(*ht));
 }
 
-
+/**
+ * Size of arena blocks, and the alignment we give fixed-size objects.
+ */
+#define	ARENA_BLOCK_SIZE	(1024 * 1024)
+#define	ARENA_ALIGN		16
+
+/**
+ * Allocate from an arena.  "align" must be a power of two.
+ */
+static void *arena_alloc(arena_t *a, const size_t len, const size_t align)
+{
+  struct arena_block *b;
+  size_t pad = 0, size;
+  void *p;
+
+  assert(a && align > 0 && (align & (align - 1)) == 0);
+
+  if (a->next != NULL)
+    pad = (-(uintptr_t) a->next) & (align - 1);
+
+  if (a->next == NULL || pad + len > a->left) {
+    size = len + align > ARENA_BLOCK_SIZE ? len + align : ARENA_BLOCK_SIZE;
+    if ((b = malloc(sizeof(*b) + size)) == NULL)
+      return NULL;
+    b->next = a->blocks;
+    a->blocks = b;
+    a->next = (char *) (b + 1);
+    a->left = size;
+    pad = (-(uintptr_t) a->next) & (align - 1);
+  }
+
+  p = a->next + pad;
+  a->next += pad + len;
+  a->left -= pad + len;
+  return p;
+}
+
+/**
+ * Release everything allocated from an arena.
+ */
+static void arena_free(arena_t *a)
+{
+  struct arena_block *b;
+
+  assert(a);
+
+  while ((b = a->blocks) != NULL) {
+    a->blocks = b->next;
+    free(b);
+  }
+
+  memset(a, 0, sizeof(*a));
+}
+
+
 
 /**
  * Allocate a new rsync_history_t object.
@@ -838,7 +1200,8 @@ static void vlogmsg(const rcynic_ctx_t *rc,
   } else {
     char ts[sizeof("00:00:00")+1];
     time_t t = time(0);
-    strftime(ts, sizeof(ts), "%H:%M:%S", localtime(&t));
+    struct tm tm;
+    strftime(ts, sizeof(ts), "%H:%M:%S", localtime_r(&t, &tm));
     fprintf(stderr, "%s: ", ts);
     if (rc->jane)
       fprintf(stderr, "%s: ", rc->jane);
@@ -994,11 +1357,264 @@ static int configure_unsigned_integer(const rcynic_ctx_t *rc,
 
 
 
+/**
+ * Lock shared parts of the program context (validation status,
+ * queues, rsync history) against access from other validation
+ * threads.  The lock is recursive, so callbacks can come back in
+ * through code paths that already hold it.  This is a no-op unless
+ * we're running with more than one validation thread or with RRDP
+ * fetch threads.
+ *
+ * Lock ordering: a thread holding a walk context's mutex may take
+ * this lock, but never the other way around.
+ */
+static void rcynic_lock(const rcynic_ctx_t *rc)
+{
+  assert(rc);
+  if (rc->threaded)
+    (void) pthread_mutex_lock((pthread_mutex_t *) &rc->lock);
+}
+
+/**
+ * Unlock shared parts of the program context.
+ */
+static void rcynic_unlock(const rcynic_ctx_t *rc)
+{
+  assert(rc);
+  if (rc->threaded)
+    (void) pthread_mutex_unlock((pthread_mutex_t *) &rc->lock);
+}
+
+/**
+ * Poke the main thread out of select() so that it notices new rsync
+ * requests, finished validation tasks, or finished RRDP fetches.
+ */
+static void rcynic_wakeup(const rcynic_ctx_t *rc)
+{
+  static const char c = 0;
+  assert(rc);
+  if (rc->threaded && rc->wakeup_fds[1] >= 0)
+    (void) write(rc->wakeup_fds[1], &c, sizeof(c));
+}
+
+/**
+ * Swallow pending wakeups.
+ */
+static void rcynic_wakeup_drain(const rcynic_ctx_t *rc)
+{
+  char junk[64];
+  assert(rc);
+  if (rc->wakeup_fds[0] >= 0)
+    while (read(rc->wakeup_fds[0], junk, sizeof(junk)) > 0)
+      ;
+}
+
+/**
+ * Mutexes backing OpenSSL's internal locks, and the callback through
+ * which OpenSSL uses them.  OpenSSL 1.0's default thread ID (address
+ * of errno) is fine for POSIX threads, so we don't bother with an ID
+ * callback.
+ */
+static pthread_mutex_t *openssl_locks;
+
+static void openssl_locking_callback(int mode, int n, const char *file, int line)
+{
+  if (mode & CRYPTO_LOCK)
+    (void) pthread_mutex_lock(&openssl_locks[n]);
+  else
+    (void) pthread_mutex_unlock(&openssl_locks[n]);
+}
+
+
+
+/**
+ * Find the held directory descriptor for whichever of our trees
+ * contains a filesystem path, and return the part of the path
+ * relative to that directory.  Paths outside the trees, or in a tree
+ * we couldn't open, come back unchanged relative to AT_FDCWD.
+ */
+static const char *path_at(const rcynic_ctx_t *rc, const path_t *name, int *fd)
+{
+  const path_t *roots[] = {
+    &rc->unauthenticated, &rc->old_authenticated, &rc->new_authenticated
+  };
+  const int fds[] = {
+    rc->unauthenticated_fd, rc->old_authenticated_fd, rc->new_authenticated_fd
+  };
+  const char *s;
+  size_t i, n;
+
+  assert(rc && name && fd);
+
+  for (i = 0; i < sizeof(fds) / sizeof(*fds); i++) {
+    n = strlen(roots[i]->s);
+    if (fds[i] < 0 || n == 0 || strncmp(name->s, roots[i]->s, n))
+      continue;
+    for (s = name->s + n; *s == '/'; s++)
+      ;
+    *fd = fds[i];
+    return *s ? s : ".";
+  }
+
+  *fd = AT_FDCWD;
+  return name->s;
+}
+
+/**
+ * open() relative to the held tree descriptors.
+ */
+static int open_at(const rcynic_ctx_t *rc, const path_t *name, const int flags, const mode_t mode)
+{
+  int fd;
+  const char *s = path_at(rc, name, &fd);
+  return openat(fd, s, flags, mode);
+}
+
+/**
+ * access() relative to the held tree descriptors.
+ */
+static int access_at(const rcynic_ctx_t *rc, const path_t *name, const int mode)
+{
+  int fd;
+  const char *s = path_at(rc, name, &fd);
+  return faccessat(fd, s, mode, 0);
+}
+
+/**
+ * unlink() relative to the held tree descriptors.
+ */
+static int unlink_at(const rcynic_ctx_t *rc, const path_t *name)
+{
+  int fd;
+  const char *s = path_at(rc, name, &fd);
+  return unlinkat(fd, s, 0);
+}
+
+/**
+ * mkdir() relative to the held tree descriptors.
+ */
+static int mkdir_at(const rcynic_ctx_t *rc, const path_t *name, const mode_t mode)
+{
+  int fd;
+  const char *s = path_at(rc, name, &fd);
+  return mkdirat(fd, s, mode);
+}
+
+/**
+ * link() relative to the held tree descriptors.
+ */
+static int link_at(const rcynic_ctx_t *rc, const path_t *source, const path_t *target)
+{
+  int fd1, fd2;
+  const char *s1 = path_at(rc, source, &fd1);
+  const char *s2 = path_at(rc, target, &fd2);
+  return linkat(fd1, s1, fd2, s2, 0);
+}
+
+/**
+ * Open descriptors for the roots of the unauthenticated and
+ * authenticated trees, so that per-object operations can skip
+ * resolving the full path prefix every time.  Failure isn't fatal,
+ * it just leaves us using full pathnames for that tree.
+ */
+static void tree_fds_open(rcynic_ctx_t *rc)
+{
+  const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+
+  rc->unauthenticated_fd = open(rc->unauthenticated.s, flags);
+  rc->old_authenticated_fd = open(rc->old_authenticated.s, flags);
+  rc->new_authenticated_fd = open(rc->new_authenticated.s, flags);
+}
+
+/**
+ * Close tree root descriptors.
+ */
+static void tree_fds_close(rcynic_ctx_t *rc)
+{
+  if (rc->unauthenticated_fd >= 0)
+    (void) close(rc->unauthenticated_fd);
+  if (rc->old_authenticated_fd >= 0)
+    (void) close(rc->old_authenticated_fd);
+  if (rc->new_authenticated_fd >= 0)
+    (void) close(rc->new_authenticated_fd);
+  rc->unauthenticated_fd = rc->old_authenticated_fd = rc->new_authenticated_fd = -1;
+}
+
+
+
+/**
+ * Check whether a directory is in the mkdir_maybe() cache,
+ * rc->mkdir_cache.  This holds directories we know exist under
+ * rc->new_authenticated, so that mkdir_maybe() doesn't have to walk
+ * and probe every ancestor of every object we install.  We only cache
+ * directories in the output tree because nothing removes directories
+ * there during a run; rsync and pruning can remove directories
+ * elsewhere.
+ *
+ * The cache is a pointer so that mkdir_maybe() can update it through
+ * the const contexts it's called with.  If we couldn't allocate it,
+ * we just don't cache.
+ */
+static int mkdir_cache_find(const rcynic_ctx_t *rc, const char *dir)
+{
+  const char *s;
+  size_t cursor = 0;
+
+  if (rc->mkdir_cache == NULL)
+    return 0;
+
+  rcynic_lock(rc);
+  while ((s = hash_table_next(rc->mkdir_cache, hash_string(dir), &cursor)) != NULL && strcmp(s, dir))
+    ;
+  rcynic_unlock(rc);
+
+  return s != NULL;
+}
+
+/**
+ * Add a directory to the mkdir_maybe() cache.  Failure just means
+ * we'll check again next time.
+ */
+static void mkdir_cache_add(const rcynic_ctx_t *rc, const char *dir)
+{
+  char *s;
+
+  if (rc->mkdir_cache == NULL || (s = strdup(dir)) == NULL)
+    return;
+
+  rcynic_lock(rc);
+  if (!hash_table_insert(rc->mkdir_cache, hash_string(s), s))
+    free(s);
+  rcynic_unlock(rc);
+}
+
+/**
+ * Free the mkdir_maybe() cache at end of run.
+ */
+static void mkdir_cache_clear(rcynic_ctx_t *rc)
+{
+  size_t i;
+
+  assert(rc);
+
+  if (rc->mkdir_cache == NULL)
+    return;
+
+  for (i = 0; i < rc->mkdir_cache->size; i++)
+    free(rc->mkdir_cache->entries[i].value);
+
+  hash_table_clear(rc->mkdir_cache);
+  free(rc->mkdir_cache);
+  rc->mkdir_cache = NULL;
+}
+
 /**
  * Make a directory if it doesn't already exist.
  */
 static int mkdir_maybe(const rcynic_ctx_t *rc, const path_t *name)
 {
+  size_t n = strlen(rc->new_authenticated.s);
+  int cacheable, ok;
   path_t path;
   char *s;
 
@@ -1012,14 +1628,22 @@ static int mkdir_maybe(const rcynic_ctx_t *rc, const path_t *name)
   if ((s = strrchr(s, '/')) == NULL)
     return 1;
   *s = '\0';
+  cacheable = n > 0 && !strncmp(path.s, rc->new_authenticated.s, n);
+  if (cacheable && mkdir_cache_find(rc, path.s))
+    return 1;
   if (!mkdir_maybe(rc, &path)) {
     logmsg(rc, log_sys_err, "Failed to make directory %s", path.s);
     return 0;
   }
-  if (!access(path.s, F_OK))
-    return 1;
-  logmsg(rc, log_verbose, "Creating directory %s", path.s);
-  return mkdir(path.s, 0777) == 0;
+  if (!access_at(rc, &path, F_OK)) {
+    ok = 1;
+  } else {
+    logmsg(rc, log_verbose, "Creating directory %s", path.s);
+    ok = mkdir_at(rc, &path, 0777) == 0 || errno == EEXIST;
+  }
+  if (ok && cacheable)
+    mkdir_cache_add(rc, path.s);
+  return ok;
 }
 
 /**
@@ -1053,14 +1677,6 @@ static int is_rsync(const char *uri)
   return uri && !strncmp(uri, SCHEME_RSYNC, SIZEOF_RSYNC);
 }
 
-/**
- * Is string an http URI?
- */
-static int is_http(const char *uri)
-{
-  return uri && !strncmp(uri, SCHEME_HTTP, SIZEOF_HTTP);
-}
-
 /**
  * Convert an rsync URI to a filename, checking for evil character
  * sequences.  NB: This routine can't call mib_increment(), because
@@ -1110,11 +1726,19 @@ static int uri_to_filename(const rcynic_ctx_t *rc,
 }
 
 /**
- * Compare filename fields of two FileAndHash structures.
+ * Find a manifest entry by filename, using the manifest's index.
  */
-static int FileAndHash_name_cmp(const FileAndHash * const *a, const FileAndHash * const *b)
+static FileAndHash *manifest_index_find(const hash_table_t *index, const char *name)
 {
-  return strcmp((char *) (*a)->file->data, (char *) (*b)->file->data);
+  const uint64_t hash = hash_string(name);
+  FileAndHash *fah;
+  size_t cursor = 0;
+
+  while ((fah = hash_table_next(index, hash, &cursor)) != NULL &&
+	 strcmp((char *) fah->file->data, name))
+    ;
+
+  return fah;
 }
 
 /**
@@ -1142,204 +1766,132 @@ static void validation_status_set_code(validation_status_t *v,
 }
 
 /**
- * validation_status object comparison, for AVL tree rather than
- * OpenSSL stacks.
+ * Hash key for a validation status entry: URI plus generation.
  */
-static int
-validation_status_cmp(const validation_status_t *node,
-		      const uri_t *uri,
-		      const object_generation_t generation)
+static uint64_t validation_status_hash(const uri_t *uri,
+				       const object_generation_t generation)
 {
-  int cmp = ((int) node->generation) - ((int) generation);
-  if (cmp)
-    return cmp;
-  else
-    return strcmp(uri->s, node->uri.s);
+  return hash_bytes(hash_string(uri->s), &generation, sizeof(generation));
 }
 
 /**
- * validation_status AVL tree insertion.  Adapted from code written by
- * Paul Vixie and explictly placed in the public domain using examples
- * from the book: "Algorithms & Data Structures," Niklaus Wirth,
- * Prentice-Hall, 1986, ISBN 0-13-022005-1.  Thanks, Paul!
+ * Find the interned copy of a URI's publication point prefix, if we
+ * have one.  Sets *name to the part of the URI after the prefix.
  */
-static validation_status_t *
-validation_status_sprout(validation_status_t **node,
-			 int *needs_balancing,
-			 validation_status_t *new_node)
+static const char *uri_prefix_find(const rcynic_ctx_t *rc,
+				   const uri_t *uri,
+				   const char **name)
 {
-#ifdef AVL_DEBUG
-#define AVL_MSG(msg) sprintf(stderr, "AVL_DEBUG: '%s'\n", msg)
-#else
-#define AVL_MSG(msg)
-#endif
+  const char *slash = strrchr(uri->s, '/');
+  const size_t len = slash == NULL ? 0 : slash + 1 - uri->s;
+  const uint64_t hash = hash_bytes(HASH_INIT, uri->s, len);
+  const char *p;
+  size_t cursor = 0;
 
-  validation_status_t *p1, *p2, *result;
-  int cmp;
+  *name = uri->s + len;
 
-  /*
-   * Are we grounded?  If so, add the node "here" and set the
-   * rebalance flag, then exit.
-   */
-  if (*node == NULL) {
-    AVL_MSG("Grounded, adding new node");
-    new_node->left_child = NULL;
-    new_node->right_child = NULL;
-    new_node->balance = 0;
-    *node = new_node;
-    *needs_balancing = 1;
-    return *node;
-  }
-
-  /*
-   * Compare the data.
-   */
-  cmp = validation_status_cmp(*node, &new_node->uri, new_node->generation);
-
-  /*
-   * If LESS, prepare to move to the left.
-   */
-  if (cmp < 0) {
-
-    AVL_MSG("LESS. sprouting left.");
-    result = validation_status_sprout(&(*node)->left_child, needs_balancing, new_node);
-
-    if (*needs_balancing) {
-      AVL_MSG("LESS: left branch has grown longer");
-
-      switch ((*node)->balance) {
-
-      case 1:
-	/*
-	 * Right branch WAS longer; balance is ok now.
-	 */
-	AVL_MSG("LESS: case 1.. balance restored implicitly");
-	(*node)->balance = 0;
-	*needs_balancing = 0;
-	break;
-
-      case 0:
-	/*
-	 * Balance WAS okay; now left branch longer.
-	 */
-	AVL_MSG("LESS: case 0.. balnce bad but still ok");
-	(*node)->balance = -1;
-	break;
+  while ((p = hash_table_next(&rc->uri_prefixes, hash, &cursor)) != NULL)
+    if (!strncmp(p, uri->s, len) && p[len] == '\0')
+      return p;
 
-      case -1:
-	/*
-	 * Left branch was already too long.  Rebalance.
-	 */
-	AVL_MSG("LESS: case -1: rebalancing");
-	p1 = (*node)->left_child;
-
-	if (p1->balance == -1) {
-	  AVL_MSG("LESS: single LL");
-	  (*node)->left_child = p1->right_child;
-	  p1->right_child = *node;
-	  (*node)->balance = 0;
-	  *node = p1;
-	}
-
-	else {
-	  AVL_MSG("LESS: double LR");
-
-	  p2 = p1->right_child;
-	  p1->right_child = p2->left_child;
-	  p2->left_child = p1;
-
-	  (*node)->left_child = p2->right_child;
-	  p2->right_child = *node;
-
-	  if (p2->balance == -1)
-	    (*node)->balance = 1;
-	  else
-	    (*node)->balance = 0;
-
-	  if (p2->balance == 1)
-	    p1->balance = -1;
-	  else
-	    p1->balance = 0;
-	  *node = p2;
-	}
-
-	(*node)->balance = 0;
-	*needs_balancing = 0;
-      }
-    }
-    return result;
-  }
-
-  /*
-   * If MORE, prepare to move to the right.
-   */
-  if (cmp > 0) {
+  return NULL;
+}
 
-    AVL_MSG("MORE: sprouting to the right");
-    result = validation_status_sprout(&(*node)->right_child, needs_balancing, new_node);
+/**
+ * Intern a URI's publication point prefix.  Sets *name to the part of
+ * the URI after the prefix.  Returns NULL if we run out of memory.
+ */
+static const char *uri_prefix_intern(rcynic_ctx_t *rc,
+				     const uri_t *uri,
+				     const char **name)
+{
+  const char *p = uri_prefix_find(rc, uri, name);
+  const size_t len = *name - uri->s;
+  char *q;
 
-    if (*needs_balancing) {
-      AVL_MSG("MORE: right branch has grown longer");
+  if (p != NULL)
+    return p;
 
-      switch ((*node)->balance) {
+  if ((q = arena_alloc(&rc->validation_status_arena, len + 1, 1)) == NULL)
+    return NULL;
 
-      case -1:AVL_MSG("MORE: balance was off, fixed implicitly");
-	(*node)->balance = 0;
-	*needs_balancing = 0;
-	break;
+  memcpy(q, uri->s, len);
+  q[len] = '\0';
 
-      case 0:	AVL_MSG("MORE: balance was okay, now off but ok");
-	(*node)->balance = 1;
-	break;
+  if (!hash_table_insert(&rc->uri_prefixes, hash_bytes(HASH_INIT, q, len), q))
+    return NULL;
 
-      case 1:	AVL_MSG("MORE: balance was off, need to rebalance");
-	p1 = (*node)->right_child;
+  return q;
+}
 
-	if (p1->balance == 1) {
-	  AVL_MSG("MORE: single RR");
-	  (*node)->right_child = p1->left_child;
-	  p1->left_child = *node;
-	  (*node)->balance = 0;
-	  *node = p1;
-	}
+/**
+ * Hash table lookup for validation status objects, given an interned
+ * prefix, the hash of that prefix, and the rest of the URI.  This is
+ * the form to use when looking up many names in one directory.
+ * Caller must hold the program context lock if validation threads
+ * might be running.
+ */
+static validation_status_t *
+validation_status_find_name(const rcynic_ctx_t *rc,
+			    const char *prefix,
+			    const uint64_t prefix_hash,
+			    const char *name,
+			    const object_generation_t generation)
+{
+  const uint64_t hash = hash_bytes(hash_bytes(prefix_hash, name, strlen(name)),
+				   &generation, sizeof(generation));
+  validation_status_t *v;
+  size_t cursor = 0;
 
-	else {
-	  AVL_MSG("MORE: double RL");
+  if (prefix == NULL)
+    return NULL;
 
-	  p2 = p1->left_child;
-	  p1->left_child = p2->right_child;
-	  p2->right_child = p1;
+  while ((v = hash_table_next(&rc->validation_status_index, hash, &cursor)) != NULL &&
+	 (v->generation != generation || v->prefix != prefix || strcmp(v->name, name)))
+    ;
 
-	  (*node)->right_child = p2->left_child;
-	  p2->left_child = *node;
+  return v;
+}
 
-	  if (p2->balance == 1)
-	    (*node)->balance = -1;
-	  else
-	    (*node)->balance = 0;
+/**
+ * Hash table lookup for validation status objects.  Caller must hold
+ * the program context lock if validation threads might be running.
+ */
+static validation_status_t *
+validation_status_find(const rcynic_ctx_t *rc,
+		       const uri_t *uri,
+		       const object_generation_t generation)
+{
+  const char *name, *prefix = uri_prefix_find(rc, uri, &name);
 
-	  if (p2->balance == -1)
-	    p1->balance = 1;
-	  else
-	    p1->balance = 0;
+  return validation_status_find_name(rc, prefix, hash_bytes(HASH_INIT, uri->s, name - uri->s),
+				     name, generation);
+}
 
-	  *node = p2;
-	} /*else*/
-	(*node)->balance = 0;
-	*needs_balancing = 0;
-      }
-    }
-    return result;
-  }
+/**
+ * Allocate a new validation status entry from the arena.
+ */
+static validation_status_t *validation_status_new(rcynic_ctx_t *rc,
+						  const uri_t *uri,
+						  const object_generation_t generation)
+{
+  validation_status_t *v;
+  const char *name;
+  size_t len;
+  char *s;
 
-  /*
-   * Neither more nor less, found existing node matching key, return it.
-   */
-  AVL_MSG("I found it!");
-  *needs_balancing = 0;
-  return *node;
+  if ((v = arena_alloc(&rc->validation_status_arena, sizeof(*v), ARENA_ALIGN)) == NULL ||
+      (v->prefix = uri_prefix_intern(rc, uri, &name)) == NULL ||
+      (s = arena_alloc(&rc->validation_status_arena, (len = strlen(name) + 1), 1)) == NULL)
+    return NULL;
 
-#undef AVL_MSG
+  memcpy(s, name, len);
+  v->name = s;
+  v->generation = generation;
+  v->installed = 0;
+  v->timestamp = 0;
+  memset(v->events, 0, sizeof(v->events));
+  return v;
 }
 
 /**
@@ -1351,7 +1903,6 @@ static void log_validation_status(rcynic_ctx_t *rc,
 				  const object_generation_t generation)
 {
   validation_status_t *v = NULL;
-  int needs_balancing = 0;
 
   assert(rc && uri && code < MIB_COUNTER_T_MAX && generation < OBJECT_GENERATION_MAX);
 
@@ -1361,31 +1912,31 @@ static void log_validation_status(rcynic_ctx_t *rc,
   if (code == rsync_transfer_skipped && !rc->run_rsync)
     return;
 
-  if (rc->validation_status_in_waiting == NULL &&
-      (rc->validation_status_in_waiting = validation_status_t_new()) == NULL) {
-    logmsg(rc, log_sys_err, "Couldn't allocate validation status entry for %s", uri->s);
-    return;
-  }
+  rcynic_lock(rc);
 
-  v = rc->validation_status_in_waiting;
-  memset(v, 0, sizeof(*v));
-  v->uri = *uri;
-  v->generation = generation;
+  if ((v = validation_status_find(rc, uri, generation)) == NULL) {
+
+    if ((v = validation_status_new(rc, uri, generation)) == NULL) {
+      logmsg(rc, log_sys_err, "Couldn't allocate validation status entry for %s", uri->s);
+      goto done;
+    }
 
-  v = validation_status_sprout(&rc->validation_status_root, &needs_balancing, v);
-  if (v == rc->validation_status_in_waiting)
-    rc->validation_status_in_waiting = NULL;
+    if (!sk_validation_status_t_push(rc->validation_status, v)) {
+      logmsg(rc, log_sys_err, "Couldn't store validation status entry for %s", uri->s);
+      goto done;
+    }
 
-  if (rc->validation_status_in_waiting == NULL &&
-      !sk_validation_status_t_push(rc->validation_status, v)) {
-    logmsg(rc, log_sys_err, "Couldn't store validation status entry for %s", uri->s);
-    return;
+    if (!hash_table_insert(&rc->validation_status_index, validation_status_hash(uri, generation), v)) {
+      logmsg(rc, log_sys_err, "Couldn't index validation status entry for %s", uri->s);
+      (void) sk_validation_status_t_pop(rc->validation_status);
+      goto done;
+    }
   }
 
   v->timestamp = time(0);
 
   if (validation_status_get_code(v, code))
-    return;
+    goto done;
 
   validation_status_set_code(v, code, 1);
 
@@ -1396,6 +1947,59 @@ static void log_validation_status(rcynic_ctx_t *rc,
 	 (generation != object_generation_null ? object_generation_label[generation] : ""),
 	 (generation != object_generation_null ? " " : ""),
 	 uri->s);
+
+ done:
+  rcynic_unlock(rc);
+}
+
+/**
+ * Copy the contents of one open file to another, starting at the
+ * current offsets.  We try the cheap ways first: sharing extents
+ * (FICLONE) where the filesystem supports it, then copying within the
+ * kernel (copy_file_range(), sendfile()), and only fall back to
+ * read()/write() through a buffer if none of those work.  Each of
+ * these advances the file offsets, so if one gives up part way the
+ * next picks up where it left off.
+ */
+static int copy_file_contents(const int in, const int out)
+{
+  char buf[65536];
+  ssize_t n, m;
+
+#ifdef FICLONE
+  if (ioctl(out, FICLONE, in) == 0)
+    return 1;
+#endif
+
+#ifdef SYS_copy_file_range
+  while ((n = syscall(SYS_copy_file_range, in, NULL, out, NULL, sizeof(buf) * 16, 0)) > 0)
+    ;
+  if (n == 0)
+    return 1;
+  if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+    return 0;
+#endif
+
+#ifdef RCYNIC_USE_SENDFILE
+  while ((n = sendfile(out, in, NULL, sizeof(buf) * 16)) > 0)
+    ;
+  if (n == 0)
+    return 1;
+  if (errno != ENOSYS && errno != EINVAL)
+    return 0;
+#endif
+
+  while ((n = read(in, buf, sizeof(buf))) > 0)
+    for (m = 0; m < n; ) {
+      ssize_t k = write(out, buf + m, n - m);
+      if (k < 0 && errno == EINTR)
+	continue;
+      if (k <= 0)
+	return 0;
+      m += k;
+    }
+
+  return n == 0;
 }
 
 /**
@@ -1403,39 +2007,29 @@ static void log_validation_status(rcynic_ctx_t *rc,
  */
 static int cp_ln(const rcynic_ctx_t *rc, const path_t *source, const path_t *target)
 {
+  struct timespec times[2];
   struct stat statbuf;
-  struct utimbuf utimebuf;
-  FILE *in = NULL, *out = NULL;
-  int c, ok = 0;
+  int in = -1, out = -1, ok = 0;
 
   if (rc->use_links) {
-    (void) unlink(target->s);
-    ok = link(source->s, target->s) == 0;
+    (void) unlink_at(rc, target);
+    ok = link_at(rc, source, target) == 0;
     if (!ok)
       logmsg(rc, log_sys_err, "Couldn't link %s to %s: %s",
 	     source->s, target->s, strerror(errno));
     return ok;
   }
 
-  if ((in = fopen(source->s, "rb")) == NULL ||
-      (out = fopen(target->s, "wb")) == NULL)
-    goto done;
-
-  while ((c = getc(in)) != EOF)
-    if (putc(c, out) == EOF)
-      goto done;
-
-  ok = 1;
-
- done:
-  ok &= !(in  != NULL && fclose(in)  == EOF);
-  ok &= !(out != NULL && fclose(out) == EOF);
+  /*
+   * Unlink first, so that we never write through a hard link into
+   * somebody else's copy, and so that FICLONE gets a fresh file.
+   */
+  (void) unlink_at(rc, target);
 
-  if (!ok) {
-    logmsg(rc, log_sys_err, "Couldn't copy %s to %s: %s",
-	   source->s, target->s, strerror(errno));
-    return ok;
-  }
+  ok = ((in = open_at(rc, source, O_RDONLY | O_CLOEXEC, 0)) >= 0 &&
+	fstat(in, &statbuf) == 0 &&
+	(out = open_at(rc, target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) >= 0 &&
+	copy_file_contents(in, out));
 
   /*
    * Perserve the file modification time to allow for detection of
@@ -1443,15 +2037,63 @@ static int cp_ln(const rcynic_ctx_t *rc, const path_t *source, const path_t *tar
    * the times is not optimal, but is also not critical, thus no
    * failure return.
    */
-  if (stat(source->s, &statbuf) < 0 ||
-      (utimebuf.actime = statbuf.st_atime,
-       utimebuf.modtime = statbuf.st_mtime,
-       utime(target->s, &utimebuf) < 0))
-    logmsg(rc, log_sys_err, "Couldn't copy inode timestamp from %s to %s: %s",
+  if (ok) {
+    times[0].tv_sec  = statbuf.st_atime;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec  = statbuf.st_mtime;
+    times[1].tv_nsec = 0;
+    if (futimens(out, times) < 0)
+      logmsg(rc, log_sys_err, "Couldn't copy inode timestamp from %s to %s: %s",
+	     source->s, target->s, strerror(errno));
+  }
+
+  if (in >= 0)
+    (void) close(in);
+  if (out >= 0 && close(out) < 0)
+    ok = 0;
+
+  if (!ok)
+    logmsg(rc, log_sys_err, "Couldn't copy %s to %s: %s",
 	   source->s, target->s, strerror(errno));
 
   return ok;
 }
+/**
+ * Record that we've installed an object in rc->new_authenticated.
+ */
+static void object_set_installed(rcynic_ctx_t *rc,
+				 const uri_t *uri,
+				 const object_generation_t generation)
+{
+  validation_status_t *v;
+
+  rcynic_lock(rc);
+  if ((v = validation_status_find(rc, uri, generation)) != NULL)
+    v->installed = 1;
+  rcynic_unlock(rc);
+}
+
+/**
+ * Check whether we've already installed an object in
+ * rc->new_authenticated.  That tree is created fresh for each run and
+ * everything in it at a URI-derived name got there via
+ * install_object(), so we can answer this from the validation status
+ * index rather than probing the filesystem.
+ */
+static int object_installed(rcynic_ctx_t *rc, const uri_t *uri)
+{
+  validation_status_t *v;
+  int installed;
+
+  rcynic_lock(rc);
+  installed = (((v = validation_status_find(rc, uri, object_generation_current)) != NULL &&
+		v->installed) ||
+	       ((v = validation_status_find(rc, uri, object_generation_backup)) != NULL &&
+		v->installed));
+  rcynic_unlock(rc);
+
+  return installed;
+}
 
 /**
  * Install an object.
@@ -1476,45 +2118,10 @@ static int install_object(rcynic_ctx_t *rc,
   if (!cp_ln(rc, source, &target))
     return 0;
   log_validation_status(rc, uri, object_accepted, generation);
+  object_set_installed(rc, uri, generation);
   return 1;
 }
 
-/**
- * AVL tree lookup for validation status objects.
- */
-static validation_status_t *
-validation_status_find(validation_status_t *node,
-		       const uri_t *uri,
-		       const object_generation_t generation)
-{
-  int cmp;
-
-  while (node != NULL && (cmp = validation_status_cmp(node, uri, generation)) != 0)
-    node = cmp < 0 ? node->left_child : node->right_child;
-
-  return node;
-}
-
-/**
- * Check whether we have a validation status entry corresponding to a
- * given filename.  This is intended for use during pruning the
- * unauthenticated tree, so it only checks the current generation.
- */
-static int
-validation_status_find_filename(const rcynic_ctx_t *rc,
-				const char *filename)
-{
-  uri_t uri;
-
-  if (strlen(filename) + SIZEOF_RSYNC >= sizeof(uri.s))
-    return 0;
-
-  strcpy(uri.s, SCHEME_RSYNC);
-  strcat(uri.s, filename);
-
-  return validation_status_find(rc->validation_status_root, &uri, object_generation_current) != NULL;
-}
-
 /**
  * Figure out whether we already have a good copy of an object.  This
  * is a little more complicated than it sounds, because we might have
@@ -1532,6 +2139,7 @@ static int skip_checking_this_object(rcynic_ctx_t *rc,
 				     const object_generation_t generation)
 {
   validation_status_t *v = NULL;
+  int accepted;
   path_t path;
 
   assert(rc && uri && rc->validation_status);
@@ -1539,7 +2147,7 @@ static int skip_checking_this_object(rcynic_ctx_t *rc,
   if (!uri_to_filename(rc, uri, &path, &rc->new_authenticated))
     return 1;
 
-  if (access(path.s, R_OK)) {
+  if (!object_installed(rc, uri)) {
     logmsg(rc, log_telemetry, "Checking %s", uri->s);
     return 0;
   }
@@ -1547,9 +2155,12 @@ static int skip_checking_this_object(rcynic_ctx_t *rc,
   if (generation != object_generation_current)
     return 1;
 
-  v = validation_status_find(rc->validation_status_root, uri, generation);
+  rcynic_lock(rc);
+  v = validation_status_find(rc, uri, generation);
+  accepted = v != NULL && validation_status_get_code(v, object_accepted);
+  rcynic_unlock(rc);
 
-  if (v != NULL && validation_status_get_code(v, object_accepted))
+  if (accepted)
     return 1;
 
   log_validation_status(rc, uri, rechecking_object, generation);
@@ -1557,6 +2168,112 @@ static int skip_checking_this_object(rcynic_ctx_t *rc,
   return 0;
 }
 
+/**
+ * Replay a saved set of status codes for an object.  object_accepted
+ * is left to whoever installs the object.
+ */
+static void replay_events(rcynic_ctx_t *rc,
+			  const uri_t *uri,
+			  const unsigned char *events,
+			  const object_generation_t generation)
+{
+  mib_counter_t code;
+
+  for (code = 0; code < MIB_COUNTER_T_MAX; code++)
+    if (code != object_accepted && (events[code >> 3] & (1 << (code & 7))))
+      log_validation_status(rc, uri, code, generation);
+}
+
+/**
+ * Snapshot the status codes we've logged so far for an object.
+ */
+static void validation_status_events(rcynic_ctx_t *rc,
+				     const uri_t *uri,
+				     const object_generation_t generation,
+				     unsigned char *events)
+{
+  validation_status_t *v;
+
+  assert(rc && uri && events);
+
+  rcynic_lock(rc);
+  if ((v = validation_status_find(rc, uri, generation)) != NULL)
+    memcpy(events, v->events, sizeof(v->events));
+  else
+    memset(events, 0, sizeof(v->events));
+  rcynic_unlock(rc);
+}
+
+/**
+ * Copy the status codes one generation of an object picked up since
+ * a snapshot to another generation, for when we've skipped checking
+ * the second generation because it's the same file as the first.
+ */
+static void validation_status_copy(rcynic_ctx_t *rc,
+				   const uri_t *uri,
+				   const unsigned char *before,
+				   const object_generation_t from,
+				   const object_generation_t to)
+{
+  unsigned char events[(MIB_COUNTER_T_MAX + 7) / 8];
+  int i;
+
+  validation_status_events(rc, uri, from, events);
+
+  for (i = 0; i < sizeof(events); i++)
+    events[i] &= ~before[i];
+
+  events[rechecking_object >> 3] &= ~(1 << (rechecking_object & 7));
+
+  replay_events(rc, uri, events, to);
+}
+
+/**
+ * Check whether the current and backup copies of an object have the
+ * same contents, in which case checking both is a waste of time: they
+ * will get the same answer.  The common cases are that they're the
+ * same inode (use-links, nothing changed since the last run), or that
+ * they're identical copies.
+ */
+static int same_file_contents(const rcynic_ctx_t *rc, const uri_t *uri)
+{
+  char buf1[8192], buf2[sizeof(buf1)];
+  struct stat st1, st2;
+  path_t path1, path2;
+  int fd1 = -1, fd2 = -1, same = 0;
+  ssize_t n1, n2;
+
+  assert(rc && uri);
+
+  if (!uri_to_filename(rc, uri, &path1, &rc->unauthenticated) ||
+      !uri_to_filename(rc, uri, &path2, &rc->old_authenticated) ||
+      stat(path1.s, &st1) < 0 || stat(path2.s, &st2) < 0 ||
+      !S_ISREG(st1.st_mode) || !S_ISREG(st2.st_mode) ||
+      st1.st_size != st2.st_size)
+    return 0;
+
+  if (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+    return 1;
+
+  if ((fd1 = open(path1.s, O_RDONLY)) < 0 ||
+      (fd2 = open(path2.s, O_RDONLY)) < 0)
+    goto done;
+
+  do {
+    n1 = read(fd1, buf1, sizeof(buf1));
+    n2 = read(fd2, buf2, sizeof(buf2));
+  } while (n1 > 0 && n1 == n2 && !memcmp(buf1, buf2, n1));
+
+  same = n1 == 0 && n2 == 0;
+
+ done:
+  if (fd1 >= 0)
+    (void) close(fd1);
+  if (fd2 >= 0)
+    (void) close(fd2);
+  return same;
+}
+
 
 
 /**
@@ -1651,60 +2368,219 @@ static int is_directory(const path_t *name)
 }
 
 /**
- * Remove a directory tree, like rm -rf.
+ * Test whether a directory entry is itself a directory, trusting
+ * d_type when the filesystem fills it in.
  */
-static int rm_rf(const path_t *name)
+static int dirent_is_directory(const int dfd, const struct dirent *d)
 {
-  path_t path;
-  struct dirent *d;
-  DIR *dir;
-  int ret = 0;
+  struct stat st;
 
-  assert(name);
+#ifdef DT_DIR
+  if (d->d_type == DT_DIR)
+    return 1;
+  if (d->d_type != DT_UNKNOWN)
+    return 0;
+#endif
 
-  if (!is_directory(name))
-    return unlink(name->s) == 0;
+  return fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Remove everything in a directory, relative to an open descriptor
+ * for it, which we consume.  Leaves the (empty) directory itself.
+ */
+static int rm_rf_at(const int dfd)
+{
+  struct dirent *d;
+  DIR *dir;
+  int fd, ok = 1;
 
-  if ((dir = opendir(name->s)) == NULL)
+  if ((dir = fdopendir(dfd)) == NULL) {
+    (void) close(dfd);
     return 0;
+  }
 
-  while ((d = readdir(dir)) != NULL) {
+  while (ok && (d = readdir(dir)) != NULL) {
     if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
       continue;
-    if (snprintf(path.s, sizeof(path.s), "%s/%s", name->s, d->d_name) >= sizeof(path.s))
-      goto done;
-    if (unlink(path.s) == 0)
-      continue;
-    else if (rm_rf(&path))
-      continue;
+    if (!dirent_is_directory(dfd, d))
+      ok = unlinkat(dfd, d->d_name, 0) == 0;
     else
-      goto done;
+      ok = ((fd = openat(dfd, d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0 &&
+	    rm_rf_at(fd) &&
+	    unlinkat(dfd, d->d_name, AT_REMOVEDIR) == 0);
   }
 
-  ret = rmdir(name->s) == 0;
-
- done:
   closedir(dir);
-  return ret;
+  return ok;
 }
 
 /**
- * Construct names for the directories not directly settable by the
- * user.
- *
- * This function also checks for an old-style rc->authenticated
- * directory, to simplify upgrade from older versions of rcynic.
+ * Remove a directory tree, like rm -rf.
  */
-static int construct_directory_names(rcynic_ctx_t *rc)
+static int rm_rf(const path_t *name)
 {
-  struct stat st;
-  ssize_t n;
-  path_t p;
-  time_t t = time(0);
+  int fd;
 
-  p = rc->authenticated;
+  assert(name);
 
-  n = strlen(p.s);
+  if (!is_directory(name))
+    return unlink(name->s) == 0;
+
+  if ((fd = open(name->s, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+    return 0;
+
+  return rm_rf_at(fd) && rmdir(name->s) == 0;
+}
+
+/**
+ * Trash removal thread.  These run whether or not we're threaded
+ * otherwise, so they use the trash queue's own lock rather than
+ * rcynic_lock().
+ */
+static void *trash_worker(void *cookie)
+{
+  trash_t *trash = &((rcynic_ctx_t *) cookie)->trash;
+  const char *name;
+  path_t path;
+
+  for (;;) {
+    (void) pthread_mutex_lock(&trash->lock);
+    if (trash->next < sk_OPENSSL_STRING_num(trash->entries))
+      name = sk_OPENSSL_STRING_value(trash->entries, trash->next++);
+    else
+      name = NULL;
+    (void) pthread_mutex_unlock(&trash->lock);
+
+    if (name == NULL)
+      return NULL;
+
+    if (strlen(name) < sizeof(path.s)) {
+      strcpy(path.s, name);
+      (void) rm_rf(&path);
+    }
+  }
+}
+
+/**
+ * Move a stale tree aside and queue it for removal.  If we can't
+ * rename it, we just remove it here and now, as we always used to.
+ */
+static void trash_add(rcynic_ctx_t *rc, const path_t *name)
+{
+  trash_t *trash = &rc->trash;
+  struct dirent *d;
+  path_t path;
+  DIR *dir;
+
+  if (snprintf(path.s, sizeof(path.s), "%s.trash.%u.%u",
+	       rc->authenticated.s, (unsigned) getpid(), trash->serial++) >= sizeof(path.s) ||
+      ((trash->roots   == NULL && (trash->roots   = sk_OPENSSL_STRING_new_null()) == NULL) ||
+       (trash->entries == NULL && (trash->entries = sk_OPENSSL_STRING_new_null()) == NULL)) ||
+      rename(name->s, path.s) < 0) {
+    logmsg(rc, log_verbose, "Removing %s", name->s);
+    (void) rm_rf(name);
+    return;
+  }
+
+  logmsg(rc, log_verbose, "Moved %s to %s for removal", name->s, path.s);
+
+  if (!sk_OPENSSL_STRING_push_strdup(trash->roots, path.s)) {
+    (void) rm_rf(&path);
+    return;
+  }
+
+  if ((dir = opendir(path.s)) == NULL)
+    return;
+
+  while ((d = readdir(dir)) != NULL) {
+    char *s;
+    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+      continue;
+    if ((s = malloc(strlen(path.s) + strlen(d->d_name) + 2)) == NULL)
+      break;
+    sprintf(s, "%s/%s", path.s, d->d_name);
+    if (!sk_OPENSSL_STRING_push(trash->entries, s)) {
+      free(s);
+      break;
+    }
+  }
+
+  closedir(dir);
+}
+
+/**
+ * Start background threads to empty the trash.  Anything we can't
+ * hand to a thread gets cleaned up by trash_finish().
+ */
+static void trash_start(rcynic_ctx_t *rc)
+{
+  trash_t *trash = &rc->trash;
+  int n = rc->validation_threads > 1 ? rc->validation_threads : 1;
+
+  if (trash->threads != NULL || sk_OPENSSL_STRING_num(trash->entries) <= 0)
+    return;
+
+  if (n > sk_OPENSSL_STRING_num(trash->entries))
+    n = sk_OPENSSL_STRING_num(trash->entries);
+
+  if ((trash->threads = calloc(n, sizeof(*trash->threads))) == NULL)
+    return;
+
+  for (trash->nthreads = 0; trash->nthreads < n; trash->nthreads++)
+    if (pthread_create(&trash->threads[trash->nthreads], NULL, trash_worker, rc) != 0)
+      break;
+
+  logmsg(rc, log_verbose, "Started %d threads to remove stale trees", trash->nthreads);
+}
+
+/**
+ * Wait for trash removal to finish, then remove whatever is left,
+ * including the renamed tree roots themselves.
+ */
+static void trash_finish(rcynic_ctx_t *rc)
+{
+  trash_t *trash = &rc->trash;
+  path_t path;
+  int i;
+
+  for (i = 0; i < trash->nthreads; i++)
+    (void) pthread_join(trash->threads[i], NULL);
+
+  for (i = 0; i < sk_OPENSSL_STRING_num(trash->roots); i++) {
+    const char *name = sk_OPENSSL_STRING_value(trash->roots, i);
+    if (strlen(name) >= sizeof(path.s))
+      continue;
+    strcpy(path.s, name);
+    if (!rm_rf(&path))
+      logmsg(rc, log_sys_err, "Couldn't remove %s: %s", path.s, strerror(errno));
+  }
+
+  free(trash->threads);
+  sk_OPENSSL_STRING_pop_free(trash->roots, OPENSSL_STRING_free);
+  sk_OPENSSL_STRING_pop_free(trash->entries, OPENSSL_STRING_free);
+  trash->threads = NULL;
+  trash->roots = trash->entries = NULL;
+  trash->nthreads = trash->next = 0;
+}
+
+/**
+ * Construct names for the directories not directly settable by the
+ * user.
+ *
+ * This function also checks for an old-style rc->authenticated
+ * directory, to simplify upgrade from older versions of rcynic.
+ */
+static int construct_directory_names(rcynic_ctx_t *rc)
+{
+  struct stat st;
+  ssize_t n;
+  path_t p;
+  time_t t = time(0);
+
+  p = rc->authenticated;
+
+  n = strlen(p.s);
 
   if (n + sizeof(authenticated_symlink_suffix) >= sizeof(p.s)) {
     logmsg(rc, log_usage_err, "Symlink name would be too long");
@@ -1743,7 +2619,7 @@ static int construct_directory_names(rcynic_ctx_t *rc)
 /**
  * Do final symlink shuffle and cleanup of output directories.
  */
-static int finalize_directories(const rcynic_ctx_t *rc)
+static int finalize_directories(rcynic_ctx_t *rc)
 {
   path_t path, real_old, real_new;
   const char *dir;
@@ -1810,52 +2686,54 @@ static int finalize_directories(const rcynic_ctx_t *rc)
       if (realpath(g.gl_pathv[i], path.s) &&
 	  strcmp(path.s, real_old.s) &&
 	  strcmp(path.s, real_new.s))
-	rm_rf(&path);
+	trash_add(rc, &path);
     globfree(&g);
   }
 
+  trash_start(rc);
+
   return 1;
 }
 
 
 
 /**
- * Test whether a pair of URIs "conflict", that is, whether attempting
- * to rsync both of them at the same time in parallel might cause
- * unpredictable behavior.  Might need a better name for this test.
- *
- * Returns non-zero iff the two URIs "conflict".
+ * Name of an entry in a directory listing.
  */
-static int conflicting_uris(const uri_t *a, const uri_t *b)
+static const char *dir_listing_name(const dir_listing_t *l, const int i)
 {
-  size_t len_a, len_b;
-
-  assert(a && is_rsync(a->s) && b && is_rsync(b->s));
-
-  len_a = strlen(a->s);
-  len_b = strlen(b->s);
-
-  assert(len_a < sizeof(a->s) && len_b < sizeof(b->s));
-
-  return !strncmp(a->s, b->s, len_a < len_b ? len_a : len_b);
+  assert(l && i >= 0 && i < l->count);
+  return l->buf + l->offsets[i];
 }
 
-
+/**
+ * Free a directory listing.
+ */
+static void dir_listing_free(dir_listing_t *l)
+{
+  if (l == NULL)
+    return;
+  free(l->buf);
+  free(l->offsets);
+  free(l);
+}
 
 /**
  * Read non-directory filenames from a directory, so we can check to
- * see what's missing from a manifest.
+ * see what's missing from a manifest.  We only stat() entries when
+ * the filesystem doesn't fill in d_type.
  */
-static STACK_OF(OPENSSL_STRING) *directory_filenames(const rcynic_ctx_t *rc,
-						     const walk_state_t state,
-						     const uri_t *uri)
+static dir_listing_t *directory_filenames(const rcynic_ctx_t *rc,
+					  const walk_state_t state,
+					  const uri_t *uri)
 {
-  STACK_OF(OPENSSL_STRING) *result = NULL;
-  path_t dpath, fpath;
+  dir_listing_t *result = NULL;
   const path_t *prefix = NULL;
   DIR *dir = NULL;
   struct dirent *d;
-  int ok = 0;
+  path_t dpath;
+  int fd = -1, ok = 0;
+  size_t n;
 
   assert(rc && uri);
 
@@ -1871,43 +2749,95 @@ static STACK_OF(OPENSSL_STRING) *directory_filenames(const rcynic_ctx_t *rc,
   }
 
   if (!uri_to_filename(rc, uri, &dpath, prefix) ||
-      (dir = opendir(dpath.s)) == NULL ||
-      (result = sk_OPENSSL_STRING_new(uri_cmp)) == NULL)
+      (fd = open_at(rc, &dpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0)) < 0 ||
+      (dir = fdopendir(fd)) == NULL ||
+      (result = calloc(1, sizeof(*result))) == NULL)
     goto done;
 
-  while ((d = readdir(dir)) != NULL)
-    if (snprintf(fpath.s, sizeof(fpath.s), "%s/%s", dpath.s, d->d_name) >= sizeof(fpath.s)) {
-      logmsg(rc, log_data_err, "Local path name %s/%s too long", dpath.s, d->d_name);
-      goto done;
+  while ((d = readdir(dir)) != NULL) {
+    if (dirent_is_directory(fd, d))
+      continue;
+
+    n = strlen(d->d_name) + 1;
+
+    if (result->len + n > result->max) {
+      size_t max = result->max ? result->max * 2 : 4096;
+      char *buf;
+      while (max < result->len + n)
+	max *= 2;
+      if ((buf = realloc(result->buf, max)) == NULL)
+	goto oom;
+      result->buf = buf;
+      result->max = max;
     }
-    else if (!is_directory(&fpath) && !sk_OPENSSL_STRING_push_strdup(result, d->d_name)) {
-      logmsg(rc, log_sys_err, "sk_OPENSSL_STRING_push_strdup() failed, probably memory exhaustion");
-      goto done;
+
+    if (result->count >= result->max_count) {
+      int max_count = result->max_count ? result->max_count * 2 : 64;
+      size_t *offsets;
+      if ((offsets = realloc(result->offsets, max_count * sizeof(*offsets))) == NULL)
+	goto oom;
+      result->offsets = offsets;
+      result->max_count = max_count;
     }
 
+    result->offsets[result->count++] = result->len;
+    memcpy(result->buf + result->len, d->d_name, n);
+    result->len += n;
+  }
+
   ok = 1;
+  goto done;
+
+ oom:
+  logmsg(rc, log_sys_err, "Couldn't allocate directory listing for %s, probably memory exhaustion", dpath.s);
 
  done:
   if (dir != NULL)
     closedir(dir);
+  else if (fd >= 0)
+    (void) close(fd);
 
   if (ok)
     return result;
 
-  sk_OPENSSL_STRING_pop_free(result, OPENSSL_STRING_free);
+  dir_listing_free(result);
   return NULL;
 }
 
 
 
+/**
+ * Lock protecting walk context reference counts.  This is a leaf
+ * lock: nothing else is ever acquired while holding it, which is what
+ * lets the main thread clone walk context stacks while holding the
+ * program context lock.
+ */
+static pthread_mutex_t walk_ctx_refcount_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * Increment walk context reference count.
  */
 static void walk_ctx_attach(walk_ctx_t *w)
 {
   if (w != NULL) {
+    (void) pthread_mutex_lock(&walk_ctx_refcount_lock);
     w->refcount++;
     assert(w->refcount != 0);
+    (void) pthread_mutex_unlock(&walk_ctx_refcount_lock);
+  }
+}
+
+/**
+ * Close a walk context's publication point directory descriptors.
+ */
+static void walk_ctx_close_dirs(walk_ctx_t *w)
+{
+  int i;
+
+  for (i = 0; i < sizeof(w->pubpoint_fd) / sizeof(*w->pubpoint_fd); i++) {
+    if (w->pubpoint_fd[i] >= 0)
+      (void) close(w->pubpoint_fd[i]);
+    w->pubpoint_fd[i] = -1;
   }
 }
 
@@ -1917,17 +2847,65 @@ static void walk_ctx_attach(walk_ctx_t *w)
  */
 static void walk_ctx_detach(walk_ctx_t *w)
 {
-  if (w != NULL && --(w->refcount) == 0) {
-    assert(w->refcount == 0);
+  unsigned refcount;
+
+  if (w == NULL)
+    return;
+
+  (void) pthread_mutex_lock(&walk_ctx_refcount_lock);
+  refcount = --(w->refcount);
+  (void) pthread_mutex_unlock(&walk_ctx_refcount_lock);
+
+  if (refcount == 0) {
+    walk_ctx_close_dirs(w);
+    (void) pthread_mutex_destroy(&w->mutex);
     X509_free(w->cert);
+    EVP_PKEY_free(w->pkey);
     Manifest_free(w->manifest);
+    hash_table_clear(&w->manifest_index);
     sk_X509_free(w->certs);
     sk_X509_CRL_pop_free(w->crls, X509_CRL_free);
-    sk_OPENSSL_STRING_pop_free(w->filenames, OPENSSL_STRING_free);
+    dir_listing_free(w->filenames);
+    free(w->children);
     free(w);
   }
 }
 
+/**
+ * Public key of the certificate a walk context represents, ie, the
+ * issuer key for everything we find in its publication point.  We
+ * decode it once and keep it with the context rather than calling
+ * X509_get_pubkey() for every child object.  Caller must hold the
+ * context's lock, and must not free the result.
+ */
+static EVP_PKEY *walk_ctx_pkey(walk_ctx_t *w)
+{
+  assert(w && w->cert);
+  if (w->pkey == NULL)
+    w->pkey = X509_get_pubkey(w->cert);
+  return w->pkey;
+}
+
+/**
+ * Lock a walk context.  Walk contexts can be shared between cloned
+ * stacks which may be running in different validation threads, so
+ * whoever is stepping a context's iterator must hold its mutex.
+ */
+static void walk_ctx_lock(walk_ctx_t *w)
+{
+  if (w != NULL)
+    (void) pthread_mutex_lock(&w->mutex);
+}
+
+/**
+ * Unlock a walk context.
+ */
+static void walk_ctx_unlock(walk_ctx_t *w)
+{
+  if (w != NULL)
+    (void) pthread_mutex_unlock(&w->mutex);
+}
+
 /**
  * Return top context of a walk context stack.
  */
@@ -1947,6 +2925,113 @@ static int walk_ctx_loop_done(STACK_OF(walk_ctx_t) *wsk)
   return wsk == NULL || w == NULL || w->state >= walk_state_done;
 }
 
+/**
+ * Get a descriptor for the directory holding a walk context's
+ * publication point under the unauthenticated or old_authenticated
+ * tree, opening it the first time we need it.  Returns -1 if we can't
+ * open it.  Caller must hold the walk context's lock.
+ */
+static int walk_ctx_dirfd(const rcynic_ctx_t *rc, walk_ctx_t *w, const path_t *prefix)
+{
+  path_t path;
+  int *fd;
+
+  if (prefix == &rc->unauthenticated)
+    fd = &w->pubpoint_fd[0];
+  else if (prefix == &rc->old_authenticated)
+    fd = &w->pubpoint_fd[1];
+  else
+    return -1;
+
+  if (*fd < 0 && uri_to_filename(rc, &w->certinfo.sia, &path, prefix))
+    *fd = open_at(rc, &path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+
+  return *fd;
+}
+
+/**
+ * Open an object for reading.  Objects that live directly in the
+ * publication point we're walking are opened relative to that
+ * directory's descriptor, anything else relative to the tree root.
+ * "path" must already hold the object's filename under "prefix".
+ */
+static int open_object(const rcynic_ctx_t *rc,
+		       STACK_OF(walk_ctx_t) *wsk,
+		       const uri_t *uri,
+		       const path_t *path,
+		       const path_t *prefix)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  const char *name;
+  size_t n;
+  int fd;
+
+  if (w != NULL && (n = strlen(w->certinfo.sia.s)) > 0 && w->certinfo.sia.s[n - 1] == '/' &&
+      !strncmp(uri->s, w->certinfo.sia.s, n) && *(name = uri->s + n) != '\0' &&
+      strchr(name, '/') == NULL && (fd = walk_ctx_dirfd(rc, w, prefix)) >= 0)
+    return openat(fd, name, O_RDONLY | O_CLOEXEC);
+
+  return open_at(rc, path, O_RDONLY | O_CLOEXEC, 0);
+}
+
+/**
+ * Tell the kernel we're about to read every file in the directory
+ * we're about to walk, so that on a cold cache it can stream them in
+ * while we're still checking the first few, rather than us blocking
+ * on each small read in turn.  Purely advisory.
+ */
+static void walk_ctx_readahead(const rcynic_ctx_t *rc, walk_ctx_t *w)
+{
+#ifdef POSIX_FADV_WILLNEED
+  const path_t *prefix;
+  int i, dfd, fd;
+
+  switch (w->state) {
+  case walk_state_current:
+    prefix = &rc->unauthenticated;
+    break;
+  case walk_state_backup:
+    prefix = &rc->old_authenticated;
+    break;
+  default:
+    return;
+  }
+
+  if (w->filenames == NULL || (dfd = walk_ctx_dirfd(rc, w, prefix)) < 0)
+    return;
+
+  for (i = 0; i < w->filenames->count; i++) {
+    if ((fd = openat(dfd, dir_listing_name(w->filenames, i), O_RDONLY | O_CLOEXEC)) < 0)
+      continue;
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    (void) close(fd);
+  }
+#endif
+}
+
+/**
+ * (Re)load the directory listing for the walk context's current pass
+ * and start read-ahead.
+ */
+static void walk_ctx_list_directory(const rcynic_ctx_t *rc, walk_ctx_t *w)
+{
+  dir_listing_free(w->filenames);
+  w->filenames = directory_filenames(rc, w->state, &w->certinfo.sia);
+  walk_ctx_readahead(rc, w);
+}
+
+/**
+ * Skip over directory listing entries the manifest already covered.
+ */
+static void walk_ctx_skip_listed(walk_ctx_t *w)
+{
+  while (w->filenames != NULL &&
+	 w->filename_iteration < w->filenames->count &&
+	 manifest_index_find(&w->manifest_index,
+			     dir_listing_name(w->filenames, w->filename_iteration)) != NULL)
+    w->filename_iteration++;
+}
+
 /**
  * Walk context iterator.  Think of this as the thing you call in the
  * third clause of a conceptual "for" loop: this reinitializes as
@@ -1972,7 +3057,7 @@ static void walk_ctx_loop_next(const rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk
   assert(w->manifest_iteration >= 0 && w->filename_iteration >= 0);
 
   n_manifest  = w->manifest  ? sk_FileAndHash_num(w->manifest->fileList) : 0;
-  n_filenames = w->filenames ? sk_OPENSSL_STRING_num(w->filenames)       : 0;
+  n_filenames = w->filenames ? w->filenames->count                       : 0;
 
   if (w->manifest_iteration + w->filename_iteration < n_manifest + n_filenames) {
     if (w->manifest_iteration < n_manifest)
@@ -1981,6 +3066,9 @@ static void walk_ctx_loop_next(const rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk
       w->filename_iteration++;
   }
 
+  if (w->manifest_iteration >= n_manifest)
+    walk_ctx_skip_listed(w);
+
   assert(w->manifest_iteration <= n_manifest && w->filename_iteration <= n_filenames);
 
   if (w->manifest_iteration + w->filename_iteration < n_manifest + n_filenames)
@@ -1990,8 +3078,7 @@ static void walk_ctx_loop_next(const rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk
     w->state++;
     w->manifest_iteration = 0;
     w->filename_iteration = 0;
-    sk_OPENSSL_STRING_pop_free(w->filenames, OPENSSL_STRING_free);
-    w->filenames = directory_filenames(rc, w->state, &w->certinfo.sia);
+    walk_ctx_list_directory(rc, w);
     if (w->manifest != NULL || w->filenames != NULL)
       return;
   }
@@ -2028,13 +3115,13 @@ static void walk_ctx_loop_init(rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk)
   assert(w->state == walk_state_current);
 
   assert(w->filenames == NULL);
-  w->filenames = directory_filenames(rc, w->state, &w->certinfo.sia);
+  walk_ctx_list_directory(rc, w);
 
   w->stale_manifest = w->manifest != NULL && X509_cmp_current_time(w->manifest->nextUpdate) < 0;
 
   while (!walk_ctx_loop_done(wsk) &&
 	 (w->manifest == NULL  || w->manifest_iteration >= sk_FileAndHash_num(w->manifest->fileList)) &&
-	 (w->filenames == NULL || w->filename_iteration >= sk_OPENSSL_STRING_num(w->filenames)))
+	 (w->filenames == NULL || w->filename_iteration >= w->filenames->count))
     walk_ctx_loop_next(rc, wsk);
 }
 
@@ -2056,8 +3143,8 @@ static int walk_ctx_loop_this(const rcynic_ctx_t *rc,
   if (w->manifest != NULL && w->manifest_iteration < sk_FileAndHash_num(w->manifest->fileList)) {
     fah = sk_FileAndHash_value(w->manifest->fileList, w->manifest_iteration);
     name = (const char *) fah->file->data;
-  } else if (w->filenames != NULL && w->filename_iteration < sk_OPENSSL_STRING_num(w->filenames)) {
-    name = sk_OPENSSL_STRING_value(w->filenames, w->filename_iteration);
+  } else if (w->filenames != NULL && w->filename_iteration < w->filenames->count) {
+    name = dir_listing_name(w->filenames, w->filename_iteration);
   }
 
   if (name == NULL) {
@@ -2077,7 +3164,6 @@ static int walk_ctx_loop_this(const rcynic_ctx_t *rc,
   strcat(uri->s, name);
 
   if (fah != NULL) {
-    sk_OPENSSL_STRING_remove(w->filenames, name);
     *hash = fah->hash->data;
     *hashlen = fah->hash->length;
   } else {
@@ -2103,21 +3189,53 @@ static walk_ctx_t *walk_ctx_stack_push(STACK_OF(walk_ctx_t) *wsk,
 				       X509 *x,
 				       const certinfo_t *certinfo)
 {
-  walk_ctx_t *w;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  walk_ctx_t *w, *issuer;
+  unsigned len;
 
   if (x == NULL ||
       (certinfo == NULL) != (sk_walk_ctx_t_num(wsk) == 0) ||
+      !X509_digest(x, EVP_sha256(), digest, &len) ||
       (w = malloc(sizeof(*w))) == NULL)
     return NULL;
 
   memset(w, 0, sizeof(*w));
+  w->pubpoint_fd[0] = w->pubpoint_fd[1] = -1;
   w->cert = x;
   if (certinfo != NULL)
     w->certinfo = *certinfo;
   else
     memset(&w->certinfo, 0, sizeof(w->certinfo));
 
+  /*
+   * Chain hash covers this certificate and all of its issuers, so
+   * that the object cache can tell when anything above an object
+   * has changed.
+   */
+  if ((issuer = walk_ctx_stack_head(wsk)) == NULL) {
+    memcpy(w->chain_hash, digest, sizeof(w->chain_hash));
+  } else {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+    int ok = (ctx != NULL &&
+	      EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+	      EVP_DigestUpdate(ctx, issuer->chain_hash, sizeof(issuer->chain_hash)) &&
+	      EVP_DigestUpdate(ctx, digest, sizeof(digest)) &&
+	      EVP_DigestFinal_ex(ctx, w->chain_hash, NULL));
+    if (ctx != NULL)
+      EVP_MD_CTX_destroy(ctx);
+    if (!ok) {
+      free(w);
+      return NULL;
+    }
+  }
+
+  if (pthread_mutex_init(&w->mutex, NULL) != 0) {
+    free(w);
+    return NULL;
+  }
+
   if (!sk_walk_ctx_t_push(wsk, w)) {
+    (void) pthread_mutex_destroy(&w->mutex);
     free(w);
     return NULL;
   }
@@ -2191,17 +3309,17 @@ static void walk_ctx_stack_free(STACK_OF(walk_ctx_t) *wsk)
 static int rsync_count_running(const rcynic_ctx_t *);
 
 /**
- * Add a task to the task queue.
+ * Add a task to one of the task queues.
  */
-static int task_add(const rcynic_ctx_t *rc,
-		    void (*handler)(rcynic_ctx_t *, void *),
-		    void *cookie)
+static int task_push(const rcynic_ctx_t *rc,
+		     STACK_OF(task_t) *queue,
+		     void (*handler)(rcynic_ctx_t *, void *),
+		     void *cookie)
 {
   task_t *t = malloc(sizeof(*t));
+  int ok = 0;
 
-  assert(rc && rc->task_queue && handler);
-
-  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+  assert(rc && queue && handler);
 
   if (!t)
     return 0;
@@ -2209,63 +3327,329 @@ static int task_add(const rcynic_ctx_t *rc,
   t->handler = handler;
   t->cookie = cookie;
 
-  if (sk_task_t_push(rc->task_queue, t))
-    return 1;
+  rcynic_lock(rc);
 
-  free(t);
-  return 0;
+  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+
+  if (sk_task_t_push(queue, t)) {
+    if (rc->validation_threads > 1)
+      (void) pthread_cond_signal((pthread_cond_t *) &rc->task_cond);
+    ok = 1;
+  }
+
+  rcynic_unlock(rc);
+
+  if (!ok)
+    free(t);
+  return ok;
 }
 
 /**
- * Run tasks until queue is empty.
+ * Add a task to the task queue.
  */
-static void task_run_q(rcynic_ctx_t *rc)
+static int task_add(const rcynic_ctx_t *rc,
+		    void (*handler)(rcynic_ctx_t *, void *),
+		    void *cookie)
 {
-  task_t *t;
-  assert(rc && rc->task_queue);
-  while ((t = sk_task_t_shift(rc->task_queue)) != NULL) {
-    t->handler(rc, t->cookie);
-    free(t);
-  }
+  return task_push(rc, rc->task_queue, handler, cookie);
 }
 
-
+/**
+ * Add a task to the ready queue.  This is for publication points
+ * whose fetch has finished: they run ahead of anything on the main
+ * task queue, and rsync_mgr() stops starting new fetches while
+ * pipeline-depth of them are waiting.
+ */
+static int task_add_ready(const rcynic_ctx_t *rc,
+			  void (*handler)(rcynic_ctx_t *, void *),
+			  void *cookie)
+{
+  return task_push(rc, rc->ready_queue, handler, cookie);
+}
 
 /**
- * Check cache of whether we've already fetched a particular URI.
+ * Take the next task to run, ready queue first.  Caller must hold the
+ * lock if there are other threads.
  */
-static rsync_history_t *rsync_history_uri(const rcynic_ctx_t *rc,
-					  const uri_t *uri)
+static task_t *task_next(const rcynic_ctx_t *rc)
 {
-  rsync_history_t h;
-  char *s;
-  int i;
+  task_t *t;
 
-  assert(rc && uri && rc->rsync_history);
+  assert(rc && rc->task_queue && rc->ready_queue);
 
-  if (!is_rsync(uri->s))
-    return NULL;
+  if ((t = sk_task_t_shift(rc->ready_queue)) == NULL)
+    t = sk_task_t_shift(rc->task_queue);
 
-  h.uri = *uri;
+  return t;
+}
 
-  while ((s = strrchr(h.uri.s, '/')) != NULL && s[1] == '\0')
-    *s = '\0';
+/**
+ * Check whether enough fetched publication points are waiting for
+ * validation that we should hold off on starting more fetches.
+ */
+static int task_ready_full(const rcynic_ctx_t *rc)
+{
+  assert(rc && rc->ready_queue);
+  return rc->pipeline_depth > 0 && sk_task_t_num(rc->ready_queue) >= rc->pipeline_depth;
+}
 
-  while ((i = sk_rsync_history_t_find(rc->rsync_history, &h)) < 0) {
-    if ((s = strrchr(h.uri.s, '/')) == NULL ||
-	(s - h.uri.s) < SIZEOF_RSYNC)
-      return NULL;
-    *s = '\0';
+/**
+ * Check whether it's worth splitting more work off the current walk:
+ * only if there are validation threads, and not so much is queued
+ * already that they'd be kept busy anyway.
+ */
+static int task_want_more(const rcynic_ctx_t *rc)
+{
+  int n;
+
+  assert(rc && rc->task_queue && rc->ready_queue);
+
+  if (rc->validation_threads <= 1)
+    return 0;
+
+  rcynic_lock(rc);
+  n = sk_task_t_num(rc->task_queue) + sk_task_t_num(rc->ready_queue);
+  rcynic_unlock(rc);
+
+  return n < rc->validation_threads;
+}
+
+/**
+ * Run queued tasks.  When we have validation threads, they drain the
+ * queues, so there's nothing for us to do here.  Otherwise, while
+ * there are fetches queued or in progress we return after each task,
+ * so that the caller can keep rsync busy while we validate.  Returns
+ * whether there are tasks left to run.
+ */
+static int task_run_q(rcynic_ctx_t *rc)
+{
+  task_t *t;
+  int more;
+  assert(rc && rc->task_queue && rc->ready_queue && rc->rsync_queue);
+  if (rc->validation_threads > 1)
+    return 0;
+  for (;;) {
+    rcynic_lock(rc);
+    t = task_next(rc);
+    rcynic_unlock(rc);
+    if (t == NULL)
+      break;
+    t->handler(rc, t->cookie);
+    free(t);
+    rcynic_lock(rc);
+    more = sk_rsync_ctx_t_num(rc->rsync_queue) > 0;
+    rcynic_unlock(rc);
+    if (more)
+      break;
+  }
+  rcynic_lock(rc);
+  more = sk_task_t_num(rc->ready_queue) + sk_task_t_num(rc->task_queue) > 0;
+  rcynic_unlock(rc);
+  return more;
+}
+
+/**
+ * Validation thread: pull tasks off the task queue and run them until
+ * told to shut down.
+ */
+static void *task_worker(void *cookie)
+{
+  rcynic_ctx_t *rc = cookie;
+  task_t *t;
+
+  assert(rc && rc->task_queue);
+
+  rcynic_lock(rc);
+
+  for (;;) {
+    while ((t = task_next(rc)) == NULL && !rc->tasks_shutdown)
+      (void) pthread_cond_wait(&rc->task_cond, &rc->lock);
+    if (t == NULL)
+      break;
+    rc->tasks_running++;
+    rcynic_unlock(rc);
+    t->handler(rc, t->cookie);
+    free(t);
+    rcynic_lock(rc);
+    rc->tasks_running--;
+    rcynic_wakeup(rc);
+  }
+
+  rcynic_unlock(rc);
+  ERR_remove_thread_state(NULL);
+  return NULL;
+}
+
+/**
+ * Start validation threads, if configured, and set up the locks and
+ * wakeup pipe we need if there are going to be any other threads,
+ * validation or RRDP.
+ */
+static int task_workers_start(rcynic_ctx_t *rc)
+{
+  pthread_mutexattr_t attr;
+  int i, n;
+
+  assert(rc && rc->task_workers == NULL);
+
+  rc->wakeup_fds[0] = rc->wakeup_fds[1] = -1;
+
+  if (rc->validation_threads <= 1 && !(rc->use_rrdp && rc->run_rsync))
+    return 1;
+
+  n = CRYPTO_num_locks();
+  if ((openssl_locks = malloc(n * sizeof(*openssl_locks))) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate OpenSSL locks");
+    goto fail;
+  }
+  for (i = 0; i < n; i++)
+    (void) pthread_mutex_init(&openssl_locks[i], NULL);
+  CRYPTO_set_locking_callback(openssl_locking_callback);
+
+  if (pthread_mutexattr_init(&attr) != 0 ||
+      pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) != 0 ||
+      pthread_mutex_init(&rc->lock, &attr) != 0 ||
+      pthread_cond_init(&rc->task_cond, NULL) != 0 ||
+      pthread_cond_init(&rc->rrdp_cond, NULL) != 0) {
+    logmsg(rc, log_sys_err, "Couldn't initialize validation thread locks");
+    goto fail;
+  }
+  (void) pthread_mutexattr_destroy(&attr);
+
+  if (pipe(rc->wakeup_fds) < 0 ||
+      fcntl(rc->wakeup_fds[0], F_SETFL, O_NONBLOCK) < 0 ||
+      fcntl(rc->wakeup_fds[1], F_SETFL, O_NONBLOCK) < 0 ||
+      fcntl(rc->wakeup_fds[0], F_SETFD, FD_CLOEXEC) < 0 ||
+      fcntl(rc->wakeup_fds[1], F_SETFD, FD_CLOEXEC) < 0) {
+    logmsg(rc, log_sys_err, "Couldn't create wakeup pipe: %s", strerror(errno));
+    goto fail;
+  }
+
+  rc->threaded = 1;
+
+  if (rc->validation_threads <= 1)
+    return 1;
+
+  if ((rc->task_workers = calloc(rc->validation_threads, sizeof(*rc->task_workers))) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate validation threads");
+    goto fail;
+  }
+
+  for (i = 0; i < rc->validation_threads; i++) {
+    if ((errno = pthread_create(&rc->task_workers[i], NULL, task_worker, rc)) != 0) {
+      logmsg(rc, log_sys_err, "Couldn't create validation thread: %s", strerror(errno));
+      rcynic_lock(rc);
+      rc->tasks_shutdown = 1;
+      (void) pthread_cond_broadcast(&rc->task_cond);
+      rcynic_unlock(rc);
+      while (--i >= 0)
+	(void) pthread_join(rc->task_workers[i], NULL);
+      free(rc->task_workers);
+      rc->task_workers = NULL;
+      goto fail;
+    }
   }
 
-  return sk_rsync_history_t_value(rc->rsync_history, i);
+  logmsg(rc, log_verbose, "Started %d validation threads", rc->validation_threads);
+  return 1;
+
+ fail:
+  CRYPTO_set_locking_callback(NULL);
+  rc->validation_threads = 1;
+  return 0;
+}
+
+/**
+ * Shut down validation threads, if any.  Safe to call more than once.
+ */
+static void task_workers_stop(rcynic_ctx_t *rc)
+{
+  int i;
+
+  assert(rc);
+
+  if (rc->task_workers == NULL)
+    return;
+
+  rcynic_lock(rc);
+  rc->tasks_shutdown = 1;
+  (void) pthread_cond_broadcast(&rc->task_cond);
+  rcynic_unlock(rc);
+
+  for (i = 0; i < rc->validation_threads; i++)
+    (void) pthread_join(rc->task_workers[i], NULL);
+
+  free(rc->task_workers);
+  rc->task_workers = NULL;
+}
+
+/**
+ * Check whether there's any work left anywhere: queued or running
+ * validation tasks, RRDP fetches, or rsync requests.
+ */
+static int work_remaining(const rcynic_ctx_t *rc)
+{
+  int n;
+
+  assert(rc && rc->task_queue && rc->ready_queue && rc->rsync_queue);
+
+  rcynic_lock(rc);
+  n = (sk_task_t_num(rc->task_queue) + sk_task_t_num(rc->ready_queue) +
+       rc->tasks_running + rc->rrdp_jobs + sk_rsync_ctx_t_num(rc->rsync_queue));
+  rcynic_unlock(rc);
+
+  return n > 0;
+}
+
+
+
+/**
+ * Check cache of whether we've already fetched a particular URI, or
+ * any of its ancestors.  History entries are indexed by hash of their
+ * URIs (without trailing slash), so we can hash the URI incrementally
+ * and probe the index at each component boundary in a single pass.
+ * If more than one ancestor matches, the longest wins.
+ */
+static rsync_history_t *rsync_history_uri(const rcynic_ctx_t *rc,
+					  const uri_t *uri)
+{
+  rsync_history_t *h, *found = NULL;
+  const char *s, *end;
+  uint64_t hash;
+  size_t cursor;
+
+  assert(rc && uri && rc->rsync_history);
+
+  if (!is_rsync(uri->s))
+    return NULL;
+
+  end = uri->s + strlen(uri->s);
+  while (end > uri->s + SIZEOF_RSYNC && end[-1] == '/')
+    end--;
+
+  hash = hash_bytes(HASH_INIT, uri->s, SIZEOF_RSYNC);
+
+  for (s = uri->s + SIZEOF_RSYNC; s <= end; s++) {
+    if (s > uri->s + SIZEOF_RSYNC && (s == end || *s == '/')) {
+      cursor = 0;
+      while ((h = hash_table_next(&rc->rsync_history_index, hash, &cursor)) != NULL)
+	if (!strncmp(h->uri.s, uri->s, s - uri->s) && h->uri.s[s - uri->s] == '\0')
+	  break;
+      if (h != NULL)
+	found = h;
+    }
+    if (s < end)
+      hash = hash_bytes(hash, s, 1);
+  }
+
+  return found;
 }
 
 /**
  * Record that we've already attempted to synchronize a particular
  * rsync URI.
  */
-static void rsync_history_add(const rcynic_ctx_t *rc,
+static void rsync_history_add(rcynic_ctx_t *rc,
 			      const rsync_ctx_t *ctx,
 			      const rsync_status_t status)
 {
@@ -2309,1301 +3693,5056 @@ static void rsync_history_add(const rcynic_ctx_t *rc,
     rsync_history_t_free(h);
     logmsg(rc, log_sys_err,
 	   "Couldn't add %s to rsync_history, blundering onwards", uri.s);
+    return;
   }
+
+  if (!hash_table_insert(&rc->rsync_history_index, hash_string(uri.s), h))
+    logmsg(rc, log_sys_err,
+	   "Couldn't index %s in rsync_history, blundering onwards", uri.s);
 }
 
 
 
 /**
- * Return count of how many rsync contexts are in running.
+ * Length of the rsync://host/module part of an rsync URI, not
+ * counting the slash that follows it, or zero if the URI doesn't name
+ * anything within a module.
  */
-static int rsync_count_running(const rcynic_ctx_t *rc)
+static size_t rsync_module_len(const char *uri)
 {
-  const rsync_ctx_t *ctx;
-  int i, n = 0;
-
-  assert(rc && rc->rsync_queue);
+  size_t n;
 
-  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i) {
-    switch (ctx->state) {
-    case rsync_state_running:
-    case rsync_state_closed:
-    case rsync_state_terminating:
-      n++;
-    default:
-      continue;
-    }
-  }
+  assert(uri && is_rsync(uri));
 
-  return n;
+  n = SIZEOF_RSYNC + strcspn(uri + SIZEOF_RSYNC, "/");
+  if (uri[n] != '/')
+    return 0;
+  n += 1 + strcspn(uri + n + 1, "/");
+  return uri[n] == '/' ? n : 0;
 }
 
 /**
- * Test whether an rsync context conflicts with anything that's
- * currently runable.
+ * Find (or create) per-module state for an rsync URI.  Returns NULL
+ * if the URI doesn't name a module or we're out of memory, in which
+ * case the only limit on the fetch is max-parallel-fetches.
  */
-static int rsync_conflicts(const rcynic_ctx_t *rc,
-			   const rsync_ctx_t *ctx)
+static rsync_host_t *rsync_host_find(rcynic_ctx_t *rc, const uri_t *uri)
 {
-  const rsync_ctx_t *c;
-  int i;
+  rsync_host_t *h;
+  uint64_t hash;
+  size_t len, cursor = 0;
 
-  assert(rc && ctx && rc->rsync_queue);
+  assert(rc && uri);
 
-  for (i = 0; (c = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
-    if (c != ctx &&
-	(c->state == rsync_state_initial ||
-	 c->state == rsync_state_running) &&
-	conflicting_uris(&c->uri, &ctx->uri))
-      return 1;
+  if ((len = rsync_module_len(uri->s)) == 0)
+    return NULL;
 
-  return 0;
+  hash = hash_bytes(HASH_INIT, uri->s, len);
+
+  while ((h = hash_table_next(&rc->rsync_hosts, hash, &cursor)) != NULL)
+    if (!strncmp(h->module.s, uri->s, len) && h->module.s[len] == '\0')
+      return h;
+
+  if ((h = malloc(sizeof(*h))) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate rsync host state for %s", uri->s);
+    return NULL;
+  }
+
+  memset(h, 0, sizeof(*h));
+  memcpy(h->module.s, uri->s, len);
+  h->tokens = rc->fetch_rate_per_host;
+  (void) clock_gettime(CLOCK_MONOTONIC, &h->refilled);
+
+  if (!hash_table_insert(&rc->rsync_hosts, hash, h)) {
+    logmsg(rc, log_sys_err, "Couldn't index rsync host state for %s", uri->s);
+    free(h);
+    return NULL;
+  }
+
+  return h;
 }
 
 /**
- * Test whether a rsync context is runable at this time.
+ * Check whether we can start another rsync process for a module:
+ * we have to be under both the configured and the learned connection
+ * limits, and have a whole token in the bucket.
  */
-static int rsync_runable(const rcynic_ctx_t *rc,
-			 const rsync_ctx_t *ctx)
+static int rsync_host_ready(const rcynic_ctx_t *rc,
+			    rsync_host_t *h)
 {
-  assert(rc && ctx);
+  struct timespec now;
+  double elapsed;
+  int limit;
 
-  switch (ctx->state) {
+  assert(rc);
 
-  case rsync_state_initial:
-  case rsync_state_running:
+  if (h == NULL)
     return 1;
 
-  case rsync_state_retry_wait:
-    return ctx->deadline <= time(0);
+  limit = rc->max_fetches_per_host;
+  if (h->limit > 0 && (limit <= 0 || h->limit < limit))
+    limit = h->limit;
 
-  case rsync_state_closed:
-  case rsync_state_terminating:
+  if (limit > 0 && h->running >= limit)
     return 0;
 
-  case rsync_state_conflict_wait:
-    return !rsync_conflicts(rc, ctx);
+  if (rc->fetch_rate_per_host <= 0)
+    return 1;
 
-  default:
-    break;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == 0) {
+    elapsed = ((double) (now.tv_sec - h->refilled.tv_sec) +
+	       (double) (now.tv_nsec - h->refilled.tv_nsec) / 1e9);
+    if (elapsed > 0) {
+      h->tokens += elapsed * rc->fetch_rate_per_host;
+      if (h->tokens > rc->fetch_rate_per_host)
+	h->tokens = rc->fetch_rate_per_host;
+      h->refilled = now;
+    }
   }
 
-  return 0;
+  return h->tokens >= 1.0;
 }
 
 /**
- * Return count of runable rsync contexts.
+ * Free per-module rsync state at end of run.
  */
-static int rsync_count_runable(const rcynic_ctx_t *rc)
+static void rsync_hosts_clear(rcynic_ctx_t *rc)
 {
-  const rsync_ctx_t *ctx;
-  int i, n = 0;
+  size_t i;
 
-  assert(rc && rc->rsync_queue);
+  assert(rc);
 
-  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
-    if (rsync_runable(rc, ctx))
-      n++;
+  for (i = 0; i < rc->rsync_hosts.size; i++)
+    free(rc->rsync_hosts.entries[i].value);
 
-  return n;
+  hash_table_clear(&rc->rsync_hosts);
 }
 
 /**
- * Call rsync context handler, if one is set.
+ * Return count of how many rsync contexts are in running.
  */
-static void rsync_call_handler(rcynic_ctx_t *rc,
-			       rsync_ctx_t *ctx,
-			       const rsync_status_t status)
+static int rsync_count_running(const rcynic_ctx_t *rc)
 {
-  if (!ctx)
-    return;
+  assert(rc);
 
-  switch (status) {
+  return (rc->rsync_state_count[rsync_state_running] +
+	  rc->rsync_state_count[rsync_state_closed] +
+	  rc->rsync_state_count[rsync_state_terminating]);
+}
 
-  case rsync_status_pending:
-  case rsync_status_done:
-    break;
+/**
+ * Whether an rsync state counts as "in flight" for purposes of
+ * conflict checking.
+ */
+static int rsync_state_is_active(const rsync_state_t state)
+{
+  return (state == rsync_state_initial ||
+	  state == rsync_state_running ||
+	  state == rsync_state_batched);
+}
 
-  case rsync_status_failed:
-    log_validation_status(rc, &ctx->uri, rsync_transfer_failed, object_generation_null);
-    break;
+/**
+ * Compare an rsync context's URI with the first len characters of
+ * key, strcmp()-style.
+ */
+static int rsync_active_cmp(const rsync_ctx_t *ctx, const char *key, const size_t len)
+{
+  int cmp = strncmp(ctx->uri.s, key, len);
+  if (cmp != 0)
+    return cmp;
+  return ctx->uri.s[len] != '\0';
+}
 
-  case rsync_status_timed_out:
-    log_validation_status(rc, &ctx->uri, rsync_transfer_timed_out, object_generation_null);
-    break;
+/**
+ * Binary search the sorted set of active rsync contexts.  Returns
+ * index of first context whose URI is greater than (or, if
+ * inclusive is zero, greater than or equal to) the first len
+ * characters of key.
+ */
+static int rsync_active_search(const rcynic_ctx_t *rc,
+			       const char *key,
+			       const size_t len,
+			       const int inclusive)
+{
+  int lo = 0, hi = sk_rsync_ctx_t_num(rc->rsync_active);
 
-  case rsync_status_skipped:
-    log_validation_status(rc, &ctx->uri, rsync_transfer_skipped, object_generation_null);
-    break;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    int cmp = rsync_active_cmp(sk_rsync_ctx_t_value(rc->rsync_active, mid), key, len);
+    if (cmp < 0 || (inclusive && cmp == 0))
+      lo = mid + 1;
+    else
+      hi = mid;
   }
 
-  if (ctx->handler)
-    ctx->handler(rc, ctx, status, &ctx->uri, ctx->cookie);
+  return lo;
 }
 
 /**
- * Run an rsync process.
+ * Find an active rsync context that conflicts with this one, if there
+ * is one.  Two URIs conflict if either is a prefix of the other, as
+ * rsyncing both at once might cause unpredictable behavior.  Rather
+ * than comparing against every active context, we use the sorted
+ * active set: contexts of which ours is a prefix sort immediately
+ * after our URI, and any context which is a prefix of ours must also
+ * be a prefix of the closest context that sorts before us, which lets
+ * us narrow the search quickly.
  */
-static void rsync_run(rcynic_ctx_t *rc,
-		      rsync_ctx_t *ctx)
+static rsync_ctx_t *rsync_conflicts(const rcynic_ctx_t *rc,
+				    const rsync_ctx_t *ctx)
 {
-  static const char * const rsync_cmd[] = {
-    "rsync", "--update", "--times", "--copy-links", "--itemize-changes"
-  };
-  static const char * const rsync_tree_args[] = {
-    "--recursive", "--delete"
-  };
+  const char *u;
+  rsync_ctx_t *c;
+  size_t len, l;
+  int i;
 
-  const char *argv[10];
-  path_t path;
-  int i, argc = 0, flags, pipe_fds[2];
+  assert(rc && ctx && rc->rsync_active);
 
-  pipe_fds[0] = pipe_fds[1] = -1;
+  u = ctx->uri.s;
+  len = strlen(u);
 
-  assert(rc && ctx && ctx->pid == 0 && ctx->state != rsync_state_running && rsync_runable(rc, ctx));
+  for (i = rsync_active_search(rc, u, len, 0);
+       (c = sk_rsync_ctx_t_value(rc->rsync_active, i)) != NULL && !strncmp(c->uri.s, u, len);
+       i++)
+    if (c != ctx)
+      return c;
 
-  if (rsync_history_uri(rc, &ctx->uri)) {
-    logmsg(rc, log_verbose, "Late rsync cache hit for %s", ctx->uri.s);
-    rsync_call_handler(rc, ctx, rsync_status_done);
-    (void) sk_rsync_ctx_t_delete_ptr(rc->rsync_queue, ctx);
-    free(ctx);
-    return;
+  while (len-- > 0) {
+    if ((i = rsync_active_search(rc, u, len, 1)) == 0)
+      break;
+    c = sk_rsync_ctx_t_value(rc->rsync_active, i - 1);
+    for (l = 0; l < len && c->uri.s[l] == u[l]; l++)
+      ;
+    if (c->uri.s[l] == '\0')
+      return c;
+    len = l + 1;
   }
 
-  assert(rsync_count_running(rc) < rc->max_parallel_fetches);
+  return NULL;
+}
 
-  logmsg(rc, log_telemetry, "Fetching %s", ctx->uri.s);
+/**
+ * Add a context to the sorted set of active rsync contexts.
+ */
+static void rsync_active_add(rcynic_ctx_t *rc, rsync_ctx_t *ctx)
+{
+  int i = rsync_active_search(rc, ctx->uri.s, strlen(ctx->uri.s), 1);
+  if (!sk_rsync_ctx_t_insert(rc->rsync_active, ctx, i))
+    logmsg(rc, log_sys_err, "Couldn't add %s to active rsync set, blundering onwards", ctx->uri.s);
+}
 
-  memset(argv, 0, sizeof(argv));
+/**
+ * Remove a context from the sorted set of active rsync contexts.
+ */
+static void rsync_active_remove(rcynic_ctx_t *rc, rsync_ctx_t *ctx)
+{
+  rsync_ctx_t *c;
+  int i;
 
-  for (i = 0; i < sizeof(rsync_cmd)/sizeof(*rsync_cmd); i++) {
-    assert(argc < sizeof(argv)/sizeof(*argv));
-    argv[argc++] = rsync_cmd[i];
-  }
-  if (endswith(ctx->uri.s, "/")) {
-    for (i = 0; i < sizeof(rsync_tree_args)/sizeof(*rsync_tree_args); i++) {
-      assert(argc < sizeof(argv)/sizeof(*argv));
-      argv[argc++] = rsync_tree_args[i];
+  for (i = rsync_active_search(rc, ctx->uri.s, strlen(ctx->uri.s), 0);
+       (c = sk_rsync_ctx_t_value(rc->rsync_active, i)) != NULL && !strcmp(c->uri.s, ctx->uri.s);
+       i++) {
+    if (c == ctx) {
+      (void) sk_rsync_ctx_t_delete(rc->rsync_active, i);
+      return;
     }
   }
+}
 
-  if (rc->rsync_program)
-    argv[0] = rc->rsync_program;
-
-  if (!uri_to_filename(rc, &ctx->uri, &path, &rc->unauthenticated)) {
-    logmsg(rc, log_data_err, "Couldn't extract filename from URI: %s", ctx->uri.s);
-    goto lose;
-  }
-
-  assert(argc < sizeof(argv)/sizeof(*argv));
-  argv[argc++] = ctx->uri.s;
-
-  assert(argc < sizeof(argv)/sizeof(*argv));
-  argv[argc++] = path.s;
+/**
+ * Append a context to the run queue, the FIFO of contexts in the
+ * initial state waiting for an rsync slot.
+ */
+static void rsync_runq_append(rcynic_ctx_t *rc, rsync_ctx_t *ctx)
+{
+  assert(rc && ctx && ctx->runq_prev == NULL && ctx->runq_next == NULL && rc->rsync_runq_head != ctx);
+  ctx->runq_prev = rc->rsync_runq_tail;
+  if (rc->rsync_runq_tail != NULL)
+    rc->rsync_runq_tail->runq_next = ctx;
+  else
+    rc->rsync_runq_head = ctx;
+  rc->rsync_runq_tail = ctx;
+}
 
-  if (!mkdir_maybe(rc, &path)) {
-    logmsg(rc, log_sys_err, "Couldn't make target directory: %s", path.s);
-    goto lose;
-  }
+/**
+ * Remove a context from the run queue, if it's there.
+ */
+static void rsync_runq_remove(rcynic_ctx_t *rc, rsync_ctx_t *ctx)
+{
+  assert(rc && ctx);
+  if (ctx->runq_prev == NULL && rc->rsync_runq_head != ctx)
+    return;
+  if (ctx->runq_prev != NULL)
+    ctx->runq_prev->runq_next = ctx->runq_next;
+  else
+    rc->rsync_runq_head = ctx->runq_next;
+  if (ctx->runq_next != NULL)
+    ctx->runq_next->runq_prev = ctx->runq_prev;
+  else
+    rc->rsync_runq_tail = ctx->runq_prev;
+  ctx->runq_prev = ctx->runq_next = NULL;
+}
 
-  for (i = 0; i < argc; i++)
-    logmsg(rc, log_debug, "rsync argv[%d]: %s", i, argv[i]);
+static void rsync_set_state(rcynic_ctx_t *, rsync_ctx_t *, const rsync_state_t);
 
-  if (pipe(pipe_fds) < 0) {
-    logmsg(rc, log_sys_err, "pipe() failed: %s", strerror(errno));
-    goto lose;
+/**
+ * Park a context in conflict_wait behind whichever active context it
+ * conflicts with, or make it runable if there's no longer a conflict.
+ */
+static void rsync_park(rcynic_ctx_t *rc, rsync_ctx_t *ctx)
+{
+  rsync_ctx_t *blocker;
+
+  assert(rc && ctx && ctx->blocker == NULL);
+
+  if ((blocker = rsync_conflicts(rc, ctx)) == NULL) {
+    rsync_set_state(rc, ctx, rsync_state_initial);
+    return;
   }
 
-  switch ((ctx->pid = vfork())) {
+  ctx->blocker = blocker;
+  ctx->next_waiter = blocker->waiters;
+  blocker->waiters = ctx;
+  rsync_set_state(rc, ctx, rsync_state_conflict_wait);
+}
 
-  case -1:
-     logmsg(rc, log_sys_err, "vfork() failed: %s", strerror(errno));
-     goto lose;
+/**
+ * Change state of an rsync context, keeping the per-state counters,
+ * the active set, and the run queue up to date.  When a context stops
+ * being active, anything that was waiting for it gets another chance.
+ */
+static void rsync_set_state(rcynic_ctx_t *rc,
+			    rsync_ctx_t *ctx,
+			    const rsync_state_t state)
+{
+  rsync_ctx_t *waiters;
+  int was_active;
 
-  case 0:
-    /*
-     * Child
-     */
-#define whine(msg) ((void) write(2, msg, sizeof(msg) - 1))
-    if (close(pipe_fds[0]) < 0)
-      whine("close(pipe_fds[0]) failed\n");
-    else if (dup2(pipe_fds[1], 1) < 0)
-      whine("dup2(pipe_fds[1], 1) failed\n");
-    else if (dup2(pipe_fds[1], 2) < 0)
-      whine("dup2(pipe_fds[1], 2) failed\n");
-    else if (close(pipe_fds[1]) < 0)
-      whine("close(pipe_fds[1]) failed\n");
-    else if (execvp(argv[0], (char * const *) argv) < 0)
-      whine("execvp(argv[0], (char * const *) argv) failed\n");
-    whine("last system error: ");
-    write(2, strerror(errno), strlen(strerror(errno)));
-    whine("\n");
-    _exit(1);
-#undef whine
+  assert(rc && ctx && state < RSYNC_STATE_T_MAX);
 
-  default:
-    /*
-     * Parent
-     */
-    ctx->fd = pipe_fds[0];
-    if ((flags = fcntl(ctx->fd, F_GETFL, 0)) == -1 ||
-	fcntl(ctx->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-      logmsg(rc, log_sys_err, "fcntl(ctx->fd, F_[GS]ETFL, O_NONBLOCK) failed: %s",
-	     strerror(errno));
-      goto lose;
-    }
-    (void) close(pipe_fds[1]);
-    ctx->state = rsync_state_running;
-    ctx->problem = rsync_problem_none;
-    if (!ctx->started)
-      ctx->started = time(0);
-    if (rc->rsync_timeout)
-      ctx->deadline = time(0) + rc->rsync_timeout;
-    logmsg(rc, log_verbose, "Subprocess %u started, queued %d, runable %d, running %d, max %d, URI %s",
-	   (unsigned) ctx->pid, sk_rsync_ctx_t_num(rc->rsync_queue), rsync_count_runable(rc), rsync_count_running(rc), rc->max_parallel_fetches, ctx->uri.s);
-    rsync_call_handler(rc, ctx, rsync_status_pending);
+  if (ctx->state == state)
     return;
 
-  }
+  was_active = rsync_state_is_active(ctx->state);
 
- lose:
-  if (pipe_fds[0] != -1)
-    (void) close(pipe_fds[0]);
-  if (pipe_fds[1] != -1)
-    (void) close(pipe_fds[1]);
-  if (rc->rsync_queue && ctx)
-    (void) sk_rsync_ctx_t_delete_ptr(rc->rsync_queue, ctx);
-  rsync_call_handler(rc, ctx, rsync_status_failed);
-  if (ctx->pid > 0) {
-    (void) kill(ctx->pid, SIGKILL);
-    ctx->pid = 0;
+  assert(rc->rsync_state_count[ctx->state] > 0);
+  rc->rsync_state_count[ctx->state]--;
+  if (ctx->state == rsync_state_initial)
+    rsync_runq_remove(rc, ctx);
+
+  ctx->state = state;
+
+  rc->rsync_state_count[state]++;
+  if (state == rsync_state_initial)
+    rsync_runq_append(rc, ctx);
+
+  if (!was_active && rsync_state_is_active(state))
+    rsync_active_add(rc, ctx);
+
+  if (!was_active || rsync_state_is_active(state))
+    return;
+
+  rsync_active_remove(rc, ctx);
+
+  waiters = ctx->waiters;
+  ctx->waiters = NULL;
+  while (waiters != NULL) {
+    rsync_ctx_t *w = waiters;
+    waiters = w->next_waiter;
+    w->next_waiter = NULL;
+    w->blocker = NULL;
+    rsync_park(rc, w);
   }
 }
 
 /**
- * Process one line of rsync's output.  This is a separate function
- * primarily to centralize scraping for magic error strings.
+ * Add a new context to the rsync queue.  It starts out either runable
+ * or waiting for whatever it conflicts with.
  */
-static void do_one_rsync_log_line(const rcynic_ctx_t *rc,
-				  rsync_ctx_t *ctx)
+static int rsync_queue_add(rcynic_ctx_t *rc, rsync_ctx_t *ctx)
 {
-  unsigned u;
-  char *s;
+  assert(rc && ctx && ctx->state == rsync_state_initial);
+
+  if (!sk_rsync_ctx_t_push(rc->rsync_queue, ctx))
+    return 0;
+
+  ctx->queue_index = sk_rsync_ctx_t_num(rc->rsync_queue) - 1;
 
   /*
-   * Send line to our log unless it's empty.
+   * Count the context as conflict_wait to start, so that
+   * rsync_park() sees a real state transition either way.
    */
-  if (ctx->buffer[strspn(ctx->buffer, " \t\n\r")] != '\0')
-    logmsg(rc, log_telemetry, "rsync[%u]: %s", ctx->pid, ctx->buffer);
+  ctx->state = rsync_state_conflict_wait;
+  rc->rsync_state_count[ctx->state]++;
+  rsync_park(rc, ctx);
+
+  if (ctx->state == rsync_state_conflict_wait)
+    logmsg(rc, log_debug, "New rsync context %s is feeling conflicted", ctx->uri.s);
+
+  return 1;
+}
+
+/**
+ * Remove a context from the rsync queue.  Doesn't free it.
+ */
+static void rsync_queue_remove(rcynic_ctx_t *rc, rsync_ctx_t *ctx)
+{
+  rsync_ctx_t *last;
+
+  assert(rc && ctx && ctx->blocker == NULL &&
+	 sk_rsync_ctx_t_value(rc->rsync_queue, ctx->queue_index) == ctx);
 
   /*
-   * Check for magic error strings
+   * Moving to closed drops the context out of the active set and the
+   * run queue and releases anything waiting for it.
    */
-  if ((s = strstr(ctx->buffer, "@ERROR: max connections")) != NULL) {
-    ctx->problem = rsync_problem_refused;
-    if (sscanf(s, "@ERROR: max connections (%u) reached -- try again later", &u) == 1)
-      logmsg(rc, log_verbose, "Subprocess %u reported limit of %u for %s", ctx->pid, u, ctx->uri.s);
+  rsync_set_state(rc, ctx, rsync_state_closed);
+  rc->rsync_state_count[ctx->state]--;
+
+  last = sk_rsync_ctx_t_pop(rc->rsync_queue);
+  if (last != ctx) {
+    (void) sk_rsync_ctx_t_set(rc->rsync_queue, ctx->queue_index, last);
+    last->queue_index = ctx->queue_index;
   }
 }
 
 /**
- * Construct select() arguments.
+ * Test whether a rsync context is runable at this time.
  */
-static int rsync_construct_select(const rcynic_ctx_t *rc,
-				  const time_t now,
-				  fd_set *rfds,
-				  struct timeval *tv)
+static int rsync_runable(const rcynic_ctx_t *rc,
+			 const rsync_ctx_t *ctx)
 {
-  rsync_ctx_t *ctx;
-  time_t when = 0;
-  int i, n = 0;
-
-  assert(rc && rc->rsync_queue && rfds && tv && rc->max_select_time >= 0);
+  assert(rc && ctx);
 
-  FD_ZERO(rfds);
+  switch (ctx->state) {
 
-  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i) {
+  case rsync_state_initial:
+  case rsync_state_running:
+    return 1;
 
-    switch (ctx->state) {
+  case rsync_state_retry_wait:
+    return ctx->deadline <= time(0);
 
-    case rsync_state_running:
-      assert(ctx->fd >= 0);
-      FD_SET(ctx->fd, rfds);
-      if (ctx->fd > n)
-	n = ctx->fd;
-      if (!rc->rsync_timeout)
-	continue;
-      /* Fall through */
+  case rsync_state_batched:
+  case rsync_state_closed:
+  case rsync_state_terminating:
+    return 0;
 
-    case rsync_state_retry_wait:
-      if (when == 0 || ctx->deadline < when)
-	when = ctx->deadline;
-      /* Fall through */
+  case rsync_state_conflict_wait:
+    return !rsync_conflicts(rc, ctx);
 
-    default:
-      continue;
-    }
+  default:
+    break;
   }
 
-  if (!when)
-    tv->tv_sec = rc->max_select_time;
-  else if (when < now)
-    tv->tv_sec = 0;
-  else if (when < now + rc->max_select_time)
-    tv->tv_sec = when - now;
-  else
-    tv->tv_sec = rc->max_select_time;
-  tv->tv_usec = 0;
-  return n;
+  return 0;
 }
 
 /**
- * Convert rsync_status_t to mib_counter_t.
- *
- * Maybe some day this will go away and we won't be carrying
- * essentially the same information in two different databases, but
- * for now I'll settle for cleaning up the duplicate code logic.
+ * Return count of runable rsync contexts.  Contexts waiting for a
+ * retry or for a conflict to clear are moved back to the initial
+ * state when they become runable, so the counters are enough.
  */
-static mib_counter_t rsync_status_to_mib_counter(rsync_status_t status)
+static int rsync_count_runable(const rcynic_ctx_t *rc)
 {
+  assert(rc);
+
+  return (rc->rsync_state_count[rsync_state_initial] +
+	  rc->rsync_state_count[rsync_state_running]);
+}
+
+/**
+ * Call rsync context handler, if one is set.
+ */
+static void rsync_call_handler(rcynic_ctx_t *rc,
+			       rsync_ctx_t *ctx,
+			       const rsync_status_t status)
+{
+  if (!ctx)
+    return;
+
   switch (status) {
-  case rsync_status_done:	return rsync_transfer_succeeded;
-  case rsync_status_timed_out:	return rsync_transfer_timed_out;
-  case rsync_status_failed:	return rsync_transfer_failed;
-  case rsync_status_skipped:	return rsync_transfer_skipped;
-  default:
-    /*
-     * Keep GCC from whining about untested cases.
-     */
-    assert(status == rsync_status_done ||
-	   status == rsync_status_timed_out ||
-	   status == rsync_status_failed ||
-	   status == rsync_status_skipped);
-    return rsync_transfer_failed;
+
+  case rsync_status_pending:
+  case rsync_status_done:
+    break;
+
+  case rsync_status_failed:
+    log_validation_status(rc, &ctx->uri, rsync_transfer_failed, object_generation_null);
+    break;
+
+  case rsync_status_timed_out:
+    log_validation_status(rc, &ctx->uri, rsync_transfer_timed_out, object_generation_null);
+    break;
+
+  case rsync_status_skipped:
+    log_validation_status(rc, &ctx->uri, rsync_transfer_skipped, object_generation_null);
+    break;
   }
+
+  if (ctx->handler)
+    ctx->handler(rc, ctx, status, &ctx->uri, ctx->cookie);
 }
 
 /**
- * Manager for queue of rsync tasks in progress.
- *
- * General plan here is to process one completed child, or output
- * accumulated from children, or block if there is absolutely nothing
- * to do, on the theory that caller had nothing to do either or would
- * not have called us.  Once we've done something allegedly useful, we
- * return, because this is not the event loop; if and when the event
- * loop has nothing more important to do, we'll be called again.
- *
- * So this is the only place where the program blocks waiting for
- * children, but we only do it when we know there's nothing else
- * useful that we could be doing while we wait.
+ * Register a file descriptor with the event loop.  cookie is the
+ * rsync context that owns the descriptor, or NULL for the wakeup
+ * pipe.  No-op if we're not using epoll().
  */
-static void rsync_mgr(rcynic_ctx_t *rc)
+static int rsync_event_add(const rcynic_ctx_t *rc,
+			   const int fd,
+			   rsync_ctx_t *cookie)
 {
-  rsync_status_t rsync_status;
-  int i, n, pid_status = -1;
-  rsync_ctx_t *ctx = NULL;
-  time_t now = time(0);
-  struct timeval tv;
-  fd_set rfds;
-  pid_t pid;
-  char *s;
+#ifdef RCYNIC_USE_EPOLL
+  struct epoll_event ev;
 
-  assert(rc && rc->rsync_queue);
+  assert(rc);
 
-  /*
-   * Check for exited subprocesses.
-   */
+  if (rc->epoll_fd < 0 || fd < 0)
+    return 1;
 
-  while ((pid = waitpid(-1, &pid_status, WNOHANG)) > 0) {
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = cookie;
 
-    /*
-     * Child exited, handle it.
-     */
+  if (epoll_ctl(rc->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+    return 1;
 
-    logmsg(rc, log_verbose, "Subprocess %u exited with status %d",
-	   (unsigned) pid, WEXITSTATUS(pid_status));
+  logmsg(rc, log_sys_err, "epoll_ctl() failed: %s", strerror(errno));
+  return 0;
+#else
+  return 1;
+#endif
+}
 
-    for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
-      if (ctx->pid == pid)
-	break;
-    if (ctx == NULL) {
-      assert(i == sk_rsync_ctx_t_num(rc->rsync_queue));
-      logmsg(rc, log_sys_err, "Couldn't find rsync context for pid %d", pid);
-      continue;
-    }
+/**
+ * Remove a file descriptor from the event loop and close it.  Closing
+ * alone isn't enough: an epoll() registration lasts until every
+ * descriptor for the open file is gone, and we'd go on getting events
+ * whose cookie points at a freed rsync context.
+ */
+static void rsync_event_close(const rcynic_ctx_t *rc, int *fd)
+{
+  assert(rc && fd);
 
-    close(ctx->fd);
-    ctx->fd = -1;
+  if (*fd < 0)
+    return;
 
-    if (ctx->buflen > 0) {
-      assert(ctx->buflen < sizeof(ctx->buffer));
-      ctx->buffer[ctx->buflen] = '\0';
-      do_one_rsync_log_line(rc, ctx);
-      ctx->buflen = 0;
+#ifdef RCYNIC_USE_EPOLL
+  if (rc->epoll_fd >= 0)
+    (void) epoll_ctl(rc->epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+#endif
+
+  (void) close(*fd);
+  *fd = -1;
+}
+
+/**
+ * Set an rsync context's deadline, and arm its timer if we're using
+ * epoll().  If we can't get a timer, the idle check in the event loop
+ * will catch the deadline eventually.
+ */
+static void rsync_set_deadline(const rcynic_ctx_t *rc,
+			       rsync_ctx_t *ctx,
+			       const time_t deadline)
+{
+#ifdef RCYNIC_USE_EPOLL
+  struct itimerspec its;
+#endif
+
+  assert(rc && ctx);
+
+  ctx->deadline = deadline;
+
+#ifdef RCYNIC_USE_EPOLL
+  if (rc->epoll_fd < 0)
+    return;
+
+  if (ctx->timerfd < 0) {
+    if ((ctx->timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+      logmsg(rc, log_sys_err, "timerfd_create() failed: %s", strerror(errno));
+      return;
+    }
+    if (!rsync_event_add(rc, ctx->timerfd, ctx)) {
+      (void) close(ctx->timerfd);
+      ctx->timerfd = -1;
+      return;
     }
+  }
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = deadline > 0 ? deadline : 1;
+  if (timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    logmsg(rc, log_sys_err, "timerfd_settime() failed: %s", strerror(errno));
+#endif
+}
+
+/**
+ * Free an rsync context and any event descriptors it's holding.
+ */
+static void rsync_ctx_free(const rcynic_ctx_t *rc, rsync_ctx_t *ctx)
+{
+  if (ctx == NULL)
+    return;
+  rsync_event_close(rc, &ctx->fd);
+  rsync_event_close(rc, &ctx->pidfd);
+  rsync_event_close(rc, &ctx->timerfd);
+  free(ctx);
+}
+
+/**
+ * Set up the event loop: use epoll() if we can, with pidfds for child
+ * exit notification if the kernel supports them, otherwise fall back
+ * to select() and waitpid().
+ */
+static int rsync_events_init(rcynic_ctx_t *rc)
+{
+  assert(rc);
+
+  rc->epoll_fd = -1;
+  rc->use_pidfd = 0;
+
+#ifdef RCYNIC_USE_EPOLL
+  if ((rc->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    logmsg(rc, log_verbose, "epoll_create1() failed, falling back to select(): %s", strerror(errno));
+    return 1;
+  }
+
+  if (rc->wakeup_fds[0] >= 0 && !rsync_event_add(rc, rc->wakeup_fds[0], NULL))
+    return 0;
+
+#ifdef SYS_pidfd_open
+  {
+    int fd = syscall(SYS_pidfd_open, getpid(), 0);
+    if (fd >= 0) {
+      rc->use_pidfd = 1;
+      (void) close(fd);
+    }
+  }
+#endif
+
+  logmsg(rc, log_verbose, "Using epoll() event loop%s",
+	 rc->use_pidfd ? " with pidfds" : "");
+#endif
+
+  return 1;
+}
+
+/**
+ * Gather runable tree fetches from the same module as ctx into a
+ * batch which ctx's rsync process will fetch along with its own URI.
+ * Contexts left over from a batch that went wrong are never batched
+ * again, see rsync_child_exited().
+ * Batched contexts leave the run queue but stay in the active set, so
+ * nothing that conflicts with them can start until the batch is done.
+ * Contexts on the run queue never conflict with each other.
+ */
+static void rsync_batch_collect(rcynic_ctx_t *rc, rsync_ctx_t *ctx)
+{
+  rsync_ctx_t *c, *next, **tail = &ctx->batch;
+  int n = 1;
+
+  assert(rc && ctx && ctx->state == rsync_state_initial && ctx->batch == NULL);
+
+  if (rc->rsync_batch_size <= 1 || ctx->host == NULL || ctx->unbatched ||
+      !endswith(ctx->uri.s, "/") || strlen(ctx->uri.s) + 2 >= sizeof(ctx->uri.s))
+    return;
+
+  for (c = ctx->runq_next; c != NULL && n < rc->rsync_batch_size; c = next) {
+    next = c->runq_next;
+    if (c->host != ctx->host || c->unbatched || !endswith(c->uri.s, "/") ||
+	strlen(c->uri.s) + 2 >= sizeof(c->uri.s) || rsync_history_uri(rc, &c->uri))
+      continue;
+    rsync_set_state(rc, c, rsync_state_batched);
+    *tail = c;
+    tail = &c->batch;
+    n++;
+  }
+}
+
+/**
+ * Break up a batch, putting its members back on the run queue.
+ */
+static void rsync_batch_release(rcynic_ctx_t *rc, rsync_ctx_t *ctx)
+{
+  rsync_ctx_t *c;
+
+  assert(rc && ctx);
+
+  while ((c = ctx->batch) != NULL) {
+    ctx->batch = c->batch;
+    c->batch = NULL;
+    rsync_set_state(rc, c, rsync_state_initial);
+  }
+}
+
+/**
+ * Start an rsync process with its stdout and stderr going to a pipe,
+ * and return its pid and the non-blocking read end of the pipe.  If
+ * the child started but something failed afterwards, *pid is still
+ * set, so that the caller can kill it.  Caller need not hold the lock.
+ */
+static int rsync_spawn(const rcynic_ctx_t *rc,
+		       const char **argv,
+		       pid_t *pid,
+		       int *fd)
+{
+  posix_spawn_file_actions_t actions;
+  int flags, err, pipe_fds[2], have_actions = 0, ok = 0;
+
+  assert(rc && argv && argv[0] && pid && fd);
+
+  *pid = 0;
+  *fd = pipe_fds[0] = pipe_fds[1] = -1;
+
+  /*
+   * Close-on-exec, so that other rsync processes don't inherit this
+   * pipe.  The dup2() calls below clear the flag for our own child.
+   */
+#ifdef RCYNIC_USE_EPOLL
+  if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+#else
+  if (pipe(pipe_fds) < 0) {
+#endif
+    logmsg(rc, log_sys_err, "pipe() failed: %s", strerror(errno));
+    goto done;
+  }
+
+  if ((err = posix_spawn_file_actions_init(&actions)) != 0) {
+    logmsg(rc, log_sys_err, "posix_spawn_file_actions_init() failed: %s", strerror(err));
+    goto done;
+  }
+
+  have_actions = 1;
+
+  if ((err = posix_spawn_file_actions_addclose(&actions, pipe_fds[0])) != 0 ||
+      (err = posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], 1)) != 0 ||
+      (err = posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], 2)) != 0 ||
+      (err = posix_spawn_file_actions_addclose(&actions, pipe_fds[1])) != 0) {
+    logmsg(rc, log_sys_err, "posix_spawn_file_actions_add*() failed: %s", strerror(err));
+    goto done;
+  }
+
+  if ((err = posix_spawnp(pid, argv[0], &actions, NULL, (char * const *) argv, environ)) != 0) {
+    logmsg(rc, log_sys_err, "posix_spawnp(%s) failed: %s", argv[0], strerror(err));
+    *pid = 0;
+    goto done;
+  }
+
+  if ((flags = fcntl(pipe_fds[0], F_GETFL, 0)) == -1 ||
+      fcntl(pipe_fds[0], F_SETFL, flags | O_NONBLOCK) == -1) {
+    logmsg(rc, log_sys_err, "fcntl(F_[GS]ETFL, O_NONBLOCK) failed: %s", strerror(errno));
+    goto done;
+  }
+
+  *fd = pipe_fds[0];
+  pipe_fds[0] = -1;
+  ok = 1;
+
+ done:
+  if (pipe_fds[0] != -1)
+    (void) close(pipe_fds[0]);
+  if (pipe_fds[1] != -1)
+    (void) close(pipe_fds[1]);
+  if (have_actions)
+    (void) posix_spawn_file_actions_destroy(&actions);
+  return ok;
+}
+
+/**
+ * Run an rsync process, fetching ctx's URI and anything batched with
+ * it.  Batched fetches use --relative with a "/./" marker after the
+ * module name in each source, so that everything lands in the right
+ * place under the module's directory.
+ */
+static void rsync_run(rcynic_ctx_t *rc,
+		      rsync_ctx_t *ctx)
+{
+  static const char * const rsync_cmd[] = {
+    "rsync", "--update", "--times", "--copy-links", "--itemize-changes"
+  };
+  static const char * const rsync_tree_args[] = {
+    "--recursive", "--delete"
+  };
+
+  int i, n, argc = 0, argv_max, fd = -1, ok;
+  const char **argv = NULL;
+  uri_t *sources = NULL, module;
+  pid_t pid = 0;
+  rsync_ctx_t *c;
+  path_t path;
+  size_t len;
+
+  assert(rc && ctx && ctx->pid == 0 && ctx->state != rsync_state_running && rsync_runable(rc, ctx));
+
+  if (rsync_history_uri(rc, &ctx->uri)) {
+    logmsg(rc, log_verbose, "Late rsync cache hit for %s", ctx->uri.s);
+    rsync_batch_release(rc, ctx);
+    rsync_call_handler(rc, ctx, rsync_status_done);
+    rsync_queue_remove(rc, ctx);
+    rsync_ctx_free(rc, ctx);
+    return;
+  }
+
+  assert(rsync_count_running(rc) < rc->max_parallel_fetches);
+
+  for (n = 0, c = ctx->batch; c != NULL; c = c->batch)
+    n++;
+
+  argv_max = (sizeof(rsync_cmd)/sizeof(*rsync_cmd) +
+	      sizeof(rsync_tree_args)/sizeof(*rsync_tree_args) + n + 4);
+
+  if ((argv = calloc(argv_max, sizeof(*argv))) == NULL ||
+      (n > 0 && (sources = calloc(n + 1, sizeof(*sources))) == NULL)) {
+    logmsg(rc, log_sys_err, "Couldn't allocate rsync arguments for %s", ctx->uri.s);
+    goto lose;
+  }
+
+  for (c = ctx; c != NULL; c = c->batch)
+    logmsg(rc, log_telemetry, "Fetching %s", c->uri.s);
+
+  for (i = 0; i < sizeof(rsync_cmd)/sizeof(*rsync_cmd); i++) {
+    assert(argc < argv_max);
+    argv[argc++] = rsync_cmd[i];
+  }
+  if (endswith(ctx->uri.s, "/")) {
+    for (i = 0; i < sizeof(rsync_tree_args)/sizeof(*rsync_tree_args); i++) {
+      assert(argc < argv_max);
+      argv[argc++] = rsync_tree_args[i];
+    }
+  }
+  if (n > 0) {
+    assert(argc < argv_max);
+    argv[argc++] = "--relative";
+  }
+
+  if (rc->rsync_program)
+    argv[0] = rc->rsync_program;
+
+  if (n == 0) {
+
+    if (!uri_to_filename(rc, &ctx->uri, &path, &rc->unauthenticated)) {
+      logmsg(rc, log_data_err, "Couldn't extract filename from URI: %s", ctx->uri.s);
+      goto lose;
+    }
+
+    assert(argc < argv_max);
+    argv[argc++] = ctx->uri.s;
+
+  } else {
+
+    len = rsync_module_len(ctx->uri.s);
+    assert(len > 0);
+    memset(&module, 0, sizeof(module));
+    memcpy(module.s, ctx->uri.s, len + 1);
+
+    if (!uri_to_filename(rc, &module, &path, &rc->unauthenticated)) {
+      logmsg(rc, log_data_err, "Couldn't extract filename from URI: %s", module.s);
+      goto lose;
+    }
+
+    for (i = 0, c = ctx; c != NULL; i++, c = c->batch) {
+      (void) snprintf(sources[i].s, sizeof(sources[i].s), "%.*s/./%s",
+		      (int) len, c->uri.s, c->uri.s + len + 1);
+      assert(argc < argv_max);
+      argv[argc++] = sources[i].s;
+    }
+
+  }
+
+  assert(argc < argv_max);
+  argv[argc++] = path.s;
+
+  if (!mkdir_maybe(rc, &path)) {
+    logmsg(rc, log_sys_err, "Couldn't make target directory: %s", path.s);
+    goto lose;
+  }
+
+  for (i = 0; i < argc; i++)
+    logmsg(rc, log_debug, "rsync argv[%d]: %s", i, argv[i]);
+
+  /*
+   * Spawning doesn't touch anything shared, and can be slow with a
+   * large address space, so don't hold up validation threads for it.
+   */
+  rcynic_unlock(rc);
+  ok = rsync_spawn(rc, argv, &pid, &fd);
+  rcynic_lock(rc);
+
+  ctx->pid = pid;
+  ctx->fd = fd;
+
+  if (!ok)
+    goto lose;
+
+#if defined(RCYNIC_USE_EPOLL) && defined(SYS_pidfd_open)
+  if (rc->use_pidfd) {
+    if ((ctx->pidfd = syscall(SYS_pidfd_open, ctx->pid, 0)) < 0) {
+      logmsg(rc, log_sys_err, "pidfd_open() failed, reverting to waitpid(): %s", strerror(errno));
+      rc->use_pidfd = 0;
+    } else if (!rsync_event_add(rc, ctx->pidfd, ctx)) {
+      (void) close(ctx->pidfd);
+      ctx->pidfd = -1;
+      rc->use_pidfd = 0;
+    }
+  }
+#endif
+  if (!rsync_event_add(rc, ctx->fd, ctx))
+    goto lose;
+  rsync_set_state(rc, ctx, rsync_state_running);
+  ctx->problem = rsync_problem_none;
+  if (!ctx->started)
+    ctx->started = time(0);
+  if (rc->rsync_timeout)
+    rsync_set_deadline(rc, ctx, time(0) + rc->rsync_timeout);
+  if (ctx->host != NULL) {
+    ctx->host->running++;
+    if (rc->fetch_rate_per_host > 0)
+      ctx->host->tokens -= 1.0;
+  }
+  logmsg(rc, log_verbose, "Subprocess %u started, queued %d, runable %d, running %d, max %d, batched %d, URI %s",
+	 (unsigned) ctx->pid, sk_rsync_ctx_t_num(rc->rsync_queue), rsync_count_runable(rc), rsync_count_running(rc), rc->max_parallel_fetches, n, ctx->uri.s);
+  for (c = ctx; c != NULL; c = c->batch) {
+    c->started = ctx->started;
+    rsync_call_handler(rc, c, rsync_status_pending);
+  }
+  goto done;
+
+ lose:
+  rsync_batch_release(rc, ctx);
+  if (rc->rsync_queue && ctx)
+    rsync_queue_remove(rc, ctx);
+  rsync_call_handler(rc, ctx, rsync_status_failed);
+  if (ctx->pid > 0) {
+    (void) kill(ctx->pid, SIGKILL);
+    ctx->pid = 0;
+  }
+  rsync_ctx_free(rc, ctx);
+
+ done:
+  free(sources);
+  free(argv);
+}
+
+/**
+ * Process one line of rsync's output.  This is a separate function
+ * primarily to centralize scraping for magic error strings.
+ */
+static void do_one_rsync_log_line(const rcynic_ctx_t *rc,
+				  rsync_ctx_t *ctx)
+{
+  unsigned u;
+  char *s;
+
+  /*
+   * Send line to our log unless it's empty.
+   */
+  if (ctx->buffer[strspn(ctx->buffer, " \t\n\r")] != '\0')
+    logmsg(rc, log_telemetry, "rsync[%u]: %s", ctx->pid, ctx->buffer);
+
+  /*
+   * Check for magic error strings
+   */
+  if ((s = strstr(ctx->buffer, "@ERROR: max connections")) != NULL) {
+    ctx->problem = rsync_problem_refused;
+    if (sscanf(s, "@ERROR: max connections (%u) reached -- try again later", &u) == 1)
+      logmsg(rc, log_verbose, "Subprocess %u reported limit of %u for %s", ctx->pid, u, ctx->uri.s);
+    /*
+     * The server's limit is for all of its clients, not just us, so
+     * the number we scraped doesn't tell us much.  What does tell us
+     * something is how many connections we had open when it
+     * refused: don't go that high again.
+     */
+    rcynic_lock(rc);
+    if (ctx->host != NULL && ctx->host->running > 1 &&
+	(ctx->host->limit == 0 || ctx->host->running - 1 < ctx->host->limit)) {
+      ctx->host->limit = ctx->host->running - 1;
+      logmsg(rc, log_verbose, "Limiting %s to %d parallel fetches", ctx->host->module.s, ctx->host->limit);
+    }
+    rcynic_unlock(rc);
+  }
+}
+
+/**
+ * Construct select() arguments.
+ */
+static int rsync_construct_select(const rcynic_ctx_t *rc,
+				  const time_t now,
+				  fd_set *rfds,
+				  struct timeval *tv)
+{
+  rsync_ctx_t *ctx;
+  time_t when = 0;
+  int i, n = 0;
+
+  assert(rc && rc->rsync_queue && rfds && tv && rc->max_select_time >= 0);
+
+  FD_ZERO(rfds);
+
+  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i) {
+
+    switch (ctx->state) {
+
+    case rsync_state_running:
+      assert(ctx->fd >= 0);
+      FD_SET(ctx->fd, rfds);
+      if (ctx->fd > n)
+	n = ctx->fd;
+      if (!rc->rsync_timeout)
+	continue;
+      /* Fall through */
+
+    case rsync_state_retry_wait:
+      if (when == 0 || ctx->deadline < when)
+	when = ctx->deadline;
+      /* Fall through */
+
+    default:
+      continue;
+    }
+  }
+
+  if (rc->wakeup_fds[0] >= 0) {
+    FD_SET(rc->wakeup_fds[0], rfds);
+    if (rc->wakeup_fds[0] > n)
+      n = rc->wakeup_fds[0];
+  }
+
+  if (!when)
+    tv->tv_sec = rc->max_select_time;
+  else if (when < now)
+    tv->tv_sec = 0;
+  else if (when < now + rc->max_select_time)
+    tv->tv_sec = when - now;
+  else
+    tv->tv_sec = rc->max_select_time;
+  if (rc->rsync_throttled && tv->tv_sec > 1)
+    tv->tv_sec = 1;
+  tv->tv_usec = 0;
+  return n;
+}
+
+/**
+ * Convert rsync_status_t to mib_counter_t.
+ *
+ * Maybe some day this will go away and we won't be carrying
+ * essentially the same information in two different databases, but
+ * for now I'll settle for cleaning up the duplicate code logic.
+ */
+static mib_counter_t rsync_status_to_mib_counter(rsync_status_t status)
+{
+  switch (status) {
+  case rsync_status_done:	return rsync_transfer_succeeded;
+  case rsync_status_timed_out:	return rsync_transfer_timed_out;
+  case rsync_status_failed:	return rsync_transfer_failed;
+  case rsync_status_skipped:	return rsync_transfer_skipped;
+  default:
+    /*
+     * Keep GCC from whining about untested cases.
+     */
+    assert(status == rsync_status_done ||
+	   status == rsync_status_timed_out ||
+	   status == rsync_status_failed ||
+	   status == rsync_status_skipped);
+    return rsync_transfer_failed;
+  }
+}
+
+/**
+ * Finish off the rest of a batch once the rsync process fetching it
+ * has exited.  Everything in the batch gets the same outcome as the
+ * context that ran the process, so this is only for outcomes that
+ * apply to the whole batch.
+ */
+static void rsync_batch_finish(rcynic_ctx_t *rc,
+			       rsync_ctx_t *ctx,
+			       const rsync_status_t status)
+{
+  rsync_ctx_t *c;
+
+  assert(rc && ctx);
+
+  while ((c = ctx->batch) != NULL) {
+    ctx->batch = c->batch;
+    c->batch = NULL;
+    log_validation_status(rc, &c->uri,
+			  rsync_status_to_mib_counter(status),
+			  object_generation_null);
+    rsync_history_add(rc, c, status);
+    rsync_call_handler(rc, c, status);
+    rsync_queue_remove(rc, c);
+    rsync_ctx_free(rc, c);
+  }
+}
+
+/**
+ * Handle exit of an rsync subprocess.  This either schedules a retry
+ * or finishes off the rsync context, calling its handler and freeing
+ * it, so caller must not touch ctx after this returns.
+ */
+static void rsync_child_exited(rcynic_ctx_t *rc,
+			       rsync_ctx_t *ctx,
+			       const int pid_status,
+			       const time_t now)
+{
+  rsync_status_t rsync_status;
+  int partial = 0;
+  rsync_ctx_t *c;
+
+  assert(rc && ctx && ctx->pid > 0);
+
+  logmsg(rc, log_verbose, "Subprocess %u exited with status %d",
+	 (unsigned) ctx->pid, WEXITSTATUS(pid_status));
+
+  if (ctx->host != NULL)
+    ctx->host->running--;
+
+  rsync_event_close(rc, &ctx->fd);
+  rsync_event_close(rc, &ctx->pidfd);
+
+  if (ctx->buflen > 0) {
+    assert(ctx->buflen < sizeof(ctx->buffer));
+    ctx->buffer[ctx->buflen] = '\0';
+    do_one_rsync_log_line(rc, ctx);
+    ctx->buflen = 0;
+  }
+
+  switch (WEXITSTATUS(pid_status)) {
+
+  case 0:
+    rsync_status = rsync_status_done;
+    break;
+
+  case 5:			/* "Error starting client-server protocol" */
+    /*
+     * Handle remote rsyncd refusing to talk to us because we've
+     * exceeded its connection limit.  Back off for a short
+     * interval, then retry.
+     */
+    if (ctx->problem == rsync_problem_refused && ctx->tries < rc->max_retries) {
+      unsigned char r;
+      if (!RAND_bytes(&r, sizeof(r)))
+	r = 60;
+      rsync_set_deadline(rc, ctx, time(0) + rc->retry_wait_min + r);
+      rsync_set_state(rc, ctx, rsync_state_retry_wait);
+      ctx->problem = rsync_problem_none;
+      ctx->pid = 0;
+      ctx->tries++;
+      logmsg(rc, log_telemetry, "Scheduling retry for %s", ctx->uri.s);
+      rsync_batch_release(rc, ctx);
+      return;
+    }
+    goto failure;
+
+  case 23:			/* "Partial transfer due to error" */
+    /*
+     * This appears to be a catch-all for "something bad happened
+     * trying to do what you asked me to do".  In the cases I've
+     * seen to date, this is things like "the directory you
+     * requested isn't there" or "NFS exploded when I tried to touch
+     * the directory".  These aren't network layer failures, so we
+     * (probably) shouldn't give up on the repository host.
+     */
+    rsync_status = rsync_status_done;
+    partial = 1;
+    break;
+
+  default:
+  failure:
+    rsync_status = rsync_status_failed;
+    logmsg(rc, log_data_err, "rsync %u exited with status %d fetching %s",
+	   (unsigned) ctx->pid, WEXITSTATUS(pid_status), ctx->uri.s);
+    break;
+  }
+
+  if (rc->rsync_timeout && now >= ctx->deadline)
+    rsync_status = rsync_status_timed_out;
+
+  /*
+   * rsync's exit status covers everything in a batch, so when a
+   * batched run fails or only partly works we can't tell which
+   * publication points were at fault.  Rather than blame all of them,
+   * break up the batch and fetch each member on its own.  Timeouts
+   * and refused connections are about the host rather than any one
+   * publication point, so those still apply to the whole batch.
+   */
+  if (ctx->batch != NULL && ctx->problem != rsync_problem_refused &&
+      (partial || rsync_status == rsync_status_failed)) {
+    logmsg(rc, log_telemetry, "Batched rsync fetching %s %s, fetching batch members separately",
+	   ctx->uri.s, partial ? "was incomplete" : "failed");
+    for (c = ctx; c != NULL; c = c->batch)
+      c->unbatched = 1;
+    ctx->problem = rsync_problem_none;
+    ctx->pid = 0;
+    rsync_batch_release(rc, ctx);
+    rsync_set_state(rc, ctx, rsync_state_initial);
+    return;
+  }
+
+  if (partial)
+    log_validation_status(rc, &ctx->uri, rsync_partial_transfer, object_generation_null);
+  log_validation_status(rc, &ctx->uri,
+			rsync_status_to_mib_counter(rsync_status),
+			object_generation_null);
+  rsync_history_add(rc, ctx, rsync_status);
+  rsync_batch_finish(rc, ctx, rsync_status);
+  rsync_call_handler(rc, ctx, rsync_status);
+  rsync_queue_remove(rc, ctx);
+  rsync_ctx_free(rc, ctx);
+}
+
+/**
+ * Read whatever output an rsync subprocess has for us, and log it
+ * line by line.  Only the main thread touches a running context's
+ * output, so we only need the lock to change its state.
+ */
+static void rsync_read_output(rcynic_ctx_t *rc,
+			      rsync_ctx_t *ctx)
+{
+  ssize_t n;
+  char *s;
+
+  assert(rc && ctx && ctx->fd >= 0);
+
+  assert(ctx->buflen < sizeof(ctx->buffer) - 1);
+
+  while ((n = read(ctx->fd, ctx->buffer + ctx->buflen, sizeof(ctx->buffer) - 1 - ctx->buflen)) > 0) {
+    ctx->buflen += n;
+    assert(ctx->buflen < sizeof(ctx->buffer));
+    ctx->buffer[ctx->buflen] = '\0';
+
+    while ((s = strchr(ctx->buffer, '\n')) != NULL) {
+      *s++ = '\0';
+      do_one_rsync_log_line(rc, ctx);
+      assert(s > ctx->buffer && s < ctx->buffer + sizeof(ctx->buffer));
+      ctx->buflen -= s - ctx->buffer;
+      assert(ctx->buflen < sizeof(ctx->buffer));
+      if (ctx->buflen > 0)
+	memmove(ctx->buffer, s, ctx->buflen);
+      ctx->buffer[ctx->buflen] = '\0';
+    }
+
+    if (ctx->buflen == sizeof(ctx->buffer) - 1) {
+      ctx->buffer[sizeof(ctx->buffer) - 1] = '\0';
+      do_one_rsync_log_line(rc, ctx);
+      ctx->buflen = 0;
+    }
+  }
+
+  if (n == 0) {
+    rcynic_lock(rc);
+    rsync_event_close(rc, &ctx->fd);
+    rsync_set_state(rc, ctx, rsync_state_closed);
+    rcynic_unlock(rc);
+  }
+}
+
+/**
+ * Deal with a child that has been running too long.
+ */
+static void rsync_check_deadline(rcynic_ctx_t *rc,
+				 rsync_ctx_t *ctx,
+				 const time_t now)
+{
+  int sig;
+
+  assert(rc && ctx);
+
+  if (!rc->rsync_timeout || ctx->pid <= 0 || now < ctx->deadline)
+    return;
+
+  sig = ctx->tries++ < KILL_MAX ? SIGTERM : SIGKILL;
+  if (ctx->state != rsync_state_terminating) {
+    ctx->problem = rsync_problem_timed_out;
+    rsync_set_state(rc, ctx, rsync_state_terminating);
+    ctx->tries = 0;
+    logmsg(rc, log_telemetry, "Subprocess %u is taking too long fetching %s, whacking it", (unsigned) ctx->pid, ctx->uri.s);
+    rsync_history_add(rc, ctx, rsync_status_timed_out);
+  } else if (sig == SIGTERM) {
+    logmsg(rc, log_verbose, "Whacking subprocess %u again", (unsigned) ctx->pid);
+  } else {
+    logmsg(rc, log_verbose, "Whacking subprocess %u with big hammer", (unsigned) ctx->pid);
+  }
+  (void) kill(ctx->pid, sig);
+  rsync_set_deadline(rc, ctx, now + 1);
+}
+
+#ifdef RCYNIC_USE_EPOLL
+
+/**
+ * Handle whatever the epoll event loop says is ready for a particular
+ * rsync context: output, child exit, or timer expiration.  We don't
+ * bother tracking which of the context's descriptors fired, as
+ * checking all of them is cheap and non-blocking.  Caller must not
+ * hold the lock; we take it only to update shared state.
+ */
+static void rsync_service(rcynic_ctx_t *rc,
+			  rsync_ctx_t *ctx,
+			  const time_t now)
+{
+  uint64_t expirations;
+  int pid_status, exited;
+
+  assert(rc && ctx);
+
+  if (ctx->timerfd >= 0)
+    (void) read(ctx->timerfd, &expirations, sizeof(expirations));
+
+  if (ctx->fd >= 0)
+    rsync_read_output(rc, ctx);
+
+  exited = ctx->pidfd >= 0 && waitpid(ctx->pid, &pid_status, WNOHANG) == ctx->pid;
+
+  rcynic_lock(rc);
+
+  if (ctx->state == rsync_state_retry_wait && ctx->deadline <= now)
+    rsync_set_state(rc, ctx, rsync_state_initial);
+  else if (exited)
+    rsync_child_exited(rc, ctx, pid_status, now);
+  else
+    rsync_check_deadline(rc, ctx, now);
+
+  rcynic_unlock(rc);
+}
+
+/**
+ * epoll() flavor of the wait-and-dispatch half of rsync_mgr().  Cost
+ * here is proportional to the number of ready descriptors rather than
+ * to the length of the rsync queue.  Caller must not hold the lock.
+ */
+static void rsync_mgr_epoll(rcynic_ctx_t *rc, const int block)
+{
+  struct epoll_event events[64];
+  rsync_ctx_t *ctx;
+  int i, j, n, timeout;
+  time_t now;
+
+  assert(rc && rc->rsync_queue && rc->epoll_fd >= 0);
+
+  rcynic_lock(rc);
+
+  if (sk_rsync_ctx_t_num(rc->rsync_queue) == 0 && rc->wakeup_fds[0] < 0) {
+    rcynic_unlock(rc);
+    return;
+  }
+
+  if (rc->max_select_time > INT_MAX / 1000)
+    timeout = INT_MAX;
+  else
+    timeout = rc->max_select_time * 1000;
+
+  if (rc->rsync_throttled && timeout > 1000)
+    timeout = 1000;
+
+  if (!block)
+    timeout = 0;
+
+  if (block && rc->log_level >= log_verbose && sk_rsync_ctx_t_num(rc->rsync_queue) > 0)
+    logmsg(rc, log_verbose, "Waiting up to %u seconds for rsync, queued %d, runable %d, running %d, max %d",
+	   rc->max_select_time, sk_rsync_ctx_t_num(rc->rsync_queue), rsync_count_runable(rc),
+	   rsync_count_running(rc), rc->max_parallel_fetches);
+
+  rcynic_unlock(rc);
+
+  n = epoll_wait(rc->epoll_fd, events, sizeof(events)/sizeof(*events), timeout);
+
+  if (n < 0 && errno != EINTR)
+    logmsg(rc, log_sys_err, "epoll_wait() failed: %s", strerror(errno));
+
+  now = time(0);
+
+  /*
+   * Belt and suspenders: if we went idle for a full timeout, check
+   * deadlines the hard way, in case we couldn't get a timer for
+   * some context.
+   */
+  if (n == 0 && block) {
+    rcynic_lock(rc);
+    for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i) {
+      if (ctx->timerfd >= 0)
+	continue;
+      if (ctx->state == rsync_state_retry_wait && ctx->deadline <= now)
+	rsync_set_state(rc, ctx, rsync_state_initial);
+      else
+	rsync_check_deadline(rc, ctx, now);
+    }
+    rcynic_unlock(rc);
+  }
+
+  for (i = 0; i < n; i++) {
+    if ((ctx = events[i].data.ptr) == NULL) {
+      rcynic_wakeup_drain(rc);
+      continue;
+    }
+    for (j = 0; j < i && events[j].data.ptr != (void *) ctx; j++)
+      ;
+    if (j == i)		/* Skip contexts we've already serviced */
+      rsync_service(rc, ctx, now);
+  }
+}
+
+#endif /* RCYNIC_USE_EPOLL */
+
+/**
+ * Manager for queue of rsync tasks in progress.
+ *
+ * General plan here is to process one completed child, or output
+ * accumulated from children, or block if there is absolutely nothing
+ * to do, on the theory that caller had nothing to do either or would
+ * not have called us.  Once we've done something allegedly useful, we
+ * return, because this is not the event loop; if and when the event
+ * loop has nothing more important to do, we'll be called again.
+ *
+ * So this is the only place where the program blocks waiting for
+ * children, but we only do it when we know there's nothing else
+ * useful that we could be doing while we wait.
+ *
+ * Where available, we block in epoll() and let the kernel tell us
+ * which rsync contexts need attention; otherwise, we fall back to
+ * select() and polling the whole queue.
+ *
+ * If block is false, caller has validation work of its own waiting,
+ * so we just poll: reap children, collect output, and fill free
+ * slots, without waiting for anything.
+ *
+ * We don't start new fetches while the ready queue is full, so that
+ * fetching can't run arbitrarily far ahead of validation.
+ *
+ * Only the main thread runs this, and only the main thread touches
+ * running rsync contexts, so we take the lock just for the shared
+ * queues and counters, not while waiting, spawning, or reading output.
+ */
+static void rsync_mgr(rcynic_ctx_t *rc, const int block)
+{
+  rsync_ctx_t *ctx = NULL, *next, *ready[FD_SETSIZE];
+  int i, n, n_ready = 0, pid_status = -1;
+  time_t now = time(0);
+  struct timeval tv;
+  fd_set rfds;
+  pid_t pid = 0;
+
+  assert(rc && rc->rsync_queue);
+
+  /*
+   * Check for exited subprocesses.  With pidfds, the event loop
+   * handles this for us.
+   */
+
+  while (!rc->use_pidfd && (pid = waitpid(-1, &pid_status, WNOHANG)) > 0) {
+
+    rcynic_lock(rc);
+
+    for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
+      if (ctx->pid == pid)
+	break;
+
+    if (ctx != NULL) {
+      rsync_child_exited(rc, ctx, pid_status, now);
+      ctx = NULL;
+    } else {
+      assert(i == sk_rsync_ctx_t_num(rc->rsync_queue));
+      logmsg(rc, log_sys_err, "Couldn't find rsync context for pid %d", pid);
+    }
+
+    rcynic_unlock(rc);
+  }
+
+  if (!rc->use_pidfd && pid == -1 && errno != EINTR && errno != ECHILD)
+    logmsg(rc, log_sys_err, "waitpid() returned error: %s", strerror(errno));
+
+  rcynic_lock(rc);
+
+  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+
+  /*
+   * Promote contexts whose retry interval has expired.  With epoll(),
+   * the retry timer does this for us.
+   */
+  if (rc->epoll_fd < 0 && rc->rsync_state_count[rsync_state_retry_wait] > 0)
+    for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
+      if (ctx->state == rsync_state_retry_wait && ctx->deadline <= now)
+	rsync_set_state(rc, ctx, rsync_state_initial);
+
+  /*
+   * Start runable rsync contexts, in the order they became runable,
+   * until we run out of slots.  Contexts whose module is at its
+   * connection limit or out of tokens wait their turn, and we don't
+   * sleep long while any are waiting.  Each context we start takes
+   * whatever else is queued for its module along with it.
+   */
+  rc->rsync_throttled = 0;
+  for (ctx = rc->rsync_runq_head;
+       ctx != NULL && rsync_count_running(rc) < rc->max_parallel_fetches && !task_ready_full(rc);
+       ctx = next) {
+    if (!rsync_host_ready(rc, ctx->host)) {
+      rc->rsync_throttled = 1;
+      next = ctx->runq_next;
+      continue;
+    }
+    rsync_batch_collect(rc, ctx);
+    next = ctx->runq_next;
+    rsync_runq_remove(rc, ctx);
+    rsync_run(rc, ctx);
+  }
+
+  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+
+#ifdef RCYNIC_USE_EPOLL
+  if (rc->epoll_fd >= 0) {
+    rcynic_unlock(rc);
+    rsync_mgr_epoll(rc, block);
+    return;
+  }
+#endif
+
+  /*
+   * Check for log text from subprocesses.
+   */
+
+  n = rsync_construct_select(rc, now, &rfds, &tv);
+
+  if (!block)
+    tv.tv_sec = 0;
+
+  if (n > 0 && tv.tv_sec && sk_rsync_ctx_t_num(rc->rsync_queue) > 0)
+    logmsg(rc, log_verbose, "Waiting up to %u seconds for rsync, queued %d, runable %d, running %d, max %d",
+	   (unsigned) tv.tv_sec, sk_rsync_ctx_t_num(rc->rsync_queue), rsync_count_runable(rc),
+	   rsync_count_running(rc), rc->max_parallel_fetches);
+
+  rcynic_unlock(rc);
+
+  if (n > 0) {
+#if 0
+    logmsg(rc, log_debug, "++ select(%d, %u)", n, tv.tv_sec);
+#endif
+    n = select(n + 1, &rfds, NULL, NULL, &tv);
+  }
+
+  if (n > 0 && rc->wakeup_fds[0] >= 0 && FD_ISSET(rc->wakeup_fds[0], &rfds))
+    rcynic_wakeup_drain(rc);
+
+  /*
+   * Other threads can add to the queue while we read, so pick out
+   * the contexts with output under the lock, then read without it.
+   */
+  if (n > 0) {
+    rcynic_lock(rc);
+    for (i = n_ready = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
+      if (ctx->fd > 0 && FD_ISSET(ctx->fd, &rfds) && n_ready < FD_SETSIZE)
+	ready[n_ready++] = ctx;
+    rcynic_unlock(rc);
+    for (i = 0; i < n_ready; i++)
+      rsync_read_output(rc, ready[i]);
+  }
+
+  rcynic_lock(rc);
+
+  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+
+  /*
+   * Deal with children that have been running too long.
+   */
+  if (rc->rsync_timeout)
+    for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i)
+      rsync_check_deadline(rc, ctx, now);
+
+  rcynic_unlock(rc);
+}
+
+/**
+ * Set up rsync context and attempt to start it.
+ */
+static void rsync_init(rcynic_ctx_t *rc,
+		       const uri_t *uri,
+		       void *cookie,
+		       void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *, const rsync_status_t, const uri_t *, void *))
+{
+  rsync_ctx_t *ctx = NULL;
+
+  assert(rc && uri && strlen(uri->s) > SIZEOF_RSYNC);
+
+  rcynic_lock(rc);
+
+  if (!rc->run_rsync) {
+    logmsg(rc, log_verbose, "rsync disabled, skipping %s", uri->s);
+    if (handler)
+      handler(rc, NULL, rsync_status_skipped, uri, cookie);
+    goto done;
+  }
+
+  if (rsync_history_uri(rc, uri)) {
+    logmsg(rc, log_verbose, "rsync cache hit for %s", uri->s);
+    if (handler)
+      handler(rc, NULL, rsync_status_done, uri, cookie);
+    goto done;
+  }
+
+  if ((ctx = malloc(sizeof(*ctx))) == NULL) {
+    logmsg(rc, log_sys_err, "malloc(rsync_ctxt_t) failed");
+    if (handler)
+      handler(rc, NULL, rsync_status_failed, uri, cookie);
+    goto done;
+  }
+
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->uri = *uri;
+  ctx->handler = handler;
+  ctx->cookie = cookie;
+  ctx->fd = ctx->pidfd = ctx->timerfd = -1;
+  ctx->host = rsync_host_find(rc, uri);
+
+  if (!rsync_queue_add(rc, ctx)) {
+    logmsg(rc, log_sys_err, "Couldn't push rsync state object onto queue, punting %s", ctx->uri.s);
+    rsync_call_handler(rc, ctx, rsync_status_failed);
+    rsync_ctx_free(rc, ctx);
+    goto done;
+  }
+
+  rcynic_wakeup(rc);
+
+ done:
+  rcynic_unlock(rc);
+}
+
+/**
+ * rsync a trust anchor.
+ */
+static void rsync_ta(rcynic_ctx_t *rc,
+		     const uri_t *uri,
+		     tal_ctx_t *tctx,
+		     void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *,
+				     const rsync_status_t, const uri_t *, void *))
+{
+  assert(endswith(uri->s, ".cer"));
+  rsync_init(rc, uri, tctx, handler);
+}
+
+/**
+ * rsync an entire subtree, generally rooted at a SIA collection.
+ */
+static void rsync_tree(rcynic_ctx_t *rc,
+		       const uri_t *uri,
+		       STACK_OF(walk_ctx_t) *wsk,
+		       void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *,
+				       const rsync_status_t, const uri_t *, void *))
+{
+  assert(endswith(uri->s, "/"));
+  rsync_init(rc, uri, wsk, handler);
+}
+
+
+
+/**
+ * Maximum length of an RRDP session_id.  These are UUIDs in practice.
+ */
+#define	RRDP_SESSION_MAX	64
+
+/**
+ * Delta file listed in an RRDP notification.
+ */
+typedef struct rrdp_delta {
+  long serial;
+  char uri[URI_MAX];
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+} rrdp_delta_t;
+
+/**
+ * Parsed RRDP notification file.
+ */
+typedef struct rrdp_notification {
+  char session[RRDP_SESSION_MAX];
+  long serial;
+  char snapshot_uri[URI_MAX];
+  unsigned char snapshot_hash[SHA256_DIGEST_LENGTH];
+  rrdp_delta_t *deltas;
+  int n_deltas;
+} rrdp_notification_t;
+
+/**
+ * Someone waiting for an RRDP fetch to finish.
+ */
+typedef struct rrdp_waiter {
+  struct rrdp_waiter *next;
+  void (*handler)(rcynic_ctx_t *, const rsync_status_t, void *);
+  void *cookie;
+} rrdp_waiter_t;
+
+/**
+ * Record of RRDP fetches during this run, so that we only process
+ * each notification URI once no matter how many CAs point at it.
+ * module is the rsync://host/module/ prefix of the SIA of the first
+ * CA to name this notification URI: we only accept objects within
+ * that module from the repository, and we only trust the repository
+ * for CAs whose SIA is within that module.  Entries waiting for a
+ * fetch thread are chained through next.
+ */
+typedef struct rrdp_history {
+  struct rrdp_history *next;
+  uri_t uri, module;
+  rrdp_waiter_t *waiters;
+  int done, ok;
+} rrdp_history_t;
+
+/**
+ * Convert a hex string to binary, insisting on exact length.
+ */
+static int rrdp_hex_decode(const char *hex, unsigned char *out, const size_t len)
+{
+  size_t i;
+  int hi = 0, lo;
+
+  if (hex == NULL || strlen(hex) != 2 * len)
+    return 0;
+
+  for (i = 0; i < 2 * len; i++) {
+    if (hex[i] >= '0' && hex[i] <= '9')
+      lo = hex[i] - '0';
+    else if (hex[i] >= 'a' && hex[i] <= 'f')
+      lo = hex[i] - 'a' + 10;
+    else if (hex[i] >= 'A' && hex[i] <= 'F')
+      lo = hex[i] - 'A' + 10;
+    else
+      return 0;
+    if (i & 1)
+      out[i / 2] = (hi << 4) | lo;
+    else
+      hi = lo;
+  }
+
+  return 1;
+}
+
+/**
+ * Parse a serial number attribute.
+ */
+static int rrdp_serial(const char *s, long *serial)
+{
+  char *end;
+  if (s == NULL || *s < '0' || *s > '9')
+    return 0;
+  *serial = strtol(s, &end, 10);
+  return *end == '\0' && *serial > 0;
+}
+
+/**
+ * Check the version, session_id and serial attributes of the root
+ * element of an RRDP file.
+ */
+static int rrdp_check_root(const rcynic_ctx_t *rc,
+			   const rrdp_xml_t *x,
+			   const char *name,
+			   const char *session,
+			   const long serial,
+			   const char *url)
+{
+  const char *version = rrdp_xml_attr(x, "version");
+  const char *session_id = rrdp_xml_attr(x, "session_id");
+  long n;
+
+  if (strcmp(x->name, name) || version == NULL || strcmp(version, "1") || session_id == NULL ||
+      (session != NULL && strcmp(session_id, session)) ||
+      !rrdp_serial(rrdp_xml_attr(x, "serial"), &n) ||
+      (serial > 0 && n != serial)) {
+    logmsg(rc, log_data_err, "Unexpected or malformed RRDP %s element in %s", name, url);
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Read and sanity check an RRDP notification file.
+ */
+static int rrdp_parse_notification(const rcynic_ctx_t *rc,
+				   FILE *f,
+				   const char *url,
+				   rrdp_notification_t *n)
+{
+  rrdp_xml_t x;
+  rrdp_xml_token_t t;
+  const char *s;
+  int ok = 0, max_deltas = 0;
+
+  assert(rc && f && url && n);
+
+  memset(n, 0, sizeof(*n));
+  memset(&x, 0, sizeof(x));
+  x.f = f;
+
+  if (rrdp_xml_next(&x) != rrdp_xml_start ||
+      !rrdp_check_root(rc, &x, "notification", NULL, 0, url) ||
+      strlen(rrdp_xml_attr(&x, "session_id")) >= sizeof(n->session))
+    goto done;
+
+  strcpy(n->session, rrdp_xml_attr(&x, "session_id"));
+  (void) rrdp_serial(rrdp_xml_attr(&x, "serial"), &n->serial);
+
+  while ((t = rrdp_xml_next(&x)) == rrdp_xml_start) {
+
+    if ((s = rrdp_xml_attr(&x, "uri")) == NULL || strlen(s) >= URI_MAX)
+      goto malformed;
+
+    if (!strcmp(x.name, "snapshot")) {
+      strcpy(n->snapshot_uri, s);
+      if (!rrdp_hex_decode(rrdp_xml_attr(&x, "hash"), n->snapshot_hash, sizeof(n->snapshot_hash)))
+	goto malformed;
+    }
+
+    else if (!strcmp(x.name, "delta")) {
+      rrdp_delta_t *d;
+      if (n->n_deltas >= max_deltas) {
+	int new_max = max_deltas ? max_deltas * 2 : 64;
+	if ((d = realloc(n->deltas, new_max * sizeof(*d))) == NULL)
+	  goto done;
+	n->deltas = d;
+	max_deltas = new_max;
+      }
+      d = &n->deltas[n->n_deltas++];
+      strcpy(d->uri, s);
+      if (!rrdp_serial(rrdp_xml_attr(&x, "serial"), &d->serial) ||
+	  !rrdp_hex_decode(rrdp_xml_attr(&x, "hash"), d->hash, sizeof(d->hash)))
+	goto malformed;
+    }
+
+    else
+      goto malformed;
+
+    if (!x.empty && rrdp_xml_next(&x) != rrdp_xml_end)
+      goto malformed;
+  }
+
+  if (t != rrdp_xml_end || strcmp(x.name, "notification") || n->snapshot_uri[0] == '\0')
+    goto malformed;
+
+  ok = 1;
+  goto done;
+
+ malformed:
+  logmsg(rc, log_data_err, "Malformed RRDP notification %s", url);
+
+ done:
+  free(x.text);
+  if (!ok) {
+    free(n->deltas);
+    n->deltas = NULL;
+  }
+  return ok;
+}
+
+/**
+ * Check the SHA-256 hash of a file in the unauthenticated tree.
+ */
+static int rrdp_check_file_hash(const path_t *path, const unsigned char *hash)
+{
+  unsigned char buf[8192], digest[SHA256_DIGEST_LENGTH];
+  EVP_MD_CTX *md = NULL;
+  FILE *f = NULL;
+  int ok = 0;
+  size_t n;
+
+  if ((f = fopen(path->s, "rb")) == NULL ||
+      (md = EVP_MD_CTX_create()) == NULL ||
+      !EVP_DigestInit_ex(md, EVP_sha256(), NULL))
+    goto done;
+
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    if (!EVP_DigestUpdate(md, buf, n))
+      goto done;
+
+  ok = !ferror(f) && EVP_DigestFinal_ex(md, digest, NULL) &&
+    !memcmp(digest, hash, sizeof(digest));
+
+ done:
+  if (md != NULL)
+    EVP_MD_CTX_destroy(md);
+  if (f != NULL)
+    (void) fclose(f);
+  return ok;
+}
+
+/**
+ * Install one published object from a snapshot or delta.  Base64
+ * text is decoded in place.  In a delta, a publish element with a
+ * hash replaces the object with that hash, and one without a hash
+ * may only create a new object (RFC 8182 section 3.5.3).
+ */
+static int rrdp_publish(const rcynic_ctx_t *rc,
+			const char *uri_s,
+			const char *hash_hex,
+			char *text,
+			const char *url,
+			const uri_t *module,
+			const int delta)
+{
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  path_t path, temp;
+  FILE *f = NULL;
+  size_t i, n;
+  int len;
+  uri_t uri;
+
+  if (uri_s == NULL || strlen(uri_s) >= sizeof(uri.s) || text == NULL)
+    goto malformed;
+
+  if (strncmp(uri_s, module->s, strlen(module->s))) {
+    logmsg(rc, log_data_err, "RRDP file %s publishes %s, outside %s", url, uri_s, module->s);
+    return 0;
+  }
+
+  strcpy(uri.s, uri_s);
+
+  if (!uri_to_filename(rc, &uri, &path, &rc->unauthenticated))
+    return 0;
+
+  if (hash_hex != NULL) {
+    if (!rrdp_hex_decode(hash_hex, hash, sizeof(hash)))
+      goto malformed;
+    if (!rrdp_check_file_hash(&path, hash)) {
+      logmsg(rc, log_data_err, "RRDP delta %s replaces %s, but we don't have the object it replaces", url, uri.s);
+      return 0;
+    }
+  }
+
+  else if (delta && !access_at(rc, &path, F_OK)) {
+    logmsg(rc, log_data_err, "RRDP delta %s publishes %s without a hash, but we already have it", url, uri.s);
+    return 0;
+  }
+
+  for (i = n = 0; text[i] != '\0'; i++)
+    if (!strchr(" \t\r\n", text[i]))
+      text[n++] = text[i];
+  text[n] = '\0';
+
+  if (n == 0 || n % 4 != 0 ||
+      (len = EVP_DecodeBlock((unsigned char *) text, (unsigned char *) text, n)) < 0)
+    goto malformed;
+
+  len -= (text[n - 1] == '=') + (n > 1 && text[n - 2] == '=');
+
+  if (strlen(path.s) + sizeof(".rrdp") > sizeof(temp.s))
+    return 0;
+  strcpy(temp.s, path.s);
+  strcat(temp.s, ".rrdp");
+
+  if (!mkdir_maybe(rc, &temp) ||
+      (f = fopen(temp.s, "wb")) == NULL ||
+      fwrite(text, 1, len, f) != len ||
+      fclose(f) == EOF ||
+      rename(temp.s, path.s) < 0) {
+    logmsg(rc, log_sys_err, "Couldn't write %s: %s", path.s, strerror(errno));
+    if (f != NULL)
+      (void) unlink(temp.s);
+    return 0;
+  }
+
+  logmsg(rc, log_debug, "RRDP published %s", uri.s);
+  return 1;
+
+ malformed:
+  logmsg(rc, log_data_err, "Malformed RRDP publish element in %s", url);
+  return 0;
+}
+
+/**
+ * Remove one withdrawn object.
+ */
+static int rrdp_withdraw(const rcynic_ctx_t *rc,
+			 const char *uri_s,
+			 const char *hash_hex,
+			 const char *url,
+			 const uri_t *module)
+{
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  path_t path;
+  uri_t uri;
+
+  if (uri_s == NULL || strlen(uri_s) >= sizeof(uri.s) ||
+      !rrdp_hex_decode(hash_hex, hash, sizeof(hash))) {
+    logmsg(rc, log_data_err, "Malformed RRDP withdraw element in %s", url);
+    return 0;
+  }
+
+  if (strncmp(uri_s, module->s, strlen(module->s))) {
+    logmsg(rc, log_data_err, "RRDP file %s withdraws %s, outside %s", url, uri_s, module->s);
+    return 0;
+  }
+
+  strcpy(uri.s, uri_s);
+
+  if (!uri_to_filename(rc, &uri, &path, &rc->unauthenticated))
+    return 0;
+
+  if (!rrdp_check_file_hash(&path, hash)) {
+    logmsg(rc, log_data_err, "RRDP delta %s withdraws %s, but we don't have that object", url, uri.s);
+    return 0;
+  }
+
+  logmsg(rc, log_debug, "RRDP withdrew %s", uri.s);
+  return unlink(path.s) == 0;
+}
+
+/**
+ * Empty our copy of an rsync module before loading a snapshot, so
+ * that nothing the snapshot doesn't list survives it.
+ */
+static int rrdp_clear_module(const rcynic_ctx_t *rc, const uri_t *module)
+{
+  path_t path;
+  int fd;
+
+  if (!uri_to_filename(rc, module, &path, &rc->unauthenticated))
+    return 0;
+
+  if ((fd = open(path.s, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+    return errno == ENOENT;
+
+  if (!rm_rf_at(fd)) {
+    logmsg(rc, log_sys_err, "Couldn't clear %s for RRDP snapshot: %s", path.s, strerror(errno));
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Stream-process an RRDP snapshot or delta file, applying each
+ * publish or withdraw element to the unauthenticated tree.  We make
+ * two passes over the file: the first checks that it's well-formed
+ * and that every element is within the module, so that a file we
+ * reject changes nothing, and the second installs.  A snapshot
+ * replaces the whole module.
+ */
+static int rrdp_apply(const rcynic_ctx_t *rc,
+		      FILE *f,
+		      const char *url,
+		      const char *root,
+		      const char *session,
+		      const long serial,
+		      const uri_t *module)
+{
+  rrdp_xml_t x;
+  rrdp_xml_token_t t;
+  char uri[URI_MAX], hash[2 * SHA256_DIGEST_LENGTH + 1];
+  const size_t module_len = strlen(module->s);
+  const char *s;
+  int install, ok = 0;
+
+  assert(rc && f && url && root && session && module);
+
+  memset(&x, 0, sizeof(x));
+  x.f = f;
+
+  for (install = 0; install < 2; install++) {
+
+    rewind(f);
+    x.n_attrs = x.empty = x.keep_text = 0;
+
+    if (rrdp_xml_next(&x) != rrdp_xml_start ||
+	!rrdp_check_root(rc, &x, root, session, serial, url))
+      goto done;
+
+    if (install && !strcmp(root, "snapshot") && !rrdp_clear_module(rc, module))
+      goto done;
+
+    while ((t = rrdp_xml_next(&x)) == rrdp_xml_start) {
+
+      if ((s = rrdp_xml_attr(&x, "uri")) == NULL || strlen(s) >= sizeof(uri))
+	goto malformed;
+      strcpy(uri, s);
+
+      if (!install && strncmp(uri, module->s, module_len)) {
+	logmsg(rc, log_data_err, "RRDP %s %s contains %s, outside %s, rejecting it",
+	       root, url, uri, module->s);
+	goto done;
+      }
+
+      if ((s = rrdp_xml_attr(&x, "hash")) != NULL && strlen(s) >= sizeof(hash))
+	goto malformed;
+      if (s != NULL)
+	strcpy(hash, s);
+
+      if (!strcmp(x.name, "publish") && !x.empty) {
+	x.keep_text = install;
+	t = rrdp_xml_next(&x);
+	x.keep_text = 0;
+	if (t != rrdp_xml_end || strcmp(x.name, "publish"))
+	  goto malformed;
+	if (install && !rrdp_publish(rc, uri, s ? hash : NULL, x.text, url, module,
+				     !strcmp(root, "delta")))
+	  goto done;
+      }
+
+      else if (!strcmp(x.name, "withdraw") && !strcmp(root, "delta")) {
+	if (!x.empty && rrdp_xml_next(&x) != rrdp_xml_end)
+	  goto malformed;
+	if (install && !rrdp_withdraw(rc, uri, s ? hash : NULL, url, module))
+	  goto done;
+      }
+
+      else
+	goto malformed;
+    }
+
+    if (t != rrdp_xml_end || strcmp(x.name, root))
+      goto malformed;
+  }
+
+  ok = 1;
+  goto done;
+
+ malformed:
+  logmsg(rc, log_data_err, "Malformed RRDP %s %s", root, url);
+
+ done:
+  free(x.text);
+  return ok;
+}
+
+/**
+ * Construct name of the file in which we keep RRDP session state for
+ * a particular notification URI.
+ */
+static int rrdp_state_filename(const rcynic_ctx_t *rc,
+			       const uri_t *notify,
+			       path_t *path)
+{
+  char name[sizeof("0123456789abcdef.state")];
+
+  (void) snprintf(name, sizeof(name), "%016llx.state",
+		  (unsigned long long) hash_string(notify->s));
+
+  if (strlen(rc->rrdp_directory.s) + strlen(name) >= sizeof(path->s))
+    return 0;
+
+  strcpy(path->s, rc->rrdp_directory.s);
+  strcat(path->s, name);
+  return 1;
+}
+
+/**
+ * Read saved RRDP session state.  State files are one line: the
+ * notification URI, the session_id, the serial number, and the rsync
+ * module the state describes.  State for a different module is no
+ * use to us, since our copy of the module isn't at that serial.
+ */
+static int rrdp_read_state(const rcynic_ctx_t *rc,
+			   const uri_t *notify,
+			   const uri_t *module,
+			   char *session,
+			   long *serial)
+{
+  char line[2 * URI_MAX + RRDP_SESSION_MAX + 32], *s1, *s2, *s3;
+  path_t path;
+  FILE *f;
+  int ok = 0;
+
+  if (!rrdp_state_filename(rc, notify, &path) || (f = fopen(path.s, "r")) == NULL)
+    return 0;
+
+  if (fgets(line, sizeof(line), f) != NULL &&
+      (s1 = strchr(line, ' ')) != NULL &&
+      (s2 = strchr(s1 + 1, ' ')) != NULL &&
+      (s3 = strchr(s2 + 1, ' ')) != NULL) {
+    *s1++ = '\0';
+    *s2++ = '\0';
+    *s3++ = '\0';
+    s3[strcspn(s3, "\r\n")] = '\0';
+    ok = (!strcmp(line, notify->s) && !strcmp(s3, module->s) &&
+	  strlen(s1) < RRDP_SESSION_MAX && rrdp_serial(s2, serial));
+    if (ok)
+      strcpy(session, s1);
+  }
+
+  (void) fclose(f);
+  return ok;
+}
+
+/**
+ * Save RRDP session state.
+ */
+static int rrdp_write_state(const rcynic_ctx_t *rc,
+			    const uri_t *notify,
+			    const uri_t *module,
+			    const char *session,
+			    const long serial)
+{
+  path_t path, temp;
+  FILE *f = NULL;
+
+  if (!rrdp_state_filename(rc, notify, &path) ||
+      strlen(path.s) + sizeof(".tmp") > sizeof(temp.s))
+    return 0;
+
+  strcpy(temp.s, path.s);
+  strcat(temp.s, ".tmp");
+
+  if (!mkdir_maybe(rc, &temp) ||
+      (f = fopen(temp.s, "w")) == NULL ||
+      fprintf(f, "%s %s %ld %s\n", notify->s, session, serial, module->s) < 0 ||
+      fclose(f) == EOF ||
+      rename(temp.s, path.s) < 0) {
+    logmsg(rc, log_sys_err, "Couldn't write RRDP state %s: %s", path.s, strerror(errno));
+    if (f != NULL)
+      (void) unlink(temp.s);
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Discard saved RRDP session state, because our copy of the module no
+ * longer matches it.
+ */
+static void rrdp_forget_state(const rcynic_ctx_t *rc, const uri_t *notify)
+{
+  path_t path;
+
+  if (rrdp_state_filename(rc, notify, &path) && unlink(path.s) == 0)
+    logmsg(rc, log_debug, "Discarded RRDP state for %s", notify->s);
+}
+
+/**
+ * Log a message from the HTTP client at the matching rcynic log level.
+ */
+static void rrdp_http_log(const void *cookie,
+			  const http_log_level_t level,
+			  const char *fmt,
+			  va_list ap)
+{
+  static const log_level_t levels[] = {
+    log_sys_err, log_data_err, log_verbose, log_telemetry
+  };
+
+  assert(level >= 0 && level < sizeof(levels)/sizeof(*levels));
+  vlogmsg(cookie, levels[level], fmt, ap);
+}
+
+/**
+ * Fetch an RRDP file into an anonymous temporary file and check its
+ * hash.  Returns the temporary file, rewound, or NULL on failure.
+ */
+static FILE *rrdp_download(const rcynic_ctx_t *rc,
+			   const char *url,
+			   const unsigned char *hash,
+			   const time_t deadline)
+{
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  http_client_t client;
+  path_t temp;
+  FILE *f = NULL;
+  int fd;
+
+  if (strlen(rc->rrdp_directory.s) + sizeof("download.XXXXXX") > sizeof(temp.s))
+    return NULL;
+
+  strcpy(temp.s, rc->rrdp_directory.s);
+  strcat(temp.s, "download.XXXXXX");
+
+  if (!mkdir_maybe(rc, &temp) || (fd = mkstemp(temp.s)) < 0) {
+    logmsg(rc, log_sys_err, "Couldn't create temporary file %s: %s", temp.s, strerror(errno));
+    return NULL;
+  }
+
+  (void) unlink(temp.s);
+
+  if ((f = fdopen(fd, "w+b")) == NULL) {
+    (void) close(fd);
+    return NULL;
+  }
+
+  memset(&client, 0, sizeof(client));
+  client.ssl_ctx = rc->ssl_ctx;
+  client.timeout = rc->rrdp_timeout;
+  client.max_size = rc->rrdp_max_size;
+  client.log = rrdp_http_log;
+  client.cookie = rc;
+
+  if (!http_get(&client, url, f, digest, deadline))
+    goto lose;
+
+  if (hash != NULL && memcmp(digest, hash, sizeof(digest))) {
+    logmsg(rc, log_data_err, "Hash mismatch for %s", url);
+    goto lose;
+  }
+
+  rewind(f);
+  return f;
+
+ lose:
+  (void) fclose(f);
+  return NULL;
+}
+
+/**
+ * Bring our copy of an RRDP repository up to date, applying deltas if
+ * we can and loading the snapshot if we can't.  The whole update has
+ * to finish within rrdp-max-time.
+ */
+static int rrdp_update(rcynic_ctx_t *rc, const uri_t *notify, const uri_t *module)
+{
+  const time_t deadline = rc->rrdp_max_time > 0 ? time(0) + rc->rrdp_max_time : 0;
+  char session[RRDP_SESSION_MAX];
+  rrdp_notification_t n;
+  long serial = 0;
+  FILE *f = NULL;
+  int i, ok = 0;
+
+  memset(&n, 0, sizeof(n));
+
+  if ((f = rrdp_download(rc, notify->s, NULL, deadline)) == NULL ||
+      !rrdp_parse_notification(rc, f, notify->s, &n))
+    goto done;
+
+  (void) fclose(f);
+  f = NULL;
+
+  if (!rrdp_read_state(rc, notify, module, session, &serial) || strcmp(session, n.session))
+    serial = 0;
+
+  if (serial == n.serial) {
+    logmsg(rc, log_verbose, "RRDP repository %s is up to date at serial %ld", notify->s, serial);
+    ok = 1;
+    goto done;
+  }
+
+  /*
+   * Deltas are only useful if we have the whole chain from our
+   * current serial to the notification's serial.
+   */
+  if (serial > 0 && serial < n.serial && n.serial - serial <= n.n_deltas) {
+    long next;
+
+    for (next = serial + 1; next <= n.serial; next++) {
+      for (i = 0; i < n.n_deltas && n.deltas[i].serial != next; i++)
+	;
+      if (i == n.n_deltas ||
+	  (f = rrdp_download(rc, n.deltas[i].uri, n.deltas[i].hash, deadline)) == NULL ||
+	  !rrdp_apply(rc, f, n.deltas[i].uri, "delta", n.session, next, module))
+	break;
+      (void) fclose(f);
+      f = NULL;
+      serial = next;
+      if (!rrdp_write_state(rc, notify, module, n.session, serial))
+	break;
+    }
+
+    if (f != NULL) {
+      (void) fclose(f);
+      f = NULL;
+    }
+
+    if (serial == n.serial) {
+      log_validation_status(rc, notify, rrdp_deltas_applied, object_generation_null);
+      ok = 1;
+      goto done;
+    }
+
+    logmsg(rc, log_telemetry, "Couldn't apply RRDP deltas for %s, falling back to snapshot", notify->s);
+  }
+
+  if ((f = rrdp_download(rc, n.snapshot_uri, n.snapshot_hash, deadline)) == NULL ||
+      !rrdp_apply(rc, f, n.snapshot_uri, "snapshot", n.session, n.serial, module) ||
+      !rrdp_write_state(rc, notify, module, n.session, n.serial))
+    goto done;
+
+  log_validation_status(rc, notify, rrdp_snapshot_loaded, object_generation_null);
+  ok = 1;
+
+ done:
+  if (f != NULL)
+    (void) fclose(f);
+  free(n.deltas);
+  return ok;
+}
+
+/**
+ * Find the RRDP history entry for a notification URI.  Caller must
+ * hold the lock if there are validation threads.
+ */
+static rrdp_history_t *rrdp_history_find(const rcynic_ctx_t *rc, const char *notify)
+{
+  rrdp_history_t *h;
+  size_t cursor = 0;
+
+  while ((h = hash_table_next(&rc->rrdp_history, hash_string(notify), &cursor)) != NULL &&
+	 strcmp(h->uri.s, notify))
+    ;
+
+  return h;
+}
+
+/**
+ * Bring a CA's publication point up to date via RRDP, in the
+ * background.  Returns false if RRDP isn't an option for this CA, in
+ * which case the caller should rsync it instead.  Otherwise, calls
+ * the handler with rsync_status_pending once the fetch is queued and
+ * again with rsync_status_done or rsync_status_failed when it's
+ * finished, or just with rsync_status_done if we already brought this
+ * repository up to date.  Each notification URI is only fetched once
+ * per run; CAs that share one all wait for the same fetch.  sia is
+ * the CA's SIA, whose module the repository has to stay within.
+ */
+static int rrdp_tree(rcynic_ctx_t *rc,
+		     const uri_t *notify,
+		     const uri_t *sia,
+		     void *cookie,
+		     void (*handler)(rcynic_ctx_t *, const rsync_status_t, void *))
+{
+  rrdp_waiter_t *waiter;
+  rrdp_history_t *h;
+  uri_t module;
+  int ok = 0;
+  size_t n;
+
+  assert(rc && notify && sia && handler);
+
+  if (rc->rrdp_workers == NULL || !is_http(notify->s) ||
+      !is_rsync(sia->s) || (n = rsync_module_len(sia->s)) == 0)
+    return 0;
+
+  memcpy(module.s, sia->s, n + 1);
+  module.s[n + 1] = '\0';
+
+  rcynic_lock(rc);
+
+  if ((h = rrdp_history_find(rc, notify->s)) == NULL) {
+    if ((h = malloc(sizeof(*h))) == NULL) {
+      logmsg(rc, log_sys_err, "Couldn't allocate RRDP history for %s", notify->s);
+      goto done;
+    }
+    memset(h, 0, sizeof(*h));
+    h->uri = *notify;
+    h->module = module;
+    if (!hash_table_insert(&rc->rrdp_history, hash_string(notify->s), h)) {
+      logmsg(rc, log_sys_err, "Couldn't index RRDP history for %s", notify->s);
+      free(h);
+      goto done;
+    }
+    if (rc->rrdp_queue_tail != NULL)
+      rc->rrdp_queue_tail->next = h;
+    else
+      rc->rrdp_queue_head = h;
+    rc->rrdp_queue_tail = h;
+    rc->rrdp_jobs++;
+    (void) pthread_cond_signal(&rc->rrdp_cond);
+  }
+
+  if (strcmp(h->module.s, module.s)) {
+    logmsg(rc, log_data_err, "RRDP repository %s serves %s, not using it for %s",
+	   notify->s, h->module.s, sia->s);
+    goto done;
+  }
+
+  if (h->done) {
+    if ((ok = h->ok) != 0)
+      handler(rc, rsync_status_done, cookie);
+    goto done;
+  }
+
+  if ((waiter = malloc(sizeof(*waiter))) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate RRDP waiter for %s", notify->s);
+    goto done;
+  }
+
+  waiter->handler = handler;
+  waiter->cookie = cookie;
+  waiter->next = h->waiters;
+  h->waiters = waiter;
+  handler(rc, rsync_status_pending, cookie);
+  ok = 1;
+
+ done:
+  rcynic_unlock(rc);
+  return ok;
+}
+
+/**
+ * RRDP fetch thread: take repositories off the queue, bring each one
+ * up to date, and tell whoever's waiting how it went.  Network I/O
+ * happens here, never in a validation thread, and never while holding
+ * any lock.  We block SIGPIPE so that a server hanging up on us shows
+ * up as a write error rather than killing the program.
+ */
+static void *rrdp_worker(void *cookie)
+{
+  rcynic_ctx_t *rc = cookie;
+  rrdp_waiter_t *waiter;
+  rrdp_history_t *h;
+  sigset_t sigs;
+  int ok;
+
+  assert(rc);
+
+  (void) sigemptyset(&sigs);
+  (void) sigaddset(&sigs, SIGPIPE);
+  (void) pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  rcynic_lock(rc);
+
+  for (;;) {
+    while ((h = rc->rrdp_queue_head) == NULL && !rc->rrdp_shutdown)
+      (void) pthread_cond_wait(&rc->rrdp_cond, &rc->lock);
+    if (h == NULL)
+      break;
+    if ((rc->rrdp_queue_head = h->next) == NULL)
+      rc->rrdp_queue_tail = NULL;
+    rcynic_unlock(rc);
+
+    if ((ok = rrdp_update(rc, &h->uri, &h->module)) == 0) {
+      log_validation_status(rc, &h->uri, rrdp_transfer_failed, object_generation_null);
+      rrdp_forget_state(rc, &h->uri);
+    }
+
+    rcynic_lock(rc);
+    h->ok = ok;
+    h->done = 1;
+    while ((waiter = h->waiters) != NULL) {
+      h->waiters = waiter->next;
+      waiter->handler(rc, ok ? rsync_status_done : rsync_status_failed, waiter->cookie);
+      free(waiter);
+    }
+    rc->rrdp_jobs--;
+    rcynic_wakeup(rc);
+  }
+
+  rcynic_unlock(rc);
+  ERR_remove_thread_state(NULL);
+  return NULL;
+}
+
+/**
+ * Shut down RRDP fetch threads, if any.  Safe to call more than once.
+ */
+static void rrdp_workers_stop(rcynic_ctx_t *rc)
+{
+  int i;
+
+  assert(rc);
+
+  if (rc->rrdp_workers == NULL)
+    return;
+
+  rcynic_lock(rc);
+  rc->rrdp_shutdown = 1;
+  (void) pthread_cond_broadcast(&rc->rrdp_cond);
+  rcynic_unlock(rc);
+
+  for (i = 0; i < rc->rrdp_threads; i++)
+    (void) pthread_join(rc->rrdp_workers[i], NULL);
+
+  free(rc->rrdp_workers);
+  rc->rrdp_workers = NULL;
+}
+
+/**
+ * Start RRDP fetch threads, as many as max-parallel-fetches, if we're
+ * using RRDP at all.  task_workers_start() has to run first, to set
+ * up the locks.
+ */
+static int rrdp_workers_start(rcynic_ctx_t *rc)
+{
+  const int n = rc->max_parallel_fetches > 0 ? rc->max_parallel_fetches : 1;
+
+  assert(rc && rc->rrdp_workers == NULL);
+
+  if (!rc->use_rrdp || !rc->run_rsync)
+    return 1;
+
+  assert(rc->threaded);
+
+  if ((rc->ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL ||
+      !SSL_CTX_set_default_verify_paths(rc->ssl_ctx)) {
+    logmsg(rc, log_sys_err, "Couldn't set up TLS context for RRDP");
+    return 0;
+  }
+
+  SSL_CTX_set_options(rc->ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION);
+  SSL_CTX_set_verify(rc->ssl_ctx, SSL_VERIFY_PEER, NULL);
+
+  if ((rc->rrdp_workers = calloc(n, sizeof(*rc->rrdp_workers))) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate RRDP fetch threads");
+    return 0;
+  }
+
+  for (rc->rrdp_threads = 0; rc->rrdp_threads < n; rc->rrdp_threads++) {
+    if ((errno = pthread_create(&rc->rrdp_workers[rc->rrdp_threads], NULL, rrdp_worker, rc)) != 0) {
+      logmsg(rc, log_sys_err, "Couldn't create RRDP fetch thread: %s", strerror(errno));
+      rrdp_workers_stop(rc);
+      return 0;
+    }
+  }
+
+  logmsg(rc, log_verbose, "Started %d RRDP fetch threads", rc->rrdp_threads);
+  return 1;
+}
+
+/**
+ * Free RRDP history at end of run.
+ */
+static void rrdp_history_clear(rcynic_ctx_t *rc)
+{
+  size_t i;
+
+  assert(rc);
+
+  for (i = 0; i < rc->rrdp_history.size; i++) {
+    rrdp_history_t *h = rc->rrdp_history.entries[i].value;
+    rrdp_waiter_t *waiter;
+    if (h == NULL)
+      continue;
+    while ((waiter = h->waiters) != NULL) {
+      h->waiters = waiter->next;
+      free(waiter);
+    }
+    free(h);
+  }
+
+  hash_table_clear(&rc->rrdp_history);
+}
+
+/**
+ * Check whether a directory in the unauthenticated tree is an rsync
+ * module we brought up to date via RRDP this run.  "dir" is the rsync
+ * URI of the directory containing it, with trailing slash.  Deltas
+ * only work if our copy of the module matches the saved state, so
+ * pruning has to leave these alone; withdraw elements take care of
+ * removing objects.
+ */
+static int rrdp_module_current(const rcynic_ctx_t *rc, const uri_t *dir, const char *name)
+{
+  const char *s = strchr(dir->s + SIZEOF_RSYNC, '/');
+  const size_t n = strlen(dir->s), len = strlen(name);
+  size_t i;
+
+  if (s == NULL || s[1] != '\0')
+    return 0;
+
+  for (i = 0; i < rc->rrdp_history.size; i++) {
+    const rrdp_history_t *h = rc->rrdp_history.entries[i].value;
+    if (h != NULL && h->ok &&
+	!strncmp(h->module.s, dir->s, n) &&
+	!strncmp(h->module.s + n, name, len) &&
+	!strcmp(h->module.s + n + len, "/"))
+      return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Discard saved RRDP state for every repository we didn't bring up to
+ * date this run.  Its module may have been pruned or rsynced since the
+ * state was written, so the next run has to start from a snapshot.
+ */
+static void rrdp_state_cleanup(const rcynic_ctx_t *rc)
+{
+  char line[URI_MAX + 1];
+  const rrdp_history_t *h;
+  struct dirent *d;
+  DIR *dir;
+  FILE *f;
+  int fd, keep;
+
+  assert(rc);
+
+  if ((dir = opendir(rc->rrdp_directory.s)) == NULL)
+    return;
+
+  while ((d = readdir(dir)) != NULL) {
+    if (!endswith(d->d_name, ".state"))
+      continue;
+    keep = 0;
+    if ((fd = openat(dirfd(dir), d->d_name, O_RDONLY | O_CLOEXEC)) >= 0 &&
+	(f = fdopen(fd, "r")) != NULL) {
+      if (fgets(line, sizeof(line), f) != NULL) {
+	line[strcspn(line, " \r\n")] = '\0';
+	keep = (h = rrdp_history_find(rc, line)) != NULL && h->ok;
+      }
+      (void) fclose(f);
+    } else if (fd >= 0) {
+      (void) close(fd);
+    }
+    if (!keep && unlinkat(dirfd(dir), d->d_name, 0) == 0)
+      logmsg(rc, log_debug, "Discarded RRDP state %s%s", rc->rrdp_directory.s, d->d_name);
+  }
+
+  closedir(dir);
+}
+
+
+
+static int prune_directory(const rcynic_ctx_t *rc, const int dfd, uri_t *uri);
+
+/**
+ * Prune one entry of a directory in the unauthenticated tree.  "uri"
+ * holds the rsync URI of the directory containing the entry, with
+ * trailing slash, and is used as scratch space while we recurse;
+ * "prefix" and "prefix_hash" are that URI's interned prefix (if any)
+ * and hash, for validation status lookups.
+ */
+static int prune_entry(const rcynic_ctx_t *rc,
+		       const int dfd,
+		       uri_t *uri,
+		       const char *prefix,
+		       const uint64_t prefix_hash,
+		       const char *name,
+		       const int isdir)
+{
+  const size_t len = strlen(uri->s);
+  const char *dir = uri->s + SIZEOF_RSYNC;
+  int fd, ok;
+
+  if (validation_status_find_name(rc, prefix, prefix_hash, name, object_generation_current)) {
+    logmsg(rc, log_debug, "prune: cache hit %s%s%s", rc->unauthenticated.s, dir, name);
+    return 1;
+  }
+
+  if (isdir && rrdp_module_current(rc, uri, name)) {
+    logmsg(rc, log_debug, "prune: %s%s%s is maintained by RRDP", rc->unauthenticated.s, dir, name);
+    return 1;
+  }
+
+  if (!isdir) {
+    if (unlinkat(dfd, name, 0) == 0) {
+      logmsg(rc, log_debug, "prune: removed %s%s%s", rc->unauthenticated.s, dir, name);
+      return 1;
+    }
+    logmsg(rc, log_sys_err, "prune: removing %s%s%s failed: %s",
+	   rc->unauthenticated.s, dir, name, strerror(errno));
+    return 0;
+  }
+
+  if (len + strlen(name) + 1 >= sizeof(uri->s)) {
+    logmsg(rc, log_debug, "prune: %s%s%s too long", rc->unauthenticated.s, dir, name);
+    return 0;
+  }
+
+  if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+    logmsg(rc, log_sys_err, "prune: couldn't open %s%s%s: %s",
+	   rc->unauthenticated.s, dir, name, strerror(errno));
+    return 0;
+  }
+
+  strcat(uri->s, name);
+  strcat(uri->s, "/");
+  ok = prune_directory(rc, fd, uri);
+  uri->s[len] = '\0';
+
+  if (!ok)
+    return 0;
+
+  if (unlinkat(dfd, name, AT_REMOVEDIR) == 0)
+    logmsg(rc, log_debug, "prune: removed %s%s%s", rc->unauthenticated.s, dir, name);
+  else if (errno != ENOTEMPTY && errno != EEXIST)
+    logmsg(rc, log_sys_err, "prune: couldn't remove %s%s%s: %s",
+	   rc->unauthenticated.s, dir, name, strerror(errno));
+
+  return 1;
+}
+
+/**
+ * Prune a directory in the unauthenticated tree.  Consumes "dfd", an
+ * open descriptor for the directory; "uri" is as for prune_entry().
+ * Everything is done relative to the directory descriptor, and each
+ * directory's prefix lookup and hash are done once for all its
+ * entries rather than rebuilding a full URI per entry.
+ */
+static int prune_directory(const rcynic_ctx_t *rc, const int dfd, uri_t *uri)
+{
+  const char *prefix, *name;
+  uint64_t prefix_hash;
+  struct dirent *d;
+  DIR *dir;
+  int ok = 1;
+
+  if ((dir = fdopendir(dfd)) == NULL) {
+    logmsg(rc, log_sys_err, "prune: fdopendir() failed on %s%s: %s",
+	   rc->unauthenticated.s, uri->s + SIZEOF_RSYNC, strerror(errno));
+    (void) close(dfd);
+    return 0;
+  }
+
+  prefix = uri_prefix_find(rc, uri, &name);
+  prefix_hash = hash_string(uri->s);
+
+  while (ok && (d = readdir(dir)) != NULL)
+    if (strcmp(d->d_name, ".") && strcmp(d->d_name, ".."))
+      ok = prune_entry(rc, dfd, uri, prefix, prefix_hash, d->d_name,
+		       dirent_is_directory(dfd, d));
+
+  closedir(dir);
+  return ok;
+}
+
+/**
+ * Pruning thread: take top-level entries of the unauthenticated tree
+ * off the shared list and prune each one until the list is empty.
+ */
+static void *prune_worker(void *cookie)
+{
+  prune_ctx_t *p = cookie;
+  const char *name, *prefix;
+  struct stat st;
+  uri_t uri;
+  int ok;
+
+  strcpy(uri.s, SCHEME_RSYNC);
+  prefix = uri_prefix_find(p->rc, &uri, &name);
+
+  for (;;) {
+    (void) pthread_mutex_lock(&p->lock);
+    if (p->ok && p->next < sk_OPENSSL_STRING_num(p->names))
+      name = sk_OPENSSL_STRING_value(p->names, p->next++);
+    else
+      name = NULL;
+    (void) pthread_mutex_unlock(&p->lock);
+
+    if (name == NULL)
+      break;
+
+    ok = prune_entry(p->rc, p->dfd, &uri, prefix, hash_string(uri.s), name,
+		     fstatat(p->dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+
+    if (!ok) {
+      (void) pthread_mutex_lock(&p->lock);
+      p->ok = 0;
+      (void) pthread_mutex_unlock(&p->lock);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Clean up old stuff from previous rsync runs.  --delete doesn't help
+ * if the URI changes and we never visit the old URI again.
+ *
+ * This runs after validation is finished, so the validation status
+ * index is read-only and we can prune each host's subtree in its own
+ * thread, using as many threads as we used for validation.
+ */
+static int prune_unauthenticated(const rcynic_ctx_t *rc)
+{
+  pthread_t *threads = NULL;
+  struct dirent *d;
+  DIR *dir = NULL;
+  prune_ctx_t p;
+  int i, n;
+
+  assert(rc);
+
+  memset(&p, 0, sizeof(p));
+  p.rc = rc;
+  p.ok = 1;
+
+  if (!is_directory(&rc->unauthenticated)) {
+    logmsg(rc, log_usage_err, "prune: %s is not a directory", rc->unauthenticated.s);
+    return 0;
+  }
+
+  if ((dir = opendir(rc->unauthenticated.s)) == NULL) {
+    logmsg(rc, log_sys_err, "prune: opendir() failed on %s: %s", rc->unauthenticated.s, strerror(errno));
+    return 0;
+  }
+
+  if ((p.names = sk_OPENSSL_STRING_new_null()) == NULL ||
+      pthread_mutex_init(&p.lock, NULL) != 0) {
+    logmsg(rc, log_sys_err, "prune: couldn't set up pruning state");
+    sk_OPENSSL_STRING_free(p.names);
+    closedir(dir);
+    return 0;
+  }
+
+  p.dfd = dirfd(dir);
+
+  while (p.ok && (d = readdir(dir)) != NULL)
+    if (strcmp(d->d_name, ".") && strcmp(d->d_name, "..") &&
+	!sk_OPENSSL_STRING_push_strdup(p.names, d->d_name)) {
+      logmsg(rc, log_sys_err, "sk_OPENSSL_STRING_push_strdup() failed, probably memory exhaustion");
+      p.ok = 0;
+    }
+
+  n = rc->validation_threads;
+  if (n > sk_OPENSSL_STRING_num(p.names))
+    n = sk_OPENSSL_STRING_num(p.names);
+  if (n > 1 && (threads = calloc(n, sizeof(*threads))) == NULL)
+    n = 1;
+
+  /*
+   * If we can't start as many threads as we wanted, we just run with
+   * the ones we got, and if we got none, the main thread does it all.
+   */
+  for (i = 0; threads != NULL && i < n; i++)
+    if (pthread_create(&threads[i], NULL, prune_worker, &p) != 0)
+      break;
+
+  if (i == 0)
+    (void) prune_worker(&p);
+
+  while (--i >= 0)
+    (void) pthread_join(threads[i], NULL);
+
+  if (!p.ok)
+    logmsg(rc, log_sys_err, "prune: pruning %s failed", rc->unauthenticated.s);
+  else if (rmdir(rc->unauthenticated.s) == 0)
+    logmsg(rc, log_debug, "prune: removed %s", rc->unauthenticated.s);
+  else if (errno != ENOTEMPTY && errno != EEXIST)
+    logmsg(rc, log_sys_err, "prune: couldn't remove %s: %s", rc->unauthenticated.s, strerror(errno));
+
+  free(threads);
+  (void) pthread_mutex_destroy(&p.lock);
+  sk_OPENSSL_STRING_pop_free(p.names, OPENSSL_STRING_free);
+  closedir(dir);
+  return p.ok;
+}
+
+
+
+/**
+ * Objects at least this large are mapped rather than read into a
+ * buffer.  RPKI objects are almost all a few kilobytes, so in practice
+ * this only matters for the occasional huge CRL or manifest.
+ */
+#define	READ_OBJECT_MMAP_THRESHOLD	(64 * 1024)
+
+/**
+ * Read a DER object from an open file descriptor.  The whole file is
+ * pulled into memory with a single read (or mapped, if it's large),
+ * hashed in one pass, and decoded directly from the buffer.  Returns
+ * the internal form of the parsed DER object, sets the hash buffer
+ * (if specified) as a side effect.  The default hash algorithm is
+ * SHA-256.  Always consumes the descriptor; a negative descriptor
+ * just fails.
+ */
+static void *read_fd_with_hash(const int fd,
+			       const ASN1_ITEM *it,
+			       const EVP_MD *md,
+			       hashbuf_t *hash)
+{
+  unsigned char *buf = NULL;
+  const unsigned char *p;
+  void *result = NULL;
+  size_t len = 0, off;
+  struct stat st;
+  int mapped = 0;
+  ssize_t n;
+
+  if (fd < 0)
+    return NULL;
+
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+      st.st_size > LONG_MAX)
+    goto done;
+
+  len = st.st_size;
+
+  if (len >= READ_OBJECT_MMAP_THRESHOLD &&
+      (buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+    mapped = 1;
+  } else {
+    if ((buf = malloc(len)) == NULL)
+      goto done;
+    for (off = 0; off < len; off += n)
+      if ((n = read(fd, buf + off, len - off)) <= 0 && (n == 0 || errno != EINTR))
+	goto done;
+      else if (n < 0)
+	n = 0;
+  }
+
+  p = buf;
+  if ((result = ASN1_item_d2i(NULL, &p, len, it)) == NULL)
+    goto done;
+
+  if (hash != NULL) {
+    memset(hash, 0, sizeof(*hash));
+    if (!EVP_Digest(buf, len, hash->h, NULL, md != NULL ? md : EVP_sha256(), NULL)) {
+      ASN1_item_free(result, it);
+      result = NULL;
+    }
+  }
+
+ done:
+  if (mapped)
+    (void) munmap(buf, len);
+  else
+    free(buf);
+  (void) close(fd);
+  return result;
+}
+
+/**
+ * Read a DER object from a file, as read_fd_with_hash().
+ */
+static void *read_file_with_hash(const path_t *filename,
+				 const ASN1_ITEM *it,
+				 const EVP_MD *md,
+				 hashbuf_t *hash)
+{
+  return read_fd_with_hash(open(filename->s, O_RDONLY | O_CLOEXEC), it, md, hash);
+}
+
+/**
+ * Read and hash a certificate.
+ */
+static X509 *read_cert(const path_t *filename, hashbuf_t *hash)
+{
+  return read_file_with_hash(filename, ASN1_ITEM_rptr(X509), NULL, hash);
+}
+
+/**
+ * Read and hash a CRL.
+ */
+static X509_CRL *read_crl(const path_t *filename, hashbuf_t *hash)
+{
+  return read_file_with_hash(filename, ASN1_ITEM_rptr(X509_CRL), NULL, hash);
+}
+
+/**
+ * Read and hash a certificate from an open descriptor.
+ */
+static X509 *read_cert_fd(const int fd, hashbuf_t *hash)
+{
+  return read_fd_with_hash(fd, ASN1_ITEM_rptr(X509), NULL, hash);
+}
+
+/**
+ * Read and hash a CMS message from an open descriptor.
+ */
+static CMS_ContentInfo *read_cms_fd(const int fd, hashbuf_t *hash)
+{
+  return read_fd_with_hash(fd, ASN1_ITEM_rptr(CMS_ContentInfo), NULL, hash);
+}
+
+
+
+/**
+ * Extract CRLDP data from a certificate.  Stops looking after finding
+ * the first rsync URI.
+ */
+static int extract_crldp_uri(rcynic_ctx_t *rc,
+			     const uri_t *uri,
+			     const object_generation_t generation,
+			     const STACK_OF(DIST_POINT) *crldp,
+			     uri_t *result)
+{
+  DIST_POINT *d;
+  int i;
+
+  assert(rc && uri && crldp && result);
+
+  if (sk_DIST_POINT_num(crldp) != 1)
+    goto bad;
+
+  d = sk_DIST_POINT_value(crldp, 0);
+
+  if (d->reasons || d->CRLissuer || !d->distpoint || d->distpoint->type != 0)
+    goto bad;
+
+  for (i = 0; i < sk_GENERAL_NAME_num(d->distpoint->name.fullname); i++) {
+    GENERAL_NAME *n = sk_GENERAL_NAME_value(d->distpoint->name.fullname, i);
+    if (n == NULL || n->type != GEN_URI)
+      goto bad;
+    if (!is_rsync((char *) n->d.uniformResourceIdentifier->data))
+      log_validation_status(rc, uri, non_rsync_uri_in_extension, generation);
+    else if (sizeof(result->s) <= n->d.uniformResourceIdentifier->length)
+      log_validation_status(rc, uri, uri_too_long, generation);
+    else if (result->s[0])
+      log_validation_status(rc, uri, multiple_rsync_uris_in_extension, generation);
+    else
+      strcpy(result->s, (char *) n->d.uniformResourceIdentifier->data);
+  }
+
+  return result->s[0];
+
+ bad:
+  log_validation_status(rc, uri, malformed_crldp_extension, generation);
+  return 0;
+}
+
+/**
+ * Extract SIA or AIA data from a certificate.
+ */
+static int extract_access_uri(rcynic_ctx_t *rc,
+			      const uri_t *uri,
+			      const object_generation_t generation,
+			      const AUTHORITY_INFO_ACCESS *xia,
+			      const int nid,
+			      uri_t *result,
+			      int *count,
+			      int (*relevant)(const char *))
+{
+  int i;
+
+  assert(rc && uri && xia && result && count);
+
+  for (i = 0; i < sk_ACCESS_DESCRIPTION_num(xia); i++) {
+    ACCESS_DESCRIPTION *a = sk_ACCESS_DESCRIPTION_value(xia, i);
+    if (a == NULL || a->location->type != GEN_URI)
+      return 0;
+    if (OBJ_obj2nid(a->method) != nid)
+      continue;
+    ++*count;
+    if (relevant && !relevant((char *) a->location->d.uniformResourceIdentifier->data))
+      continue;
+    if (sizeof(result->s) <= a->location->d.uniformResourceIdentifier->length)
+      log_validation_status(rc, uri, uri_too_long, generation);
+    else if (result->s[0])
+      log_validation_status(rc, uri, multiple_rsync_uris_in_extension, generation);
+    else
+      strcpy(result->s, (char *) a->location->d.uniformResourceIdentifier->data);
+  }
+  return 1;
+}
+
+
+
+/**
+ * Check to see whether an AKI extension is present, is of the right
+ * form, and matches the issuer.
+ */
+static int check_aki(rcynic_ctx_t *rc,
+		     const uri_t *uri,
+		     const X509 *issuer,
+		     const AUTHORITY_KEYID *aki,
+		     const object_generation_t generation)
+{
+  assert(rc && uri && issuer && issuer->skid);
+
+  if (aki == NULL) {
+    log_validation_status(rc, uri, aki_extension_missing, generation);
+    return 0;
+  }
+
+  if (!aki->keyid || aki->serial || aki->issuer) {
+    log_validation_status(rc, uri, aki_extension_wrong_format, generation);
+    return 0;
+  }
+
+  if (ASN1_OCTET_STRING_cmp(aki->keyid, issuer->skid)) {
+    log_validation_status(rc, uri, aki_extension_issuer_mismatch, generation);
+    return 0;
+  }
+
+  return 1;
+}
+
+
+
+/**
+ * Check whether a Distinguished Name conforms to the rescert profile.
+ * The profile is very restrictive: it only allows one mandatory
+ * CommonName field and one optional SerialNumber field, both of which
+ * must be of type PrintableString.
+ */
+static int check_allowed_dn(X509_NAME *dn)
+{
+  X509_NAME_ENTRY *ne;
+  ASN1_STRING *s;
+  int loc;
+
+  if (dn == NULL)
+    return 0;
+
+  switch (X509_NAME_entry_count(dn)) {
+
+  case 2:
+    if ((loc = X509_NAME_get_index_by_NID(dn, NID_serialNumber, -1)) < 0 ||
+	(ne = X509_NAME_get_entry(dn, loc)) == NULL ||
+	(s = X509_NAME_ENTRY_get_data(ne)) == NULL ||
+	ASN1_STRING_type(s) != V_ASN1_PRINTABLESTRING)
+      return 0;
+
+    /* Fall through */
+
+  case 1:
+    if ((loc = X509_NAME_get_index_by_NID(dn, NID_commonName, -1)) < 0 ||
+	(ne = X509_NAME_get_entry(dn, loc)) == NULL ||
+	(s = X509_NAME_ENTRY_get_data(ne)) == NULL ||
+	ASN1_STRING_type(s) != V_ASN1_PRINTABLESTRING)
+      return 0;
+
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Check whether an ASN.1 TIME value conforms to RFC 5280 4.1.2.5.
+ */
+static int check_allowed_time_encoding(ASN1_TIME *t)
+{
+  switch (t->type) {
+
+  case V_ASN1_UTCTIME:
+    return t->length == sizeof("yymmddHHMMSSZ") - 1;
+
+  case  V_ASN1_GENERALIZEDTIME:
+    return (t->length == sizeof("yyyymmddHHMMSSZ") - 1 &&
+	    strcmp("205", (char *) t->data) <= 0);
+
+  }
+  return 0;
+}
+
+/**
+ * Compare ASN1_TIME values.
+ */
+static int asn1_time_cmp(ASN1_TIME *t1, ASN1_TIME *t2)
+{
+  ASN1_GENERALIZEDTIME *g1 = ASN1_TIME_to_generalizedtime(t1, NULL);
+  ASN1_GENERALIZEDTIME *g2 = ASN1_TIME_to_generalizedtime(t2, NULL);
+
+  int cmp = ASN1_STRING_cmp(g1, g2);
+
+  ASN1_GENERALIZEDTIME_free(g1);
+  ASN1_GENERALIZEDTIME_free(g2);
+
+  return cmp;
+}
+
+
+
+/**
+ * Attempt to read and check one CRL from disk.
+ */
+
+static X509_CRL *check_crl_1(rcynic_ctx_t *rc,
+			     const uri_t *uri,
+			     path_t *path,
+			     const path_t *prefix,
+			     X509 *issuer,
+			     EVP_PKEY *issuer_pkey,
+			     hashbuf_t *hash,
+			     const object_generation_t generation)
+{
+  STACK_OF(X509_REVOKED) *revoked;
+  X509_CRL *crl = NULL;
+  int i;
+
+  assert(uri && path && issuer);
+
+  if (!uri_to_filename(rc, uri, path, prefix) ||
+      (crl = read_crl(path, hash)) == NULL)
+    goto punt;
+
+  if (X509_CRL_get_version(crl) != 1) {
+    log_validation_status(rc, uri, wrong_object_version, generation);
+    goto punt;
+  }
+
+  if (!crl->crl || !crl->crl->sig_alg || !crl->crl->sig_alg->algorithm ||
+      OBJ_obj2nid(crl->crl->sig_alg->algorithm) != NID_sha256WithRSAEncryption) {
+    log_validation_status(rc, uri, nonconformant_signature_algorithm, generation);
+    goto punt;
+  }
+
+  if (!check_allowed_time_encoding(X509_CRL_get_lastUpdate(crl)) ||
+      !check_allowed_time_encoding(X509_CRL_get_nextUpdate(crl))) {
+    log_validation_status(rc, uri, nonconformant_asn1_time_value, generation);
+    goto punt;
+  }
+
+  if (X509_cmp_current_time(X509_CRL_get_lastUpdate(crl)) > 0) {
+    log_validation_status(rc, uri, crl_not_yet_valid, generation);
+    goto punt;
+  }
+
+  if (X509_cmp_current_time(X509_CRL_get_nextUpdate(crl)) < 0) {
+    log_validation_status(rc, uri, stale_crl_or_manifest, generation);
+    if (!rc->allow_stale_crl)
+      goto punt;
+  }
+
+  if (!check_aki(rc, uri, issuer, crl->akid, generation))
+    goto punt;
+
+  if (crl->crl_number == NULL) {
+    log_validation_status(rc, uri, crl_number_extension_missing, generation);
+    goto punt;
+  }
+
+  if (ASN1_INTEGER_cmp(crl->crl_number, asn1_zero) < 0) {
+    log_validation_status(rc, uri, crl_number_is_negative, generation);
+    goto punt;
+  }
+
+  if (ASN1_INTEGER_cmp(crl->crl_number, asn1_twenty_octets) > 0) {
+    log_validation_status(rc, uri, crl_number_out_of_range, generation);
+    goto punt;
+  }
+
+  if (X509_CRL_get_ext_count(crl) != 2) {
+    log_validation_status(rc, uri, disallowed_x509v3_extension, generation);
+    goto punt;
+  }
+
+  if (X509_NAME_cmp(X509_CRL_get_issuer(crl), X509_get_subject_name(issuer))) {
+    log_validation_status(rc, uri, crl_issuer_name_mismatch, generation);
+    goto punt;
+  }
+
+  if (!check_allowed_dn(X509_CRL_get_issuer(crl))) {
+    log_validation_status(rc, uri, nonconformant_issuer_name, generation);
+    if (!rc->allow_nonconformant_name)
+      goto punt;
+  }
+
+  if ((revoked = X509_CRL_get_REVOKED(crl)) != NULL) {
+    for (i = sk_X509_REVOKED_num(revoked) - 1; i >= 0; --i) {
+      if (X509_REVOKED_get_ext_count(sk_X509_REVOKED_value(revoked, i)) > 0) {
+	log_validation_status(rc, uri, disallowed_x509v3_extension, generation);
+	goto punt;
+      }
+    }
+  }
+
+  if (issuer_pkey != NULL && X509_CRL_verify(crl, issuer_pkey) > 0)
+    return crl;
+
+ punt:
+  X509_CRL_free(crl);
+  return NULL;
+}
+
+/**
+ * Sorted index of the serial numbers revoked by a CRL, as fixed-width
+ * big-endian values packed end to end, so that a revocation check is
+ * a binary search over one contiguous block of memory rather than a
+ * trip through OpenSSL's generic X509_STORE_CTX CRL machinery.
+ */
+typedef struct crl_index {
+  size_t count;
+  unsigned char *serials;
+} crl_index_t;
+
+/**
+ * In-memory cache of CRLs we've accepted this run, indexed by URI hash
+ * in rc->crl_cache.  Every issuer whose certificates name a CRL needs
+ * it, as do manifest checks, so without this we'd read and decode the
+ * same (possibly very large) CRL over and over again.  The revocation
+ * index is only valid if indexed is set; if we couldn't build one, we
+ * fall back to letting OpenSSL check revocation.
+ */
+typedef struct crl_cache_entry {
+  uri_t uri;
+  X509_CRL *crl;
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  crl_index_t index;
+  int indexed;
+} crl_cache_entry_t;
+
+/**
+ * Convert a serial number to fixed-width form for a CRL index.
+ * Returns false if the serial number doesn't fit.
+ */
+static int crl_serial_encode(const ASN1_INTEGER *serial, unsigned char *buf)
+{
+  if (serial == NULL || serial->type != V_ASN1_INTEGER ||
+      serial->length < 0 || serial->length > CRL_SERIAL_LEN)
+    return 0;
+  memset(buf, 0, CRL_SERIAL_LEN - serial->length);
+  memcpy(buf + CRL_SERIAL_LEN - serial->length, serial->data, serial->length);
+  return 1;
+}
+
+/**
+ * Comparison function for fixed-width serial numbers.
+ */
+static int crl_serial_cmp(const void *a, const void *b)
+{
+  return memcmp(a, b, CRL_SERIAL_LEN);
+}
+
+/**
+ * Build the revocation index for a CRL.
+ */
+static int crl_index_build(crl_index_t *index, X509_CRL *crl)
+{
+  STACK_OF(X509_REVOKED) *revoked = X509_CRL_get_REVOKED(crl);
+  int i, n = sk_X509_REVOKED_num(revoked);
+
+  assert(index && crl);
+
+  index->count = 0;
+  index->serials = NULL;
+
+  if (n <= 0)
+    return 1;
+
+  if ((index->serials = malloc((size_t) n * CRL_SERIAL_LEN)) == NULL)
+    return 0;
+
+  for (i = 0; i < n; i++)
+    if (!crl_serial_encode(sk_X509_REVOKED_value(revoked, i)->serialNumber,
+			   index->serials + (size_t) i * CRL_SERIAL_LEN))
+      goto fail;
+
+  qsort(index->serials, n, CRL_SERIAL_LEN, crl_serial_cmp);
+  index->count = n;
+  return 1;
+
+ fail:
+  free(index->serials);
+  index->serials = NULL;
+  return 0;
+}
+
+/**
+ * Check whether a CRL index lists a fixed-width serial number.
+ */
+static int crl_index_lookup(const crl_index_t *index, const unsigned char *serial)
+{
+  assert(index && serial);
+
+  return (index->count > 0 &&
+	  bsearch(serial, index->serials, index->count, CRL_SERIAL_LEN, crl_serial_cmp) != NULL);
+}
+
+/**
+ * Check whether a CRL index lists a certificate as revoked.
+ */
+static int crl_index_revoked(const crl_index_t *index, X509 *x)
+{
+  unsigned char serial[CRL_SERIAL_LEN];
+
+  assert(index && x);
+
+  return (crl_serial_encode(X509_get_serialNumber(x), serial) &&
+	  crl_index_lookup(index, serial));
+}
+
+/**
+ * Look up an accepted CRL.  Returns a new reference to the CRL and
+ * copies its SHA-256 hash to hash (if not NULL), or returns NULL if
+ * we haven't accepted this CRL yet.
+ */
+static X509_CRL *crl_cache_get(rcynic_ctx_t *rc,
+			       const uri_t *uri,
+			       unsigned char *hash)
+{
+  crl_cache_entry_t *e;
+  X509_CRL *crl = NULL;
+  size_t cursor = 0;
+
+  assert(rc && uri);
+
+  rcynic_lock(rc);
+
+  while ((e = hash_table_next(&rc->crl_cache, hash_string(uri->s), &cursor)) != NULL)
+    if (!strcmp(e->uri.s, uri->s))
+      break;
+
+  if (e != NULL) {
+    crl = e->crl;
+    CRYPTO_add(&crl->references, 1, CRYPTO_LOCK_X509_CRL);
+    if (hash != NULL)
+      memcpy(hash, e->hash, sizeof(e->hash));
+  }
+
+  rcynic_unlock(rc);
+
+  return crl;
+}
+
+/**
+ * Remember an accepted CRL.  The cache takes its own reference.
+ */
+static void crl_cache_add(rcynic_ctx_t *rc,
+			  const uri_t *uri,
+			  X509_CRL *crl,
+			  const unsigned char *hash)
+{
+  crl_cache_entry_t *e, *old;
+  size_t cursor = 0;
+
+  assert(rc && uri && crl && hash);
+
+  if ((e = malloc(sizeof(*e))) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate CRL cache entry for %s", uri->s);
+    return;
+  }
+
+  e->uri = *uri;
+  e->crl = crl;
+  memcpy(e->hash, hash, sizeof(e->hash));
+  e->indexed = crl_index_build(&e->index, crl);
+
+  rcynic_lock(rc);
+
+  while ((old = hash_table_next(&rc->crl_cache, hash_string(uri->s), &cursor)) != NULL)
+    if (!strcmp(old->uri.s, uri->s))
+      break;
+
+  if (old == NULL && hash_table_insert(&rc->crl_cache, hash_string(uri->s), e)) {
+    CRYPTO_add(&crl->references, 1, CRYPTO_LOCK_X509_CRL);
+    e = NULL;
+  } else if (old == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't index CRL cache entry for %s", uri->s);
+  }
+
+  rcynic_unlock(rc);
+
+  if (e != NULL) {
+    free(e->index.serials);
+    free(e);
+  }
+}
+
+/**
+ * Find the revocation index for an accepted CRL, if we have one.
+ * Entries live until the end of the run, so the caller can hang onto
+ * the pointer.
+ */
+static const crl_index_t *crl_cache_index(rcynic_ctx_t *rc, const uri_t *uri)
+{
+  const crl_index_t *index = NULL;
+  crl_cache_entry_t *e;
+  size_t cursor = 0;
+
+  assert(rc && uri);
+
+  rcynic_lock(rc);
+
+  while ((e = hash_table_next(&rc->crl_cache, hash_string(uri->s), &cursor)) != NULL)
+    if (!strcmp(e->uri.s, uri->s))
+      break;
+
+  if (e != NULL && e->indexed)
+    index = &e->index;
+
+  rcynic_unlock(rc);
+
+  return index;
+}
+
+/**
+ * Free the CRL cache at end of run.
+ */
+static void crl_cache_clear(rcynic_ctx_t *rc)
+{
+  size_t i;
+
+  assert(rc);
+
+  for (i = 0; i < rc->crl_cache.size; i++) {
+    crl_cache_entry_t *e = rc->crl_cache.entries[i].value;
+    if (e != NULL) {
+      X509_CRL_free(e->crl);
+      free(e->index.serials);
+      free(e);
+    }
+  }
+
+  hash_table_clear(&rc->crl_cache);
+}
+
+/**
+ * Check whether we already have a particular CRL, attempt to fetch it
+ * and check issuer's signature if we don't.  On success, also returns
+ * the SHA-256 hash of the CRL we picked.
+ *
+ * General plan here is to do basic checks on both current and backup
+ * generation CRLs, then, if both generations pass all of our other
+ * tests, pick the generation with the highest CRL number, to protect
+ * against replay attacks.
+ */
+static X509_CRL *check_crl(rcynic_ctx_t *rc,
+			   const uri_t *uri,
+			   X509 *issuer,
+			   EVP_PKEY *issuer_pkey,
+			   unsigned char *hash)
+{
+  unsigned char before[(MIB_COUNTER_T_MAX + 7) / 8];
+  X509_CRL *old_crl = NULL, *new_crl, *result = NULL;
+  hashbuf_t old_hash, new_hash;
+  path_t old_path, new_path;
+
+  assert(rc && uri && issuer && hash);
+
+  if ((result = crl_cache_get(rc, uri, hash)) != NULL)
+    return result;
+
+  /*
+   * Installed without going through us, eg, carried forward.
+   */
+  if (object_installed(rc, uri) &&
+      uri_to_filename(rc, uri, &new_path, &rc->new_authenticated) &&
+      (new_crl = read_crl(&new_path, &new_hash)) != NULL) {
+    crl_cache_add(rc, uri, new_crl, new_hash.h);
+    memcpy(hash, new_hash.h, SHA256_DIGEST_LENGTH);
+    return new_crl;
+  }
+
+  logmsg(rc, log_telemetry, "Checking CRL %s", uri->s);
+
+  validation_status_events(rc, uri, object_generation_current, before);
+
+  new_crl = check_crl_1(rc, uri, &new_path, &rc->unauthenticated,
+			issuer, issuer_pkey, &new_hash, object_generation_current);
+
+  /*
+   * If the backup copy is the same file, it gets the same answer, and
+   * the current copy wins any comparison, so all the backup needs is
+   * the status codes.
+   */
+  if (same_file_contents(rc, uri))
+    validation_status_copy(rc, uri, before, object_generation_current, object_generation_backup);
+  else
+    old_crl = check_crl_1(rc, uri, &old_path, &rc->old_authenticated,
+			  issuer, issuer_pkey, &old_hash, object_generation_backup);
+
+  (void) uri_to_filename(rc, uri, &old_path, &rc->old_authenticated);
+
+  if (!new_crl)
+    result = old_crl;
+
+  else if (!old_crl)
+    result = new_crl;
+
+  else {
+    ASN1_GENERALIZEDTIME *g_old = ASN1_TIME_to_generalizedtime(X509_CRL_get_lastUpdate(old_crl), NULL);
+    ASN1_GENERALIZEDTIME *g_new = ASN1_TIME_to_generalizedtime(X509_CRL_get_lastUpdate(new_crl), NULL);
+    int num_cmp = ASN1_INTEGER_cmp(old_crl->crl_number, new_crl->crl_number);
+    int date_cmp = (!g_old || !g_new) ? 0 : ASN1_STRING_cmp(g_old, g_new);
+
+    if (!g_old)
+      log_validation_status(rc, uri, bad_thisupdate, object_generation_backup);
+    if (!g_new)
+      log_validation_status(rc, uri, bad_thisupdate, object_generation_current);
+    if (num_cmp > 0)
+      log_validation_status(rc, uri, backup_number_higher_than_current, object_generation_current);
+    if (g_old && g_new && date_cmp > 0)
+      log_validation_status(rc, uri, backup_thisupdate_newer_than_current, object_generation_current);
+
+    if (num_cmp > 0 && (!g_old || !g_new || date_cmp > 0))
+      result = old_crl;
+    else
+      result = new_crl;
+
+    ASN1_GENERALIZEDTIME_free(g_old);
+    ASN1_GENERALIZEDTIME_free(g_new);
+  }
+
+  if (result && result == new_crl)
+    install_object(rc, uri, &new_path, object_generation_current);
+  else if (!access_at(rc, &new_path, F_OK))
+    log_validation_status(rc, uri, object_rejected, object_generation_current);
+
+  if (result && result == old_crl)
+    install_object(rc, uri, &old_path, object_generation_backup);
+  else if (!result && !access_at(rc, &old_path, F_OK))
+    log_validation_status(rc, uri, object_rejected, object_generation_backup);
+
+  if (result != new_crl)
+    X509_CRL_free(new_crl);
+
+  if (result != old_crl)
+    X509_CRL_free(old_crl);
+
+  if (result != NULL) {
+    memcpy(hash, (result == new_crl ? &new_hash : &old_hash)->h, SHA256_DIGEST_LENGTH);
+    crl_cache_add(rc, uri, result, hash);
+  }
+
+  return result;
+}
+
+
+/**
+ * Check digest of a CRL we've already accepted.
+ */
+static int check_crl_digest(rcynic_ctx_t *rc,
+			    const uri_t *uri,
+			    const unsigned char *hash,
+			    const size_t hashlen)
+{
+  X509_CRL *crl = NULL;
+  hashbuf_t hashbuf;
+  path_t path;
+  int result;
+
+  assert(rc && uri && hash);
+
+  memset(&hashbuf, 0, sizeof(hashbuf));
+
+  if ((crl = crl_cache_get(rc, uri, hashbuf.h)) == NULL &&
+      (!object_installed(rc, uri) ||
+       !uri_to_filename(rc, uri, &path, &rc->new_authenticated) ||
+       (crl = read_crl(&path, &hashbuf)) == NULL))
+    return 0;
+
+  result = hashlen <= sizeof(hashbuf.h) && !memcmp(hashbuf.h, hash, hashlen);
+
+  X509_CRL_free(crl);
+
+  return result;
+}
+
+
+
+/**
+ * Validation callback function for use with x509_verify_cert().
+ */
+static int check_x509_cb(int ok, X509_STORE_CTX *ctx)
+{
+  rcynic_x509_store_ctx_t *rctx = (rcynic_x509_store_ctx_t *) ctx;
+  mib_counter_t code;
+
+  assert(rctx != NULL);
+
+  switch (ctx->error) {
+  case X509_V_OK:
+    return ok;
+
+  case X509_V_ERR_SUBJECT_ISSUER_MISMATCH:
+    /*
+     * Informational events, not really errors.  ctx->check_issued()
+     * is called in many places where failure to find an issuer is not
+     * a failure for the calling function.  Just leave these alone.
+     */
+    return ok;
+
+  case X509_V_ERR_CRL_HAS_EXPIRED:
+    /*
+     * This isn't really an error, exactly.  CRLs don't really
+     * "expire".  What OpenSSL really means by this error is just
+     * "it's now later than the issuer said it intended to publish a
+     * new CRL".  Whether we treat this as an error or not is
+     * configurable, see the allow_stale_crl parameter.
+     *
+     * Deciding whether to allow stale CRLs is check_crl_1()'s job,
+     * not ours.  By the time this callback occurs, we've already
+     * accepted the CRL; this callback is just notifying us that the
+     * object being checked is tainted by a stale CRL.  So we mark the
+     * object as tainted and carry on.
+     */
+    log_validation_status(rctx->rc, &rctx->subject->uri, tainted_by_stale_crl, rctx->subject->generation);
+    ok = 1;
+    return ok;
+
+  case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
+    /*
+     * This is another error that's only an error in the strange world
+     * of OpenSSL, but a more serious one.  By default, OpenSSL
+     * expects all trust anchors to be self-signed.  This is not a
+     * PKIX requirement, it's just an OpenSSL thing, but one violates
+     * it at one's peril, because the only way to convince OpenSSL to
+     * allow a non-self-signed trust anchor is to intercept this
+     * "error" in the verify callback handler.
+     *
+     * So this program supports non-self-signed trust anchors, but be
+     * warned that enabling this feature may cause this program's
+     * output not to work with other OpenSSL-based applications.
+     */
+    if (rctx->rc->allow_non_self_signed_trust_anchor)
+      ok = 1;
+    log_validation_status(rctx->rc, &rctx->subject->uri, trust_anchor_not_self_signed, rctx->subject->generation);
+    return ok;
+
+  /*
+   * Select correct MIB counter for every known OpenSSL verify errors
+   * except the ones we handle explicitly above, then fall through to
+   * common handling for all of these.
+   */
+#define QV(x)							\
+  case x:							\
+    code = mib_openssl_##x;					\
+    break;
+    MIB_COUNTERS_FROM_OPENSSL;
+#undef	QV
+
+  default:
+    code = unknown_openssl_verify_error;
+    break;
+  }
+
+  log_validation_status(rctx->rc, &rctx->subject->uri, code, rctx->subject->generation);
+  return ok;
+}
+
+/**
+ * Convert an ASN1_TIME to seconds since the epoch.
+ */
+static int asn1_time_to_seconds(const ASN1_TIME *t, const time_t now, int64_t *result)
+{
+  int days, seconds;
+
+  if (t == NULL || !ASN1_TIME_diff(&days, &seconds, NULL, t))
+    return 0;
+
+  *result = (int64_t) now + (int64_t) days * 86400 + seconds;
+  return 1;
+}
+
+/**
+ * Note that something this walk context's publication point depends
+ * on stops being valid at a particular time.  We keep the earliest
+ * such time, which bounds how long we can carry the publication point
+ * forward without looking at it again.
+ */
+static void walk_ctx_expires(walk_ctx_t *w, const int64_t when)
+{
+  if (w != NULL && (w->expires == 0 || when < w->expires))
+    w->expires = when;
+}
+
+/**
+ * Same as walk_ctx_expires(), for an ASN1_TIME.
+ */
+static void walk_ctx_expires_asn1(walk_ctx_t *w, const ASN1_TIME *t)
+{
+  int64_t when;
+
+  if (asn1_time_to_seconds(t, time(0), &when))
+    walk_ctx_expires(w, when);
+}
+
+/**
+ * Make sure the head frame of a walk context stack has the CRL named
+ * by crldp loaded, checking it if necessary.  Returns the CRL, or NULL
+ * if we couldn't get one.  uri and generation are the object on whose
+ * behalf we're doing this, for logging.
+ */
+static X509_CRL *walk_ctx_crl(rcynic_ctx_t *rc,
+			      STACK_OF(walk_ctx_t) *wsk,
+			      const uri_t *uri,
+			      const uri_t *crldp,
+			      const object_generation_t generation)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+
+  assert(rc && wsk && w && uri && crldp);
+
+  if (w->crls == NULL && ((w->crls = sk_X509_CRL_new_null()) == NULL ||
+			  !sk_X509_CRL_push(w->crls, NULL))) {
+    logmsg(rc, log_sys_err, "Internal allocation error setting up CRL for validation");
+    return NULL;
+  }
+
+  assert(sk_X509_CRL_num(w->crls) == 1);
+  assert((w->crldp.s[0] == '\0') == (sk_X509_CRL_value(w->crls, 0) == NULL));
+
+  if (strcmp(w->crldp.s, crldp->s)) {
+    X509_CRL *old_crl = sk_X509_CRL_value(w->crls, 0);
+    X509_CRL *new_crl = check_crl(rc, crldp, w->cert, walk_ctx_pkey(w), hash);
+
+    if (w->crldp.s[0])
+      log_validation_status(rc, uri, issuer_uses_multiple_crldp_values, generation);
+
+    if (new_crl == NULL) {
+      log_validation_status(rc, uri, bad_crl, generation);
+      return NULL;
+    }
+
+    if (old_crl && new_crl && ASN1_INTEGER_cmp(old_crl->crl_number, new_crl->crl_number) < 0) {
+      log_validation_status(rc, uri, crldp_names_newer_crl, generation);
+      X509_CRL_free(old_crl);
+      old_crl = NULL;
+    }
+
+    if (old_crl == NULL) {
+      sk_X509_CRL_set(w->crls, 0, new_crl);
+      w->crldp = *crldp;
+      walk_ctx_expires_asn1(w, X509_CRL_get_nextUpdate(new_crl));
+      memcpy(w->crl_hash, hash, sizeof(w->crl_hash));
+      w->crl_index = crl_cache_index(rc, crldp);
+    } else {
+      X509_CRL_free(new_crl);
+    }
+  }
+
+  assert(sk_X509_CRL_value(w->crls, 0));
+  return sk_X509_CRL_value(w->crls, 0);
+}
+
+
+
+/**
+ * Compute the configuration fingerprint for the persistent caches.
+ * Any change to a setting which can change a validation verdict, or
+ * to the cache record layouts, invalidates the caches.
+ */
+static uint64_t cache_config(const rcynic_ctx_t *rc)
+{
+  int settings[] = {
+    MIB_COUNTER_T_MAX,
+    sizeof(object_cache_record_t),
+    sizeof(pubpoint_record_t),
+    sizeof(pubpoint_object_t),
+    rc->allow_stale_crl,
+    rc->allow_stale_manifest,
+    rc->allow_non_self_signed_trust_anchor,
+    rc->allow_object_not_in_manifest,
+    rc->allow_digest_mismatch,
+    rc->allow_crl_digest_mismatch,
+    rc->allow_nonconformant_name,
+    rc->allow_ee_without_signedObject,
+    rc->allow_1024_bit_ee_key,
+    rc->allow_wrong_cms_si_attributes,
+    rc->require_crl_in_manifest
+  };
+
+  return hash_bytes(HASH_INIT, settings, sizeof(settings));
+}
+
+/**
+ * Length of a cache record.  All record types start with their length.
+ */
+static size_t record_length(const void *record)
+{
+  return *(const uint32_t *) record;
+}
 
-    switch (WEXITSTATUS(pid_status)) {
+/**
+ * Find the n'th string in a block of packed NUL-terminated strings.
+ */
+static const char *packed_string(const char *s, int n)
+{
+  while (n-- > 0)
+    s += strlen(s) + 1;
+  return s;
+}
 
-    case 0:
-      rsync_status = rsync_status_done;
-      break;
+/**
+ * Check that a block of packed strings is sane: n strings, each
+ * NUL-terminated before end and no longer than a URI.  Returns a
+ * pointer past the last string, or NULL if something's wrong.
+ */
+static const char *packed_strings_ok(const char *s, const char *end, int n)
+{
+  const char *nul;
 
-    case 5:			/* "Error starting client-server protocol" */
-      /*
-       * Handle remote rsyncd refusing to talk to us because we've
-       * exceeded its connection limit.  Back off for a short
-       * interval, then retry.
-       */
-      if (ctx->problem == rsync_problem_refused && ctx->tries < rc->max_retries) {
-	unsigned char r;
-	if (!RAND_bytes(&r, sizeof(r)))
-	  r = 60;
-	ctx->deadline = time(0) + rc->retry_wait_min + r;
-	ctx->state = rsync_state_retry_wait;
-	ctx->problem = rsync_problem_none;
-	ctx->pid = 0;
-	ctx->tries++;
-	logmsg(rc, log_telemetry, "Scheduling retry for %s", ctx->uri.s);
-	continue;
-      }
-      goto failure;
-
-    case 23:			/* "Partial transfer due to error" */
-      /*
-       * This appears to be a catch-all for "something bad happened
-       * trying to do what you asked me to do".  In the cases I've
-       * seen to date, this is things like "the directory you
-       * requested isn't there" or "NFS exploded when I tried to touch
-       * the directory".  These aren't network layer failures, so we
-       * (probably) shouldn't give up on the repository host.
-       */
-      rsync_status = rsync_status_done;
-      log_validation_status(rc, &ctx->uri, rsync_partial_transfer, object_generation_null);
-      break;
+  while (n-- > 0) {
+    if (s >= end || (nul = memchr(s, '\0', end - s)) == NULL || nul - s >= URI_MAX)
+      return NULL;
+    s = nul + 1;
+  }
 
-    default:
-    failure:
-      rsync_status = rsync_status_failed;
-      logmsg(rc, log_data_err, "rsync %u exited with status %d fetching %s",
-	     (unsigned) pid, WEXITSTATUS(pid_status), ctx->uri.s);
-      break;
-    }
+  return s;
+}
 
-    if (rc->rsync_timeout && now >= ctx->deadline)
-      rsync_status = rsync_status_timed_out;
-    log_validation_status(rc, &ctx->uri,
-			  rsync_status_to_mib_counter(rsync_status),
-			  object_generation_null);
-    rsync_history_add(rc, ctx, rsync_status);
-    rsync_call_handler(rc, ctx, rsync_status);
-    (void) sk_rsync_ctx_t_delete_ptr(rc->rsync_queue, ctx);
-    free(ctx);
-    ctx = NULL;
-  }
+/**
+ * Number of certinfo URIs we pack into cache records.
+ */
+#define	CERTINFO_PACKED_URIS	7
 
-  if (pid == -1 && errno != EINTR && errno != ECHILD)
-    logmsg(rc, log_sys_err, "waitpid() returned error: %s", strerror(errno));
+/**
+ * Space needed to pack the URIs from a certinfo_t.
+ */
+static size_t certinfo_packed_length(const certinfo_t *certinfo)
+{
+  return (strlen(certinfo->uri.s)          + 1 +
+	  strlen(certinfo->sia.s)          + 1 +
+	  strlen(certinfo->aia.s)          + 1 +
+	  strlen(certinfo->crldp.s)        + 1 +
+	  strlen(certinfo->manifest.s)     + 1 +
+	  strlen(certinfo->signedobject.s) + 1 +
+	  strlen(certinfo->rrdpnotify.s)   + 1);
+}
 
-  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+/**
+ * Pack the URIs from a certinfo_t.  Returns pointer past the end.
+ */
+static char *certinfo_pack(char *s, const certinfo_t *certinfo)
+{
+  const uri_t *uris[CERTINFO_PACKED_URIS];
+  int i;
 
-  /*
-   * Look for rsync contexts that have become runable.  Odd loop
-   * structure is because rsync_run() might decide to remove the
-   * specified rsync task from the queue instead of running it.
-   */
-  for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; i++) {
-    n = sk_rsync_ctx_t_num(rc->rsync_queue);
-    if (ctx->state != rsync_state_running &&
-	rsync_runable(rc, ctx) &&
-	rsync_count_running(rc) < rc->max_parallel_fetches)
-      rsync_run(rc, ctx);
-    if (n > sk_rsync_ctx_t_num(rc->rsync_queue))
-      i--;
-  }
+  uris[0] = &certinfo->uri;
+  uris[1] = &certinfo->sia;
+  uris[2] = &certinfo->aia;
+  uris[3] = &certinfo->crldp;
+  uris[4] = &certinfo->manifest;
+  uris[5] = &certinfo->signedobject;
+  uris[6] = &certinfo->rrdpnotify;
 
-  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+  for (i = 0; i < CERTINFO_PACKED_URIS; i++) {
+    strcpy(s, uris[i]->s);
+    s += strlen(s) + 1;
+  }
 
-  /*
-   * Check for log text from subprocesses.
-   */
+  return s;
+}
 
-  n = rsync_construct_select(rc, now, &rfds, &tv);
+/**
+ * Unpack URIs packed by certinfo_pack().  Caller must already have
+ * checked the strings with packed_strings_ok().  Doesn't touch any
+ * of the non-URI fields.
+ */
+static void certinfo_unpack(const char *s, certinfo_t *certinfo)
+{
+  uri_t *uris[CERTINFO_PACKED_URIS];
+  int i;
 
-  if (n > 0 && tv.tv_sec)
-    logmsg(rc, log_verbose, "Waiting up to %u seconds for rsync, queued %d, runable %d, running %d, max %d",
-	   (unsigned) tv.tv_sec, sk_rsync_ctx_t_num(rc->rsync_queue), rsync_count_runable(rc),
-	   rsync_count_running(rc), rc->max_parallel_fetches);
+  uris[0] = &certinfo->uri;
+  uris[1] = &certinfo->sia;
+  uris[2] = &certinfo->aia;
+  uris[3] = &certinfo->crldp;
+  uris[4] = &certinfo->manifest;
+  uris[5] = &certinfo->signedobject;
+  uris[6] = &certinfo->rrdpnotify;
 
-  if (n > 0) {
-#if 0
-    logmsg(rc, log_debug, "++ select(%d, %u)", n, tv.tv_sec);
-#endif
-    n = select(n + 1, &rfds, NULL, NULL, &tv);
+  for (i = 0; i < CERTINFO_PACKED_URIS; i++) {
+    strcpy(uris[i]->s, s);
+    s += strlen(s) + 1;
   }
+}
 
-  if (n > 0) {
+/**
+ * SHA-256 of a file's contents.  A missing file hashes to all zeros,
+ * so that "still missing" compares equal.
+ */
+static int file_sha256(const path_t *path, unsigned char *digest)
+{
+  unsigned char buf[8192];
+  EVP_MD_CTX *ctx = NULL;
+  FILE *f;
+  size_t n;
+  int ok = 0;
 
-    for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i) {
-      if (ctx->fd <= 0 || !FD_ISSET(ctx->fd, &rfds))
-	continue;
+  memset(digest, 0, SHA256_DIGEST_LENGTH);
 
-      assert(ctx->buflen < sizeof(ctx->buffer) - 1);
-
-      while ((n = read(ctx->fd, ctx->buffer + ctx->buflen, sizeof(ctx->buffer) - 1 - ctx->buflen)) > 0) {
-	ctx->buflen += n;
-	assert(ctx->buflen < sizeof(ctx->buffer));
-	ctx->buffer[ctx->buflen] = '\0';
-
-	while ((s = strchr(ctx->buffer, '\n')) != NULL) {
-	  *s++ = '\0';
-	  do_one_rsync_log_line(rc, ctx);
-	  assert(s > ctx->buffer && s < ctx->buffer + sizeof(ctx->buffer));
-	  ctx->buflen -= s - ctx->buffer;
-	  assert(ctx->buflen < sizeof(ctx->buffer));
-	  if (ctx->buflen > 0)
-	    memmove(ctx->buffer, s, ctx->buflen);
-	  ctx->buffer[ctx->buflen] = '\0';
-	}
+  if ((f = fopen(path->s, "rb")) == NULL)
+    return errno == ENOENT;
 
-	if (ctx->buflen == sizeof(ctx->buffer) - 1) {
-	  ctx->buffer[sizeof(ctx->buffer) - 1] = '\0';
-	  do_one_rsync_log_line(rc, ctx);
-	  ctx->buflen = 0;
-	}
-      }
+  if ((ctx = EVP_MD_CTX_create()) == NULL ||
+      !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+    goto done;
 
-      if (n == 0) {
-	(void) close(ctx->fd);
-	ctx->fd = -1;
-	ctx->state = rsync_state_closed;
-      }
-    }
-  }
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    if (!EVP_DigestUpdate(ctx, buf, n))
+      goto done;
 
-  assert(rsync_count_running(rc) <= rc->max_parallel_fetches);
+  ok = !ferror(f) && EVP_DigestFinal_ex(ctx, digest, NULL);
 
-  /*
-   * Deal with children that have been running too long.
-   */
-  if (rc->rsync_timeout) {
-    for (i = 0; (ctx = sk_rsync_ctx_t_value(rc->rsync_queue, i)) != NULL; ++i) {
-      int sig;
-      if (ctx->pid <= 0 || now < ctx->deadline)
-	continue;
-      sig = ctx->tries++ < KILL_MAX ? SIGTERM : SIGKILL;
-      if (ctx->state != rsync_state_terminating) {
-	ctx->problem = rsync_problem_timed_out;
-	ctx->state = rsync_state_terminating;
-	ctx->tries = 0;
-	logmsg(rc, log_telemetry, "Subprocess %u is taking too long fetching %s, whacking it", (unsigned) ctx->pid, ctx->uri.s);
-	rsync_history_add(rc, ctx, rsync_status_timed_out);
-      } else if (sig == SIGTERM) {
-	logmsg(rc, log_verbose, "Whacking subprocess %u again", (unsigned) ctx->pid);
-      } else {
-	logmsg(rc, log_verbose, "Whacking subprocess %u with big hammer", (unsigned) ctx->pid);
-      }
-      (void) kill(ctx->pid, sig);
-      ctx->deadline = now + 1;
-    }
-  }
+ done:
+  if (ctx != NULL)
+    EVP_MD_CTX_destroy(ctx);
+  (void) fclose(f);
+  return ok;
 }
 
+
+
 /**
- * Set up rsync context and attempt to start it.
+ * Load a cache file, if we have one.  A missing, damaged, or stale
+ * (different configuration) cache file is not an error, we just start
+ * over with an empty cache.  record_ok() checks one record, given the
+ * space left in the file; key() computes a record's index key.
  */
-static void rsync_init(rcynic_ctx_t *rc,
-		       const uri_t *uri,
-		       void *cookie,
-		       void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *, const rsync_status_t, const uri_t *, void *))
+static int record_cache_load(rcynic_ctx_t *rc,
+			     record_cache_t *cache,
+			     int (*record_ok)(const void *, const size_t),
+			     uint64_t (*key)(const void *))
 {
-  rsync_ctx_t *ctx = NULL;
+  const record_cache_header_t *hdr;
+  const char *p, *end;
+  struct stat st;
+  size_t i;
+  int fd;
 
-  assert(rc && uri && strlen(uri->s) > SIZEOF_RSYNC);
+  assert(rc && cache && cache->magic && record_ok && key);
 
-  if (!rc->run_rsync) {
-    logmsg(rc, log_verbose, "rsync disabled, skipping %s", uri->s);
-    if (handler)
-      handler(rc, NULL, rsync_status_skipped, uri, cookie);
-    return;
+  cache->config = cache_config(rc);
+
+  if (cache->filename.s[0] == '\0')
+    return 1;
+
+  if ((fd = open(cache->filename.s, O_RDONLY)) < 0) {
+    if (errno != ENOENT)
+      logmsg(rc, log_sys_err, "Couldn't open cache %s: %s", cache->filename.s, strerror(errno));
+    return 1;
   }
 
-  if (rsync_history_uri(rc, uri)) {
-    logmsg(rc, log_verbose, "rsync cache hit for %s", uri->s);
-    if (handler)
-      handler(rc, NULL, rsync_status_done, uri, cookie);
-    return;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr) ||
+      (cache->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    logmsg(rc, log_sys_err, "Couldn't map cache %s: %s", cache->filename.s, strerror(errno));
+    cache->map = NULL;
+    (void) close(fd);
+    return 1;
   }
 
-  if ((ctx = malloc(sizeof(*ctx))) == NULL) {
-    logmsg(rc, log_sys_err, "malloc(rsync_ctxt_t) failed");
-    if (handler)
-      handler(rc, NULL, rsync_status_failed, uri, cookie);
-    return;
+  (void) close(fd);
+  cache->map_length = st.st_size;
+  hdr = cache->map;
+
+  if (memcmp(hdr->magic, cache->magic, sizeof(hdr->magic)) ||
+      hdr->config != cache->config ||
+      hdr->length != cache->map_length ||
+      hdr->count > (cache->map_length - sizeof(*hdr)) / 8) {
+    logmsg(rc, log_telemetry, "Cache %s is stale or damaged, ignoring it", cache->filename.s);
+    return 1;
   }
 
-  memset(ctx, 0, sizeof(*ctx));
-  ctx->uri = *uri;
-  ctx->handler = handler;
-  ctx->cookie = cookie;
-  ctx->fd = -1;
+  if (hdr->count > 0 && (cache->loaded = calloc(hdr->count, sizeof(*cache->loaded))) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate index for cache %s", cache->filename.s);
+    return 1;
+  }
 
-  if (!sk_rsync_ctx_t_push(rc->rsync_queue, ctx)) {
-    logmsg(rc, log_sys_err, "Couldn't push rsync state object onto queue, punting %s", ctx->uri.s);
-    rsync_call_handler(rc, ctx, rsync_status_failed);
-    free(ctx);
-    return;
+  p = (const char *) (hdr + 1);
+  end = (const char *) cache->map + cache->map_length;
+
+  for (i = 0; i < hdr->count; i++) {
+    if (end - p < sizeof(uint32_t) ||
+	record_length(p) % 8 != 0 || record_length(p) > end - p ||
+	!record_ok(p, end - p)) {
+      logmsg(rc, log_telemetry, "Cache %s is damaged, ignoring it", cache->filename.s);
+      break;
+    }
+    cache->loaded[i].record = p;
+    if (!hash_table_insert(&cache->index, key(p), &cache->loaded[i])) {
+      logmsg(rc, log_sys_err, "Couldn't index cache %s", cache->filename.s);
+      break;
+    }
+    p += record_length(p);
   }
 
-  if (rsync_conflicts(rc, ctx)) {
-    logmsg(rc, log_debug, "New rsync context %s is feeling conflicted", ctx->uri.s);
-    ctx->state = rsync_state_conflict_wait;
+  if (i < hdr->count) {
+    hash_table_clear(&cache->index);
+    free(cache->loaded);
+    cache->loaded = NULL;
+    return 1;
   }
-}
 
-/**
- * rsync a trust anchor.
- */
-static void rsync_ta(rcynic_ctx_t *rc,
-		     const uri_t *uri,
-		     tal_ctx_t *tctx,
-		     void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *,
-				     const rsync_status_t, const uri_t *, void *))
-{
-  assert(endswith(uri->s, ".cer"));
-  rsync_init(rc, uri, tctx, handler);
+  cache->n_loaded = hdr->count;
+  logmsg(rc, log_telemetry, "Loaded %lu records from cache %s",
+	 (unsigned long) cache->n_loaded, cache->filename.s);
+  return 1;
 }
 
 /**
- * rsync an entire subtree, generally rooted at a SIA collection.
+ * Write one record to a new cache file.
  */
-static void rsync_tree(rcynic_ctx_t *rc,
-		       const uri_t *uri,
-		       STACK_OF(walk_ctx_t) *wsk,
-		       void (*handler)(rcynic_ctx_t *, const rsync_ctx_t *,
-				       const rsync_status_t, const uri_t *, void *))
+static int record_cache_write_record(FILE *f, const record_cache_entry_t *e, record_cache_header_t *hdr)
 {
-  assert(endswith(uri->s, "/"));
-  rsync_init(rc, uri, wsk, handler);
+  if (fwrite(e->record, record_length(e->record), 1, f) != 1)
+    return 0;
+  hdr->count++;
+  hdr->length += record_length(e->record);
+  return 1;
 }
 
-
-
 /**
- * Clean up old stuff from previous rsync runs.  --delete doesn't help
- * if the URI changes and we never visit the old URI again.
+ * Write out a cache: every record we used this run, plus every record
+ * we added.  We write to a temporary file and rename() it into place
+ * so that a crash never leaves a half-written cache.
  */
-static int prune_unauthenticated(const rcynic_ctx_t *rc,
-				 const path_t *name,
-				 const size_t baselen)
+static int record_cache_save(const rcynic_ctx_t *rc, const record_cache_t *cache)
 {
-  path_t path;
-  struct dirent *d;
-  DIR *dir;
-  const char *slash;
+  record_cache_header_t hdr;
+  const record_cache_entry_t *e;
+  path_t temp;
+  FILE *f = NULL;
+  size_t i;
+  int ok = 1;
+
+  assert(rc && cache);
 
-  assert(rc && name && baselen > 0 && strlen(name->s) >= baselen);
+  if (cache->filename.s[0] == '\0')
+    return 1;
 
-  if (!is_directory(name)) {
-    logmsg(rc, log_usage_err, "prune: %s is not a directory", name->s);
+  if (strlen(cache->filename.s) + sizeof(".tmp") > sizeof(temp.s))
     return 0;
-  }
 
-  if ((dir = opendir(name->s)) == NULL) {
-    logmsg(rc, log_sys_err, "prune: opendir() failed on %s: %s", name->s, strerror(errno));
+  strcpy(temp.s, cache->filename.s);
+  strcat(temp.s, ".tmp");
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, cache->magic, sizeof(hdr.magic));
+  hdr.config = cache->config;
+  hdr.length = sizeof(hdr);
+
+  if (!mkdir_maybe(rc, &temp) || (f = fopen(temp.s, "wb")) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't create cache %s: %s", temp.s, strerror(errno));
     return 0;
   }
 
-  slash = endswith(name->s, "/") ? "" : "/";
+  ok &= fwrite(&hdr, sizeof(hdr), 1, f) == 1;
 
-  while ((d = readdir(dir)) != NULL) {
-    if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
-      continue;
+  for (i = 0; ok && i < cache->n_loaded; i++)
+    if (cache->loaded[i].used)
+      ok &= record_cache_write_record(f, &cache->loaded[i], &hdr);
 
-    if (snprintf(path.s, sizeof(path.s), "%s%s%s", name->s, slash, d->d_name) >= sizeof(path.s)) {
-      logmsg(rc, log_debug, "prune: %s%s%s too long", name->s, slash, d->d_name);
-      goto done;
-    }
+  for (e = cache->added; ok && e != NULL; e = e->next)
+    if (e->used)
+      ok &= record_cache_write_record(f, e, &hdr);
 
-    if (validation_status_find_filename(rc, path.s + baselen)) {
-      logmsg(rc, log_debug, "prune: cache hit %s", path.s);
-      continue;
-    }
+  ok = (ok &&
+	fseek(f, 0, SEEK_SET) == 0 &&
+	fwrite(&hdr, sizeof(hdr), 1, f) == 1);
 
-    if (unlink(path.s) == 0) {
-      logmsg(rc, log_debug, "prune: removed %s", path.s);
-      continue;
-    }
+  if (fclose(f) == EOF)
+    ok = 0;
 
-    if (prune_unauthenticated(rc, &path, baselen))
-      continue;
+  if (ok && rename(temp.s, cache->filename.s) < 0)
+    ok = 0;
 
-    logmsg(rc, log_sys_err, "prune: removing %s failed: %s", path.s, strerror(errno));
-    goto done;
+  if (!ok) {
+    logmsg(rc, log_sys_err, "Couldn't write cache %s: %s", cache->filename.s, strerror(errno));
+    (void) unlink(temp.s);
+  } else {
+    logmsg(rc, log_telemetry, "Wrote %lu records to cache %s",
+	   (unsigned long) hdr.count, cache->filename.s);
   }
 
-  if (rmdir(name->s) == 0)
-    logmsg(rc, log_debug, "prune: removed %s", name->s);
-  else if (errno != ENOTEMPTY)
-    logmsg(rc, log_sys_err, "prune: couldn't remove %s: %s", name->s, strerror(errno));
-
- done:
-  closedir(dir);
-  return !d;
+  return ok;
 }
 
-
-
 /**
- * Read a DER object using a BIO pipeline that hashes the file content
- * as we read it.  Returns the internal form of the parsed DER object,
- * sets the hash buffer (if specified) as a side effect.  The default
- * hash algorithm is SHA-256.
+ * Release cache storage.
  */
-static void *read_file_with_hash(const path_t *filename,
-				 const ASN1_ITEM *it,
-				 const EVP_MD *md,
-				 hashbuf_t *hash)
+static void record_cache_free(record_cache_t *cache)
 {
-  void *result = NULL;
-  BIO *b;
+  record_cache_entry_t *e;
 
-  if ((b = BIO_new_file(filename->s, "rb")) == NULL)
-    goto error;
+  assert(cache);
 
-  if (hash != NULL) {
-    BIO *b2 = BIO_new(BIO_f_md());
-    if (b2 == NULL)
-      goto error;
-    if (md == NULL)
-      md = EVP_sha256();
-    if (!BIO_set_md(b2, md)) {
-      BIO_free(b2);
-      goto error;
-    }
-    BIO_push(b2, b);
-    b = b2;
+  while ((e = cache->added) != NULL) {
+    cache->added = e->next;
+    free(e);
   }
 
-  if ((result = ASN1_item_d2i_bio(it, b, NULL)) == NULL)
-    goto error;
-
-  if (hash != NULL) {
-    memset(hash, 0, sizeof(*hash));
-    BIO_gets(b, (char *) hash, sizeof(hash->h));
-  }
+  if (cache->map != NULL)
+    (void) munmap(cache->map, cache->map_length);
 
- error:
-  BIO_free_all(b);
-  return result;
+  free(cache->loaded);
+  hash_table_clear(&cache->index);
+  cache->map = NULL;
+  cache->loaded = NULL;
+  cache->n_loaded = 0;
 }
 
 /**
- * Read and hash a certificate.
+ * Allocate a new cache entry with room for a record of the given
+ * length (rounded up to the record alignment).  The record is
+ * zeroed, with its length field filled in.
  */
-static X509 *read_cert(const path_t *filename, hashbuf_t *hash)
+static record_cache_entry_t *record_cache_entry_new(size_t length)
 {
-  return read_file_with_hash(filename, ASN1_ITEM_rptr(X509), NULL, hash);
-}
+  record_cache_entry_t *e;
 
-/**
- * Read and hash a CRL.
- */
-static X509_CRL *read_crl(const path_t *filename, hashbuf_t *hash)
-{
-  return read_file_with_hash(filename, ASN1_ITEM_rptr(X509_CRL), NULL, hash);
+  length = (length + 7) & ~7;
+
+  if ((e = malloc(sizeof(*e) + length)) == NULL)
+    return NULL;
+
+  memset(e, 0, sizeof(*e) + length);
+  *(uint32_t *) (e + 1) = length;
+  e->record = e + 1;
+  e->used = 1;
+  return e;
 }
 
 /**
- * Read and hash a CMS message.
+ * Add a new entry to a cache.  Entries for which same_key() returns
+ * true are superseded by the new one.  Takes ownership of the entry.
  */
-static CMS_ContentInfo *read_cms(const path_t *filename, hashbuf_t *hash)
+static void record_cache_add(rcynic_ctx_t *rc,
+			     record_cache_t *cache,
+			     const uint64_t key,
+			     record_cache_entry_t *e,
+			     int (*same_key)(const void *, const void *))
 {
-  return read_file_with_hash(filename, ASN1_ITEM_rptr(CMS_ContentInfo), NULL, hash);
-}
+  record_cache_entry_t *old;
+  size_t cursor = 0;
 
-
+  assert(rc && cache && e && same_key);
 
-/**
- * Extract CRLDP data from a certificate.  Stops looking after finding
- * the first rsync URI.
- */
-static int extract_crldp_uri(rcynic_ctx_t *rc,
-			     const uri_t *uri,
-			     const object_generation_t generation,
-			     const STACK_OF(DIST_POINT) *crldp,
-			     uri_t *result)
-{
-  DIST_POINT *d;
-  int i;
+  rcynic_lock(rc);
 
-  assert(rc && uri && crldp && result);
+  while ((old = hash_table_next(&cache->index, key, &cursor)) != NULL)
+    if (same_key(old->record, e->record))
+      old->used = 0;
 
-  if (sk_DIST_POINT_num(crldp) != 1)
-    goto bad;
+  if (hash_table_insert(&cache->index, key, e)) {
+    e->next = cache->added;
+    cache->added = e;
+    e = NULL;
+  }
 
-  d = sk_DIST_POINT_value(crldp, 0);
+  rcynic_unlock(rc);
 
-  if (d->reasons || d->CRLissuer || !d->distpoint || d->distpoint->type != 0)
-    goto bad;
+  free(e);
+}
 
-  for (i = 0; i < sk_GENERAL_NAME_num(d->distpoint->name.fullname); i++) {
-    GENERAL_NAME *n = sk_GENERAL_NAME_value(d->distpoint->name.fullname, i);
-    if (n == NULL || n->type != GEN_URI)
-      goto bad;
-    if (!is_rsync((char *) n->d.uniformResourceIdentifier->data))
-      log_validation_status(rc, uri, non_rsync_uri_in_extension, generation);
-    else if (sizeof(result->s) <= n->d.uniformResourceIdentifier->length)
-      log_validation_status(rc, uri, uri_too_long, generation);
-    else if (result->s[0])
-      log_validation_status(rc, uri, multiple_rsync_uris_in_extension, generation);
-    else
-      strcpy(result->s, (char *) n->d.uniformResourceIdentifier->data);
-  }
 
-  return result->s[0];
 
- bad:
-  log_validation_status(rc, uri, malformed_crldp_extension, generation);
-  return 0;
+/**
+ * Index key for an object cache record: URI plus object hash.
+ */
+static uint64_t object_cache_key(const char *uri, const unsigned char *hash)
+{
+  return hash_bytes(hash_string(uri), hash, SHA256_DIGEST_LENGTH);
+}
+
+/**
+ * Find the packed URI strings in an object cache record.
+ */
+static const char *object_cache_uris(const object_cache_record_t *r)
+{
+  return (const char *) (r + 1);
 }
 
 /**
- * Extract SIA or AIA data from a certificate.
+ * Index key for an object cache record loaded from disk.
  */
-static int extract_access_uri(rcynic_ctx_t *rc,
-			      const uri_t *uri,
-			      const object_generation_t generation,
-			      const AUTHORITY_INFO_ACCESS *xia,
-			      const int nid,
-			      uri_t *result,
-			      int *count,
-			      int (*relevant)(const char *))
+static uint64_t object_cache_record_key(const void *record)
 {
-  int i;
+  const object_cache_record_t *r = record;
+  return object_cache_key(object_cache_uris(r), r->hash);
+}
 
-  assert(rc && uri && xia && result && count);
+/**
+ * Sanity check an object cache record loaded from disk.
+ */
+static int object_cache_record_ok(const void *record, const size_t space)
+{
+  const object_cache_record_t *r = record;
 
-  for (i = 0; i < sk_ACCESS_DESCRIPTION_num(xia); i++) {
-    ACCESS_DESCRIPTION *a = sk_ACCESS_DESCRIPTION_value(xia, i);
-    if (a == NULL || a->location->type != GEN_URI)
-      return 0;
-    if (OBJ_obj2nid(a->method) != nid)
-      continue;
-    ++*count;
-    if (relevant && !relevant((char *) a->location->d.uniformResourceIdentifier->data))
-      continue;
-    if (sizeof(result->s) <= a->location->d.uniformResourceIdentifier->length)
-      log_validation_status(rc, uri, uri_too_long, generation);
-    else if (result->s[0])
-      log_validation_status(rc, uri, multiple_rsync_uris_in_extension, generation);
-    else
-      strcpy(result->s, (char *) a->location->d.uniformResourceIdentifier->data);
-  }
-  return 1;
+  return (r->length >= sizeof(*r) &&
+	  packed_strings_ok(object_cache_uris(r), (const char *) r + r->length,
+			    CERTINFO_PACKED_URIS) != NULL);
 }
 
-
-
 /**
- * Check to see whether an AKI extension is present, is of the right
- * form, and matches the issuer.
+ * Whether two object cache records are for the same object in the
+ * same context, in which case the newer one supersedes the older.
  */
-static int check_aki(rcynic_ctx_t *rc,
-		     const uri_t *uri,
-		     const X509 *issuer,
-		     const AUTHORITY_KEYID *aki,
-		     const object_generation_t generation)
+static int object_cache_same_key(const void *record1, const void *record2)
 {
-  assert(rc && uri && issuer && issuer->skid);
+  const object_cache_record_t *r1 = record1, *r2 = record2;
 
-  if (aki == NULL) {
-    log_validation_status(rc, uri, aki_extension_missing, generation);
-    return 0;
-  }
+  return (!strcmp(object_cache_uris(r1), object_cache_uris(r2)) &&
+	  !memcmp(r1->hash, r2->hash, sizeof(r1->hash)) &&
+	  !memcmp(r1->fingerprint, r2->fingerprint, sizeof(r1->fingerprint)));
+}
 
-  if (!aki->keyid || aki->serial || aki->issuer) {
-    log_validation_status(rc, uri, aki_extension_wrong_format, generation);
-    return 0;
-  }
+/**
+ * Compute the issuer fingerprint for an object: everything about the
+ * object's context that could change its validation verdict without
+ * changing the object itself.  This covers the whole chain of issuer
+ * certificates (via the chain hash in the walk context), whether the
+ * issuer's CRL is stale, whether the manifest is stale, and the issuer
+ * URIs against which the object's AIA and CRLDP are checked.
+ *
+ * The CRL itself is deliberately not part of the fingerprint: it's
+ * reissued far more often than anything else here changes, and a new
+ * CRL only matters if it revokes the object, which the lookup checks
+ * directly against the CRL index.
+ *
+ * The head walk context must already have its CRL loaded.
+ */
+static int object_cache_fingerprint(STACK_OF(walk_ctx_t) *wsk,
+				    const object_generation_t generation,
+				    unsigned char *fingerprint)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  X509_CRL *crl;
+  EVP_MD_CTX *ctx;
+  int flags[4], ok;
 
-  if (ASN1_OCTET_STRING_cmp(aki->keyid, issuer->skid)) {
-    log_validation_status(rc, uri, aki_extension_issuer_mismatch, generation);
+  assert(wsk && w && fingerprint);
+
+  if (w->crls == NULL || (crl = sk_X509_CRL_value(w->crls, 0)) == NULL)
     return 0;
-  }
 
-  return 1;
+  flags[0] = generation;
+  flags[1] = w->stale_manifest;
+  flags[2] = w->certinfo.ta;
+  flags[3] = X509_cmp_current_time(X509_CRL_get_nextUpdate(crl)) < 0;
+
+  ok = ((ctx = EVP_MD_CTX_create()) != NULL &&
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+	EVP_DigestUpdate(ctx, w->chain_hash, sizeof(w->chain_hash)) &&
+	EVP_DigestUpdate(ctx, flags, sizeof(flags)) &&
+	EVP_DigestUpdate(ctx, w->certinfo.uri.s, strlen(w->certinfo.uri.s) + 1) &&
+	EVP_DigestUpdate(ctx, w->certinfo.sia.s, strlen(w->certinfo.sia.s) + 1) &&
+	EVP_DigestFinal_ex(ctx, fingerprint, NULL));
+
+  if (ctx != NULL)
+    EVP_MD_CTX_destroy(ctx);
+  return ok;
 }
 
-
-
 /**
- * Check whether a Distinguished Name conforms to the rescert profile.
- * The profile is very restrictive: it only allows one mandatory
- * CommonName field and one optional SerialNumber field, both of which
- * must be of type PrintableString.
- */
-static int check_allowed_dn(X509_NAME *dn)
+ * Check whether we've already validated an object in this context.
+ * On a hit, we replay the status codes we recorded when we first
+ * validated the object, fill in certinfo (if requested), and the
+ * caller can skip all of the parsing and crypto.
+ *
+ * The object must be unchanged on disk (same inode, size, and mtime as
+ * when we validated it) and still have the hash the manifest says it
+ * should have, the issuer context must have the same fingerprint, the
+ * signing certificate must still be within its validity period, and
+ * the current CRL must not list the signing certificate's serial
+ * number.  If we have no index for the CRL, we can't check revocation
+ * cheaply, so we treat that as a miss.
+ */
+static int object_cache_lookup(rcynic_ctx_t *rc,
+			       STACK_OF(walk_ctx_t) *wsk,
+			       const uri_t *uri,
+			       const path_t *path,
+			       const unsigned char *hash,
+			       const size_t hashlen,
+			       const object_generation_t generation,
+			       certinfo_t *certinfo)
 {
-  X509_NAME_ENTRY *ne;
-  ASN1_STRING *s;
-  int loc;
+  record_cache_t *cache = &rc->object_cache;
+  unsigned char fingerprint[SHA256_DIGEST_LENGTH];
+  record_cache_entry_t *e, *candidates[8];
+  const object_cache_record_t *r = NULL;
+  int i, n_candidates = 0;
+  size_t cursor = 0;
+  struct stat st;
+  uri_t crldp;
+  time_t now;
+  uint64_t key;
 
-  if (dn == NULL)
+  assert(rc && wsk && uri && path);
+
+  if (cache->filename.s[0] == '\0' || hash == NULL || hashlen != SHA256_DIGEST_LENGTH ||
+      stat(path->s, &st) < 0)
     return 0;
 
-  switch (X509_NAME_entry_count(dn)) {
+  key = object_cache_key(uri->s, hash);
 
-  case 2:
-    if ((loc = X509_NAME_get_index_by_NID(dn, NID_serialNumber, -1)) < 0 ||
-	(ne = X509_NAME_get_entry(dn, loc)) == NULL ||
-	(s = X509_NAME_ENTRY_get_data(ne)) == NULL ||
-	ASN1_STRING_type(s) != V_ASN1_PRINTABLESTRING)
-      return 0;
+  rcynic_lock(rc);
 
-    /* Fall through */
+  now = time(0);
 
-  case 1:
-    if ((loc = X509_NAME_get_index_by_NID(dn, NID_commonName, -1)) < 0 ||
-	(ne = X509_NAME_get_entry(dn, loc)) == NULL ||
-	(s = X509_NAME_ENTRY_get_data(ne)) == NULL ||
-	ASN1_STRING_type(s) != V_ASN1_PRINTABLESTRING)
-      return 0;
+  while (n_candidates < sizeof(candidates)/sizeof(*candidates) &&
+	 (e = hash_table_next(&cache->index, key, &cursor)) != NULL) {
+    r = e->record;
+    if (!memcmp(r->hash, hash, SHA256_DIGEST_LENGTH) &&
+	!strcmp(object_cache_uris(r), uri->s) &&
+	r->file_dev == (uint64_t) st.st_dev &&
+	r->file_ino == (uint64_t) st.st_ino &&
+	r->file_size == (uint64_t) st.st_size &&
+	r->file_mtime == (int64_t) st.st_mtime &&
+	r->not_before <= now && r->not_after >= now)
+      candidates[n_candidates++] = e;
+  }
 
-    return 1;
+  rcynic_unlock(rc);
 
-  default:
+  /*
+   * Records are immutable once indexed, so we can check fingerprints
+   * without holding the lock.  We need the CRL named by the record's
+   * CRLDP loaded before we can compute the fingerprint or check
+   * revocation.
+   */
+  for (e = NULL, i = 0; e == NULL && i < n_candidates; i++) {
+    r = candidates[i]->record;
+    strcpy(crldp.s, packed_string(object_cache_uris(r), 3));
+    if (crldp.s[0] &&
+	walk_ctx_crl(rc, wsk, uri, &crldp, generation) != NULL &&
+	walk_ctx_stack_head(wsk)->crl_index != NULL &&
+	!crl_index_lookup(walk_ctx_stack_head(wsk)->crl_index, r->serial) &&
+	object_cache_fingerprint(wsk, generation, fingerprint) &&
+	!memcmp(fingerprint, r->fingerprint, sizeof(fingerprint)))
+      e = candidates[i];
+  }
+
+  if (e == NULL)
     return 0;
+
+  r = e->record;
+
+  logmsg(rc, log_debug, "Object cache hit for %s", uri->s);
+
+  rcynic_lock(rc);
+  e->used = 1;
+  rcynic_unlock(rc);
+
+  walk_ctx_expires(walk_ctx_stack_head(wsk), r->not_after);
+
+  replay_events(rc, uri, r->events, generation);
+
+  if (certinfo != NULL) {
+    memset(certinfo, 0, sizeof(*certinfo));
+    certinfo_unpack(object_cache_uris(r), certinfo);
+    certinfo->ca = r->ca;
+    certinfo->generation = generation;
   }
+
+  return 1;
 }
 
 /**
- * Check whether an ASN.1 TIME value conforms to RFC 5280 4.1.2.5.
+ * Record an object we've just validated in the object cache.  x is
+ * the object's certificate (the EE certificate for signed objects),
+ * certinfo is what check_x509() extracted from it.  Failure here is
+ * not an error, we just won't have a cache entry next time.
  */
-static int check_allowed_time_encoding(ASN1_TIME *t)
+static void object_cache_add(rcynic_ctx_t *rc,
+			     STACK_OF(walk_ctx_t) *wsk,
+			     const uri_t *uri,
+			     const path_t *path,
+			     const unsigned char *hash,
+			     const size_t hashlen,
+			     const object_generation_t generation,
+			     X509 *x,
+			     const certinfo_t *certinfo)
 {
-  switch (t->type) {
+  object_cache_record_t *r;
+  record_cache_entry_t *e;
+  validation_status_t *v;
+  time_t now = time(0);
+  struct stat st;
 
-  case V_ASN1_UTCTIME:
-    return t->length == sizeof("yymmddHHMMSSZ") - 1;
+  assert(rc && wsk && uri && path && x && certinfo && !strcmp(uri->s, certinfo->uri.s));
 
-  case  V_ASN1_GENERALIZEDTIME:
-    return (t->length == sizeof("yyyymmddHHMMSSZ") - 1 &&
-	    strcmp("205", (char *) t->data) <= 0);
+  if (rc->object_cache.filename.s[0] == '\0' || hash == NULL || hashlen != SHA256_DIGEST_LENGTH ||
+      stat(path->s, &st) < 0 ||
+      (e = record_cache_entry_new(sizeof(*r) + certinfo_packed_length(certinfo))) == NULL)
+    return;
 
+  r = (object_cache_record_t *) e->record;
+  r->ca = certinfo->ca;
+  memcpy(r->hash, hash, sizeof(r->hash));
+  r->file_dev = st.st_dev;
+  r->file_ino = st.st_ino;
+  r->file_size = st.st_size;
+  r->file_mtime = st.st_mtime;
+  (void) certinfo_pack((char *) (r + 1), certinfo);
+
+  if (!crl_serial_encode(X509_get_serialNumber(x), r->serial) ||
+      !asn1_time_to_seconds(X509_get_notBefore(x), now, &r->not_before) ||
+      !asn1_time_to_seconds(X509_get_notAfter(x),  now, &r->not_after) ||
+      !object_cache_fingerprint(wsk, generation, r->fingerprint)) {
+    free(e);
+    return;
   }
-  return 0;
+
+  rcynic_lock(rc);
+  if ((v = validation_status_find(rc, uri, generation)) != NULL)
+    memcpy(r->events, v->events, sizeof(r->events));
+  rcynic_unlock(rc);
+
+  record_cache_add(rc, &rc->object_cache, object_cache_key(uri->s, hash), e, object_cache_same_key);
 }
 
+
+
 /**
- * Compare ASN1_TIME values.
+ * Find the packed manifest and CRL URIs in a publication point record.
  */
-static int asn1_time_cmp(ASN1_TIME *t1, ASN1_TIME *t2)
+static const char *pubpoint_uris(const pubpoint_record_t *r)
 {
-  ASN1_GENERALIZEDTIME *g1 = ASN1_TIME_to_generalizedtime(t1, NULL);
-  ASN1_GENERALIZEDTIME *g2 = ASN1_TIME_to_generalizedtime(t2, NULL);
-
-  int cmp = ASN1_STRING_cmp(g1, g2);
-
-  ASN1_GENERALIZEDTIME_free(g1);
-  ASN1_GENERALIZEDTIME_free(g2);
-
-  return cmp;
+  return (const char *) (r + 1);
 }
 
-
+/**
+ * Find the first object in a publication point record.
+ */
+static const pubpoint_object_t *pubpoint_first_object(const pubpoint_record_t *r)
+{
+  const char *s = packed_string(pubpoint_uris(r), 2);
+  return (const pubpoint_object_t *) ((const char *) r + ((s - (const char *) r + 7) & ~7));
+}
 
 /**
- * Attempt to read and check one CRL from disk.
+ * Find the URI (and, for CA certificates, the rest of the packed
+ * certinfo) in a publication point object.
  */
+static const char *pubpoint_object_uris(const pubpoint_object_t *o)
+{
+  return (const char *) (o + 1);
+}
 
-static X509_CRL *check_crl_1(rcynic_ctx_t *rc,
-			     const uri_t *uri,
-			     path_t *path,
-			     const path_t *prefix,
-			     X509 *issuer,
-			     const object_generation_t generation)
+/**
+ * Index key for a publication point record: the manifest URI.
+ */
+static uint64_t pubpoint_record_key(const void *record)
 {
-  STACK_OF(X509_REVOKED) *revoked;
-  X509_CRL *crl = NULL;
-  EVP_PKEY *pkey;
-  int i, ret;
+  return hash_string(pubpoint_uris(record));
+}
 
-  assert(uri && path && issuer);
+/**
+ * Whether two publication point records are for the same manifest.
+ */
+static int pubpoint_same_key(const void *record1, const void *record2)
+{
+  return !strcmp(pubpoint_uris(record1), pubpoint_uris(record2));
+}
 
-  if (!uri_to_filename(rc, uri, path, prefix) ||
-      (crl = read_crl(path, NULL)) == NULL)
-    goto punt;
+/**
+ * Sanity check a publication point record loaded from disk.
+ */
+static int pubpoint_record_ok(const void *record, const size_t space)
+{
+  const pubpoint_record_t *r = record;
+  const char *end = (const char *) r + r->length;
+  const pubpoint_object_t *o;
+  uint32_t i;
 
-  if (X509_CRL_get_version(crl) != 1) {
-    log_validation_status(rc, uri, wrong_object_version, generation);
-    goto punt;
-  }
+  if (r->length < sizeof(*r) ||
+      packed_strings_ok(pubpoint_uris(r), end, 2) == NULL)
+    return 0;
 
-  if (!crl->crl || !crl->crl->sig_alg || !crl->crl->sig_alg->algorithm ||
-      OBJ_obj2nid(crl->crl->sig_alg->algorithm) != NID_sha256WithRSAEncryption) {
-    log_validation_status(rc, uri, nonconformant_signature_algorithm, generation);
-    goto punt;
+  for (o = pubpoint_first_object(r), i = 0; i < r->n_objects; i++) {
+    if ((const char *) o > end - sizeof(*o) ||
+	o->length < sizeof(*o) || o->length % 8 != 0 || o->length > end - (const char *) o ||
+	o->generation >= OBJECT_GENERATION_MAX ||
+	packed_strings_ok(pubpoint_object_uris(o), (const char *) o + o->length,
+			  o->ca ? CERTINFO_PACKED_URIS : 1) == NULL)
+      return 0;
+    o = (const pubpoint_object_t *) ((const char *) o + o->length);
   }
 
-  if (!check_allowed_time_encoding(X509_CRL_get_lastUpdate(crl)) ||
-      !check_allowed_time_encoding(X509_CRL_get_nextUpdate(crl))) {
-    log_validation_status(rc, uri, nonconformant_asn1_time_value, generation);
-    goto punt;
-  }
+  return (const char *) o == end;
+}
 
-  if (X509_cmp_current_time(X509_CRL_get_lastUpdate(crl)) > 0) {
-    log_validation_status(rc, uri, crl_not_yet_valid, generation);
-    goto punt;
-  }
+/**
+ * Hash the directory listing for a publication point under a given
+ * prefix: names, sizes, inode numbers and modification times of all
+ * the files in it.  A missing directory hashes as an empty one.
+ */
+static int pubpoint_listing_hash(const rcynic_ctx_t *rc,
+				 const path_t *prefix,
+				 const uri_t *sia,
+				 unsigned char *digest)
+{
+  STACK_OF(OPENSSL_STRING) *names = NULL;
+  EVP_MD_CTX *ctx = NULL;
+  struct dirent *d;
+  struct stat st;
+  int64_t attrs[3];
+  DIR *dp = NULL;
+  int i, fd, ok = 0;
+  path_t dir;
+
+  if (!uri_to_filename(rc, sia, &dir, prefix) ||
+      (names = sk_OPENSSL_STRING_new(uri_cmp)) == NULL ||
+      (ctx = EVP_MD_CTX_create()) == NULL ||
+      !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+    goto done;
 
-  if (X509_cmp_current_time(X509_CRL_get_nextUpdate(crl)) < 0) {
-    log_validation_status(rc, uri, stale_crl_or_manifest, generation);
-    if (!rc->allow_stale_crl)
-      goto punt;
-  }
+  if ((fd = open_at(rc, &dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0)) >= 0 &&
+      (dp = fdopendir(fd)) == NULL)
+    (void) close(fd);
 
-  if (!check_aki(rc, uri, issuer, crl->akid, generation))
-    goto punt;
+  if (dp != NULL)
+    while ((d = readdir(dp)) != NULL)
+      if (!sk_OPENSSL_STRING_push_strdup(names, d->d_name))
+	goto done;
 
-  if (crl->crl_number == NULL) {
-    log_validation_status(rc, uri, crl_number_extension_missing, generation);
-    goto punt;
-  }
+  sk_OPENSSL_STRING_sort(names);
 
-  if (ASN1_INTEGER_cmp(crl->crl_number, asn1_zero) < 0) {
-    log_validation_status(rc, uri, crl_number_is_negative, generation);
-    goto punt;
+  for (i = 0; i < sk_OPENSSL_STRING_num(names); i++) {
+    const char *name = sk_OPENSSL_STRING_value(names, i);
+    if (fstatat(dirfd(dp), name, &st, 0) < 0)
+      goto done;
+    if (S_ISDIR(st.st_mode))
+      continue;
+    attrs[0] = st.st_size;
+    attrs[1] = st.st_ino;
+    attrs[2] = st.st_mtime;
+    if (!EVP_DigestUpdate(ctx, name, strlen(name) + 1) ||
+	!EVP_DigestUpdate(ctx, attrs, sizeof(attrs)))
+      goto done;
   }
 
-  if (ASN1_INTEGER_cmp(crl->crl_number, asn1_twenty_octets) > 0) {
-    log_validation_status(rc, uri, crl_number_out_of_range, generation);
-    goto punt;
-  }
+  ok = EVP_DigestFinal_ex(ctx, digest, NULL);
 
-  if (X509_CRL_get_ext_count(crl) != 2) {
-    log_validation_status(rc, uri, disallowed_x509v3_extension, generation);
-    goto punt;
-  }
+ done:
+  if (dp != NULL)
+    closedir(dp);
+  if (ctx != NULL)
+    EVP_MD_CTX_destroy(ctx);
+  sk_OPENSSL_STRING_pop_free(names, OPENSSL_STRING_free);
+  return ok;
+}
 
-  if (X509_NAME_cmp(X509_CRL_get_issuer(crl), X509_get_subject_name(issuer))) {
-    log_validation_status(rc, uri, crl_issuer_name_mismatch, generation);
-    goto punt;
-  }
+/**
+ * Compute the input hashes for a publication point: manifest, CRL,
+ * and the unauthenticated and authenticated directory listings.
+ *
+ * The authenticated listing is what becomes next run's backup data:
+ * when recording, we hash what we just installed in
+ * rc->new_authenticated; when checking, we hash what we find in
+ * rc->old_authenticated.  If they match, nothing has touched last
+ * run's output since we wrote it.
+ */
+static int pubpoint_inputs(const rcynic_ctx_t *rc,
+			   const walk_ctx_t *w,
+			   const uri_t *crl,
+			   const path_t *authenticated,
+			   pubpoint_record_t *r)
+{
+  path_t path;
 
-  if (!check_allowed_dn(X509_CRL_get_issuer(crl))) {
-    log_validation_status(rc, uri, nonconformant_issuer_name, generation);
-    if (!rc->allow_nonconformant_name)
-      goto punt;
-  }
+  return (uri_to_filename(rc, &w->certinfo.manifest, &path, &rc->unauthenticated) &&
+	  file_sha256(&path, r->manifest_hash) &&
+	  uri_to_filename(rc, crl, &path, &rc->unauthenticated) &&
+	  file_sha256(&path, r->crl_hash) &&
+	  pubpoint_listing_hash(rc, &rc->unauthenticated, &w->certinfo.sia, r->current_listing) &&
+	  pubpoint_listing_hash(rc, authenticated, &w->certinfo.sia, r->authenticated_listing));
+}
 
-  if ((revoked = X509_CRL_get_REVOKED(crl)) != NULL) {
-    for (i = sk_X509_REVOKED_num(revoked) - 1; i >= 0; --i) {
-      if (X509_REVOKED_get_ext_count(sk_X509_REVOKED_value(revoked, i)) > 0) {
-	log_validation_status(rc, uri, disallowed_x509v3_extension, generation);
-	goto punt;
-      }
-    }
-  }
+/**
+ * Remember a CA certificate we accepted from this publication point,
+ * so that we can push it again when carrying the publication point
+ * forward on a later run.
+ */
+static void pubpoint_add_child(const rcynic_ctx_t *rc,
+			       walk_ctx_t *w,
+			       const certinfo_t *certinfo)
+{
+  size_t n = certinfo_packed_length(certinfo);
 
-  if ((pkey = X509_get_pubkey(issuer)) == NULL)
-    goto punt;
-  ret = X509_CRL_verify(crl, pkey);
-  EVP_PKEY_free(pkey);
+  assert(rc && w && certinfo);
 
-  if (ret > 0)
-    return crl;
+  if (rc->pubpoint_cache.filename.s[0] == '\0' || w->carry != NULL)
+    return;
 
- punt:
-  X509_CRL_free(crl);
-  return NULL;
+  if (w->children_length + n > w->children_max) {
+    size_t new_max = w->children_max ? w->children_max * 2 : 8192;
+    char *new_children;
+    while (new_max < w->children_length + n)
+      new_max *= 2;
+    if ((new_children = realloc(w->children, new_max)) == NULL)
+      return;
+    w->children = new_children;
+    w->children_max = new_max;
+  }
+
+  certinfo_pack(w->children + w->children_length, certinfo);
+  w->children_length += n;
 }
 
 /**
- * Check whether we already have a particular CRL, attempt to fetch it
- * and check issuer's signature if we don't.
- *
- * General plan here is to do basic checks on both current and backup
- * generation CRLs, then, if both generations pass all of our other
- * tests, pick the generation with the highest CRL number, to protect
- * against replay attacks.
+ * Append one object to a publication point record being built.
  */
-static X509_CRL *check_crl(rcynic_ctx_t *rc,
+static int pubpoint_append(char **buf,
+			   size_t *len,
+			   size_t *max,
 			   const uri_t *uri,
-			   X509 *issuer)
+			   const object_generation_t generation,
+			   const unsigned char *events,
+			   const char *certinfo)
 {
-  X509_CRL *old_crl, *new_crl, *result = NULL;
-  path_t old_path, new_path;
-
-  if (uri_to_filename(rc, uri, &new_path, &rc->new_authenticated) &&
-      (new_crl = read_crl(&new_path, NULL)) != NULL)
-    return new_crl;
+  size_t n = sizeof(pubpoint_object_t);
+  pubpoint_object_t *o;
+
+  n += certinfo ? packed_string(certinfo, CERTINFO_PACKED_URIS) - certinfo : strlen(uri->s) + 1;
+  n = (n + 7) & ~7;
+
+  if (*len + n > *max) {
+    size_t new_max = *max * 2;
+    char *new_buf;
+    while (new_max < *len + n)
+      new_max *= 2;
+    if ((new_buf = realloc(*buf, new_max)) == NULL)
+      return 0;
+    *buf = new_buf;
+    *max = new_max;
+  }
+
+  o = (pubpoint_object_t *) (*buf + *len);
+  memset(o, 0, n);
+  o->length = n;
+  o->generation = generation;
+  o->ca = certinfo != NULL;
+  memcpy(o->events, events, sizeof(o->events));
+  if (certinfo)
+    memcpy(o + 1, certinfo, packed_string(certinfo, CERTINFO_PACKED_URIS) - certinfo);
+  else
+    strcpy((char *) (o + 1), uri->s);
+  *len += n;
+  return 1;
+}
 
-  logmsg(rc, log_telemetry, "Checking CRL %s", uri->s);
+/**
+ * Record the inputs and results of a publication point we've just
+ * finished walking, so that next run can carry it forward if nothing
+ * changed.  We don't record publication points with rejected objects
+ * or without a usable manifest, those get the full treatment every
+ * time.
+ */
+static void pubpoint_record(rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk)
+{
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  STACK_OF(OPENSSL_STRING) *names = NULL;
+  dir_listing_t *listing;
+  size_t len, max = 65536, cursor;
+  hash_table_t children;
+  record_cache_entry_t *e;
+  pubpoint_record_t *r;
+  validation_status_t *v;
+  unsigned char events[sizeof(v->events)];
+  const char *name, *child;
+  char *buf = NULL, *s;
+  uri_t uri;
+  int i, ok = 0;
+  object_generation_t generation;
 
-  new_crl = check_crl_1(rc, uri, &new_path, &rc->unauthenticated,
-			issuer, object_generation_current);
+  assert(rc && wsk && w);
 
-  old_crl = check_crl_1(rc, uri, &old_path, &rc->old_authenticated,
-			issuer, object_generation_backup);
+  memset(&children, 0, sizeof(children));
 
-  if (!new_crl)
-    result = old_crl;
+  /*
+   * Cloned stacks sharing this frame may each get here.
+   */
+  if (rc->pubpoint_cache.filename.s[0] == '\0' || w->recorded)
+    return;
 
-  else if (!old_crl)
-    result = new_crl;
+  w->recorded = 1;
 
-  else {
-    ASN1_GENERALIZEDTIME *g_old = ASN1_TIME_to_generalizedtime(X509_CRL_get_lastUpdate(old_crl), NULL);
-    ASN1_GENERALIZEDTIME *g_new = ASN1_TIME_to_generalizedtime(X509_CRL_get_lastUpdate(new_crl), NULL);
-    int num_cmp = ASN1_INTEGER_cmp(old_crl->crl_number, new_crl->crl_number);
-    int date_cmp = (!g_old || !g_new) ? 0 : ASN1_STRING_cmp(g_old, g_new);
+  /*
+   * A carried-forward publication point just needs its authenticated
+   * listing updated to match what we installed this time.
+   */
+  if (w->carry != NULL) {
+    if ((e = record_cache_entry_new(w->carry->length)) == NULL)
+      return;
+    r = (pubpoint_record_t *) e->record;
+    memcpy(r, w->carry, w->carry->length);
+    if (pubpoint_listing_hash(rc, &rc->new_authenticated, &w->certinfo.sia, r->authenticated_listing))
+      record_cache_add(rc, &rc->pubpoint_cache, hash_string(w->certinfo.manifest.s), e, pubpoint_same_key);
+    else
+      free(e);
+    return;
+  }
 
-    if (!g_old)
-      log_validation_status(rc, uri, bad_thisupdate, object_generation_backup);
-    if (!g_new)
-      log_validation_status(rc, uri, bad_thisupdate, object_generation_current);
-    if (num_cmp > 0)
-      log_validation_status(rc, uri, backup_number_higher_than_current, object_generation_current);
-    if (g_old && g_new && date_cmp > 0)
-      log_validation_status(rc, uri, backup_thisupdate_newer_than_current, object_generation_current);
+  if (w->manifest == NULL || w->expires == 0 ||
+      !startswith(w->certinfo.manifest.s, w->certinfo.sia.s) ||
+      !startswith(w->crldp.s, w->certinfo.sia.s))
+    return;
 
-    if (num_cmp > 0 && (!g_old || !g_new || date_cmp > 0))
-      result = old_crl;
-    else
-      result = new_crl;
+  /*
+   * Everything the walk might have looked at: the manifest, the CRL,
+   * every name on the manifest, and everything in both directories.
+   */
+  if ((names = sk_OPENSSL_STRING_new(uri_cmp)) == NULL)
+    goto done;
 
-    ASN1_GENERALIZEDTIME_free(g_old);
-    ASN1_GENERALIZEDTIME_free(g_new);
+  for (generation = object_generation_current; generation <= object_generation_backup; generation++) {
+    listing = directory_filenames(rc, (generation == object_generation_current
+				       ? walk_state_current : walk_state_backup),
+				  &w->certinfo.sia);
+    for (i = 0; listing != NULL && i < listing->count; i++)
+      if (!sk_OPENSSL_STRING_push_strdup(names, dir_listing_name(listing, i)))
+	break;
+    ok = listing == NULL || i == listing->count;
+    dir_listing_free(listing);
+    if (!ok)
+      goto done;
+    ok = 0;
   }
 
-  if (result && result == new_crl)
-    install_object(rc, uri, &new_path, object_generation_current);
-  else if (!access(new_path.s, F_OK))
-    log_validation_status(rc, uri, object_rejected, object_generation_current);
+  for (i = 0; i < sk_FileAndHash_num(w->manifest->fileList); i++)
+    if (!sk_OPENSSL_STRING_push_strdup(names, (char *) sk_FileAndHash_value(w->manifest->fileList, i)->file->data))
+      goto done;
 
-  if (result && result == old_crl)
-    install_object(rc, uri, &old_path, object_generation_backup);
-  else if (!result && !access(old_path.s, F_OK))
-    log_validation_status(rc, uri, object_rejected, object_generation_backup);
+  if (!sk_OPENSSL_STRING_push_strdup(names, w->certinfo.manifest.s + strlen(w->certinfo.sia.s)) ||
+      !sk_OPENSSL_STRING_push_strdup(names, w->crldp.s + strlen(w->certinfo.sia.s)))
+    goto done;
 
-  if (result != new_crl)
-    X509_CRL_free(new_crl);
+  sk_OPENSSL_STRING_sort(names);
 
-  if (result != old_crl)
-    X509_CRL_free(old_crl);
+  for (s = w->children; s != NULL && s < w->children + w->children_length;
+       s = (char *) packed_string(s, CERTINFO_PACKED_URIS))
+    if (!hash_table_insert(&children, hash_string(s), s))
+      goto done;
 
-  return result;
-}
+  /*
+   * Fixed part and URIs first, objects after.
+   */
+  len = sizeof(*r) + strlen(w->certinfo.manifest.s) + 1 + strlen(w->crldp.s) + 1;
+  len = (len + 7) & ~7;
+  while (max < len)
+    max *= 2;
+  if ((buf = malloc(max)) == NULL)
+    goto done;
+  memset(buf, 0, len);
+  r = (pubpoint_record_t *) buf;
+  memcpy(r->chain_hash, w->chain_hash, sizeof(r->chain_hash));
+  r->expires = w->expires;
+  strcpy((char *) (r + 1), w->certinfo.manifest.s);
+  strcpy((char *) (r + 1) + strlen(w->certinfo.manifest.s) + 1, w->crldp.s);
+
+  if (!pubpoint_inputs(rc, w, &w->crldp, &rc->new_authenticated, r))
+    goto done;
+
+  for (i = 0; i < sk_OPENSSL_STRING_num(names); i++) {
+    name = sk_OPENSSL_STRING_value(names, i);
+    if (i > 0 && !strcmp(name, sk_OPENSSL_STRING_value(names, i - 1)))
+      continue;
+    if (strlen(w->certinfo.sia.s) + strlen(name) >= sizeof(uri.s))
+      goto done;
+    strcpy(uri.s, w->certinfo.sia.s);
+    strcat(uri.s, name);
 
+    for (generation = object_generation_current; generation <= object_generation_backup; generation++) {
+
+      rcynic_lock(rc);
+      if ((v = validation_status_find(rc, &uri, generation)) != NULL)
+	memcpy(events, v->events, sizeof(events));
+      rcynic_unlock(rc);
+
+      if (v == NULL)
+	continue;
+
+      if (generation == object_generation_current && (events[object_rejected >> 3] & (1 << (object_rejected & 7))))
+	goto done;
+
+      child = NULL;
+      if (events[object_accepted >> 3] & (1 << (object_accepted & 7)))
+	for (cursor = 0; (child = hash_table_next(&children, hash_string(uri.s), &cursor)) != NULL; )
+	  if (!strcmp(child, uri.s))
+	    break;
+
+      if (!pubpoint_append(&buf, &len, &max, &uri, generation, events, child))
+	goto done;
+      ((pubpoint_record_t *) buf)->n_objects++;
+    }
+  }
+
+  if ((e = record_cache_entry_new(len)) == NULL)
+    goto done;
+
+  memcpy((void *) e->record, buf, len);
+  record_cache_add(rc, &rc->pubpoint_cache, hash_string(w->certinfo.manifest.s), e, pubpoint_same_key);
+  ok = 1;
+
+ done:
+  if (!ok)
+    logmsg(rc, log_debug, "Not recording state for publication point %s", w->certinfo.sia.s);
+  hash_table_clear(&children);
+  sk_OPENSSL_STRING_pop_free(names, OPENSSL_STRING_free);
+  free(buf);
+}
 
 /**
- * Check digest of a CRL we've already accepted.
+ * Check whether we can carry a publication point forward from the
+ * previous run: same issuer chain, same manifest, same CRL, same
+ * directory contents (both the unauthenticated copy and last run's
+ * output), and nothing has expired.  If so, replay the
+ * recorded status codes, link the accepted objects from the previous
+ * run's output into this run's output, and return true.  The caller
+ * then uses pubpoint_carry_next() to walk the child CAs.
  */
-static int check_crl_digest(const rcynic_ctx_t *rc,
-			    const uri_t *uri,
-			    const unsigned char *hash,
-			    const size_t hashlen)
+static int pubpoint_carry_forward(rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk)
 {
-  X509_CRL *crl = NULL;
-  hashbuf_t hashbuf;
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  record_cache_t *cache = &rc->pubpoint_cache;
+  const pubpoint_record_t *r = NULL;
+  const pubpoint_object_t *o;
+  pubpoint_record_t inputs;
+  record_cache_entry_t *e;
+  size_t cursor = 0;
   path_t path;
-  int result;
+  uri_t uri;
+  uint32_t i;
 
-  assert(rc && uri && hash);
+  assert(rc && wsk && w);
 
-  if (!uri_to_filename(rc, uri, &path, &rc->new_authenticated) ||
-      (crl = read_crl(&path, &hashbuf)) == NULL)
+  if (cache->filename.s[0] == '\0')
     return 0;
 
-  result = hashlen <= sizeof(hashbuf.h) && !memcmp(hashbuf.h, hash, hashlen);
+  rcynic_lock(rc);
+  while ((e = hash_table_next(&cache->index, hash_string(w->certinfo.manifest.s), &cursor)) != NULL &&
+	 strcmp(pubpoint_uris(e->record), w->certinfo.manifest.s))
+    ;
+  rcynic_unlock(rc);
 
-  X509_CRL_free(crl);
+  if (e == NULL)
+    return 0;
 
-  return result;
-}
+  r = e->record;
+  strcpy(uri.s, packed_string(pubpoint_uris(r), 1));
 
-
+  if (memcmp(r->chain_hash, w->chain_hash, sizeof(r->chain_hash)) ||
+      r->expires <= time(0) ||
+      !pubpoint_inputs(rc, w, &uri, &rc->old_authenticated, &inputs) ||
+      memcmp(r->manifest_hash,   inputs.manifest_hash,   sizeof(r->manifest_hash)) ||
+      memcmp(r->crl_hash,        inputs.crl_hash,        sizeof(r->crl_hash)) ||
+      memcmp(r->current_listing, inputs.current_listing, sizeof(r->current_listing)) ||
+      memcmp(r->authenticated_listing, inputs.authenticated_listing, sizeof(r->authenticated_listing)))
+    return 0;
+
+  /*
+   * Make sure everything we'd carry forward is still in last run's
+   * output before we commit to anything.
+   */
+  for (o = pubpoint_first_object(r), i = 0; i < r->n_objects;
+       o = (const pubpoint_object_t *) ((const char *) o + o->length), i++) {
+    strcpy(uri.s, pubpoint_object_uris(o));
+    if ((o->events[object_accepted >> 3] & (1 << (object_accepted & 7))) &&
+	(!uri_to_filename(rc, &uri, &path, &rc->old_authenticated) || access_at(rc, &path, R_OK)))
+      return 0;
+  }
+
+  logmsg(rc, log_telemetry, "Carrying forward unchanged publication point %s", w->certinfo.sia.s);
+
+  for (o = pubpoint_first_object(r), i = 0; i < r->n_objects;
+       o = (const pubpoint_object_t *) ((const char *) o + o->length), i++) {
+    strcpy(uri.s, pubpoint_object_uris(o));
+    replay_events(rc, &uri, o->events, o->generation);
+    if ((o->events[object_accepted >> 3] & (1 << (object_accepted & 7))) &&
+	uri_to_filename(rc, &uri, &path, &rc->old_authenticated))
+      install_object(rc, &uri, &path, o->generation);
+  }
+
+  rcynic_lock(rc);
+  e->used = 1;
+  rcynic_unlock(rc);
+
+  w->carry = r;
+  w->carry_next = pubpoint_first_object(r);
+  w->carry_remaining = r->n_objects;
+  return 1;
+}
 
 /**
- * Validation callback function for use with x509_verify_cert().
+ * Push the next child CA of a carried-forward publication point onto
+ * the walk context stack.  Returns false when there are no more.
  */
-static int check_x509_cb(int ok, X509_STORE_CTX *ctx)
+static int pubpoint_carry_next(rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk)
 {
-  rcynic_x509_store_ctx_t *rctx = (rcynic_x509_store_ctx_t *) ctx;
-  mib_counter_t code;
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  const pubpoint_object_t *o;
+  certinfo_t certinfo;
+  path_t path;
+  X509 *x;
 
-  assert(rctx != NULL);
+  assert(rc && wsk && w && w->carry);
 
-  switch (ctx->error) {
-  case X509_V_OK:
-    return ok;
+  while (w->carry_remaining > 0) {
+    o = w->carry_next;
+    w->carry_next = (const pubpoint_object_t *) ((const char *) o + o->length);
+    w->carry_remaining--;
 
-  case X509_V_ERR_SUBJECT_ISSUER_MISMATCH:
-    /*
-     * Informational events, not really errors.  ctx->check_issued()
-     * is called in many places where failure to find an issuer is not
-     * a failure for the calling function.  Just leave these alone.
-     */
-    return ok;
+    if (!o->ca)
+      continue;
 
-  case X509_V_ERR_CRL_HAS_EXPIRED:
-    /*
-     * This isn't really an error, exactly.  CRLs don't really
-     * "expire".  What OpenSSL really means by this error is just
-     * "it's now later than the issuer said it intended to publish a
-     * new CRL".  Whether we treat this as an error or not is
-     * configurable, see the allow_stale_crl parameter.
-     *
-     * Deciding whether to allow stale CRLs is check_crl_1()'s job,
-     * not ours.  By the time this callback occurs, we've already
-     * accepted the CRL; this callback is just notifying us that the
-     * object being checked is tainted by a stale CRL.  So we mark the
-     * object as tainted and carry on.
-     */
-    log_validation_status(rctx->rc, &rctx->subject->uri, tainted_by_stale_crl, rctx->subject->generation);
-    ok = 1;
-    return ok;
+    memset(&certinfo, 0, sizeof(certinfo));
+    certinfo_unpack(pubpoint_object_uris(o), &certinfo);
+    certinfo.ca = 1;
+    certinfo.generation = o->generation;
 
-  case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
-    /*
-     * This is another error that's only an error in the strange world
-     * of OpenSSL, but a more serious one.  By default, OpenSSL
-     * expects all trust anchors to be self-signed.  This is not a
-     * PKIX requirement, it's just an OpenSSL thing, but one violates
-     * it at one's peril, because the only way to convince OpenSSL to
-     * allow a non-self-signed trust anchor is to intercept this
-     * "error" in the verify callback handler.
-     *
-     * So this program supports non-self-signed trust anchors, but be
-     * warned that enabling this feature may cause this program's
-     * output not to work with other OpenSSL-based applications.
-     */
-    if (rctx->rc->allow_non_self_signed_trust_anchor)
-      ok = 1;
-    log_validation_status(rctx->rc, &rctx->subject->uri, trust_anchor_not_self_signed, rctx->subject->generation);
-    return ok;
+    if (!uri_to_filename(rc, &certinfo.uri, &path, &rc->old_authenticated) ||
+	(x = read_cert(&path, NULL)) == NULL) {
+      logmsg(rc, log_sys_err, "Couldn't reload carried-forward certificate %s", certinfo.uri.s);
+      continue;
+    }
 
-  /*
-   * Select correct MIB counter for every known OpenSSL verify errors
-   * except the ones we handle explicitly above, then fall through to
-   * common handling for all of these.
-   */
-#define QV(x)							\
-  case x:							\
-    code = mib_openssl_##x;					\
-    break;
-    MIB_COUNTERS_FROM_OPENSSL;
-#undef	QV
+    if (walk_ctx_stack_push(wsk, x, &certinfo))
+      return 1;
 
-  default:
-    code = unknown_openssl_verify_error;
-    break;
+    X509_free(x);
   }
 
-  log_validation_status(rctx->rc, &rctx->subject->uri, code, rctx->subject->generation);
-  return ok;
+  return 0;
 }
 
+
+
 /**
  * Check crypto aspects of a certificate, policy OID, RFC 3779 path
  * validation, and conformance to the RPKI certificate profile.
@@ -3617,7 +8756,7 @@ static int check_x509(rcynic_ctx_t *rc,
 {
   walk_ctx_t *w = walk_ctx_stack_head(wsk);
   rcynic_x509_store_ctx_t rctx;
-  EVP_PKEY *issuer_pkey = NULL, *subject_pkey = NULL;
+  EVP_PKEY *issuer_pkey, *subject_pkey = NULL;
   unsigned long flags = (X509_V_FLAG_POLICY_CHECK | X509_V_FLAG_EXPLICIT_POLICY | X509_V_FLAG_X509_STRICT);
   AUTHORITY_INFO_ACCESS *sia = NULL, *aia = NULL;
   STACK_OF(POLICYINFO) *policies = NULL;
@@ -3627,7 +8766,8 @@ static int check_x509(rcynic_ctx_t *rc,
   BASIC_CONSTRAINTS *bc = NULL;
   hashbuf_t ski_hashbuf;
   unsigned ski_hashlen, afi;
-  int i, ok, crit, loc, ex_count, routercert = 0, ret = 0;
+  X509_CRL *crl;
+  int i, ok, crit, loc, ex_count, routercert = 0, revoked = 0, ret = 0;
 
   assert(rc && wsk && w && uri && x && w->cert);
 
@@ -3961,7 +9101,7 @@ static int check_x509(rcynic_ctx_t *rc,
     goto done;
   }
 
-  if ((issuer_pkey = X509_get_pubkey(w->cert)) == NULL || X509_verify(x, issuer_pkey) <= 0) {
+  if ((issuer_pkey = walk_ctx_pkey(w)) == NULL || X509_verify(x, issuer_pkey) <= 0) {
     log_validation_status(rc, uri, certificate_bad_signature, generation);
     goto done;
   }
@@ -3985,44 +9125,25 @@ static int check_x509(rcynic_ctx_t *rc,
       goto done;
     }
 
-    if (w->crls == NULL && ((w->crls = sk_X509_CRL_new_null()) == NULL ||
-			    !sk_X509_CRL_push(w->crls, NULL))) {
-      logmsg(rc, log_sys_err, "Internal allocation error setting up CRL for validation");
+    if ((crl = walk_ctx_crl(rc, wsk, uri, &certinfo->crldp, generation)) == NULL)
       goto done;
-    }
-
-    assert(sk_X509_CRL_num(w->crls) == 1);
-    assert((w->crldp.s[0] == '\0') == (sk_X509_CRL_value(w->crls, 0) == NULL));
 
-    if (strcmp(w->crldp.s, certinfo->crldp.s)) {
-      X509_CRL *old_crl = sk_X509_CRL_value(w->crls, 0);
-      X509_CRL *new_crl = check_crl(rc, &certinfo->crldp, w->cert);
-
-      if (w->crldp.s[0])
-	log_validation_status(rc, uri, issuer_uses_multiple_crldp_values, generation);
-
-      if (new_crl == NULL) {
-	log_validation_status(rc, uri, bad_crl, generation);
-	goto done;
-      }
-
-      if (old_crl && new_crl && ASN1_INTEGER_cmp(old_crl->crl_number, new_crl->crl_number) < 0) {
-	log_validation_status(rc, uri, crldp_names_newer_crl, generation);
-	X509_CRL_free(old_crl);
-	old_crl = NULL;
-      }
-
-      if (old_crl == NULL) {
-	sk_X509_CRL_set(w->crls, 0, new_crl);
-	w->crldp = certinfo->crldp;
-      } else {
-	X509_CRL_free(new_crl);
-      }
+    /*
+     * check_crl_1() has already done everything else OpenSSL's CRL
+     * check would do (signature, issuer, extensions, lastUpdate), so
+     * all that's left is revocation and staleness, which we can do
+     * ourselves with the CRL index.  Fall back to OpenSSL if we have
+     * no index.
+     */
+    if (w->crl_index == NULL) {
+      flags |= X509_V_FLAG_CRL_CHECK;
+      X509_STORE_CTX_set0_crls(&rctx.ctx, w->crls);
+    } else {
+      if (X509_cmp_current_time(X509_CRL_get_nextUpdate(crl)) < 0)
+	log_validation_status(rc, uri, tainted_by_stale_crl, generation);
+      if ((revoked = crl_index_revoked(w->crl_index, x)) != 0)
+	log_validation_status(rc, uri, mib_openssl_X509_V_ERR_CERT_REVOKED, generation);
     }
-
-    assert(sk_X509_CRL_value(w->crls, 0));
-    flags |= X509_V_FLAG_CRL_CHECK;
-    X509_STORE_CTX_set0_crls(&rctx.ctx, w->crls);
   }
 
   if (ex_count > 0) {
@@ -4038,16 +9159,16 @@ static int check_x509(rcynic_ctx_t *rc,
 
   X509_VERIFY_PARAM_add0_policy(rctx.ctx.param, OBJ_nid2obj(NID_cp_ipAddr_asNumber));
 
-  if (X509_verify_cert(&rctx.ctx) <= 0) {
+  if (X509_verify_cert(&rctx.ctx) <= 0 || revoked) {
     log_validation_status(rc, uri, certificate_failed_validation, generation);
     goto done;
   }
 
+  walk_ctx_expires_asn1(w, X509_get_notAfter(x));
   ret = 1;
 
  done:
   X509_STORE_CTX_cleanup(&rctx.ctx);
-  EVP_PKEY_free(issuer_pkey);
   EVP_PKEY_free(subject_pkey);
   BASIC_CONSTRAINTS_free(bc);
   sk_ACCESS_DESCRIPTION_pop_free(sia, ACCESS_DESCRIPTION_free);
@@ -4131,9 +9252,9 @@ static int check_cms(rcynic_ctx_t *rc,
     goto error;
 
   if (hash)
-    cms = read_cms(path, &hashbuf);
+    cms = read_cms_fd(open_object(rc, wsk, uri, path, prefix), &hashbuf);
   else
-    cms = read_cms(path, NULL);
+    cms = read_cms_fd(open_object(rc, wsk, uri, path, prefix), NULL);
 
   if (!cms)
     goto error;
@@ -4275,19 +9396,20 @@ static X509 *check_cert_1(rcynic_ctx_t *rc,
 {
   hashbuf_t hashbuf;
   X509 *x = NULL;
+  int fd;
 
   assert(uri && path && wsk && certinfo);
 
   if (!uri_to_filename(rc, uri, path, prefix))
     return NULL;
 
-  if (access(path->s, R_OK))
+  if ((fd = open_object(rc, wsk, uri, path, prefix)) < 0)
     return NULL;
 
   if (hash)
-    x = read_cert(path, &hashbuf);
+    x = read_cert_fd(fd, &hashbuf);
   else
-    x = read_cert(path, NULL);
+    x = read_cert_fd(fd, NULL);
 
   if (!x) {
     logmsg(rc, log_sys_err, "Can't read certificate %s", path->s);
@@ -4299,11 +9421,17 @@ static X509 *check_cert_1(rcynic_ctx_t *rc,
     log_validation_status(rc, uri, digest_mismatch, generation);
     if (!rc->allow_digest_mismatch)
       goto punt;
+    hash = NULL;		/* Don't cache what we didn't verify */
   }
 
-  if (check_x509(rc, wsk, uri, x, certinfo, generation))
+  if (object_cache_lookup(rc, wsk, uri, path, hash, hashlen, generation, certinfo))
     return x;
 
+  if (check_x509(rc, wsk, uri, x, certinfo, generation)) {
+    object_cache_add(rc, wsk, uri, path, hash, hashlen, generation, x, certinfo);
+    return x;
+  }
+
  punt:
   X509_free(x);
   return NULL;
@@ -4344,10 +9472,26 @@ static X509 *check_cert(rcynic_ctx_t *rc,
   if (skip_checking_this_object(rc, uri, generation))
     return NULL;
 
+  /*
+   * We only get here for the backup generation if the current one
+   * wasn't accepted.  If it was rejected and the backup copy is the
+   * same file, the backup copy gets rejected for the same reasons.
+   */
+  if (generation == object_generation_backup) {
+    unsigned char current[(MIB_COUNTER_T_MAX + 7) / 8], none[sizeof(current)];
+    validation_status_events(rc, uri, object_generation_current, current);
+    if ((current[object_rejected >> 3] & (1 << (object_rejected & 7))) &&
+	same_file_contents(rc, uri)) {
+      memset(none, 0, sizeof(none));
+      validation_status_copy(rc, uri, none, object_generation_current, object_generation_backup);
+      return NULL;
+    }
+  }
+
   if ((x = check_cert_1(rc, wsk, uri, &path, prefix, certinfo,
 			hash, hashlen, generation)) != NULL)
     install_object(rc, uri, &path, generation);
-  else if (!access(path.s, F_OK))
+  else if (!access_at(rc, &path, F_OK))
     log_validation_status(rc, uri, object_rejected, generation);
   else if (hash && generation == w->manifest_generation)
     log_validation_status(rc, uri, manifest_lists_missing_object, generation);
@@ -4366,17 +9510,19 @@ static Manifest *check_manifest_1(rcynic_ctx_t *rc,
 				  path_t *path,
 				  const path_t *prefix,
 				  certinfo_t *certinfo,
+				  hash_table_t *index,
 				  const object_generation_t generation)
 {
-  STACK_OF(FileAndHash) *sorted_fileList = NULL;
   Manifest *manifest = NULL, *result = NULL;
   CMS_ContentInfo *cms = NULL;
-  FileAndHash *fah = NULL, *fah2 = NULL;
+  FileAndHash *fah = NULL;
   BIO *bio = NULL;
   X509 *x;
   int i;
 
-  assert(rc && wsk && uri && path && prefix);
+  assert(rc && wsk && uri && path && prefix && index);
+
+  memset(index, 0, sizeof(*index));
 
   if ((bio = BIO_new(BIO_s_mem())) == NULL) {
     logmsg(rc, log_sys_err, "Couldn't allocate BIO for manifest %s", uri->s);
@@ -4425,19 +9571,20 @@ static Manifest *check_manifest_1(rcynic_ctx_t *rc,
     goto done;
   }
 
-  if ((sorted_fileList = sk_FileAndHash_dup(manifest->fileList)) == NULL) {
-    logmsg(rc, log_sys_err, "Couldn't allocate shallow copy of fileList for manifest %s", uri->s);
-    goto done;
-  }
-
-  (void) sk_FileAndHash_set_cmp_func(sorted_fileList, FileAndHash_name_cmp);
-  sk_FileAndHash_sort(sorted_fileList);
-
-  for (i = 0; (fah = sk_FileAndHash_value(sorted_fileList, i)) != NULL && (fah2 = sk_FileAndHash_value(sorted_fileList, i + 1)) != NULL; i++) {
-    if (!strcmp((char *) fah->file->data, (char *) fah2->file->data)) {
+  /*
+   * Index the fileList by name.  This is how we catch duplicates, and
+   * the walk keeps the index of whichever manifest we accept for CRL
+   * and not-in-manifest lookups.
+   */
+  for (i = 0; (fah = sk_FileAndHash_value(manifest->fileList, i)) != NULL; i++) {
+    if (manifest_index_find(index, (char *) fah->file->data) != NULL) {
       log_validation_status(rc, uri, duplicate_name_in_manifest, generation);
       goto done;
     }
+    if (!hash_table_insert(index, hash_string((char *) fah->file->data), fah)) {
+      logmsg(rc, log_sys_err, "Couldn't allocate index for manifest %s", uri->s);
+      goto done;
+    }
   }
 
   for (i = 0; (fah = sk_FileAndHash_value(manifest->fileList, i)) != NULL; i++) {
@@ -4455,7 +9602,8 @@ static Manifest *check_manifest_1(rcynic_ctx_t *rc,
   BIO_free(bio);
   Manifest_free(manifest);
   CMS_ContentInfo_free(cms);
-  sk_FileAndHash_free(sorted_fileList);
+  if (result == NULL)
+    hash_table_clear(index);
   return result;
 }
 
@@ -4476,28 +9624,44 @@ static int check_manifest(rcynic_ctx_t *rc,
 			  STACK_OF(walk_ctx_t) *wsk)
 {
   walk_ctx_t *w = walk_ctx_stack_head(wsk);
-  Manifest *old_manifest, *new_manifest, *result = NULL;
+  unsigned char before[(MIB_COUNTER_T_MAX + 7) / 8];
+  Manifest *old_manifest = NULL, *new_manifest, *result = NULL;
   certinfo_t old_certinfo, new_certinfo;
+  hash_table_t old_index, new_index, *index = NULL;
   const uri_t *uri, *crldp = NULL;
   object_generation_t generation = object_generation_null;
   path_t old_path, new_path;
   FileAndHash *fah = NULL;
   const char *crl_tail;
-  int i, ok = 1;
+  int ok = 1;
 
   assert(rc && wsk && w && !w->manifest);
 
+  memset(&old_index, 0, sizeof(old_index));
+
   uri = &w->certinfo.manifest;
 
   logmsg(rc, log_telemetry, "Checking manifest %s", uri->s);
 
+  validation_status_events(rc, uri, object_generation_current, before);
+
   new_manifest = check_manifest_1(rc, wsk, uri, &new_path,
 				  &rc->unauthenticated, &new_certinfo,
-				  object_generation_current);
+				  &new_index, object_generation_current);
+
+  /*
+   * Same deal as in check_crl(): an identical backup copy can't do
+   * better than the current one, so just copy the status codes.
+   */
+  if (same_file_contents(rc, uri))
+    validation_status_copy(rc, uri, before, object_generation_current, object_generation_backup);
+  else
+    old_manifest = check_manifest_1(rc, wsk, uri, &old_path,
+				    &rc->old_authenticated, &old_certinfo,
+				    &old_index, object_generation_backup);
 
-  old_manifest = check_manifest_1(rc, wsk, uri, &old_path,
-				  &rc->old_authenticated, &old_certinfo,
-				  object_generation_backup);
+  (void) uri_to_filename(rc, uri, &new_path, &rc->unauthenticated);
+  (void) uri_to_filename(rc, uri, &old_path, &rc->old_authenticated);
 
   if (!new_manifest)
     result = old_manifest;
@@ -4524,12 +9688,14 @@ static int check_manifest(rcynic_ctx_t *rc,
     generation = object_generation_current;
     install_object(rc, uri, &new_path, generation);
     crldp = &new_certinfo.crldp;
+    index = &new_index;
   }
 
   if (result && result == old_manifest) {
     generation = object_generation_backup;
     install_object(rc, uri, &old_path, generation);
     crldp = &old_certinfo.crldp;
+    index = &old_index;
   }
 
   if (result) {
@@ -4537,11 +9703,7 @@ static int check_manifest(rcynic_ctx_t *rc,
     assert(crl_tail != NULL);
     crl_tail++;
 
-    for (i = 0; (fah = sk_FileAndHash_value(result->fileList, i)) != NULL; i++)
-      if (!strcmp((char *) fah->file->data, crl_tail))
-	break;
-
-    if (!fah) {
+    if ((fah = manifest_index_find(index, crl_tail)) == NULL) {
       log_validation_status(rc, uri, crl_not_in_manifest, generation);
       if (rc->require_crl_in_manifest)
 	ok = 0;
@@ -4554,10 +9716,10 @@ static int check_manifest(rcynic_ctx_t *rc,
     }
   }
 
-  if ((!result || result != new_manifest) && !access(new_path.s, F_OK))
+  if ((!result || result != new_manifest) && !access_at(rc, &new_path, F_OK))
     log_validation_status(rc, uri, object_rejected, object_generation_current);
 
-  if (!result && !access(old_path.s, F_OK))
+  if (!result && !access_at(rc, &old_path, F_OK))
     log_validation_status(rc, uri, object_rejected, object_generation_backup);
 
   if (result != new_manifest)
@@ -4566,10 +9728,19 @@ static int check_manifest(rcynic_ctx_t *rc,
   if (result != old_manifest)
     Manifest_free(old_manifest);
 
+  if (index != NULL) {
+    w->manifest_index = *index;
+    memset(index, 0, sizeof(*index));
+  }
+  hash_table_clear(&new_index);
+  hash_table_clear(&old_index);
+
   w->manifest = result;
   if (crldp)
     w->crldp = *crldp;
   w->manifest_generation = generation;
+  if (result)
+    walk_ctx_expires_asn1(w, result->nextUpdate);
 
   return ok;
 }
@@ -4584,15 +9755,18 @@ static void rsync_needed_mark_recheck(rcynic_ctx_t *rc,
 {
   validation_status_t *v = NULL;
 
+  rcynic_lock(rc);
+
   if (uri->s[0] != '\0')
-    v = validation_status_find(rc->validation_status_root,
-			       uri, object_generation_current);
+    v = validation_status_find(rc, uri, object_generation_current);
 
   if (v) {
     validation_status_set_code(v, stale_crl_or_manifest, 0);
     log_validation_status(rc, uri, rechecking_object,
 			  object_generation_current);
   }
+
+  rcynic_unlock(rc);
 }
 
 /**
@@ -4618,6 +9792,7 @@ static int rsync_needed(rcynic_ctx_t *rc,
     rsync_needed_mark_recheck(rc, &w->certinfo.crldp);
     Manifest_free(w->manifest);
     w->manifest = NULL;
+    hash_table_clear(&w->manifest_index);
   }
 
   return needed;
@@ -4681,6 +9856,7 @@ static int check_roa_1(rcynic_ctx_t *rc,
   STACK_OF(IPAddressFamily) *roa_resources = NULL, *ee_resources = NULL;
   unsigned char addrbuf[ADDR_RAW_BUF_LEN];
   CMS_ContentInfo *cms = NULL;
+  certinfo_t certinfo;
   BIO *bio = NULL;
   ROA *roa = NULL;
   X509 *x = NULL;
@@ -4691,12 +9867,16 @@ static int check_roa_1(rcynic_ctx_t *rc,
 
   assert(rc && wsk && uri && path && prefix);
 
+  if (uri_to_filename(rc, uri, path, prefix) &&
+      object_cache_lookup(rc, wsk, uri, path, hash, hashlen, generation, NULL))
+    return 1;
+
   if ((bio = BIO_new(BIO_s_mem())) == NULL) {
     logmsg(rc, log_sys_err, "Couldn't allocate BIO for ROA %s", uri->s);
     goto error;
   }
 
-  if (!check_cms(rc, wsk, uri, path, prefix, &cms, &x, NULL, bio, NULL, 0,
+  if (!check_cms(rc, wsk, uri, path, prefix, &cms, &x, &certinfo, bio, NULL, 0,
 		 NID_ct_ROA, 0, generation))
     goto error;
 
@@ -4804,6 +9984,8 @@ static int check_roa_1(rcynic_ctx_t *rc,
     goto error;
   }
 
+  object_cache_add(rc, wsk, uri, path, hash, hashlen, generation, x, &certinfo);
+
   result = 1;
 
  error:
@@ -4827,34 +10009,42 @@ static void check_roa(rcynic_ctx_t *rc,
 		      const size_t hashlen)
 {
   walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  unsigned char before[(MIB_COUNTER_T_MAX + 7) / 8];
   path_t path;
 
   assert(rc && wsk && w && uri);
 
-  if (uri_to_filename(rc, uri, &path, &rc->new_authenticated) &&
-      !access(path.s, F_OK))
+  if (object_installed(rc, uri))
     return;
 
   logmsg(rc, log_telemetry, "Checking ROA %s", uri->s);
 
+  validation_status_events(rc, uri, object_generation_current, before);
+
   if (check_roa_1(rc, wsk, uri, &path, &rc->unauthenticated,
 		  hash, hashlen, object_generation_current)) {
     install_object(rc, uri, &path, object_generation_current);
     return;
   }
 
-  if (!access(path.s, F_OK))
+  if (!access_at(rc, &path, F_OK))
     log_validation_status(rc, uri, object_rejected, object_generation_current);
   else if (hash)
     log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_current);
 
+  if (same_file_contents(rc, uri)) {
+    validation_status_copy(rc, uri, before, object_generation_current, object_generation_backup);
+    log_validation_status(rc, uri, object_rejected, object_generation_backup);
+    return;
+  }
+
   if (check_roa_1(rc, wsk, uri, &path, &rc->old_authenticated,
 		  hash, hashlen, object_generation_backup)) {
     install_object(rc, uri, &path, object_generation_backup);
     return;
   }
 
-  if (!access(path.s, F_OK))
+  if (!access_at(rc, &path, F_OK))
     log_validation_status(rc, uri, object_rejected, object_generation_backup);
   else if (hash && w->manifest_generation == object_generation_backup)
     log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_backup);
@@ -4875,12 +10065,17 @@ static int check_ghostbuster_1(rcynic_ctx_t *rc,
 			       const object_generation_t generation)
 {
   CMS_ContentInfo *cms = NULL;
+  certinfo_t certinfo;
   BIO *bio = NULL;
   X509 *x;
   int result = 0;
 
   assert(rc && wsk && uri && path && prefix);
 
+  if (uri_to_filename(rc, uri, path, prefix) &&
+      object_cache_lookup(rc, wsk, uri, path, hash, hashlen, generation, NULL))
+    return 1;
+
 #if 0
   /*
    * May want this later if we're going to inspect the VCard.  For now,
@@ -4892,7 +10087,7 @@ static int check_ghostbuster_1(rcynic_ctx_t *rc,
   }
 #endif
 
-  if (!check_cms(rc, wsk, uri, path, prefix, &cms, &x, NULL, bio, NULL, 0,
+  if (!check_cms(rc, wsk, uri, path, prefix, &cms, &x, &certinfo, bio, NULL, 0,
 		 NID_ct_rpkiGhostbusters, 1, generation))
     goto error;
 
@@ -4903,6 +10098,8 @@ static int check_ghostbuster_1(rcynic_ctx_t *rc,
    */
 #endif
 
+  object_cache_add(rc, wsk, uri, path, hash, hashlen, generation, x, &certinfo);
+
   result = 1;
 
  error:
@@ -4923,34 +10120,42 @@ static void check_ghostbuster(rcynic_ctx_t *rc,
 			      const size_t hashlen)
 {
   walk_ctx_t *w = walk_ctx_stack_head(wsk);
+  unsigned char before[(MIB_COUNTER_T_MAX + 7) / 8];
   path_t path;
 
   assert(rc && wsk && w && uri);
 
-  if (uri_to_filename(rc, uri, &path, &rc->new_authenticated) &&
-      !access(path.s, F_OK))
+  if (object_installed(rc, uri))
     return;
 
   logmsg(rc, log_telemetry, "Checking Ghostbuster record %s", uri->s);
 
+  validation_status_events(rc, uri, object_generation_current, before);
+
   if (check_ghostbuster_1(rc, wsk, uri, &path, &rc->unauthenticated,
 			  hash, hashlen, object_generation_current)) {
     install_object(rc, uri, &path, object_generation_current);
     return;
   }
 
-  if (!access(path.s, F_OK))
+  if (!access_at(rc, &path, F_OK))
     log_validation_status(rc, uri, object_rejected, object_generation_current);
   else if (hash)
     log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_current);
 
+  if (same_file_contents(rc, uri)) {
+    validation_status_copy(rc, uri, before, object_generation_current, object_generation_backup);
+    log_validation_status(rc, uri, object_rejected, object_generation_backup);
+    return;
+  }
+
   if (check_ghostbuster_1(rc, wsk, uri, &path, &rc->old_authenticated,
 			  hash, hashlen, object_generation_backup)) {
     install_object(rc, uri, &path, object_generation_backup);
     return;
   }
 
-  if (!access(path.s, F_OK))
+  if (!access_at(rc, &path, F_OK))
     log_validation_status(rc, uri, object_rejected, object_generation_backup);
   else if (hash && w->manifest_generation == object_generation_backup)
     log_validation_status(rc, uri, manifest_lists_missing_object, object_generation_backup);
@@ -4960,6 +10165,25 @@ static void check_ghostbuster(rcynic_ctx_t *rc,
 
 static void walk_cert(rcynic_ctx_t *, void *);
 
+/**
+ * Carry on walking the rest of the issuer's products on a copy of the
+ * walk stack, as a separate task, leaving the head of the stack to
+ * whoever has it now.  We do this while a publication point is being
+ * fetched, and, when there are validation threads, for each child CA
+ * we find, so that separate subtrees get validated in parallel.
+ */
+static void walk_cert_fork(rcynic_ctx_t *rc, STACK_OF(walk_ctx_t) *wsk)
+{
+  if ((wsk = walk_ctx_stack_clone(wsk)) == NULL) {
+    logmsg(rc, log_sys_err,
+	   "walk_ctx_stack_clone() failed, probably memory exhaustion, blundering onwards without forking stack");
+    return;
+  }
+
+  walk_ctx_stack_pop(wsk);
+  task_add(rc, walk_cert, wsk);
+}
+
 /**
  * rsync callback for fetching SIA tree.
  */
@@ -4976,21 +10200,43 @@ static void rsync_sia_callback(rcynic_ctx_t *rc,
 
   if (status != rsync_status_pending) {
     w->state++;
-    task_add(rc, walk_cert, wsk);
+    task_add_ready(rc, walk_cert, wsk);
     return;
   }
 
-  if (rsync_count_runable(rc) >= rc->max_parallel_fetches)
+  if (rsync_count_runable(rc) < rc->max_parallel_fetches)
+    walk_cert_fork(rc, wsk);
+}
+
+/**
+ * RRDP callback for fetching SIA tree.  If RRDP didn't work out, we
+ * fall back to rsync.
+ */
+static void rrdp_sia_callback(rcynic_ctx_t *rc,
+			      const rsync_status_t status,
+			      void *cookie)
+{
+  STACK_OF(walk_ctx_t) *wsk = cookie;
+  walk_ctx_t *w = walk_ctx_stack_head(wsk);
+
+  assert(rc && wsk);
+
+  switch (status) {
+
+  case rsync_status_pending:
+    if (rc->rrdp_jobs <= rc->rrdp_threads)
+      walk_cert_fork(rc, wsk);
     return;
 
-  if ((wsk = walk_ctx_stack_clone(wsk)) == NULL) {
-    logmsg(rc, log_sys_err,
-	   "walk_ctx_stack_clone() failed, probably memory exhaustion, blundering onwards without forking stack");
+  case rsync_status_done:
+    w->state++;
+    task_add_ready(rc, walk_cert, wsk);
     return;
-  }
 
-  walk_ctx_stack_pop(wsk);
-  task_add(rc, walk_cert, wsk);
+  default:
+    rsync_tree(rc, &w->certinfo.sia, wsk, rsync_sia_callback);
+    return;
+  }
 }
 
 /**
@@ -5011,14 +10257,24 @@ static void walk_cert(rcynic_ctx_t *rc, void *cookie)
   STACK_OF(walk_ctx_t) *wsk = cookie;
   const unsigned char *hash = NULL;
   object_generation_t generation;
+  walk_ctx_t *w, *locked = NULL;
   size_t hashlen;
-  walk_ctx_t *w;
   uri_t uri;
 
   assert(rc && wsk);
 
   while ((w = walk_ctx_stack_head(wsk)) != NULL) {
 
+    /*
+     * Frames below the head of the stack may also be in use by other
+     * validation threads, so hold the head's lock while stepping it.
+     */
+    if (w != locked) {
+      walk_ctx_unlock(locked);
+      walk_ctx_lock(w);
+      locked = w;
+    }
+
     switch (w->state) {
     case walk_state_current:
       generation = object_generation_current;
@@ -5052,7 +10308,9 @@ static void walk_cert(rcynic_ctx_t *rc, void *cookie)
     case walk_state_rsync:
 
       if (rsync_needed(rc, wsk)) {
-	rsync_tree(rc, &w->certinfo.sia, wsk, rsync_sia_callback);
+	walk_ctx_unlock(w);
+	if (!rrdp_tree(rc, &w->certinfo.rrdpnotify, &w->certinfo.sia, wsk, rrdp_sia_callback))
+	  rsync_tree(rc, &w->certinfo.sia, wsk, rsync_sia_callback);
 	return;
       }
       log_validation_status(rc, &w->certinfo.sia, rsync_transfer_skipped, object_generation_null);
@@ -5061,7 +10319,17 @@ static void walk_cert(rcynic_ctx_t *rc, void *cookie)
 
     case walk_state_ready:
 
-      walk_ctx_loop_init(rc, wsk);      /* sets w->state */
+      if (!w->carry_checked) {
+	w->carry_checked = 1;
+	(void) pubpoint_carry_forward(rc, wsk);
+      }
+
+      if (w->carry == NULL)
+	walk_ctx_loop_init(rc, wsk);    /* sets w->state */
+      else if (!pubpoint_carry_next(rc, wsk))
+	w->state = walk_state_done;
+      else if (task_want_more(rc))
+	walk_cert_fork(rc, wsk);
       continue;
 
     case walk_state_current:
@@ -5103,8 +10371,12 @@ static void walk_cert(rcynic_ctx_t *rc, void *cookie)
       if (endswith(uri.s, ".cer")) {
 	certinfo_t certinfo;
 	X509 *x = check_cert(rc, wsk, &uri, &certinfo, hash, hashlen);
+	if (x != NULL && certinfo.ca)
+	  pubpoint_add_child(rc, w, &certinfo);
 	if (!walk_ctx_stack_push(wsk, x, &certinfo))
 	  walk_ctx_loop_next(rc, wsk);
+	else if (certinfo.ca && task_want_more(rc))
+	  walk_cert_fork(rc, wsk);
 	continue;
       }
 
@@ -5114,6 +10386,10 @@ static void walk_cert(rcynic_ctx_t *rc, void *cookie)
 
     case walk_state_done:
 
+      walk_ctx_close_dirs(w);
+      pubpoint_record(rc, wsk);
+      walk_ctx_unlock(w);
+      locked = NULL;
       walk_ctx_stack_pop(wsk);	/* Resume our issuer's state */
       continue;
 
@@ -5216,7 +10492,7 @@ static int check_ta_cer(rcynic_ctx_t *rc,
 	     "Couldn't construct path name for trust anchor %s", path1.s);
       goto lose;
     }
-    if (access(path2.s, F_OK))
+    if (access_at(rc, &path2, F_OK))
       break;
   }
   if (i == INT_MAX) {
@@ -5439,115 +10715,415 @@ static int check_ta_dir(rcynic_ctx_t *rc,
 
 
 
+/**
+ * Buffered output for the summary writers.  We format into a large
+ * buffer ourselves rather than making several fprintf() calls for
+ * every status bit of every URI, which is most of the cost of writing
+ * the summary for a large run.
+ */
+typedef struct summary_buf {
+  FILE *f;
+  char *buf;
+  size_t len;
+  int ok;
+} summary_buf_t;
+
+/**
+ * Flush a summary buffer to its file.
+ */
+static void summary_flush(summary_buf_t *sb)
+{
+  if (sb->ok && sb->len > 0)
+    sb->ok = fwrite(sb->buf, 1, sb->len, sb->f) == sb->len;
+  sb->len = 0;
+}
+
+/**
+ * Append raw bytes to a summary buffer.
+ */
+static void summary_write(summary_buf_t *sb, const void *data, const size_t n)
+{
+  if (sb->len + n > SUMMARY_BUFFER_SIZE)
+    summary_flush(sb);
+  if (n > SUMMARY_BUFFER_SIZE) {
+    if (sb->ok)
+      sb->ok = fwrite(data, 1, n, sb->f) == n;
+    return;
+  }
+  memcpy(sb->buf + sb->len, data, n);
+  sb->len += n;
+}
+
+/**
+ * Append a string to a summary buffer.
+ */
+static void summary_puts(summary_buf_t *sb, const char *s)
+{
+  summary_write(sb, s, strlen(s));
+}
+
+/**
+ * Append a string to a summary buffer, escaping XML special characters.
+ */
+static void summary_puts_xml(summary_buf_t *sb, const char *s)
+{
+  size_t n;
+
+  for (;;) {
+    n = strcspn(s, "&<>\"");
+    summary_write(sb, s, n);
+    switch (s[n]) {
+    case '&':	summary_puts(sb, "&amp;");	break;
+    case '<':	summary_puts(sb, "&lt;");	break;
+    case '>':	summary_puts(sb, "&gt;");	break;
+    case '"':	summary_puts(sb, "&quot;");	break;
+    default:	return;
+    }
+    s += n + 1;
+  }
+}
+
+/**
+ * Append formatted text to a summary buffer.  Only used for the
+ * handful of lines that aren't per-URI, so it doesn't need to be fast.
+ */
+static void summary_printf(summary_buf_t *sb, const char *fmt, ...)
+{
+  char line[1024];
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+
+  if (n < 0 || n >= sizeof(line))
+    sb->ok = 0;
+  else
+    summary_write(sb, line, n);
+}
+
+/**
+ * Open a summary output file.  We write to a temporary file and
+ * rename() it into place when done, or write straight to standard
+ * output if the filename is "-".
+ */
+static int summary_open(const rcynic_ctx_t *rc,
+			summary_buf_t *sb,
+			const char *filename,
+			const char *what,
+			path_t *temp)
+{
+  memset(sb, 0, sizeof(*sb));
+
+  logmsg(rc, log_telemetry, "Writing %s summary to %s", what,
+	 (strcmp(filename, "-") ? filename : "standard output"));
+
+  if (strcmp(filename, "-") &&
+      snprintf(temp->s, sizeof(temp->s), "%s.%u.tmp", filename, (unsigned) getpid()) >= sizeof(temp->s)) {
+    logmsg(rc, log_usage_err, "Filename \"%s\" is too long, not writing %s", filename, what);
+    return 0;
+  }
+
+  if ((sb->buf = malloc(SUMMARY_BUFFER_SIZE)) == NULL) {
+    logmsg(rc, log_sys_err, "Couldn't allocate buffer for %s summary", what);
+    return 0;
+  }
+
+  if (!strcmp(filename, "-"))
+    sb->f = stdout;
+  else
+    sb->f = fopen(temp->s, "w");
+
+  sb->ok = sb->f != NULL;
+  return 1;
+}
+
+/**
+ * Finish writing a summary output file.
+ */
+static int summary_close(const rcynic_ctx_t *rc,
+			 summary_buf_t *sb,
+			 const char *filename,
+			 const char *what,
+			 const path_t *temp)
+{
+  const int use_stdout = !strcmp(filename, "-");
+  int ok;
+
+  summary_flush(sb);
+  ok = sb->ok;
+
+  if (sb->f != NULL && use_stdout)
+    ok &= fflush(sb->f) != EOF;
+
+  if (sb->f != NULL && !use_stdout)
+    ok &= fclose(sb->f) != EOF;
+
+  if (ok && !use_stdout)
+    ok &= rename(temp->s, filename) == 0;
+
+  if (!ok)
+    logmsg(rc, log_sys_err, "Couldn't write %s summary to %s: %s", what,
+	   (use_stdout ? "standard output" : filename), strerror(errno));
+
+  if (!ok && !use_stdout)
+    (void) unlink(temp->s);
+
+  free(sb->buf);
+  memset(sb, 0, sizeof(*sb));
+  return ok;
+}
+
 /**
  * Write detailed log of what we've done as an XML file.
  */
 static int write_xml_file(const rcynic_ctx_t *rc,
 			  const char *xmlfile)
 {
-  int i, j, use_stdout, ok;
   char hostname[HOSTNAME_MAX];
-  mib_counter_t code;
+  summary_buf_t sb;
   timestamp_t ts;
-  FILE *f = NULL;
   path_t xmltemp;
+  unsigned bits;
+  int i, j;
 
   if (xmlfile == NULL)
     return 1;
 
-  use_stdout = !strcmp(xmlfile, "-");
-
-  logmsg(rc, log_telemetry, "Writing XML summary to %s",
-	 (use_stdout ? "standard output" : xmlfile));
-
-  if (use_stdout) {
-    f = stdout;
-    ok = 1;
-  } else if (snprintf(xmltemp.s, sizeof(xmltemp.s), "%s.%u.tmp", xmlfile, (unsigned) getpid()) >= sizeof(xmltemp.s)) {
-    logmsg(rc, log_usage_err, "Filename \"%s\" is too long, not writing XML", xmlfile);
+  if (!summary_open(rc, &sb, xmlfile, "XML", &xmltemp))
     return 0;
-  } else {
-    ok = (f = fopen(xmltemp.s, "w")) != NULL;
+
+  if (gethostname(hostname, sizeof(hostname)) != 0) {
+    hostname[0] = '\0';
+    sb.ok = 0;
   }
 
-  ok &= gethostname(hostname, sizeof(hostname)) == 0;
+  summary_printf(&sb, "<?xml version=\"1.0\" ?>\n"
+		 "<rcynic-summary date=\"%s\" rcynic-version=\"%s\""
+		 " summary-version=\"%d\" reporting-hostname=\"%s\">\n"
+		 "  <labels>\n",
+		 time_to_string(&ts, NULL),
+		 svn_id, XML_SUMMARY_VERSION, hostname);
 
-  if (ok)
-    ok &= fprintf(f, "<?xml version=\"1.0\" ?>\n"
-		  "<rcynic-summary date=\"%s\" rcynic-version=\"%s\""
-		  " summary-version=\"%d\" reporting-hostname=\"%s\">\n"
-		  "  <labels>\n",
-		  time_to_string(&ts, NULL),
-		  svn_id, XML_SUMMARY_VERSION, hostname) != EOF;
-
-  for (j = 0; ok && j < MIB_COUNTER_T_MAX; ++j)
-    ok &= fprintf(f, "    <%s kind=\"%s\">%s</%s>\n",
-		  mib_counter_label[j], mib_counter_kind[j],
-		  (mib_counter_desc[j]
-		   ? mib_counter_desc[j]
-		   : X509_verify_cert_error_string(mib_counter_openssl[j])),
-		  mib_counter_label[j]) != EOF;
+  for (j = 0; j < MIB_COUNTER_T_MAX; ++j)
+    summary_printf(&sb, "    <%s kind=\"%s\">%s</%s>\n",
+		   mib_counter_label[j], mib_counter_kind[j],
+		   (mib_counter_desc[j]
+		    ? mib_counter_desc[j]
+		    : X509_verify_cert_error_string(mib_counter_openssl[j])),
+		   mib_counter_label[j]);
 
-  if (ok)
-    ok &= fprintf(f, "  </labels>\n") != EOF;
+  summary_puts(&sb, "  </labels>\n");
 
-  for (i = 0; ok && i < sk_validation_status_t_num(rc->validation_status); i++) {
+  /*
+   * Only visit the status codes that are actually set, lowest first,
+   * rather than testing every code for every URI.
+   */
+  for (i = 0; sb.ok && i < sk_validation_status_t_num(rc->validation_status); i++) {
     validation_status_t *v = sk_validation_status_t_value(rc->validation_status, i);
     assert(v);
 
     (void) time_to_string(&ts, &v->timestamp);
 
-    for (code = (mib_counter_t) 0; ok && code < MIB_COUNTER_T_MAX; code++) {
-      if (validation_status_get_code(v, code)) {
-	if (ok)
-	  ok &= fprintf(f, "  <validation_status timestamp=\"%s\" status=\"%s\"",
-			ts.s, mib_counter_label[code]) != EOF;
-	if (ok && (v->generation == object_generation_current ||
-		   v->generation == object_generation_backup))
-	  ok &= fprintf(f, " generation=\"%s\"",
-			object_generation_label[v->generation]) != EOF;
-	if (ok)
-	  ok &= fprintf(f, ">%s</validation_status>\n", v->uri.s) != EOF;
+    for (j = 0; j < sizeof(v->events); j++) {
+      for (bits = v->events[j]; bits != 0; bits &= bits - 1) {
+	const mib_counter_t code = (mib_counter_t) (j * 8 + ffs(bits) - 1);
+	summary_puts(&sb, "  <validation_status timestamp=\"");
+	summary_puts(&sb, ts.s);
+	summary_puts(&sb, "\" status=\"");
+	summary_puts(&sb, mib_counter_label[code]);
+	if (v->generation == object_generation_current ||
+	    v->generation == object_generation_backup) {
+	  summary_puts(&sb, "\" generation=\"");
+	  summary_puts(&sb, object_generation_label[v->generation]);
+	}
+	summary_puts(&sb, "\">");
+	summary_puts_xml(&sb, v->prefix);
+	summary_puts_xml(&sb, v->name);
+	summary_puts(&sb, "</validation_status>\n");
       }
     }
   }
 
-  for (i = 0; ok && i < sk_rsync_history_t_num(rc->rsync_history); i++) {
+  sk_rsync_history_t_sort(rc->rsync_history);
+
+  for (i = 0; sb.ok && i < sk_rsync_history_t_num(rc->rsync_history); i++) {
     rsync_history_t *h = sk_rsync_history_t_value(rc->rsync_history, i);
     assert(h);
 
-    if (ok)
-      ok &= fprintf(f, "  <rsync_history") != EOF;
-    if (ok && h->started)
-      ok &= fprintf(f, " started=\"%s\"",
-		    time_to_string(&ts, &h->started)) != EOF;
-    if (ok && h->finished)
-      ok &= fprintf(f, " finished=\"%s\"",
-		    time_to_string(&ts, &h->finished)) != EOF;
-    if (ok && h->status != rsync_status_done)
-      ok &= fprintf(f, " error=\"%u\"", (unsigned) h->status) != EOF;
-    if (ok)
-      ok &= fprintf(f, ">%s%s</rsync_history>\n",
-		    h->uri.s, (h->final_slash ? "/" : "")) != EOF;
+    summary_puts(&sb, "  <rsync_history");
+    if (h->started)
+      summary_printf(&sb, " started=\"%s\"", time_to_string(&ts, &h->started));
+    if (h->finished)
+      summary_printf(&sb, " finished=\"%s\"", time_to_string(&ts, &h->finished));
+    if (h->status != rsync_status_done)
+      summary_printf(&sb, " error=\"%u\"", (unsigned) h->status);
+    summary_puts(&sb, ">");
+    summary_puts_xml(&sb, h->uri.s);
+    summary_puts(&sb, h->final_slash ? "/</rsync_history>\n" : "</rsync_history>\n");
   }
 
-  if (ok)
-    ok &= fprintf(f, "</rcynic-summary>\n") != EOF;
+  summary_puts(&sb, "</rcynic-summary>\n");
 
-  if (f && !use_stdout)
-    ok &= fclose(f) != EOF;
+  return summary_close(rc, &sb, xmlfile, "XML", &xmltemp);
+}
 
-  if (ok && !use_stdout)
-    ok &= rename(xmltemp.s, xmlfile) == 0;
+/**
+ * CBOR (RFC 7049) major types, and the one simple value we use.
+ */
+#define	CBOR_UINT	0
+#define	CBOR_TEXT	3
+#define	CBOR_ARRAY	4
+#define	CBOR_MAP	5
+#define	CBOR_SIMPLE	7
+#define	CBOR_NULL	22
 
-  if (!ok)
-    logmsg(rc, log_sys_err, "Couldn't write XML summary to %s: %s",
-	   (use_stdout ? "standard output" : xmlfile), strerror(errno));
+/**
+ * Append a CBOR data item head: major type plus argument.
+ */
+static void cbor_head(summary_buf_t *sb, const unsigned major, const uint64_t n)
+{
+  unsigned char b[9];
+  size_t len, i;
+
+  if (n < 24) {
+    b[0] = (major << 5) | n;
+    len = 1;
+  } else if (n <= 0xFF) {
+    b[0] = (major << 5) | 24;
+    len = 2;
+  } else if (n <= 0xFFFF) {
+    b[0] = (major << 5) | 25;
+    len = 3;
+  } else if (n <= 0xFFFFFFFF) {
+    b[0] = (major << 5) | 26;
+    len = 5;
+  } else {
+    b[0] = (major << 5) | 27;
+    len = 9;
+  }
 
-  if (!ok && !use_stdout)
-    (void) unlink(xmltemp.s);
+  for (i = 1; i < len; i++)
+    b[i] = (n >> ((len - 1 - i) * 8)) & 0xFF;
 
-  return ok;
+  summary_write(sb, b, len);
+}
+
+/**
+ * Append a CBOR text string made of up to two concatenated parts.
+ */
+static void cbor_text(summary_buf_t *sb, const char *s1, const char *s2)
+{
+  const size_t n1 = strlen(s1), n2 = s2 == NULL ? 0 : strlen(s2);
+  cbor_head(sb, CBOR_TEXT, n1 + n2);
+  summary_write(sb, s1, n1);
+  summary_write(sb, s2, n2);
+}
+
+/**
+ * Write a summary file in CBOR format, for tools that would rather
+ * not parse hundreds of megabytes of XML.  Content is the same as the
+ * XML summary, as a map:
+ *
+ *   "date":               text
+ *   "rcynic-version":     text
+ *   "summary-version":    uint
+ *   "reporting-hostname": text
+ *   "labels":             array of [label, kind, description]
+ *   "validation_status":  array of [uri, timestamp, generation, [codes]]
+ *   "rsync_history":      array of [uri, started, finished, error]
+ *
+ * Timestamps are seconds since the epoch, zero if not set.  Status
+ * codes are indexes into "labels".  Generation is a label or null,
+ * as is rsync error.
+ */
+static int write_cbor_file(const rcynic_ctx_t *rc,
+			   const char *cborfile)
+{
+  char hostname[HOSTNAME_MAX];
+  summary_buf_t sb;
+  timestamp_t ts;
+  path_t cbortemp;
+  unsigned bits;
+  int i, j, n;
+
+  if (cborfile == NULL)
+    return 1;
+
+  if (!summary_open(rc, &sb, cborfile, "CBOR", &cbortemp))
+    return 0;
+
+  if (gethostname(hostname, sizeof(hostname)) != 0) {
+    hostname[0] = '\0';
+    sb.ok = 0;
+  }
+
+  cbor_head(&sb, CBOR_MAP, 7);
+
+  cbor_text(&sb, "date", NULL);
+  cbor_text(&sb, time_to_string(&ts, NULL), NULL);
+  cbor_text(&sb, "rcynic-version", NULL);
+  cbor_text(&sb, svn_id, NULL);
+  cbor_text(&sb, "summary-version", NULL);
+  cbor_head(&sb, CBOR_UINT, XML_SUMMARY_VERSION);
+  cbor_text(&sb, "reporting-hostname", NULL);
+  cbor_text(&sb, hostname, NULL);
+
+  cbor_text(&sb, "labels", NULL);
+  cbor_head(&sb, CBOR_ARRAY, MIB_COUNTER_T_MAX);
+  for (j = 0; j < MIB_COUNTER_T_MAX; ++j) {
+    cbor_head(&sb, CBOR_ARRAY, 3);
+    cbor_text(&sb, mib_counter_label[j], NULL);
+    cbor_text(&sb, mib_counter_kind[j], NULL);
+    cbor_text(&sb, (mib_counter_desc[j]
+		    ? mib_counter_desc[j]
+		    : X509_verify_cert_error_string(mib_counter_openssl[j])), NULL);
+  }
+
+  cbor_text(&sb, "validation_status", NULL);
+  cbor_head(&sb, CBOR_ARRAY, sk_validation_status_t_num(rc->validation_status));
+  for (i = 0; sb.ok && i < sk_validation_status_t_num(rc->validation_status); i++) {
+    validation_status_t *v = sk_validation_status_t_value(rc->validation_status, i);
+    assert(v);
+
+    cbor_head(&sb, CBOR_ARRAY, 4);
+    cbor_text(&sb, v->prefix, v->name);
+    cbor_head(&sb, CBOR_UINT, v->timestamp);
+    if (v->generation == object_generation_current ||
+	v->generation == object_generation_backup)
+      cbor_text(&sb, object_generation_label[v->generation], NULL);
+    else
+      cbor_head(&sb, CBOR_SIMPLE, CBOR_NULL);
+
+    for (n = 0, j = 0; j < sizeof(v->events); j++)
+      for (bits = v->events[j]; bits != 0; bits &= bits - 1)
+	n++;
+    cbor_head(&sb, CBOR_ARRAY, n);
+    for (j = 0; j < sizeof(v->events); j++)
+      for (bits = v->events[j]; bits != 0; bits &= bits - 1)
+	cbor_head(&sb, CBOR_UINT, j * 8 + ffs(bits) - 1);
+  }
+
+  sk_rsync_history_t_sort(rc->rsync_history);
+
+  cbor_text(&sb, "rsync_history", NULL);
+  cbor_head(&sb, CBOR_ARRAY, sk_rsync_history_t_num(rc->rsync_history));
+  for (i = 0; sb.ok && i < sk_rsync_history_t_num(rc->rsync_history); i++) {
+    rsync_history_t *h = sk_rsync_history_t_value(rc->rsync_history, i);
+    assert(h);
+
+    cbor_head(&sb, CBOR_ARRAY, 4);
+    cbor_text(&sb, h->uri.s, h->final_slash ? "/" : NULL);
+    cbor_head(&sb, CBOR_UINT, h->started);
+    cbor_head(&sb, CBOR_UINT, h->finished);
+    if (h->status != rsync_status_done)
+      cbor_head(&sb, CBOR_UINT, h->status);
+    else
+      cbor_head(&sb, CBOR_SIMPLE, CBOR_NULL);
+  }
+
+  return summary_close(rc, &sb, cborfile, "CBOR", &cbortemp);
 }
 
 
@@ -5621,7 +11197,7 @@ int main(int argc, char *argv[])
   int opt_jitter = 0, use_syslog = 0, use_stderr = 0, syslog_facility = 0;
   int opt_syslog = 0, opt_stderr = 0, opt_level = 0, prune = 1;
   int opt_auth = 0, opt_unauth = 0, keep_lockfile = 0;
-  char *lockfile = NULL, *xmlfile = NULL;
+  char *lockfile = NULL, *xmlfile = NULL, *cborfile = NULL;
   char *cfg_file = "rcynic.conf";
   int c, i, ret = 1, jitter = 600, lockfd = -1;
   STACK_OF(CONF_VALUE) *cfg_section = NULL;
@@ -5665,23 +11241,39 @@ int main(int argc, char *argv[])
   rc.allow_1024_bit_ee_key = 1;
   rc.allow_wrong_cms_si_attributes = 1;
   rc.max_parallel_fetches = 1;
+  rc.rsync_batch_size = 8;
   rc.max_retries = 3;
   rc.retry_wait_min = 30;
   rc.run_rsync = 1;
   rc.rsync_timeout = 300;
   rc.max_select_time = 30;
   rc.rsync_early = 1;
+  rc.validation_threads = 1;
+  rc.pipeline_depth = 32;
+  rc.wakeup_fds[0] = rc.wakeup_fds[1] = -1;
+  rc.unauthenticated_fd = rc.old_authenticated_fd = rc.new_authenticated_fd = -1;
+  rc.epoll_fd = -1;
+  (void) pthread_mutex_init(&rc.trash.lock, NULL);
+  rc.mkdir_cache = calloc(1, sizeof(*rc.mkdir_cache));
+  rc.rrdp_timeout = 300;
+  rc.rrdp_max_time = 1800;
+  rc.rrdp_max_size = 1 << 30;
+  rc.object_cache.magic = OBJECT_CACHE_MAGIC;
+  rc.pubpoint_cache.magic = PUBPOINT_CACHE_MAGIC;
 
 #define QQ(x,y)   rc.priority[x] = y;
   LOG_LEVELS;
 #undef QQ
 
   if (!set_directory(&rc, &rc.authenticated,   "rcynic-data/authenticated", 0) ||
-      !set_directory(&rc, &rc.unauthenticated, "rcynic-data/unauthenticated/", 1))
+      !set_directory(&rc, &rc.unauthenticated, "rcynic-data/unauthenticated/", 1) ||
+      !set_directory(&rc, &rc.rrdp_directory,  "rcynic-data/rrdp/", 1))
     goto done;
 
   OpenSSL_add_all_algorithms();
   ERR_load_crypto_strings();
+  SSL_library_init();
+  SSL_load_error_strings();
 
   if (!create_missing_nids()) {
     logmsg(&rc, log_sys_err, "Couldn't initialize missing OIDs!");
@@ -5788,6 +11380,28 @@ int main(int argc, char *argv[])
 	     !set_directory(&rc, &rc.unauthenticated, val->value, 1))
       goto done;
 
+    else if (!name_cmp(val->name, "object-cache") &&
+	     strlen(val->value) >= sizeof(rc.object_cache.filename.s)) {
+      logmsg(&rc, log_usage_err, "Object cache filename \"%s\" too long", val->value);
+      goto done;
+    }
+
+    else if (!name_cmp(val->name, "object-cache"))
+      strcpy(rc.object_cache.filename.s, val->value);
+
+    else if (!name_cmp(val->name, "pubpoint-cache") &&
+	     strlen(val->value) >= sizeof(rc.pubpoint_cache.filename.s)) {
+      logmsg(&rc, log_usage_err, "Publication point cache filename \"%s\" too long", val->value);
+      goto done;
+    }
+
+    else if (!name_cmp(val->name, "pubpoint-cache"))
+      strcpy(rc.pubpoint_cache.filename.s, val->value);
+
+    else if (!name_cmp(val->name, "rrdp-directory") &&
+	     !set_directory(&rc, &rc.rrdp_directory, val->value, 1))
+      goto done;
+
     else if (!name_cmp(val->name, "trust-anchor-directory") &&
 	     !set_directory(&rc, &ta_dir, val->value, 0))
       goto done;
@@ -5800,10 +11414,42 @@ int main(int argc, char *argv[])
 	     !configure_integer(&rc, &rc.max_parallel_fetches, val->value))
       goto done;
 
+    else if (!name_cmp(val->name, "max-fetches-per-host") &&
+	     !configure_integer(&rc, &rc.max_fetches_per_host, val->value))
+      goto done;
+
+    else if (!name_cmp(val->name, "fetch-rate-per-host") &&
+	     !configure_integer(&rc, &rc.fetch_rate_per_host, val->value))
+      goto done;
+
+    else if (!name_cmp(val->name, "rsync-batch-size") &&
+	     !configure_integer(&rc, &rc.rsync_batch_size, val->value))
+      goto done;
+
     else if (!name_cmp(val->name, "max-select-time") &&
 	     !configure_unsigned_integer(&rc, &rc.max_select_time, val->value))
       goto done;
 
+    else if (!name_cmp(val->name, "rrdp-timeout") &&
+	     !configure_integer(&rc, &rc.rrdp_timeout, val->value))
+      goto done;
+
+    else if (!name_cmp(val->name, "rrdp-max-time") &&
+	     !configure_integer(&rc, &rc.rrdp_max_time, val->value))
+      goto done;
+
+    else if (!name_cmp(val->name, "rrdp-max-size") &&
+	     !configure_integer(&rc, &rc.rrdp_max_size, val->value))
+      goto done;
+
+    else if (!name_cmp(val->name, "pipeline-depth") &&
+	     !configure_integer(&rc, &rc.pipeline_depth, val->value))
+      goto done;
+
+    else if (!name_cmp(val->name, "validation-threads") &&
+	     !configure_integer(&rc, &rc.validation_threads, val->value))
+      goto done;
+
     else if (!name_cmp(val->name, "rsync-program"))
       rc.rsync_program = strdup(val->value);
 
@@ -5844,6 +11490,9 @@ int main(int argc, char *argv[])
 	      !name_cmp(val->name, "xml-summary")))
       xmlfile = strdup(val->value);
 
+    else if (!cborfile && !name_cmp(val->name, "cbor-summary"))
+      cborfile = strdup(val->value);
+
     else if (!name_cmp(val->name, "allow-stale-crl") &&
 	     !configure_boolean(&rc, &rc.allow_stale_crl, val->value))
       goto done;
@@ -5900,6 +11549,10 @@ int main(int argc, char *argv[])
 	     !configure_boolean(&rc, &rc.allow_wrong_cms_si_attributes, val->value))
       goto done;
 
+    else if (!name_cmp(val->name, "use-rrdp") &&
+	     !configure_boolean(&rc, &rc.use_rrdp, val->value))
+      goto done;
+
     else if (!name_cmp(val->name, "rsync-early") &&
 	     !configure_boolean(&rc, &rc.rsync_early, val->value))
       goto done;
@@ -5940,11 +11593,21 @@ int main(int argc, char *argv[])
     goto done;
   }
 
+  if ((rc.rsync_active = sk_rsync_ctx_t_new_null()) == NULL) {
+    logmsg(&rc, log_sys_err, "Couldn't allocate rsync_active");
+    goto done;
+  }
+
   if ((rc.task_queue = sk_task_t_new_null()) == NULL) {
     logmsg(&rc, log_sys_err, "Couldn't allocate task_queue");
     goto done;
   }
 
+  if ((rc.ready_queue = sk_task_t_new_null()) == NULL) {
+    logmsg(&rc, log_sys_err, "Couldn't allocate ready_queue");
+    goto done;
+  }
+
   rc.use_syslog = use_syslog;
 
   if (use_syslog)
@@ -5993,6 +11656,14 @@ int main(int argc, char *argv[])
     goto done;
   }
 
+  (void) mkdir_maybe(&rc, &rc.unauthenticated);
+  tree_fds_open(&rc);
+
+  if (!record_cache_load(&rc, &rc.object_cache, object_cache_record_ok, object_cache_record_key) ||
+      !record_cache_load(&rc, &rc.pubpoint_cache, pubpoint_record_ok, pubpoint_record_key) ||
+      !task_workers_start(&rc) || !rrdp_workers_start(&rc) || !rsync_events_init(&rc))
+    goto done;
+
   for (i = 0; i < sk_CONF_VALUE_num(cfg_section); i++) {
     CONF_VALUE *val = sk_CONF_VALUE_value(cfg_section, i);
 
@@ -6014,38 +11685,63 @@ int main(int argc, char *argv[])
   if (*ta_dir.s != '\0' && !check_ta_dir(&rc, ta_dir.s))
     goto done;
 
-  while (sk_task_t_num(rc.task_queue) > 0 || sk_rsync_ctx_t_num(rc.rsync_queue) > 0) {
-    task_run_q(&rc);
-    rsync_mgr(&rc);
+  while (work_remaining(&rc)) {
+    int busy = task_run_q(&rc);
+    rsync_mgr(&rc, !busy);
   }
 
+  task_workers_stop(&rc);
+  rrdp_workers_stop(&rc);
+
   logmsg(&rc, log_telemetry, "Event loop done, beginning final output and cleanup");
 
+  (void) record_cache_save(&rc, &rc.object_cache);
+  (void) record_cache_save(&rc, &rc.pubpoint_cache);
+
   if (!finalize_directories(&rc))
     goto done;
 
   if (prune && rc.run_rsync &&
-      !prune_unauthenticated(&rc, &rc.unauthenticated,
-			     strlen(rc.unauthenticated.s))) {
+      !prune_unauthenticated(&rc)) {
     logmsg(&rc, log_sys_err, "Trouble pruning old unauthenticated data");
     goto done;
   }
 
-  if (!write_xml_file(&rc, xmlfile))
+  if (rc.run_rsync)
+    rrdp_state_cleanup(&rc);
+
+  if (!write_xml_file(&rc, xmlfile) || !write_cbor_file(&rc, cborfile))
     goto done;
 
   ret = 0;
 
  done:
+  task_workers_stop(&rc);
+  rrdp_workers_stop(&rc);
+  if (rc.epoll_fd >= 0)
+    (void) close(rc.epoll_fd);
   log_openssl_errors(&rc);
 
   /*
    * Do NOT free cfg_section, NCONF_free() takes care of that
    */
-  sk_validation_status_t_pop_free(rc.validation_status, validation_status_t_free);
+  sk_validation_status_t_free(rc.validation_status);
   sk_rsync_history_t_pop_free(rc.rsync_history, rsync_history_t_free);
-  validation_status_t_free(rc.validation_status_in_waiting);
+  hash_table_clear(&rc.rsync_history_index);
+  hash_table_clear(&rc.validation_status_index);
+  hash_table_clear(&rc.uri_prefixes);
+  arena_free(&rc.validation_status_arena);
+  rrdp_history_clear(&rc);
+  rsync_hosts_clear(&rc);
+  crl_cache_clear(&rc);
+  mkdir_cache_clear(&rc);
+  trash_finish(&rc);
+  (void) pthread_mutex_destroy(&rc.trash.lock);
+  tree_fds_close(&rc);
+  record_cache_free(&rc.object_cache);
+  record_cache_free(&rc.pubpoint_cache);
   X509_STORE_free(rc.x509_store);
+  SSL_CTX_free(rc.ssl_ctx);
   NCONF_free(cfg_handle);
   CONF_modules_free();
   EVP_cleanup();
@@ -6058,6 +11754,8 @@ int main(int argc, char *argv[])
     free(lockfile);
   if (xmlfile)
     free(xmlfile);
+  if (cborfile)
+    free(cborfile);
 
   if (start) {
     finish = time(0);
@@ -0,0 +1,292 @@
+#!/usr/bin/env python
+# $Id$
+#
+# Copyright (C) 2016  Parsons Government Services ("PARSONS")
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notices and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND PARSONS DISCLAIMS ALL
+# WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL
+# PARSONS BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+# CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+# OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+# NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+# WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+"""
+Exercise rcynic's RRDP client against a local HTTP stand-in.
+
+Generates a small repository (trust anchor, CRL, manifest), serves
+RRDP notification, snapshot and delta files for it from a local HTTP
+server, and runs rcynic against it several times, checking that the
+snapshot, delta, state-file and module-scope logic does what it
+should.  Nothing here touches the network beyond 127.0.0.1, and rsync
+is replaced by a program that always fails.
+"""
+
+import os
+import sys
+import time
+import uuid
+import base64
+import shutil
+import hashlib
+import argparse
+import threading
+import subprocess
+import BaseHTTPServer
+import distutils.spawn
+import xml.etree.ElementTree
+
+import rpki.x509
+import rpki.sundial
+import rpki.resource_set
+
+os.environ.update(TZ = "UTC")
+time.tzset()
+
+parser = argparse.ArgumentParser(description = __doc__)
+parser.add_argument("--rcynic", default = "./rcynic",
+                    help = "rcynic binary to test")
+parser.add_argument("--directory", default = "rrdp-fetch-test.dir",
+                    help = "scratch directory, wiped at start")
+parser.add_argument("--keep", action = "store_true",
+                    help = "don't delete scratch directory when done")
+args = parser.parse_args()
+
+rcynic = os.path.abspath(args.rcynic)
+top = os.path.abspath(args.directory)
+module = "rsync://localhost/rrdp-fetch-test/"
+
+def log(msg):
+    sys.stdout.write(msg + "\n")
+    sys.stdout.flush()
+
+def sha256hex(data):
+    return hashlib.sha256(data).hexdigest()
+
+
+class Handler(BaseHTTPServer.BaseHTTPRequestHandler):
+    """
+    Serve whatever is currently in the published dictionary.
+    """
+
+    published = {}
+
+    def do_GET(self):
+        data = self.published.get(self.path)
+        if data is None:
+            self.send_error(404)
+            return
+        self.send_response(200)
+        self.send_header("Content-Type", "application/xml")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def log_message(self, *ignored):
+        pass
+
+
+class Repository(object):
+    """
+    A one-CA repository, published via RRDP.  Each call to update()
+    reissues the CRL and manifest, producing a new serial with a delta
+    from the previous one.
+    """
+
+    def __init__(self, base_url):
+        self.base_url = base_url
+        self.notify = base_url + "notify.xml"
+        self.key = rpki.x509.RSA.generate(quiet = True)
+        self.mft_key = rpki.x509.RSA.generate(quiet = True)
+        self.now = rpki.sundial.now()
+        self.next = self.now + rpki.sundial.timedelta(days = 1)
+        self.ta = rpki.x509.X509.self_certify(
+            keypair     = self.key,
+            subject_key = self.key.get_public(),
+            serial      = 1,
+            sia         = (module, module + "ta.mft", None, self.notify),
+            notAfter    = self.now + rpki.sundial.timedelta(days = 30),
+            resources   = rpki.resource_set.resource_bag.from_str("10.0.0.0/8"))
+        self.objects = {}
+        self.deltas = []
+        self.new_session()
+
+    def new_session(self):
+        self.session = str(uuid.uuid4())
+        self.serial = 0
+        self.deltas = []
+
+    def update(self, extra_publish = (), withdraw = ()):
+        self.serial += 1
+        old = dict(self.objects)
+        crl = rpki.x509.CRL.generate(
+            keypair             = self.key,
+            issuer              = self.ta,
+            serial              = self.serial,
+            thisUpdate          = self.now,
+            nextUpdate          = self.next,
+            revokedCertificates = ())
+        ee = self.ta.issue(
+            keypair     = self.key,
+            subject_key = self.mft_key.get_public(),
+            serial      = self.serial + 1,
+            sia         = (None, None, module + "ta.mft", self.notify),
+            resources   = rpki.resource_set.resource_bag.from_inheritance(),
+            aia         = module + "ta.cer",
+            crldp       = module + "ta.crl",
+            notAfter    = self.next,
+            is_ca       = False)
+        mft = rpki.x509.SignedManifest.build(
+            keypair             = self.mft_key,
+            certs               = ee,
+            serial              = self.serial,
+            thisUpdate          = self.now,
+            nextUpdate          = self.next,
+            names_and_objs      = [("ta.crl", crl)])
+        self.objects[module + "ta.crl"] = crl.get_DER()
+        self.objects[module + "ta.mft"] = mft.get_DER()
+        for uri in withdraw:
+            del self.objects[uri]
+        changes = []
+        for uri, der in sorted(self.objects.iteritems()):
+            if old.get(uri) != der:
+                changes.append(self.publish(uri, der, old.get(uri)))
+        for uri in withdraw:
+            changes.append('  <withdraw uri="%s" hash="%s"/>\n' % (uri, sha256hex(old[uri])))
+        for uri, der in extra_publish:
+            changes.append(self.publish(uri, der, None))
+        self.deltas.append((self.serial, self.xml("delta", changes)))
+        snapshot = [self.publish(uri, der, None) for uri, der in sorted(self.objects.iteritems())]
+        snapshot.extend(self.publish(uri, der, None) for uri, der in extra_publish)
+        self.serve(self.xml("snapshot", snapshot))
+
+    def publish(self, uri, der, old):
+        return '  <publish uri="%s"%s>%s</publish>\n' % (
+            uri, "" if old is None else ' hash="%s"' % sha256hex(old), base64.b64encode(der))
+
+    def xml(self, tag, elts):
+        return '<%s xmlns="http://www.ripe.net/rpki/rrdp" version="1" session_id="%s" serial="%d">\n%s</%s>\n' % (
+            tag, self.session, self.serial, "".join(elts), tag)
+
+    def serve(self, snapshot):
+        Handler.published.clear()
+        path = "/%s/%d/snapshot.xml" % (self.session, self.serial)
+        Handler.published[path] = snapshot
+        elts = ['  <snapshot uri="%s%s" hash="%s"/>\n' % (self.base_url, path[1:], sha256hex(snapshot))]
+        for serial, delta in self.deltas:
+            path = "/%s/%d/delta.xml" % (self.session, serial)
+            Handler.published[path] = delta
+            elts.append('  <delta serial="%d" uri="%s%s" hash="%s"/>\n' % (
+                serial, self.base_url, path[1:], sha256hex(delta)))
+        Handler.published["/notify.xml"] = self.xml("notification", elts)
+
+
+def run_rcynic():
+    """
+    Run rcynic once and return the set of (status, uri) pairs from its
+    XML summary.
+    """
+
+    xml_file = os.path.join(top, "rcynic.xml")
+    if os.path.exists(xml_file):
+        os.unlink(xml_file)
+    subprocess.call((rcynic, "-c", os.path.join(top, "rcynic.conf"), "-j", "0"))
+    return set((v.get("status"), v.text.strip())
+               for v in xml.etree.ElementTree.parse(xml_file).getroot().iter("validation_status"))
+
+def unauthenticated(uri):
+    return os.path.join(top, "unauthenticated", uri[len("rsync://"):])
+
+def authenticated(uri):
+    return os.path.join(top, "authenticated", uri[len("rsync://"):])
+
+def state_files():
+    return [fn for fn in os.listdir(os.path.join(top, "rrdp")) if fn.endswith(".state")]
+
+failures = []
+
+def check(what, ok):
+    log("%s: %s" % ("PASS" if ok else "FAIL", what))
+    if not ok:
+        failures.append(what)
+
+
+if os.path.exists(top):
+    shutil.rmtree(top)
+os.makedirs(os.path.join(top, "rrdp"))
+
+server = BaseHTTPServer.HTTPServer(("127.0.0.1", 0), Handler)
+thread = threading.Thread(target = server.serve_forever)
+thread.daemon = True
+thread.start()
+
+repo = Repository("http://127.0.0.1:%d/" % server.server_address[1])
+
+with open(os.path.join(top, "ta.cer"), "wb") as f:
+    f.write(repo.ta.get_DER())
+
+with open(os.path.join(top, "rcynic.conf"), "w") as f:
+    f.write("[rcynic]\n"
+            "authenticated   = %(top)s/authenticated\n"
+            "unauthenticated = %(top)s/unauthenticated/\n"
+            "rrdp-directory  = %(top)s/rrdp/\n"
+            "xml-summary     = %(top)s/rcynic.xml\n"
+            "lockfile        = %(top)s/lock\n"
+            "rsync-program   = %(false)s\n"
+            "trust-anchor    = %(top)s/ta.cer\n"
+            "use-rrdp        = yes\n"
+            "use-syslog      = no\n"
+            "rrdp-timeout    = 30\n"
+            "rrdp-max-time   = 60\n"
+            % dict(top = top, false = distutils.spawn.find_executable("false")))
+
+stale = module + "stale.cer"
+
+log("Initial snapshot")
+repo.objects[stale] = "Not really a certificate"
+repo.update()
+status = run_rcynic()
+check("snapshot loaded", ("rrdp_snapshot_loaded", repo.notify) in status)
+check("manifest validated", os.path.exists(authenticated(module + "ta.mft")))
+check("state saved", len(state_files()) == 1)
+
+log("Delta with a withdrawal")
+repo.update(withdraw = (stale,))
+status = run_rcynic()
+check("deltas applied", ("rrdp_deltas_applied", repo.notify) in status)
+check("snapshot not reloaded", ("rrdp_snapshot_loaded", repo.notify) not in status)
+check("withdrawn object removed", not os.path.exists(unauthenticated(stale)))
+check("manifest still valid", os.path.exists(authenticated(module + "ta.mft")))
+
+log("Delta and snapshot publishing outside the module")
+repo.update(extra_publish = (("rsync://elsewhere/evil.cer", "Not really a certificate"),))
+status = run_rcynic()
+check("transfer failed", ("rrdp_transfer_failed", repo.notify) in status)
+check("nothing written outside module", not os.path.exists(unauthenticated("rsync://elsewhere/evil.cer")))
+check("state discarded", len(state_files()) == 0)
+
+log("New session, snapshot replaces stray files")
+repo.new_session()
+repo.update()
+stray = unauthenticated(module + "stray.cer")
+with open(stray, "w") as f:
+    f.write("Left over from some earlier rsync")
+status = run_rcynic()
+check("snapshot loaded for new session", ("rrdp_snapshot_loaded", repo.notify) in status)
+check("stray file cleared", not os.path.exists(stray))
+check("state saved again", len(state_files()) == 1)
+
+server.shutdown()
+
+if not args.keep:
+    shutil.rmtree(top)
+
+if failures:
+    sys.exit("%d check%s failed" % (len(failures), "" if len(failures) == 1 else "s"))
+
+log("All checks passed")
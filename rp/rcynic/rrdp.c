@@ -0,0 +1,806 @@
+/*
+ * Copyright (C) 2016  Parsons Government Services ("PARSONS")
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notices and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND PARSONS DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL
+ * PARSONS BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* $Id$ */
+
+/** @file rrdp.c
+ *
+ * The network and parsing end of rcynic's RRDP support: a minimal
+ * HTTP/1.0 client (with TLS) that streams a response body to a file,
+ * and a streaming XML tokenizer that knows just enough XML to read
+ * RRDP notification, snapshot and delta files.  Neither knows
+ * anything about rcynic's own data structures; what to do with the
+ * results is rcynic.c's problem.
+ *
+ * We roll our own rather than using libcurl and libxml2 because the
+ * C side of this package otherwise depends on nothing but OpenSSL,
+ * and what RRDP needs of either is small.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "rrdp.h"
+
+#define SCHEME_HTTP	("http://")
+#define	SIZEOF_HTTP	(sizeof(SCHEME_HTTP) - 1)
+
+#define SCHEME_HTTPS	("https://")
+#define	SIZEOF_HTTPS	(sizeof(SCHEME_HTTPS) - 1)
+
+/**
+ * Maximum length of a hostname.
+ */
+#ifndef	HOSTNAME_MAX
+#define	HOSTNAME_MAX	256
+#endif
+
+
+
+#ifdef __GNUC__
+static void http_log(const http_client_t *client,
+		     const http_log_level_t level,
+		     const char *fmt, ...)
+     __attribute__ ((format (printf, 3, 4)));
+#endif
+
+/**
+ * Hand a log message to the client's logging callback.
+ */
+static void http_log(const http_client_t *client,
+		     const http_log_level_t level,
+		     const char *fmt, ...)
+{
+  va_list ap;
+
+  assert(client && fmt);
+
+  if (client->log == NULL)
+    return;
+
+  va_start(ap, fmt);
+  client->log(client->cookie, level, fmt, ap);
+  va_end(ap);
+}
+
+/**
+ * Is string an http or https URI?
+ */
+int is_http(const char *uri)
+{
+  return uri && (!strncmp(uri, SCHEME_HTTP, SIZEOF_HTTP) ||
+		 !strncmp(uri, SCHEME_HTTPS, SIZEOF_HTTPS));
+}
+
+/**
+ * Is string an https URI?
+ */
+int is_https(const char *uri)
+{
+  return uri && !strncmp(uri, SCHEME_HTTPS, SIZEOF_HTTPS);
+}
+
+
+
+/**
+ * An HTTP connection, with TLS if ssl is set.  We do our own input
+ * buffering, so that we can read the response header a line at a
+ * time, and so that every read and write goes through the timeout
+ * checks below.
+ */
+typedef struct http_conn {
+  SSL *ssl;
+  int s;
+  time_t deadline;
+  size_t pos, len;
+  char buf[8192];
+} http_conn_t;
+
+/**
+ * How many seconds the next network operation may take: the client's
+ * timeout, or whatever's left before the deadline (if any) if that's
+ * sooner.  Returns zero if the deadline has passed, INT_MAX if there's
+ * no limit at all.
+ */
+static int http_time_left(const http_client_t *client, const time_t deadline)
+{
+  const time_t now = time(0);
+  int t = client->timeout > 0 ? client->timeout : INT_MAX;
+
+  if (deadline > 0 && deadline - now < t)
+    t = deadline > now ? (int) (deadline - now) : 0;
+
+  return t;
+}
+
+/**
+ * Set a socket timeout (SO_RCVTIMEO or SO_SNDTIMEO) for the next
+ * operation on an HTTP connection.  Returns false if the deadline has
+ * passed.
+ */
+static int http_set_timeout(const http_client_t *client, const http_conn_t *c, const int which)
+{
+  const int t = http_time_left(client, c->deadline);
+  struct timeval tv;
+
+  if (t == 0)
+    return 0;
+
+  tv.tv_sec = t == INT_MAX ? 0 : t;
+  tv.tv_usec = 0;
+  (void) setsockopt(c->s, SOL_SOCKET, which, &tv, sizeof(tv));
+  return 1;
+}
+
+/**
+ * Open a TCP connection to an HTTP server, with a timeout on the
+ * connect() itself.  Returns a socket, or -1 on failure.
+ */
+static int http_connect(const http_client_t *client,
+			const char *host,
+			const char *port,
+			const time_t deadline)
+{
+  struct addrinfo hints, *res = NULL, *ai;
+  struct pollfd pfd;
+  int s = -1, t, err, flags;
+  socklen_t len;
+
+  assert(client && host && port);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+    http_log(client, http_log_data_err, "Couldn't look up %s: %s", host, gai_strerror(err));
+    return -1;
+  }
+
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    if ((t = http_time_left(client, deadline)) == 0)
+      break;
+    if ((s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+      continue;
+    if ((flags = fcntl(s, F_GETFL, 0)) == -1 ||
+	fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1)
+      goto next;
+    if (connect(s, ai->ai_addr, ai->ai_addrlen) < 0) {
+      if (errno != EINPROGRESS)
+	goto next;
+      pfd.fd = s;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
+      len = sizeof(err);
+      if (poll(&pfd, 1, t > INT_MAX / 1000 ? -1 : t * 1000) <= 0 ||
+	  getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+	goto next;
+    }
+    if (fcntl(s, F_SETFL, flags) == -1)
+      goto next;
+    break;
+  next:
+    (void) close(s);
+    s = -1;
+  }
+
+  freeaddrinfo(res);
+
+  if (s < 0)
+    http_log(client, http_log_data_err, "Couldn't connect to %s port %s", host, port);
+
+  return s;
+}
+
+/**
+ * Close an HTTP connection.  We've read to the end by the time we get
+ * here, so there's no point in a TLS close_notify exchange.
+ */
+static void http_close(http_conn_t *c)
+{
+  if (c->ssl != NULL)
+    SSL_free(c->ssl);
+  c->ssl = NULL;
+  if (c->s >= 0)
+    (void) close(c->s);
+  c->s = -1;
+}
+
+/**
+ * Start TLS on an HTTP connection.  The server's certificate has to
+ * chain to one of the system's trust anchors and match the host name
+ * (or address) in the URL.
+ */
+static int http_start_tls(const http_client_t *client, http_conn_t *c, const char *host)
+{
+  X509_VERIFY_PARAM *param;
+  long verify;
+
+  assert(client && client->ssl_ctx && c && c->ssl == NULL && host);
+
+  if ((c->ssl = SSL_new(client->ssl_ctx)) == NULL ||
+      !SSL_set_fd(c->ssl, c->s) ||
+      (param = SSL_get0_param(c->ssl)) == NULL ||
+      (!X509_VERIFY_PARAM_set1_ip_asc(param, host) &&
+       (!SSL_set_tlsext_host_name(c->ssl, host) ||
+	!X509_VERIFY_PARAM_set1_host(param, host, 0)))) {
+    http_log(client, http_log_sys_err, "Couldn't set up TLS for %s", host);
+    ERR_clear_error();
+    return 0;
+  }
+
+  if (!http_set_timeout(client, c, SO_RCVTIMEO) ||
+      !http_set_timeout(client, c, SO_SNDTIMEO) ||
+      SSL_connect(c->ssl) <= 0) {
+    if ((verify = SSL_get_verify_result(c->ssl)) != X509_V_OK)
+      http_log(client, http_log_data_err, "Couldn't verify TLS certificate of %s: %s",
+	     host, X509_verify_cert_error_string(verify));
+    else
+      http_log(client, http_log_data_err, "TLS handshake with %s failed", host);
+    ERR_clear_error();
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Write to an HTTP connection.
+ */
+static int http_write(const http_client_t *client, http_conn_t *c, const char *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    if (!http_set_timeout(client, c, SO_SNDTIMEO))
+      return 0;
+    if (c->ssl != NULL)
+      n = SSL_write(c->ssl, buf, len);
+    else if ((n = send(c->s, buf, len, 0)) < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    buf += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+/**
+ * Refill the input buffer of an HTTP connection.  Returns the number
+ * of bytes read, zero at end of input, or -1 on error or timeout.
+ *
+ * Plenty of servers hang up without a TLS close_notify, so we treat
+ * that as end of input too.  Truncation doesn't get past us: we check
+ * Content-Length when there is one, snapshots and deltas have to
+ * match the hashes in the notification, and a truncated notification
+ * isn't well-formed XML.
+ */
+static ssize_t http_fill(const http_client_t *client, http_conn_t *c)
+{
+  ssize_t n;
+  int err;
+
+  c->pos = c->len = 0;
+
+  if (c->ssl != NULL) {
+    if (!http_set_timeout(client, c, SO_RCVTIMEO))
+      return -1;
+    if ((n = SSL_read(c->ssl, c->buf, sizeof(c->buf))) <= 0) {
+      err = SSL_get_error(c->ssl, n);
+      ERR_clear_error();
+      return err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && n == 0) ? 0 : -1;
+    }
+    c->len = n;
+    return n;
+  }
+
+  do {
+    if (!http_set_timeout(client, c, SO_RCVTIMEO))
+      return -1;
+  } while ((n = recv(c->s, c->buf, sizeof(c->buf), 0)) < 0 && errno == EINTR);
+
+  if (n > 0)
+    c->len = n;
+  return n;
+}
+
+/**
+ * Read from an HTTP connection.  Returns the number of bytes read,
+ * zero at end of input, or -1 on error or timeout.
+ */
+static ssize_t http_read(const http_client_t *client, http_conn_t *c, char *buf, const size_t size)
+{
+  ssize_t n;
+
+  if (c->pos == c->len && (n = http_fill(client, c)) <= 0)
+    return n;
+
+  n = c->len - c->pos < size ? c->len - c->pos : size;
+  memcpy(buf, c->buf + c->pos, n);
+  c->pos += n;
+  return n;
+}
+
+/**
+ * Read a line from an HTTP connection, newline and all.  Anything
+ * that doesn't fit in the caller's buffer is discarded.  Returns
+ * false at end of input or on error.
+ */
+static int http_gets(const http_client_t *client, http_conn_t *c, char *line, const size_t size)
+{
+  size_t n = 0;
+  int got = 0;
+  char ch;
+
+  assert(size > 1);
+
+  while (c->pos < c->len || http_fill(client, c) > 0) {
+    got = 1;
+    ch = c->buf[c->pos++];
+    if (n < size - 1)
+      line[n++] = ch;
+    if (ch == '\n')
+      break;
+  }
+
+  line[n] = '\0';
+  return got;
+}
+
+/**
+ * Resolve a Location header value, which may be relative (RFC 7231
+ * section 7.1.2), against the URL it came from.  We handle absolute
+ * URLs, network-path references, absolute paths and relative paths.
+ * We leave "." and ".." segments for the server to sort out.
+ */
+static int http_resolve(const char *base, const char *ref, char *out, const size_t size)
+{
+  const char *path, *end;
+  int len;
+
+  assert(is_http(base) && ref && out);
+
+  if (is_http(ref)) {
+    len = snprintf(out, size, "%s", ref);
+  }
+
+  else if (ref[0] == '/' && ref[1] == '/') {
+    len = snprintf(out, size, "%s%s", is_https(base) ? "https:" : "http:", ref);
+  }
+
+  else {
+    path = base + (is_https(base) ? SIZEOF_HTTPS : SIZEOF_HTTP);
+    path += strcspn(path, "/?#");
+    end = path;
+    if (ref[0] != '/')
+      for (end += strcspn(path, "?#"); end > path && end[-1] != '/'; end--)
+	;
+    len = snprintf(out, size, "%.*s%s%s", (int) (end - base), base,
+		   ref[0] == '/' || end > path ? "" : "/", ref);
+  }
+
+  return len >= 0 && len < size;
+}
+
+/**
+ * Fetch an http:// or https:// URL, writing the body to a file and
+ * computing its SHA-256 digest as we go.  We speak HTTP/1.0 so that
+ * we don't have to deal with chunked transfer encoding, and we follow
+ * a few redirects, but never from https:// to http://.  We give up if
+ * the transfer is still going at the deadline (if any) or if the body
+ * is bigger than the client's max_size.
+ */
+int http_get(const http_client_t *client,
+	     const char *url,
+	     FILE *out,
+	     unsigned char *digest,
+	     const time_t deadline)
+{
+  char host[HOSTNAME_MAX], port[8], line[RRDP_URL_MAX + 64], location[RRDP_URL_MAX];
+  char request[RRDP_URL_MAX + HOSTNAME_MAX + 128], current[RRDP_URL_MAX];
+  long content_length, total;
+  EVP_MD_CTX *md = NULL;
+  int status, redirects, tls = 0, ok = 0;
+  const char *h, *p;
+  http_conn_t c;
+  ssize_t len;
+  size_t n;
+
+  assert(client && url && out && digest);
+
+  memset(&c, 0, sizeof(c));
+  c.s = -1;
+  c.deadline = deadline;
+
+  if (!is_http(url) || strlen(url) >= sizeof(current)) {
+    http_log(client, http_log_data_err, "Can't fetch %s, not an http:// or https:// URL", url);
+    goto done;
+  }
+
+  /*
+   * Keep the URL we're currently fetching in its own buffer, so that
+   * redirects don't leave url pointing at something we've reused.
+   */
+  strcpy(current, url);
+  url = current;
+
+  for (redirects = 0; redirects < 5; redirects++) {
+
+    if (!is_http(url)) {
+      http_log(client, http_log_data_err, "Can't fetch %s, not an http:// or https:// URL", url);
+      goto done;
+    }
+
+    if (tls && !is_https(url)) {
+      http_log(client, http_log_data_err, "Not following redirect from https:// to %s", url);
+      goto done;
+    }
+
+    tls = is_https(url);
+    h = url + (tls ? SIZEOF_HTTPS : SIZEOF_HTTP);
+    if (*h == '[') {
+      if ((p = strchr(++h, ']')) == NULL)
+	goto bad_url;
+      n = p++ - h;
+    } else {
+      n = strcspn(h, ":/");
+      p = h + n;
+    }
+    if (n == 0 || n >= sizeof(host))
+      goto bad_url;
+    memcpy(host, h, n);
+    host[n] = '\0';
+
+    strcpy(port, tls ? "443" : "80");
+    if (*p == ':') {
+      n = strspn(++p, "0123456789");
+      if (n == 0 || n >= sizeof(port))
+	goto bad_url;
+      memcpy(port, p, n);
+      port[n] = '\0';
+      p += n;
+    }
+    if (*p == '\0')
+      p = "/";
+    else if (*p != '/')
+      goto bad_url;
+
+    http_log(client, http_log_telemetry, "Fetching %s", url);
+
+    if ((c.s = http_connect(client, host, port, deadline)) < 0 ||
+	(tls && !http_start_tls(client, &c, host)))
+      goto done;
+
+    c.pos = c.len = 0;
+
+    len = snprintf(request, sizeof(request),
+		   "GET %s HTTP/1.0\r\n"
+		   "Host: %s\r\n"
+		   "User-Agent: rcynic\r\n"
+		   "Connection: close\r\n"
+		   "\r\n", p, host);
+
+    if (len < 0 || len >= sizeof(request) || !http_write(client, &c, request, len)) {
+      http_log(client, http_log_data_err, "Couldn't send HTTP request for %s", url);
+      goto done;
+    }
+
+    if (!http_gets(client, &c, line, sizeof(line)) ||
+	sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+      http_log(client, http_log_data_err, "Bad HTTP response for %s", url);
+      goto done;
+    }
+
+    content_length = -1;
+    location[0] = '\0';
+
+    while (http_gets(client, &c, line, sizeof(line)) && strcspn(line, "\r\n") > 0) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (!strncasecmp(line, "Content-Length:", sizeof("Content-Length:") - 1))
+	content_length = strtol(line + sizeof("Content-Length:") - 1, NULL, 10);
+      else if (!strncasecmp(line, "Location:", sizeof("Location:") - 1)) {
+	h = line + sizeof("Location:") - 1;
+	h += strspn(h, " \t");
+	if (strlen(h) < sizeof(location))
+	  strcpy(location, h);
+      }
+    }
+
+    if ((status == 301 || status == 302 || status == 303 ||
+	 status == 307 || status == 308) && location[0] != '\0') {
+      if (!http_resolve(url, location, line, sizeof(current))) {
+	http_log(client, http_log_data_err, "Can't follow redirect from %s to %s", url, location);
+	goto done;
+      }
+      http_log(client, http_log_verbose, "Following redirect from %s to %s", url, line);
+      http_close(&c);
+      strcpy(current, line);
+      continue;
+    }
+
+    if (status != 200) {
+      http_log(client, http_log_data_err, "HTTP status %d fetching %s", status, url);
+      goto done;
+    }
+
+    if (client->max_size > 0 && content_length > client->max_size) {
+      http_log(client, http_log_data_err, "%s is %ld bytes, more than rrdp-max-size", url, content_length);
+      goto done;
+    }
+
+    if ((md = EVP_MD_CTX_create()) == NULL ||
+	!EVP_DigestInit_ex(md, EVP_sha256(), NULL))
+      goto done;
+
+    total = 0;
+    while ((len = http_read(client, &c, line, sizeof(line))) > 0) {
+      if (client->max_size > 0 && total + len > client->max_size) {
+	http_log(client, http_log_data_err, "%s is more than rrdp-max-size bytes, giving up", url);
+	goto done;
+      }
+      if (fwrite(line, 1, len, out) != len || !EVP_DigestUpdate(md, line, len))
+	goto done;
+      total += len;
+    }
+
+    if (len < 0) {
+      if (http_time_left(client, deadline) == 0)
+	http_log(client, http_log_data_err, "Gave up on %s, rrdp-max-time exceeded", url);
+      else
+	http_log(client, http_log_data_err, "Error reading body of %s: %s", url, strerror(errno));
+      goto done;
+    }
+
+    if (content_length >= 0 && total != content_length) {
+      http_log(client, http_log_data_err, "Short read from %s: expected %ld bytes, got %ld",
+	     url, content_length, total);
+      goto done;
+    }
+
+    ok = EVP_DigestFinal_ex(md, digest, NULL) && fflush(out) != EOF;
+    goto done;
+  }
+
+  http_log(client, http_log_data_err, "Too many redirects fetching %s", url);
+  goto done;
+
+ bad_url:
+  http_log(client, http_log_data_err, "Can't parse URL %s", url);
+
+ done:
+  if (md != NULL)
+    EVP_MD_CTX_destroy(md);
+  http_close(&c);
+  return ok;
+}
+
+
+
+/*
+ * XML tokenizer.  See rrdp.h for what it does and doesn't handle.
+ */
+
+/**
+ * Skip whitespace, return next interesting character.
+ */
+static int rrdp_xml_skip_ws(rrdp_xml_t *x)
+{
+  int c;
+  while ((c = getc(x->f)) == ' ' || c == '\t' || c == '\r' || c == '\n')
+    ;
+  return c;
+}
+
+/**
+ * Read an element or attribute name.  Namespace prefixes are dropped,
+ * RRDP only uses the one namespace.  Returns the character after the
+ * name.
+ */
+static int rrdp_xml_read_name(rrdp_xml_t *x, int c, char *name, size_t size)
+{
+  size_t n = 0;
+
+  while (c != EOF && !strchr(" \t\r\n/>=", c)) {
+    if (c == ':')
+      n = 0;
+    else if (n < size - 1)
+      name[n++] = c;
+    else
+      return EOF;
+    c = getc(x->f);
+  }
+
+  name[n] = '\0';
+  return n > 0 ? c : EOF;
+}
+
+/**
+ * Read a quoted attribute value, decoding character and entity
+ * references.
+ */
+static int rrdp_xml_read_value(rrdp_xml_t *x, char *value, size_t size)
+{
+  static const struct { const char *name; char c; } entities[] = {
+    {"amp", '&'}, {"lt", '<'}, {"gt", '>'}, {"quot", '"'}, {"apos", '\''}
+  };
+  char ref[16];
+  size_t n = 0, r;
+  int c, q, i;
+
+  if ((q = rrdp_xml_skip_ws(x)) != '"' && q != '\'')
+    return 0;
+
+  while ((c = getc(x->f)) != q) {
+    if (c == EOF || c == '<')
+      return 0;
+    if (c == '&') {
+      for (r = 0; (c = getc(x->f)) != ';'; r++)
+	if (c == EOF || r >= sizeof(ref) - 1)
+	  return 0;
+	else
+	  ref[r] = c;
+      ref[r] = '\0';
+      if (ref[0] == '#') {
+	c = (int) strtol(ref + 1 + (ref[1] == 'x'), NULL, ref[1] == 'x' ? 16 : 10);
+	if (c <= 0 || c > 0x7f)
+	  return 0;
+      } else {
+	for (i = 0; i < sizeof(entities)/sizeof(*entities) && strcmp(ref, entities[i].name); i++)
+	  ;
+	if (i == sizeof(entities)/sizeof(*entities))
+	  return 0;
+	c = entities[i].c;
+      }
+    }
+    if (n >= size - 1)
+      return 0;
+    value[n++] = c;
+  }
+
+  value[n] = '\0';
+  return 1;
+}
+
+/**
+ * Skip until we've seen a particular terminator string.
+ */
+static int rrdp_xml_skip_until(rrdp_xml_t *x, const char *terminator)
+{
+  size_t n = strlen(terminator), i = 0;
+  int c;
+
+  while (i < n && (c = getc(x->f)) != EOF) {
+    if (c == terminator[i])
+      i++;
+    else
+      i = (c == terminator[0]);
+  }
+
+  return i == n;
+}
+
+/**
+ * Pull the next start or end tag out of the input.  Text between tags
+ * is saved in x->text if x->keep_text is set.
+ */
+rrdp_xml_token_t rrdp_xml_next(rrdp_xml_t *x)
+{
+  int c;
+
+  assert(x && x->f);
+
+  for (;;) {
+
+    if ((c = getc(x->f)) == EOF)
+      return ferror(x->f) ? rrdp_xml_error : rrdp_xml_eof;
+
+    if (c != '<') {
+      if (!x->keep_text)
+	continue;
+      if (x->textlen + 1 >= x->textmax) {
+	size_t newmax = x->textmax ? x->textmax * 2 : 8192;
+	char *newtext = realloc(x->text, newmax);
+	if (newtext == NULL)
+	  return rrdp_xml_error;
+	x->text = newtext;
+	x->textmax = newmax;
+      }
+      x->text[x->textlen++] = c;
+      x->text[x->textlen] = '\0';
+      continue;
+    }
+
+    switch ((c = getc(x->f))) {
+
+    case '?':
+      if (!rrdp_xml_skip_until(x, "?>"))
+	return rrdp_xml_error;
+      continue;
+
+    case '!':
+      if (!rrdp_xml_skip_until(x, (c = getc(x->f)) == '-' ? "-->" : ">"))
+	return rrdp_xml_error;
+      continue;
+
+    case '/':
+      c = rrdp_xml_read_name(x, getc(x->f), x->name, sizeof(x->name));
+      if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+	c = rrdp_xml_skip_ws(x);
+      return c == '>' ? rrdp_xml_end : rrdp_xml_error;
+
+    default:
+      x->n_attrs = 0;
+      x->empty = 0;
+      x->textlen = 0;
+      if (x->text != NULL)
+	x->text[0] = '\0';
+      c = rrdp_xml_read_name(x, c, x->name, sizeof(x->name));
+      for (;;) {
+	if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+	  c = rrdp_xml_skip_ws(x);
+	if (c == '>')
+	  return rrdp_xml_start;
+	if (c == '/') {
+	  x->empty = 1;
+	  return getc(x->f) == '>' ? rrdp_xml_start : rrdp_xml_error;
+	}
+	if (c == EOF || x->n_attrs >= RRDP_XML_MAX_ATTRS)
+	  return rrdp_xml_error;
+	c = rrdp_xml_read_name(x, c, x->attr[x->n_attrs].name, sizeof(x->attr[x->n_attrs].name));
+	if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+	  c = rrdp_xml_skip_ws(x);
+	if (c != '=' || !rrdp_xml_read_value(x, x->attr[x->n_attrs].value, sizeof(x->attr[x->n_attrs].value)))
+	  return rrdp_xml_error;
+	x->n_attrs++;
+	c = getc(x->f);
+      }
+    }
+  }
+}
+
+/**
+ * Find an attribute of the current element.
+ */
+const char *rrdp_xml_attr(const rrdp_xml_t *x, const char *name)
+{
+  int i;
+  for (i = 0; i < x->n_attrs; i++)
+    if (!strcmp(x->attr[i].name, name))
+      return x->attr[i].value;
+  return NULL;
+}
@@ -0,0 +1,84 @@
+/* $Id$ */
+
+#ifndef __RRDP_H__
+#define __RRDP_H__
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include <openssl/ssl.h>
+
+/**
+ * Longest URL or XML attribute value we handle.  This is longer than
+ * any URI rcynic itself will store, callers check lengths before
+ * copying.
+ */
+#define	RRDP_URL_MAX		(FILENAME_MAX + 512)
+
+/**
+ * How bad an HTTP client log message is, mapped onto rcynic's own
+ * log levels by the caller.
+ */
+typedef enum {
+  http_log_sys_err,
+  http_log_data_err,
+  http_log_verbose,
+  http_log_telemetry
+} http_log_level_t;
+
+/**
+ * Everything the HTTP client needs from its caller.  timeout is the
+ * longest any one network operation may take, max_size the largest
+ * body we'll accept; zero means no limit for either.  Log messages go
+ * to log(), with cookie as its first argument.
+ */
+typedef struct http_client {
+  SSL_CTX *ssl_ctx;
+  int timeout, max_size;
+  void (*log)(const void *cookie, const http_log_level_t level, const char *fmt, va_list ap);
+  const void *cookie;
+} http_client_t;
+
+/**
+ * Streaming XML tokenizer, just enough for RRDP.  We don't build a
+ * tree and we never hold more than one element's text in memory, so
+ * snapshots of any size are fine.  We don't handle DTDs, CDATA, or
+ * character references in text (RRDP text is all Base64); character
+ * and entity references in attribute values are decoded.
+ */
+
+#define	RRDP_XML_MAX_ATTRS	8
+
+typedef enum {
+  rrdp_xml_error = -1,
+  rrdp_xml_eof,
+  rrdp_xml_start,
+  rrdp_xml_end
+} rrdp_xml_token_t;
+
+typedef struct rrdp_xml {
+  FILE *f;
+  char name[64];
+  struct {
+    char name[32];
+    char value[RRDP_URL_MAX];
+  } attr[RRDP_XML_MAX_ATTRS];
+  int n_attrs, empty, keep_text;
+  char *text;
+  size_t textlen, textmax;
+} rrdp_xml_t;
+
+int is_http(const char *uri);
+int is_https(const char *uri);
+
+int http_get(const http_client_t *client,
+	     const char *url,
+	     FILE *out,
+	     unsigned char *digest,
+	     const time_t deadline);
+
+rrdp_xml_token_t rrdp_xml_next(rrdp_xml_t *x);
+const char *rrdp_xml_attr(const rrdp_xml_t *x, const char *name);
+
+#endif /* __RRDP_H__ */